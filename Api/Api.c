@@ -8,11 +8,57 @@
 #include "Apidrvr.h"
 #include "Ipc.h"
 #include "Mount.h"
+#include "HeaderHints.h"
+#include "Pkcs5.h"
+#include "WhirlpoolFast.h"
+#include "Tests.h"
+#include "Random.h"
+#include "RandomStream.h"
 
 BOOL bTcApiInitialized = FALSE;
 
 #define TCAPI_CHECK_INITIALIZED(RESULT) do { if (!bTcApiInitialized) { SetLastError(TCAPI_E_NOT_INITIALIZED); return RESULT; } } while (0)
 
+static CRITICAL_SECTION RandomGeneratorLock;
+static BOOL bRandomGeneratorHeld = FALSE;
+
+/* Starts the random number generator when an API call first needs it. It then keeps running until 
+   Shutdown (or until Initialize is called again), so that the calls do not start and stop its hooks 
+   and poll thread every time. */
+static BOOL HoldRandomGenerator (void)
+{
+	BOOL bResult = TRUE;
+
+	EnterCriticalSection (&RandomGeneratorLock);
+
+	if (!bRandomGeneratorHeld)
+	{
+		if (Randinit ())
+		{
+			set_error_debug_out(TCAPI_E_ERROR);
+			bResult = FALSE;
+		}
+		else
+			bRandomGeneratorHeld = TRUE;
+	}
+
+	LeaveCriticalSection (&RandomGeneratorLock);
+	return bResult;
+}
+
+static void ReleaseRandomGenerator (BOOL freePool)
+{
+	EnterCriticalSection (&RandomGeneratorLock);
+
+	if (bRandomGeneratorHeld)
+	{
+		bRandomGeneratorHeld = FALSE;
+		RandStop (freePool);
+	}
+
+	LeaveCriticalSection (&RandomGeneratorLock);
+}
+
 DLLEXPORT BOOL APIENTRY Initialize(PTCAPI_OPTIONS options) {
 
 	if (!InitOSVersionInfo()) {
@@ -27,6 +73,10 @@ DLLEXPORT BOOL APIENTRY Initialize(PTCAPI_OPTIONS options) {
 		return FALSE;
 	}
 
+	/* The generator is restarted on its next use, so that it picks up a changed entropy source */
+	if (bTcApiInitialized)
+		ReleaseRandomGenerator (FALSE);
+
 	if (!options || !ApplyOptions(options)) {
 		//TODO: Doc -> See GetLastError()
 		return FALSE;
@@ -38,6 +88,18 @@ DLLEXPORT BOOL APIENTRY Initialize(PTCAPI_OPTIONS options) {
 		return FALSE;
 	}
 
+	// The options may be applied again, the rest is set up once
+	if (bTcApiInitialized)
+		return TRUE;
+
+	InitializeCriticalSection (&RandomGeneratorLock);
+	InitializeCriticalSection (&MountOperationLock);
+	InitializeCriticalSection (&HeaderHintsLock);
+
+	// Built here rather than on first use, as key derivations may run concurrently. If the
+	// self-test fails, HMAC-Whirlpool keeps using the reference implementation.
+	WhirlpoolFastInit ();
+
 	bTcApiInitialized = TRUE;
 	return bTcApiInitialized;
 }
@@ -47,7 +109,13 @@ DLLEXPORT BOOL APIENTRY Shutdown(void) {
 	//returns FALSE if not initialized
 	TCAPI_CHECK_INITIALIZED(0);
 
+	bTcApiInitialized = FALSE;
+
 	EncryptionThreadPoolStop();
+	ReleaseRandomGenerator (TRUE);
+	DeleteCriticalSection (&RandomGeneratorLock);
+	DeleteCriticalSection (&MountOperationLock);
+	DeleteCriticalSection (&HeaderHintsLock);
 	return TRUE;
 }
 
@@ -68,3 +136,629 @@ DLLEXPORT BOOL APIENTRY MountV(int nDosDriveNo, char *szFileName, Password Volum
 	TCAPI_CHECK_INITIALIZED(0);
 	return Mount (NULL, nDosDriveNo, szFileName, VolumePassword);
 }
+
+DLLEXPORT int APIENTRY MountBatch(PTCAPI_MOUNT_ENTRY entries, int count, int maxConcurrency)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+	return MountVolumeBatch (entries, count, maxConcurrency);
+}
+
+DLLEXPORT int APIENTRY ChangePasswordBatch(PTCAPI_PASSWORD_CHANGE_ENTRY entries, int count, int maxConcurrency, PTCAPI_PASSWORD_CHANGE_PROGRESS progress, void *progressContext)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+	return ChangeVolumePasswordBatch (entries, count, maxConcurrency, progress, progressContext);
+}
+
+DLLEXPORT PDIRECT_VOLUME APIENTRY OpenVolume(char *szFileName, Password *VolumePassword, BOOL readOnly)
+{
+	PDIRECT_VOLUME volume;
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(NULL);
+
+	status = DirectVolumeOpen (szFileName, VolumePassword, readOnly, &volume);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return NULL;
+	}
+
+	return volume;
+}
+
+DLLEXPORT BOOL APIENTRY CloseVolume(PDIRECT_VOLUME volume)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!volume)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	DirectVolumeClose (volume);
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY GetVolumeGeometry(PDIRECT_VOLUME volume, unsigned __int64 *size, DWORD *sectorSize)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!volume || !size || !sectorSize)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	*size = DirectVolumeGetSize (volume);
+	*sectorSize = DirectVolumeGetSectorSize (volume);
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY ReadVolumeSectors(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, void *buffer)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeReadSectors (volume, sectorNo, sectorCount, buffer);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY WriteVolumeSectors(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, const void *buffer)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeWriteSectors (volume, sectorNo, sectorCount, buffer);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY FlushVolume(PDIRECT_VOLUME volume)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeFlush (volume);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY ReadVolumeStream(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount, DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeReadStream (volume, sectorNo, sectorCount, callback, callbackContext);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY WriteVolumeStream(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount, DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeWriteStream (volume, sectorNo, sectorCount, callback, callbackContext);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY SetVolumeQueueDepth(PDIRECT_VOLUME volume, DWORD queueDepth)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeSetQueueDepth (volume, queueDepth);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY SetVolumeCacheSize(PDIRECT_VOLUME volume, DWORD cacheSize)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeSetCacheSize (volume, cacheSize);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY GetVolumeCacheStats(PDIRECT_VOLUME volume, SECTOR_CACHE_STATS *stats)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeGetCacheStats (volume, stats);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY SetVolumeReadAhead(PDIRECT_VOLUME volume, DWORD maxSize)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeSetReadAhead (volume, maxSize);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY SetVolumeWriteBack(PDIRECT_VOLUME volume, DWORD maxSize, DWORD flushInterval)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeSetWriteBack (volume, maxSize, flushInterval);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT PDIRECT_VOLUME_VIEW APIENTRY OpenVolumeView(PDIRECT_VOLUME volume, DWORD cachePageCount, int accessHint)
+{
+	PDIRECT_VOLUME_VIEW view;
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(NULL);
+
+	status = DirectVolumeOpenView (volume, cachePageCount, accessHint, &view);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return NULL;
+	}
+
+	return view;
+}
+
+DLLEXPORT BOOL APIENTRY CloseVolumeView(PDIRECT_VOLUME_VIEW view)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!view)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	DirectVolumeCloseView (view);
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY AdviseVolumeView(PDIRECT_VOLUME_VIEW view, int accessHint)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeViewAdvise (view, accessHint);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY GetVolumeViewPage(PDIRECT_VOLUME_VIEW view, unsigned __int64 pageNo, const unsigned char **data, DWORD *length)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DirectVolumeViewGetPage (view, pageNo, data, length);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY CreateVolumeFromImage(char *szImageFile, char *szVolumeFile, Password *VolumePassword, int ea, int pkcs5, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = EncryptImageToVolume (szImageFile, szVolumeFile, VolumePassword, ea, pkcs5, progress, progressContext);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY CreateVolumeInPlace(char *szFileName, Password *VolumePassword, int ea, int pkcs5, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = EncryptFileInPlace (szFileName, VolumePassword, ea, pkcs5, progress, progressContext);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY ResumeVolumeInPlace(char *szFileName, Password *VolumePassword, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = ResumeFileInPlaceEncryption (szFileName, VolumePassword, progress, progressContext);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY ExportVolume(char *szFileName, Password *VolumePassword, char *szImageFile, DWORD flags, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext)
+{
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	status = DecryptVolumeToImage (szFileName, VolumePassword, szImageFile, flags, progress, progressContext);
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT int APIENTRY ExportVolumeBatch(PTCAPI_VOLUME_EXPORT_ENTRY entries, int count, int maxConcurrency, PTCAPI_VOLUME_EXPORT_PROGRESS progress, void *progressContext)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+	return DecryptVolumesToImages (entries, count, maxConcurrency, progress, progressContext);
+}
+
+DLLEXPORT BOOL APIENTRY GetRandomData(unsigned char *buffer, unsigned __int64 length)
+{
+	PRANDOM_STREAM stream;
+	int status;
+
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if ((!buffer && length > 0) || length > (size_t) -1)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	if (!HoldRandomGenerator ())
+		return FALSE;
+
+	status = RandomStreamOpen (&stream);
+	if (status == ERR_SUCCESS)
+	{
+		if (!RandomStreamGetBytes (stream, buffer, (size_t) length))
+			status = ERR_OS_ERROR;
+
+		RandomStreamClose (stream);
+	}
+
+	if (status != ERR_SUCCESS)
+	{
+		HandleTcError (status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY BenchmarkRandomPool(int hashAlgorithm, DWORD duration, unsigned __int64 *mixesPerSecond)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!mixesPerSecond || duration == 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	*mixesPerSecond = RandBenchmarkMix (hashAlgorithm, duration);
+	if (*mixesPerSecond == 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY BenchmarkRandomInit(unsigned __int64 *microseconds)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!microseconds)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	if (!HoldRandomGenerator ())
+		return FALSE;
+
+	/* Duration of the start of the running generator */
+	*microseconds = RandGetInitDuration ();
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY BenchmarkRandomThreads(int threadCount, BOOL perThread, DWORD duration, unsigned __int64 *bytesPerSecond)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!bytesPerSecond || threadCount < 1 || threadCount > MAXIMUM_WAIT_OBJECTS || duration == 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	if (!HoldRandomGenerator ())
+		return FALSE;
+
+	*bytesPerSecond = RandBenchmarkThreads (threadCount, perThread, duration);
+
+	if (*bytesPerSecond == 0)
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY BenchmarkPkcs5(int pkcs5Prf, DWORD duration, unsigned __int64 *iterationsPerSecond)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!iterationsPerSecond || duration == 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	*iterationsPerSecond = Pkcs5Benchmark (pkcs5Prf, duration);
+	if (*iterationsPerSecond == 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestPkcs5(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_pkcs5 ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestRandomStreams(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	// The test restarts the generator
+	ReleaseRandomGenerator (FALSE);
+
+	if (!test_random_streams ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestDirectVolumeWriteBack(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_direct_volume_write_back ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestInPlaceEncryptionResume(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_in_place_encryption_resume ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestMountBatch(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_mount_batch ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestSectorCache(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_sector_cache ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestDirectVolumeReadAhead(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_direct_volume_read_ahead ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestDirectVolumePipeline(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_direct_volume_pipeline ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestDirectVolumeView(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_direct_volume_view ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestImageToVolume(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_image_to_volume ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestVolumeToImage(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_volume_to_image ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+DLLEXPORT BOOL APIENTRY TestEntropyRing(void)
+{
+	TCAPI_CHECK_INITIALIZED(0);
+
+	if (!test_entropy_ring ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -13,6 +13,10 @@
 
 #include "Options.h"
 #include "Password.h"
+#include "MountBatch.h"
+#include "PasswordBatch.h"
+#include "DirectVolume.h"
+#include "VolumeImage.h"
 
 #define DLLEXPORT __declspec(dllexport)
 
@@ -27,6 +31,47 @@ extern "C" {
 	DLLEXPORT int APIENTRY LoadTrueCryptDriver(void);
 	DLLEXPORT BOOL APIENTRY UnloadTrueCryptDriver(void);
 	DLLEXPORT BOOL APIENTRY MountV(int nDosDriveNo, char *szFileName, Password VolumePassword);
+	DLLEXPORT int APIENTRY MountBatch(PTCAPI_MOUNT_ENTRY entries, int count, int maxConcurrency);
+	DLLEXPORT int APIENTRY ChangePasswordBatch(PTCAPI_PASSWORD_CHANGE_ENTRY entries, int count, int maxConcurrency, PTCAPI_PASSWORD_CHANGE_PROGRESS progress, void *progressContext);
+	DLLEXPORT PDIRECT_VOLUME APIENTRY OpenVolume(char *szFileName, Password *VolumePassword, BOOL readOnly);
+	DLLEXPORT BOOL APIENTRY CloseVolume(PDIRECT_VOLUME volume);
+	DLLEXPORT BOOL APIENTRY GetVolumeGeometry(PDIRECT_VOLUME volume, unsigned __int64 *size, DWORD *sectorSize);
+	DLLEXPORT BOOL APIENTRY ReadVolumeSectors(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, void *buffer);
+	DLLEXPORT BOOL APIENTRY WriteVolumeSectors(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, const void *buffer);
+	DLLEXPORT BOOL APIENTRY FlushVolume(PDIRECT_VOLUME volume);
+	DLLEXPORT BOOL APIENTRY ReadVolumeStream(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount, DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext);
+	DLLEXPORT BOOL APIENTRY WriteVolumeStream(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount, DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext);
+	DLLEXPORT BOOL APIENTRY SetVolumeQueueDepth(PDIRECT_VOLUME volume, DWORD queueDepth);
+	DLLEXPORT BOOL APIENTRY SetVolumeCacheSize(PDIRECT_VOLUME volume, DWORD cacheSize);
+	DLLEXPORT BOOL APIENTRY GetVolumeCacheStats(PDIRECT_VOLUME volume, SECTOR_CACHE_STATS *stats);
+	DLLEXPORT BOOL APIENTRY SetVolumeReadAhead(PDIRECT_VOLUME volume, DWORD maxSize);
+	DLLEXPORT BOOL APIENTRY SetVolumeWriteBack(PDIRECT_VOLUME volume, DWORD maxSize, DWORD flushInterval);
+	DLLEXPORT PDIRECT_VOLUME_VIEW APIENTRY OpenVolumeView(PDIRECT_VOLUME volume, DWORD cachePageCount, int accessHint);
+	DLLEXPORT BOOL APIENTRY CloseVolumeView(PDIRECT_VOLUME_VIEW view);
+	DLLEXPORT BOOL APIENTRY AdviseVolumeView(PDIRECT_VOLUME_VIEW view, int accessHint);
+	DLLEXPORT BOOL APIENTRY GetVolumeViewPage(PDIRECT_VOLUME_VIEW view, unsigned __int64 pageNo, const unsigned char **data, DWORD *length);
+	DLLEXPORT BOOL APIENTRY CreateVolumeFromImage(char *szImageFile, char *szVolumeFile, Password *VolumePassword, int ea, int pkcs5, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext);
+	DLLEXPORT BOOL APIENTRY CreateVolumeInPlace(char *szFileName, Password *VolumePassword, int ea, int pkcs5, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext);
+	DLLEXPORT BOOL APIENTRY ResumeVolumeInPlace(char *szFileName, Password *VolumePassword, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext);
+	DLLEXPORT BOOL APIENTRY ExportVolume(char *szFileName, Password *VolumePassword, char *szImageFile, DWORD flags, PVOLUME_IMAGE_PROGRESS_CALLBACK progress, void *progressContext);
+	DLLEXPORT int APIENTRY ExportVolumeBatch(PTCAPI_VOLUME_EXPORT_ENTRY entries, int count, int maxConcurrency, PTCAPI_VOLUME_EXPORT_PROGRESS progress, void *progressContext);
+	DLLEXPORT BOOL APIENTRY GetRandomData(unsigned char *buffer, unsigned __int64 length);
+	DLLEXPORT BOOL APIENTRY BenchmarkRandomPool(int hashAlgorithm, DWORD duration, unsigned __int64 *mixesPerSecond);
+	DLLEXPORT BOOL APIENTRY BenchmarkRandomInit(unsigned __int64 *microseconds);
+	DLLEXPORT BOOL APIENTRY BenchmarkRandomThreads(int threadCount, BOOL perThread, DWORD duration, unsigned __int64 *bytesPerSecond);
+	DLLEXPORT BOOL APIENTRY BenchmarkPkcs5(int pkcs5Prf, DWORD duration, unsigned __int64 *iterationsPerSecond);
+	DLLEXPORT BOOL APIENTRY TestPkcs5(void);
+	DLLEXPORT BOOL APIENTRY TestRandomStreams(void);
+	DLLEXPORT BOOL APIENTRY TestDirectVolumeWriteBack(void);
+	DLLEXPORT BOOL APIENTRY TestInPlaceEncryptionResume(void);
+	DLLEXPORT BOOL APIENTRY TestMountBatch(void);
+	DLLEXPORT BOOL APIENTRY TestSectorCache(void);
+	DLLEXPORT BOOL APIENTRY TestDirectVolumeReadAhead(void);
+	DLLEXPORT BOOL APIENTRY TestDirectVolumePipeline(void);
+	DLLEXPORT BOOL APIENTRY TestDirectVolumeView(void);
+	DLLEXPORT BOOL APIENTRY TestImageToVolume(void);
+	DLLEXPORT BOOL APIENTRY TestVolumeToImage(void);
+	DLLEXPORT BOOL APIENTRY TestEntropyRing(void);
 
 #ifdef __cplusplus
 }
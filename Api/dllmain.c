@@ -1,5 +1,7 @@
 // dllmain.c : Defines the entry point for the DLL application.
 #include "Api.h"
+#include "Random.h"
+#include "RandomStream.h"
 
 BOOL APIENTRY DllMain( HMODULE hModule,
                        DWORD  ul_reason_for_call,
@@ -9,9 +11,16 @@ BOOL APIENTRY DllMain( HMODULE hModule,
 	switch (ul_reason_for_call)
 	{
 	case DLL_PROCESS_ATTACH:
-	case DLL_THREAD_ATTACH:
+		RandProcessAttach ();
+		return RandomThreadStreamsStart ();
 	case DLL_THREAD_DETACH:
+		RandomThreadStreamRelease ();
+		break;
 	case DLL_PROCESS_DETACH:
+		RandomThreadStreamsStop ();
+		RandProcessDetach ();
+		break;
+	case DLL_THREAD_ATTACH:
 		break;
 	}
 	return TRUE;
@@ -4,6 +4,9 @@
 #include "stdafx.h"
 #include "..\Common\Options.h"
 #include "..\Common\Password.h"
+#include "..\Common\MountBatch.h"
+#include "..\Common\PasswordBatch.h"
+#include "..\Common\DirectVolume.h"
 
 using namespace std;
 
@@ -12,6 +15,28 @@ typedef int (STDMETHODCALLTYPE *PSHUTDOWN)();
 typedef int (STDMETHODCALLTYPE *PLOAD_TC_DRIVER)();
 typedef int (STDMETHODCALLTYPE *PUNLOAD_TC_DRIVER)();
 typedef BOOL (STDMETHODCALLTYPE *PMOUNT)(int nDosDriveNo, char *szFileName, Password VolumePassword);
+typedef int (STDMETHODCALLTYPE *PMOUNT_BATCH)(PTCAPI_MOUNT_ENTRY entries, int count, int maxConcurrency);
+typedef int (STDMETHODCALLTYPE *PCHANGE_PASSWORD_BATCH)(PTCAPI_PASSWORD_CHANGE_ENTRY entries, int count, int maxConcurrency, PTCAPI_PASSWORD_CHANGE_PROGRESS progress, void *progressContext);
+typedef PDIRECT_VOLUME (STDMETHODCALLTYPE *POPEN_VOLUME)(char *szFileName, Password *VolumePassword, BOOL readOnly);
+typedef BOOL (STDMETHODCALLTYPE *PCLOSE_VOLUME)(PDIRECT_VOLUME volume);
+typedef BOOL (STDMETHODCALLTYPE *PGET_VOLUME_GEOMETRY)(PDIRECT_VOLUME volume, unsigned __int64 *size, DWORD *sectorSize);
+typedef BOOL (STDMETHODCALLTYPE *PREAD_VOLUME_SECTORS)(PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, void *buffer);
+typedef BOOL (STDMETHODCALLTYPE *PBENCHMARK_RANDOM_POOL)(int hashAlgorithm, DWORD duration, unsigned __int64 *mixesPerSecond);
+typedef BOOL (STDMETHODCALLTYPE *PBENCHMARK_RANDOM_INIT)(unsigned __int64 *microseconds);
+typedef BOOL (STDMETHODCALLTYPE *PBENCHMARK_RANDOM_THREADS)(int threadCount, BOOL perThread, DWORD duration, unsigned __int64 *bytesPerSecond);
+typedef BOOL (STDMETHODCALLTYPE *PBENCHMARK_PKCS5)(int pkcs5Prf, DWORD duration, unsigned __int64 *iterationsPerSecond);
+typedef BOOL (STDMETHODCALLTYPE *PTEST_PKCS5)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_RANDOM_STREAMS)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_DIRECT_VOLUME_WRITE_BACK)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_IN_PLACE_ENCRYPTION_RESUME)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_MOUNT_BATCH)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_SECTOR_CACHE)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_DIRECT_VOLUME_READ_AHEAD)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_DIRECT_VOLUME_PIPELINE)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_DIRECT_VOLUME_VIEW)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_IMAGE_TO_VOLUME)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_VOLUME_TO_IMAGE)();
+typedef BOOL (STDMETHODCALLTYPE *PTEST_ENTROPY_RING)();
 
 class ApiTest {
 private:
@@ -21,6 +46,28 @@ private:
 	PINITIALIZE Initialize;
 	PSHUTDOWN Shutdown;
 	PMOUNT Mount;
+	PMOUNT_BATCH MountBatch;
+	PCHANGE_PASSWORD_BATCH ChangePasswordBatch;
+	POPEN_VOLUME OpenVolume;
+	PCLOSE_VOLUME CloseVolume;
+	PGET_VOLUME_GEOMETRY GetVolumeGeometry;
+	PREAD_VOLUME_SECTORS ReadVolumeSectors;
+	PBENCHMARK_RANDOM_POOL BenchmarkRandomPool;
+	PBENCHMARK_RANDOM_INIT BenchmarkRandomInit;
+	PBENCHMARK_RANDOM_THREADS BenchmarkRandomThreads;
+	PBENCHMARK_PKCS5 BenchmarkPkcs5;
+	PTEST_PKCS5 TestPkcs5;
+	PTEST_RANDOM_STREAMS TestRandomStreams;
+	PTEST_DIRECT_VOLUME_WRITE_BACK TestDirectVolumeWriteBack;
+	PTEST_IN_PLACE_ENCRYPTION_RESUME TestInPlaceEncryptionResume;
+	PTEST_MOUNT_BATCH TestMountBatch;
+	PTEST_SECTOR_CACHE TestSectorCache;
+	PTEST_DIRECT_VOLUME_READ_AHEAD TestDirectVolumeReadAhead;
+	PTEST_DIRECT_VOLUME_PIPELINE TestDirectVolumePipeline;
+	PTEST_DIRECT_VOLUME_VIEW TestDirectVolumeView;
+	PTEST_IMAGE_TO_VOLUME TestImageToVolume;
+	PTEST_VOLUME_TO_IMAGE TestVolumeToImage;
+	PTEST_ENTROPY_RING TestEntropyRing;
 
 protected:
 	BOOL LoadTrueCryptApi(LPCTSTR path) {
@@ -63,6 +110,28 @@ protected:
 		LoadProcAddress((FARPROC *)&LoadTrueCryptDriver, "LoadTrueCryptDriver");
 		LoadProcAddress((FARPROC *)&UnloadTrueCryptDriver, "UnloadTrueCryptDriver");
 		LoadProcAddress((FARPROC *)&Mount, "MountV");
+		LoadProcAddress((FARPROC *)&MountBatch, "MountBatch");
+		LoadProcAddress((FARPROC *)&ChangePasswordBatch, "ChangePasswordBatch");
+		LoadProcAddress((FARPROC *)&OpenVolume, "OpenVolume");
+		LoadProcAddress((FARPROC *)&CloseVolume, "CloseVolume");
+		LoadProcAddress((FARPROC *)&GetVolumeGeometry, "GetVolumeGeometry");
+		LoadProcAddress((FARPROC *)&ReadVolumeSectors, "ReadVolumeSectors");
+		LoadProcAddress((FARPROC *)&BenchmarkRandomPool, "BenchmarkRandomPool");
+		LoadProcAddress((FARPROC *)&BenchmarkRandomInit, "BenchmarkRandomInit");
+		LoadProcAddress((FARPROC *)&BenchmarkRandomThreads, "BenchmarkRandomThreads");
+		LoadProcAddress((FARPROC *)&BenchmarkPkcs5, "BenchmarkPkcs5");
+		LoadProcAddress((FARPROC *)&TestPkcs5, "TestPkcs5");
+		LoadProcAddress((FARPROC *)&TestRandomStreams, "TestRandomStreams");
+		LoadProcAddress((FARPROC *)&TestDirectVolumeWriteBack, "TestDirectVolumeWriteBack");
+		LoadProcAddress((FARPROC *)&TestInPlaceEncryptionResume, "TestInPlaceEncryptionResume");
+		LoadProcAddress((FARPROC *)&TestMountBatch, "TestMountBatch");
+		LoadProcAddress((FARPROC *)&TestSectorCache, "TestSectorCache");
+		LoadProcAddress((FARPROC *)&TestDirectVolumeReadAhead, "TestDirectVolumeReadAhead");
+		LoadProcAddress((FARPROC *)&TestDirectVolumePipeline, "TestDirectVolumePipeline");
+		LoadProcAddress((FARPROC *)&TestDirectVolumeView, "TestDirectVolumeView");
+		LoadProcAddress((FARPROC *)&TestImageToVolume, "TestImageToVolume");
+		LoadProcAddress((FARPROC *)&TestVolumeToImage, "TestVolumeToImage");
+		LoadProcAddress((FARPROC *)&TestEntropyRing, "TestEntropyRing");
 
 		return TRUE;
 	}
@@ -79,7 +148,7 @@ protected:
 
 	void RunInitialize() {
 		PTCAPI_OPTIONS pOptions;
-		int numOptions = 6;
+		int numOptions = 7;
 
 		DWORD memSize = sizeof TCAPI_OPTIONS + (sizeof TCAPI_OPTION * numOptions);
 
@@ -103,6 +172,9 @@ protected:
 
 		pOptions->Options[5].OptionId = TC_OPTION_WIPE_CACHE_ON_EXIT;
 		pOptions->Options[5].OptionValue = TRUE;
+
+		pOptions->Options[6].OptionId = TC_OPTION_HEADER_HINTS;
+		pOptions->Options[6].OptionValue = TRUE;
 		
 		pOptions->NumberOfOptions = numOptions;
 
@@ -124,6 +196,38 @@ protected:
 		cout << "Shutdown returned " << res << endl;
 	}
 
+	void RunDirectVolume() {
+		Password pass;
+		const char *passString = "lalala";
+		memset(&pass, 0, sizeof pass);
+
+		pass.Length = strlen(passString);
+		strcpy ((char *) &pass.Text[0], passString);
+
+		cout << "Opening volume without driver" << endl;
+
+		PDIRECT_VOLUME volume = OpenVolume("d:\\test.dat", &pass, TRUE);
+		if (!volume) {
+			cout << "Error opening volume: " << hex << GetLastError() << dec << endl;
+			return;
+		}
+
+		unsigned __int64 size = 0;
+		DWORD sectorSize = 512;
+		if (GetVolumeGeometry(volume, &size, &sectorSize))
+			cout << "Volume size: " << size << ", sector size: " << sectorSize << endl;
+
+		// Boot sector of the filesystem
+		byte *sector = new byte[sectorSize];
+		if (ReadVolumeSectors(volume, 0, 1, sector))
+			cout << "Boot sector signature: " << hex << (int) sector[510] << " " << (int) sector[511] << dec << endl;
+		else
+			cout << "Error reading volume: " << hex << GetLastError() << dec << endl;
+
+		delete[] sector;
+		CloseVolume(volume);
+	}
+
 	void RunMount() {
 		Password pass;
 		const char *passString = "lalala";
@@ -140,6 +244,184 @@ protected:
 
 	}
 
+	void RunMountBatch() {
+		const char *passString = "lalala";
+		const char *paths[] = { "d:\\test1.dat", "d:\\test2.dat", "d:\\test3.dat" };
+		const int count = sizeof paths / sizeof paths[0];
+		TCAPI_MOUNT_ENTRY entries[count];
+		memset(entries, 0, sizeof entries);
+
+		for (int i = 0; i < count; i++) {
+			strcpy(entries[i].VolumePath, paths[i]);
+			entries[i].DriveNo = 16 + i;
+			entries[i].VolumePassword.Length = strlen(passString);
+			strcpy ((char *) &entries[i].VolumePassword.Text[0], passString);
+		}
+
+		cout << "Mounting " << count << " volumes" << endl;
+
+		int res = MountBatch(entries, count, 0);
+
+		for (int i = 0; i < count; i++)
+			cout << entries[i].VolumePath << " mount result: " << entries[i].Result << ", error: " << hex << entries[i].LastError << dec << endl;
+
+		cout << "Volumes mounted: " << res << endl;
+	}
+
+	static void CALLBACK ChangePasswordBatchProgress(int entryIndex, int completedCount, int totalCount, void *context) {
+		cout << "Password change progress: " << completedCount << "/" << totalCount << " (entry " << entryIndex << ")" << endl;
+	}
+
+	void RunChangePasswordBatch() {
+		const char *passString = "lalala";
+		const char *paths[] = { "d:\\test1.dat", "d:\\test2.dat", "d:\\test3.dat" };
+		const int count = sizeof paths / sizeof paths[0];
+		TCAPI_PASSWORD_CHANGE_ENTRY entries[count];
+		memset(entries, 0, sizeof entries);
+
+		for (int i = 0; i < count; i++) {
+			strcpy(entries[i].VolumePath, paths[i]);
+			entries[i].OldPassword.Length = strlen(passString);
+			strcpy ((char *) &entries[i].OldPassword.Text[0], passString);
+			entries[i].NewPassword = entries[i].OldPassword;
+		}
+
+		cout << "Changing passwords of " << count << " volumes" << endl;
+
+		int res = ChangePasswordBatch(entries, count, 0, ChangePasswordBatchProgress, NULL);
+
+		for (int i = 0; i < count; i++)
+			cout << entries[i].VolumePath << " password change result: " << entries[i].Result << ", error: " << hex << entries[i].LastError << dec << endl;
+
+		cout << "Passwords changed: " << res << endl;
+	}
+
+	void RunBenchmarkRandomPool() {
+		// Hash algorithm IDs: 1 = RIPEMD-160, 2 = SHA-512, 3 = Whirlpool
+		const char *names[] = { "RIPEMD-160", "SHA-512", "Whirlpool" };
+
+		for (int i = 0; i < 3; i++) {
+			unsigned __int64 mixesPerSecond = 0;
+			if (BenchmarkRandomPool(i + 1, 1000, &mixesPerSecond))
+				// The pool is mixed once per 16 bytes added
+				cout << names[i] << " pool mixes/s: " << mixesPerSecond << ", pool input: " << mixesPerSecond * 16 / 1024 << " KB/s" << endl;
+			else
+				cout << "Error benchmarking " << names[i] << ": " << hex << GetLastError() << dec << endl;
+		}
+
+		unsigned __int64 initTime = 0;
+		if (BenchmarkRandomInit(&initTime))
+			cout << "Random generator startup: " << initTime << " us" << endl;
+		else
+			cout << "Error benchmarking random generator startup: " << hex << GetLastError() << dec << endl;
+
+		// Shared pool versus per-thread generators
+		for (int threads = 1; threads <= 8; threads *= 2) {
+			unsigned __int64 pooled = 0, perThread = 0;
+			if (BenchmarkRandomThreads(threads, FALSE, 1000, &pooled) && BenchmarkRandomThreads(threads, TRUE, 1000, &perThread))
+				cout << threads << " threads: pool " << pooled / 1024 << " KB/s, per-thread " << perThread / 1024 << " KB/s" << endl;
+			else
+				cout << "Error benchmarking " << threads << " random threads: " << hex << GetLastError() << dec << endl;
+		}
+	}
+
+	void RunBenchmarkPkcs5() {
+		// PRF IDs: 1 = HMAC-RIPEMD-160, 2 = HMAC-SHA-512, 3 = HMAC-Whirlpool
+		const char *names[] = { "HMAC-RIPEMD-160", "HMAC-SHA-512", "HMAC-Whirlpool" };
+
+		for (int i = 0; i < 3; i++) {
+			unsigned __int64 iterationsPerSecond = 0;
+			if (BenchmarkPkcs5(i + 1, 1000, &iterationsPerSecond))
+				cout << names[i] << " PBKDF2 iterations/s: " << iterationsPerSecond << endl;
+			else
+				cout << "Error benchmarking " << names[i] << ": " << hex << GetLastError() << dec << endl;
+		}
+	}
+
+	void RunTestPkcs5() {
+		if (TestPkcs5())
+			cout << "PBKDF2 known-answer tests passed" << endl;
+		else
+			cout << "PBKDF2 known-answer tests failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestRandomStreams() {
+		if (TestRandomStreams())
+			cout << "Random stream tests passed" << endl;
+		else
+			cout << "Random stream tests failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestDirectVolumeWriteBack() {
+		if (TestDirectVolumeWriteBack())
+			cout << "Direct volume write-back test passed" << endl;
+		else
+			cout << "Direct volume write-back test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestInPlaceEncryptionResume() {
+		if (TestInPlaceEncryptionResume())
+			cout << "In-place encryption resume test passed" << endl;
+		else
+			cout << "In-place encryption resume test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestMountBatch() {
+		if (TestMountBatch())
+			cout << "Mount batch test passed" << endl;
+		else
+			cout << "Mount batch test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestSectorCache() {
+		if (TestSectorCache())
+			cout << "Sector cache test passed" << endl;
+		else
+			cout << "Sector cache test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestDirectVolumeReadAhead() {
+		if (TestDirectVolumeReadAhead())
+			cout << "Direct volume read-ahead test passed" << endl;
+		else
+			cout << "Direct volume read-ahead test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestDirectVolumePipeline() {
+		if (TestDirectVolumePipeline())
+			cout << "Direct volume pipeline test passed" << endl;
+		else
+			cout << "Direct volume pipeline test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestDirectVolumeView() {
+		if (TestDirectVolumeView())
+			cout << "Direct volume view test passed" << endl;
+		else
+			cout << "Direct volume view test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestImageToVolume() {
+		if (TestImageToVolume())
+			cout << "Image to volume test passed" << endl;
+		else
+			cout << "Image to volume test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestVolumeToImage() {
+		if (TestVolumeToImage())
+			cout << "Volume to image test passed" << endl;
+		else
+			cout << "Volume to image test failed: " << hex << GetLastError() << dec << endl;
+	}
+
+	void RunTestEntropyRing() {
+		if (TestEntropyRing())
+			cout << "Entropy ring test passed" << endl;
+		else
+			cout << "Entropy ring test failed: " << hex << GetLastError() << dec << endl;
+	}
+
 public:
 	void run() {
 		if (!LoadTrueCryptApi("TrueCryptApi.dll")) return;
@@ -154,8 +436,29 @@ public:
 				cout << "LoadTrueCryptDriver version: " << hex << res << endl;
 			}
 
+			RunBenchmarkRandomPool();
+			RunTestPkcs5();
+			RunTestRandomStreams();
+			RunTestDirectVolumeWriteBack();
+			RunTestInPlaceEncryptionResume();
+			RunTestMountBatch();
+			RunTestSectorCache();
+			RunTestDirectVolumeReadAhead();
+			RunTestDirectVolumePipeline();
+			RunTestDirectVolumeView();
+			RunTestImageToVolume();
+			RunTestVolumeToImage();
+			RunTestEntropyRing();
+			RunBenchmarkPkcs5();
+
+			RunDirectVolume();
+
 			RunMount();
 
+			RunMountBatch();
+
+			RunChangePasswordBatch();
+
 			RunShutdown();
 		}
 		UnloadTrueCryptApi();
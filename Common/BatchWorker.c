@@ -0,0 +1,105 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+/* NN: Thread scaffolding shared by the batch APIs (MountVolumeBatch(), ChangeVolumePasswordBatch(), 
+   DecryptVolumesToImages()). Entries are handed out one at a time to a number of threads, the calling 
+   thread included, until none is left. */
+
+#include <process.h>
+#include "BatchWorker.h"
+#include "EncryptionThreadPool.h"
+
+#define BATCH_MAX_THREAD_COUNT	MAXIMUM_WAIT_OBJECTS
+
+typedef struct
+{
+	LONG EntryCount;
+	volatile LONG NextEntry;
+	LONG CompletedCount;
+	LONG SucceededCount;
+	CRITICAL_SECTION Lock;
+	BATCH_ENTRY_PROC ProcessEntry;
+	BATCH_ENTRY_DONE_PROC EntryDone;
+	void *Context;
+} BatchContext;
+
+static unsigned __stdcall BatchThreadProc (void *threadArg)
+{
+	BatchContext *batch = (BatchContext *) threadArg;
+	BOOL succeeded;
+	LONG i;
+
+	while ((i = InterlockedIncrement (&batch->NextEntry) - 1) < batch->EntryCount)
+	{
+		SetLastError (ERROR_SUCCESS);
+
+		succeeded = batch->ProcessEntry ((int) i, batch->Context);
+
+		EnterCriticalSection (&batch->Lock);
+
+		if (succeeded)
+			++batch->SucceededCount;
+
+		++batch->CompletedCount;
+
+		if (batch->EntryDone)
+			batch->EntryDone ((int) i, succeeded, (int) batch->CompletedCount, batch->Context);
+
+		LeaveCriticalSection (&batch->Lock);
+	}
+
+	return 0;
+}
+
+// Calls processEntry for entries 0 to count - 1 using up to maxConcurrency threads (0 = one per 
+// encryption thread). Returns the number of entries which succeeded.
+int RunBatch (int count, int maxConcurrency, BATCH_ENTRY_PROC processEntry, BATCH_ENTRY_DONE_PROC entryDone, void *context)
+{
+	HANDLE threads[BATCH_MAX_THREAD_COUNT];
+	BatchContext batch;
+	int threadCount = 0;
+	int i;
+
+	if (count <= 0)
+		return 0;
+
+	if (maxConcurrency <= 0)
+		maxConcurrency = (int) max (GetEncryptionThreadCount (), 1);
+
+	maxConcurrency = min (min (maxConcurrency, count), BATCH_MAX_THREAD_COUNT);
+
+	memset (&batch, 0, sizeof (batch));
+	batch.EntryCount = count;
+	batch.ProcessEntry = processEntry;
+	batch.EntryDone = entryDone;
+	batch.Context = context;
+	InitializeCriticalSection (&batch.Lock);
+
+	// The calling thread processes entries as well
+	for (i = 0; i < maxConcurrency - 1; ++i)
+	{
+		threads[threadCount] = (HANDLE) _beginthreadex (NULL, 0, BatchThreadProc, &batch, 0, NULL);
+		if (!threads[threadCount])
+			break;
+
+		++threadCount;
+	}
+
+	BatchThreadProc (&batch);
+
+	if (threadCount > 0)
+	{
+		WaitForMultipleObjects (threadCount, threads, TRUE, INFINITE);
+
+		for (i = 0; i < threadCount; ++i)
+			CloseHandle (threads[i]);
+	}
+
+	DeleteCriticalSection (&batch.Lock);
+
+	return (int) batch.SucceededCount;
+}
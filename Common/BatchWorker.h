@@ -0,0 +1,31 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+#ifndef BATCH_WORKER_H
+#define BATCH_WORKER_H
+
+#include "Tcdefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/* Processes one entry of a batch; called concurrently from all batch threads. Returns TRUE if the 
+	   entry succeeded. The thread's last error is reset before each call. */
+	typedef BOOL (*BATCH_ENTRY_PROC) (int entryIndex, void *context);
+
+	/* Called once an entry has been processed. Calls are serialized but may come from any of the batch 
+	   threads. */
+	typedef void (*BATCH_ENTRY_DONE_PROC) (int entryIndex, BOOL succeeded, int completedCount, void *context);
+
+	int RunBatch (int count, int maxConcurrency, BATCH_ENTRY_PROC processEntry, BATCH_ENTRY_DONE_PROC entryDone, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -971,6 +971,8 @@ namespace TrueCrypt
 		if (Randinit() != ERR_SUCCESS)
 			throw ParameterIncorrect (SRC_POS);
 
+		finally_do ({ RandStop (FALSE); });
+
 		UserEnrichRandomPool ();
 
 		if (!RandgetBytes (request.WipeKey, sizeof (request.WipeKey), TRUE))
@@ -1028,6 +1030,8 @@ namespace TrueCrypt
 		if (IsHiddenOSRunning() || Randinit() != ERR_SUCCESS)
 			throw ParameterIncorrect (SRC_POS);
 
+		finally_do ({ RandStop (FALSE); });
+
 		Device device (GetSystemDriveConfiguration().DevicePath);
 		byte mbr[TC_SECTOR_SIZE_BIOS];
 
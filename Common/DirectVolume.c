@@ -0,0 +1,1595 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+/* NN: Driverless access to file-hosted volumes. The volume header is located the same way ChangePwd does
+   it, and the data area is mapped the same way the driver does it when mounting (Driver/Ntvol.c): sector
+   N of the volume lives at host offset volDataAreaOffset + N * SectorSize and is encrypted as data units
+   starting at that host offset divided by ENCRYPTION_DATA_UNIT_SIZE. Host file I/O is positional, so a
+   volume can be accessed from several threads at once. Hidden volume protection is not supported.
+   Host transfers are pipelined; reads may be served by a sector cache or a read-ahead window, writes may 
+   be buffered, and views decrypt pages of a read-only mapping of the host file. */
+
+#include "Tcdefs.h"
+
+#include <process.h>
+#include "Crypto.h"
+#include "Volumes.h"
+#include "DirectVolume.h"
+#include "Options.h"
+#include "HeaderHints.h"
+#include "Errors.h"
+
+// Maximum size of a single host transfer (the same as the driver's encrypted I/O queue fragment size)
+#define DIRECT_VOLUME_FRAGMENT_SIZE	(256 * 1024)
+
+#define DIRECT_VOLUME_DEFAULT_QUEUE_DEPTH	8
+
+#define DIRECT_VOLUME_DEFAULT_CACHE_SIZE	(1024 * 1024)
+
+// Larger reads bypass the sector cache
+#define DIRECT_VOLUME_CACHE_MAX_TRANSFER_SIZE	(64 * 1024)
+
+// Initial read-ahead window size; windows also end at multiples of it
+#define DIRECT_VOLUME_READ_AHEAD_MIN_SIZE	(64 * 1024)
+#define DIRECT_VOLUME_DEFAULT_READ_AHEAD_SIZE	(2 * 1024 * 1024)
+
+// A buffered sector
+typedef struct
+{
+	uint64 SectorNo;
+	DWORD Slot;			// Index of the sector's data in WriteBackData
+} WriteBackEntry;
+
+// Size of the part of the host file a view keeps mapped at a time
+#define DIRECT_VOLUME_VIEW_WINDOW_SIZE	(16 * 1024 * 1024)
+
+#define DIRECT_VOLUME_VIEW_DEFAULT_CACHE_PAGES	64
+#define DIRECT_VOLUME_VIEW_MAX_READ_AHEAD	16
+
+struct DirectVolumeStruct
+{
+	HANDLE HostFile;
+	BOOL ReadOnly;
+	PCRYPTO_INFO CryptoInfo;
+	int VolumeType;
+	uint64 HostSize;
+	uint64 Size;			// Size of the data area in bytes
+	uint32 SectorSize;
+	DWORD QueueDepth;		// Maximum number of host transfers in flight
+	volatile LONG WriteGeneration;	// Incremented by every write; invalidates view caches
+	PSECTOR_CACHE Cache;	// NULL if caching is disabled
+
+	CRITICAL_SECTION ReadAheadLock;
+	DWORD ReadAheadMaxSize;		// 0 if read-ahead is disabled
+	DWORD ReadAheadWindow;		// Size of the next window in bytes; 0 if no sequential stream is detected
+	uint64 NextSectorNo;		// Sector following the last one read
+	byte *ReadAheadBuffer;		// Plaintext of the current window
+	uint64 ReadAheadStart;
+	DWORD ReadAheadCount;		// Number of valid sectors in ReadAheadBuffer
+	BOOL ReadAheadFilling;		// ReadAheadBuffer is being filled by a reader outside ReadAheadLock
+
+	CRITICAL_SECTION FlushLock;		// Serializes flushes and direct writes; taken before WriteBackLock
+	CRITICAL_SECTION WriteBackLock;
+	DWORD WriteBackCapacity;	// Maximum number of buffered sectors; 0 if write-back is disabled
+	WriteBackEntry *WriteBackEntries;	// Sorted by sector number
+	DWORD WriteBackCount;
+	WriteBackEntry *FlushEntries;	// Sectors being written to the host by FlushWriteBack, sorted by sector number
+	DWORD FlushCount;
+	byte *WriteBackData;
+	DWORD *WriteBackFreeSlots;
+	DWORD WriteBackFreeSlotCount;
+	DWORD WriteBackInterval;	// Milliseconds between periodic flushes
+	HANDLE WriteBackThread;
+	HANDLE WriteBackStopEvent;
+};
+
+typedef struct
+{
+	PDIRECT_VOLUME Volume;
+	WriteBackEntry *Entries;
+	DWORD FirstEntry;
+	uint64 FirstSectorNo;
+} WriteBackFlushContext;
+
+typedef struct
+{
+	PDIRECT_VOLUME Volume;
+	DIRECT_VOLUME_STREAM_CALLBACK Callback;
+	void *CallbackContext;
+} WriteBackStreamContext;
+
+typedef struct
+{
+	uint64 PageNo;
+	uint64 LastUse;
+	DWORD Length;
+	BOOL Valid;
+} ViewCachePage;
+
+struct DirectVolumeViewStruct
+{
+	PDIRECT_VOLUME Volume;
+	HANDLE Mapping;
+	byte *Window;			// Mapped part of the host file
+	uint64 WindowOffset;
+	DWORD WindowSize;
+	DWORD AllocationGranularity;
+	int AccessHint;
+	DWORD CachePageCount;
+	ViewCachePage *CachePages;
+	byte *CacheData;		// Plaintext of the cached pages
+	uint64 UseCounter;
+	LONG WriteGeneration;
+};
+
+// A fragment transferred from/to the host
+typedef struct
+{
+	OVERLAPPED Overlapped;
+	byte *Data;
+	uint64 HostOffset;
+	DWORD Length;
+	BOOL Pending;
+} HostIoSlot;
+
+
+// Starts an overlapped read or write of the slot's fragment
+static BOOL BeginHostTransfer (HANDLE hostFile, BOOL write, HostIoSlot *slot)
+{
+	BOOL bResult;
+
+	slot->Overlapped.Internal = 0;
+	slot->Overlapped.InternalHigh = 0;
+	slot->Overlapped.Offset = (DWORD) slot->HostOffset;
+	slot->Overlapped.OffsetHigh = (DWORD) (slot->HostOffset >> 32);
+
+	if (write)
+		bResult = WriteFile (hostFile, slot->Data, slot->Length, NULL, &slot->Overlapped);
+	else
+		bResult = ReadFile (hostFile, slot->Data, slot->Length, NULL, &slot->Overlapped);
+
+	if (!bResult && GetLastError () != ERROR_IO_PENDING)
+		return FALSE;
+
+	slot->Pending = TRUE;
+	return TRUE;
+}
+
+
+// Waits for the slot's transfer to complete
+static BOOL CompleteHostTransfer (HANDLE hostFile, HostIoSlot *slot)
+{
+	DWORD bytesTransferred;
+
+	slot->Pending = FALSE;
+
+	if (!GetOverlappedResult (hostFile, &slot->Overlapped, &bytesTransferred, TRUE))
+		return FALSE;
+
+	if (bytesTransferred != slot->Length)
+	{
+		SetLastError (ERROR_HANDLE_EOF);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+// Transfers sectorCount sectors starting at sectorNo in fragments, with up to QueueDepth host transfers in
+// flight, so that completed fragments are decrypted (or the next ones encrypted) by the encryption thread
+// pool while the host is busy with the others. Reads go directly to buffer if it is not NULL; otherwise 
+// each decrypted fragment is passed to callback. Writes take the plaintext from buffer if it is not NULL; 
+// otherwise each fragment is filled by callback. Fragments are always processed in ascending order.
+static int TransferSectors (PDIRECT_VOLUME volume, BOOL write, uint64 sectorNo, uint64 sectorCount, byte *buffer,
+	DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext)
+{
+	HostIoSlot slots[DIRECT_VOLUME_MAX_QUEUE_DEPTH];
+	byte *slotBuffers = NULL;
+	uint64 hostOffset = volume->CryptoInfo->volDataAreaOffset + sectorNo * volume->SectorSize;
+	uint64 length = sectorCount * volume->SectorSize;
+	uint64 fragmentCount = (length + DIRECT_VOLUME_FRAGMENT_SIZE - 1) / DIRECT_VOLUME_FRAGMENT_SIZE;
+	uint64 submitted = 0, completed = 0;
+	DWORD slotCount = (DWORD) min (volume->QueueDepth, fragmentCount);
+	DWORD slotBufferSize = (DWORD) min (length, DIRECT_VOLUME_FRAGMENT_SIZE);
+	UINT64_STRUCT dataUnitNo;
+	HostIoSlot *slot;
+	int status = ERR_SUCCESS;
+	DWORD i;
+
+	if (length == 0)
+		return ERR_SUCCESS;
+
+	memset (slots, 0, sizeof (slots));
+
+	// Reads into the caller's buffer need no buffers of their own
+	if (write || buffer == NULL)
+	{
+		slotBuffers = (byte *) TCalloc ((size_t) slotCount * slotBufferSize);
+		if (!slotBuffers)
+			return ERR_OUTOFMEMORY;
+
+		VirtualLock (slotBuffers, slotCount * slotBufferSize);
+	}
+
+	for (i = 0; i < slotCount; ++i)
+	{
+		slots[i].Overlapped.hEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+		if (!slots[i].Overlapped.hEvent)
+		{
+			status = ERR_OS_ERROR;
+			goto ret;
+		}
+	}
+
+	while (completed < fragmentCount)
+	{
+		if (!write)
+		{
+			// Keep the queue full
+			while (submitted < fragmentCount && submitted - completed < slotCount)
+			{
+				slot = &slots[submitted % slotCount];
+				slot->HostOffset = hostOffset + submitted * DIRECT_VOLUME_FRAGMENT_SIZE;
+				slot->Length = (DWORD) min (length - submitted * DIRECT_VOLUME_FRAGMENT_SIZE, DIRECT_VOLUME_FRAGMENT_SIZE);
+				slot->Data = slotBuffers ? slotBuffers + (submitted % slotCount) * slotBufferSize : buffer + submitted * DIRECT_VOLUME_FRAGMENT_SIZE;
+
+				if (!BeginHostTransfer (volume->HostFile, FALSE, slot))
+				{
+					status = ERR_OS_ERROR;
+					goto ret;
+				}
+
+				++submitted;
+			}
+
+			slot = &slots[completed % slotCount];
+
+			if (!CompleteHostTransfer (volume->HostFile, slot))
+			{
+				status = ERR_OS_ERROR;
+				goto ret;
+			}
+
+			dataUnitNo.Value = slot->HostOffset / ENCRYPTION_DATA_UNIT_SIZE;
+			DecryptDataUnits (slot->Data, &dataUnitNo, slot->Length / ENCRYPTION_DATA_UNIT_SIZE, volume->CryptoInfo);
+
+			if (callback && !callback (sectorNo + completed * (DIRECT_VOLUME_FRAGMENT_SIZE / volume->SectorSize),
+				slot->Length / volume->SectorSize, slot->Data, callbackContext))
+			{
+				status = ERR_USER_ABORT;
+				goto ret;
+			}
+		}
+		else
+		{
+			slot = &slots[completed % slotCount];
+
+			// The slot is reused once its previous write has completed
+			if (slot->Pending && !CompleteHostTransfer (volume->HostFile, slot))
+			{
+				status = ERR_OS_ERROR;
+				goto ret;
+			}
+
+			slot->HostOffset = hostOffset + completed * DIRECT_VOLUME_FRAGMENT_SIZE;
+			slot->Length = (DWORD) min (length - completed * DIRECT_VOLUME_FRAGMENT_SIZE, DIRECT_VOLUME_FRAGMENT_SIZE);
+			slot->Data = slotBuffers + (completed % slotCount) * slotBufferSize;
+
+			if (buffer)
+			{
+				memcpy (slot->Data, buffer + completed * DIRECT_VOLUME_FRAGMENT_SIZE, slot->Length);
+			}
+			else if (!callback (sectorNo + completed * (DIRECT_VOLUME_FRAGMENT_SIZE / volume->SectorSize),
+				slot->Length / volume->SectorSize, slot->Data, callbackContext))
+			{
+				status = ERR_USER_ABORT;
+				goto ret;
+			}
+
+			dataUnitNo.Value = slot->HostOffset / ENCRYPTION_DATA_UNIT_SIZE;
+			EncryptDataUnits (slot->Data, &dataUnitNo, slot->Length / ENCRYPTION_DATA_UNIT_SIZE, volume->CryptoInfo);
+
+			if (!BeginHostTransfer (volume->HostFile, TRUE, slot))
+			{
+				status = ERR_OS_ERROR;
+				goto ret;
+			}
+		}
+
+		++completed;
+	}
+
+ret:
+	// The buffers must not be released while the host is still accessing them
+	for (i = 0; i < slotCount; ++i)
+	{
+		if (slots[i].Pending && !CompleteHostTransfer (volume->HostFile, &slots[i]) && status == ERR_SUCCESS)
+			status = ERR_OS_ERROR;
+
+		if (slots[i].Overlapped.hEvent)
+			CloseHandle (slots[i].Overlapped.hEvent);
+	}
+
+	// Only once no write is pending, so readers that see the old generation cannot miss the new data
+	if (write)
+		InterlockedIncrement (&volume->WriteGeneration);
+
+	if (slotBuffers)
+	{
+		burn (slotBuffers, (size_t) slotCount * slotBufferSize);
+		VirtualUnlock (slotBuffers, slotCount * slotBufferSize);
+		TCfree (slotBuffers);
+	}
+
+	return status;
+}
+
+
+// Reads the sectors through the sector cache. Runs of missed sectors are read from the host at once.
+static int CachedReadSectors (PDIRECT_VOLUME volume, uint64 sectorNo, DWORD sectorCount, byte *buffer)
+{
+	LONG generation = SectorCacheGetGeneration (volume->Cache);
+	DWORD runStart, i, j;
+	int status;
+
+	for (i = 0; i < sectorCount; ++i)
+	{
+		if (SectorCacheLookup (volume->Cache, sectorNo + i, buffer + (size_t) i * volume->SectorSize))
+			continue;
+
+		runStart = i;
+
+		while (++i < sectorCount && !SectorCacheLookup (volume->Cache, sectorNo + i, buffer + (size_t) i * volume->SectorSize));
+
+		status = TransferSectors (volume, FALSE, sectorNo + runStart, i - runStart, buffer + (size_t) runStart * volume->SectorSize, NULL, NULL);
+		if (status != ERR_SUCCESS)
+			return status;
+
+		for (j = runStart; j < i; ++j)
+			SectorCacheInsert (volume->Cache, sectorNo + j, buffer + (size_t) j * volume->SectorSize, generation);
+
+		// Sector i (if any) has been read from the cache
+	}
+
+	return ERR_SUCCESS;
+}
+
+
+// Reads the sectors through the read-ahead window if they continue a sequential stream. Each read that 
+// starts where the previous one ended doubles the window (up to ReadAheadMaxSize), which is then read and
+// decrypted by one pipelined transfer and serves the following small reads. Sets *handled to FALSE if the
+// read must be performed by the caller.
+static int ReadAheadSectors (PDIRECT_VOLUME volume, uint64 sectorNo, DWORD sectorCount, byte *buffer, BOOL *handled)
+{
+	uint64 hostStart, hostEnd, volumeEnd;
+	DWORD count, served = 0;
+	LONG generation;
+	BOOL sequential;
+	int status = ERR_SUCCESS;
+
+	*handled = TRUE;
+
+	EnterCriticalSection (&volume->ReadAheadLock);
+
+	sequential = (sectorNo == volume->NextSectorNo);
+	volume->NextSectorNo = sectorNo + sectorCount;
+
+	// Use the part of the request covered by the window
+	if (volume->ReadAheadCount > 0 && sectorNo >= volume->ReadAheadStart && sectorNo < volume->ReadAheadStart + volume->ReadAheadCount)
+	{
+		count = (DWORD) min (sectorCount, volume->ReadAheadStart + volume->ReadAheadCount - sectorNo);
+		memcpy (buffer, volume->ReadAheadBuffer + (size_t) (sectorNo - volume->ReadAheadStart) * volume->SectorSize, (size_t) count * volume->SectorSize);
+
+		sectorNo += count;
+		sectorCount -= count;
+		buffer += (size_t) count * volume->SectorSize;
+		served = count;
+		sequential = TRUE;
+
+		if (sectorCount == 0)
+			goto ret;
+	}
+
+	if (!sequential)
+	{
+		// Random access ends the stream
+		volume->ReadAheadWindow = 0;
+		*handled = FALSE;
+		goto ret;
+	}
+
+	// Large reads gain nothing from read-ahead; reads arriving while another reader fills the window do 
+	// not wait for it
+	if ((uint64) sectorCount * volume->SectorSize > volume->ReadAheadMaxSize || volume->ReadAheadFilling)
+	{
+		if (served == 0)
+			*handled = FALSE;
+		else
+			status = TransferSectors (volume, FALSE, sectorNo, sectorCount, buffer, NULL, NULL);
+
+		goto ret;
+	}
+
+	volume->ReadAheadWindow = volume->ReadAheadWindow == 0 ? DIRECT_VOLUME_READ_AHEAD_MIN_SIZE
+		: min (volume->ReadAheadWindow * 2, volume->ReadAheadMaxSize);
+
+	if (!volume->ReadAheadBuffer)
+	{
+		volume->ReadAheadBuffer = (byte *) TCalloc (volume->ReadAheadMaxSize);
+		if (!volume->ReadAheadBuffer)
+		{
+			status = ERR_OUTOFMEMORY;
+			goto ret;
+		}
+
+		VirtualLock (volume->ReadAheadBuffer, volume->ReadAheadMaxSize);
+	}
+
+	// The window starts at the requested sector and ends at an aligned host offset
+	hostStart = volume->CryptoInfo->volDataAreaOffset + sectorNo * volume->SectorSize;
+	hostEnd = hostStart + max ((uint64) sectorCount * volume->SectorSize, volume->ReadAheadWindow);
+	hostEnd -= hostEnd % DIRECT_VOLUME_READ_AHEAD_MIN_SIZE;
+
+	if (hostEnd < hostStart + (uint64) sectorCount * volume->SectorSize)
+		hostEnd = hostStart + (uint64) sectorCount * volume->SectorSize;
+
+	volumeEnd = volume->CryptoInfo->volDataAreaOffset + volume->Size;
+	hostEnd = min (hostEnd, volumeEnd);
+	count = (DWORD) min ((hostEnd - hostStart) / volume->SectorSize, volume->ReadAheadMaxSize / volume->SectorSize);
+
+	// Claim the buffer and fill it without holding the lock. A write completed meanwhile changes the 
+	// generation; the window may then be stale and is not published.
+	volume->ReadAheadCount = 0;
+	volume->ReadAheadFilling = TRUE;
+	generation = volume->WriteGeneration;
+
+	LeaveCriticalSection (&volume->ReadAheadLock);
+
+	status = TransferSectors (volume, FALSE, sectorNo, count, volume->ReadAheadBuffer, NULL, NULL);
+	if (status == ERR_SUCCESS)
+		memcpy (buffer, volume->ReadAheadBuffer, (size_t) sectorCount * volume->SectorSize);
+
+	EnterCriticalSection (&volume->ReadAheadLock);
+
+	if (status == ERR_SUCCESS && generation == volume->WriteGeneration)
+	{
+		volume->ReadAheadStart = sectorNo;
+		volume->ReadAheadCount = count;
+	}
+
+	volume->ReadAheadFilling = FALSE;
+
+ret:
+	LeaveCriticalSection (&volume->ReadAheadLock);
+	return status;
+}
+
+
+// Discards cached plaintext of the given sectors. Must be called after they have been written to the host.
+static void InvalidateCachedSectors (PDIRECT_VOLUME volume, uint64 sectorNo, uint64 sectorCount)
+{
+	if (volume->Cache)
+		SectorCacheInvalidate (volume->Cache, sectorNo, sectorCount);
+
+	EnterCriticalSection (&volume->ReadAheadLock);
+
+	if (volume->ReadAheadCount > 0 && sectorNo < volume->ReadAheadStart + volume->ReadAheadCount
+		&& volume->ReadAheadStart < sectorNo + sectorCount)
+	{
+		volume->ReadAheadCount = 0;
+	}
+
+	LeaveCriticalSection (&volume->ReadAheadLock);
+}
+
+
+// Returns the index of the first entry not below sectorNo
+static DWORD FindWriteBackEntry (const WriteBackEntry *entries, DWORD count, uint64 sectorNo)
+{
+	DWORD low = 0, high = count, middle;
+
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+
+		if (entries[middle].SectorNo < sectorNo)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+
+static void ReleaseWriteBackSlot (PDIRECT_VOLUME volume, DWORD slot)
+{
+	burn (volume->WriteBackData + (size_t) slot * volume->SectorSize, volume->SectorSize);
+	volume->WriteBackFreeSlots[volume->WriteBackFreeSlotCount++] = slot;
+}
+
+
+static BOOL CALLBACK FillFromWriteBack (unsigned __int64 sectorNo, DWORD sectorCount, unsigned char *data, void *context)
+{
+	WriteBackFlushContext *flushContext = (WriteBackFlushContext *) context;
+	PDIRECT_VOLUME volume = flushContext->Volume;
+	WriteBackEntry *entry = &flushContext->Entries[flushContext->FirstEntry + (sectorNo - flushContext->FirstSectorNo)];
+	DWORD i;
+
+	for (i = 0; i < sectorCount; ++i, ++entry)
+		memcpy (data + (size_t) i * volume->SectorSize, volume->WriteBackData + (size_t) entry->Slot * volume->SectorSize, volume->SectorSize);
+
+	return TRUE;
+}
+
+
+// Writes all buffered sectors to the host. Consecutive sectors are written as one run. The buffered
+// sectors are moved to FlushEntries and WriteBackLock is released while they are written, so that reads
+// and buffered writes are not blocked; reads keep overlaying them until they have been written. Sectors
+// that fail to be written remain buffered unless they have been written again in the meantime.
+// The caller must hold FlushLock and WriteBackLock.
+static int FlushWriteBack (PDIRECT_VOLUME volume)
+{
+	WriteBackEntry *entries = volume->WriteBackEntries;
+	DWORD count = volume->WriteBackCount;
+	WriteBackFlushContext flushContext;
+	DWORD first, last, attempted = 0, written = 0, i, index;
+	int status = ERR_SUCCESS;
+
+	if (count == 0)
+		return ERR_SUCCESS;
+
+	volume->WriteBackEntries = volume->FlushEntries;
+	volume->WriteBackCount = 0;
+	volume->FlushEntries = entries;
+	volume->FlushCount = count;
+
+	LeaveCriticalSection (&volume->WriteBackLock);
+
+	flushContext.Volume = volume;
+	flushContext.Entries = entries;
+
+	for (first = 0; first < count && status == ERR_SUCCESS; first = last)
+	{
+		for (last = first + 1; last < count && entries[last].SectorNo == entries[last - 1].SectorNo + 1; ++last);
+
+		flushContext.FirstEntry = first;
+		flushContext.FirstSectorNo = entries[first].SectorNo;
+
+		status = TransferSectors (volume, TRUE, entries[first].SectorNo, last - first, NULL, FillFromWriteBack, &flushContext);
+
+		attempted = last;
+		if (status == ERR_SUCCESS)
+			written = last;
+	}
+
+	EnterCriticalSection (&volume->WriteBackLock);
+
+	// Data read from the host while the sectors were buffered may have been cached. Readers hold
+	// WriteBackLock, so none of them can cache older data once the entries are released.
+	for (first = 0; first < attempted; first = last)
+	{
+		for (last = first + 1; last < attempted && entries[last].SectorNo == entries[last - 1].SectorNo + 1; ++last);
+		InvalidateCachedSectors (volume, entries[first].SectorNo, last - first);
+	}
+
+	for (i = 0; i < written; ++i)
+		ReleaseWriteBackSlot (volume, entries[i].Slot);
+
+	for (i = written; i < count; ++i)
+	{
+		index = FindWriteBackEntry (volume->WriteBackEntries, volume->WriteBackCount, entries[i].SectorNo);
+
+		if (index < volume->WriteBackCount && volume->WriteBackEntries[index].SectorNo == entries[i].SectorNo)
+		{
+			ReleaseWriteBackSlot (volume, entries[i].Slot);
+		}
+		else
+		{
+			memmove (volume->WriteBackEntries + index + 1, volume->WriteBackEntries + index, (volume->WriteBackCount - index) * sizeof (WriteBackEntry));
+			volume->WriteBackEntries[index] = entries[i];
+			volume->WriteBackCount++;
+		}
+	}
+
+	volume->FlushCount = 0;
+	return status;
+}
+
+
+// Drops buffered copies of the given sectors. The caller must hold FlushLock and WriteBackLock.
+static void DiscardWriteBackSectors (PDIRECT_VOLUME volume, uint64 sectorNo, uint64 sectorCount)
+{
+	DWORD first = FindWriteBackEntry (volume->WriteBackEntries, volume->WriteBackCount, sectorNo);
+	DWORD last, i;
+
+	for (last = first; last < volume->WriteBackCount && volume->WriteBackEntries[last].SectorNo - sectorNo < sectorCount; ++last)
+		ReleaseWriteBackSlot (volume, volume->WriteBackEntries[last].Slot);
+
+	memmove (volume->WriteBackEntries + first, volume->WriteBackEntries + last, (volume->WriteBackCount - last) * sizeof (WriteBackEntry));
+	volume->WriteBackCount -= last - first;
+}
+
+
+// Buffers the written sectors. Returns FALSE, leaving the buffer unchanged, if the sectors do not fit in
+// the free part of the buffer or exceed half of it. The caller must hold WriteBackLock.
+static BOOL BufferSectors (PDIRECT_VOLUME volume, uint64 sectorNo, DWORD sectorCount, const byte *data)
+{
+	WriteBackEntry *entry;
+	DWORD i, index, newCount = 0;
+
+	if (sectorCount > volume->WriteBackCapacity / 2)
+		return FALSE;
+
+	index = FindWriteBackEntry (volume->WriteBackEntries, volume->WriteBackCount, sectorNo);
+
+	for (i = 0; i < sectorCount; ++i)
+	{
+		if (index < volume->WriteBackCount && volume->WriteBackEntries[index].SectorNo == sectorNo + i)
+			++index;
+		else
+			++newCount;
+	}
+
+	if (newCount > volume->WriteBackFreeSlotCount)
+		return FALSE;
+
+	for (i = 0; i < sectorCount; ++i)
+	{
+		index = FindWriteBackEntry (volume->WriteBackEntries, volume->WriteBackCount, sectorNo + i);
+		entry = &volume->WriteBackEntries[index];
+
+		if (index == volume->WriteBackCount || entry->SectorNo != sectorNo + i)
+		{
+			memmove (entry + 1, entry, (volume->WriteBackCount - index) * sizeof (WriteBackEntry));
+			volume->WriteBackCount++;
+
+			entry->SectorNo = sectorNo + i;
+			entry->Slot = volume->WriteBackFreeSlots[--volume->WriteBackFreeSlotCount];
+		}
+
+		memcpy (volume->WriteBackData + (size_t) entry->Slot * volume->SectorSize, data + (size_t) i * volume->SectorSize, volume->SectorSize);
+	}
+
+	return TRUE;
+}
+
+
+// Writes sectors that BufferSectors rejected. Writes of more than half of the buffer are written directly;
+// others are buffered after the buffer has been flushed.
+static int WriteOverflowSectors (PDIRECT_VOLUME volume, uint64 sectorNo, DWORD sectorCount, const byte *data)
+{
+	int status = ERR_SUCCESS;
+
+	EnterCriticalSection (&volume->FlushLock);
+	EnterCriticalSection (&volume->WriteBackLock);
+
+	if (sectorCount > volume->WriteBackCapacity / 2)
+	{
+		// No flush is in progress, so older buffered data cannot overwrite the sectors afterwards
+		DiscardWriteBackSectors (volume, sectorNo, sectorCount);
+
+		status = TransferSectors (volume, TRUE, sectorNo, sectorCount, (byte *) data, NULL, NULL);
+		InvalidateCachedSectors (volume, sectorNo, sectorCount);
+	}
+	else
+	{
+		// Other writers may use the freed slots first
+		while (!BufferSectors (volume, sectorNo, sectorCount, data))
+		{
+			status = FlushWriteBack (volume);
+			if (status != ERR_SUCCESS)
+				break;
+		}
+	}
+
+	LeaveCriticalSection (&volume->WriteBackLock);
+	LeaveCriticalSection (&volume->FlushLock);
+	return status;
+}
+
+
+static void OverlayEntries (PDIRECT_VOLUME volume, const WriteBackEntry *entries, DWORD count, uint64 sectorNo, uint64 sectorCount, byte *buffer)
+{
+	DWORD i;
+
+	for (i = FindWriteBackEntry (entries, count, sectorNo); i < count && entries[i].SectorNo - sectorNo < sectorCount; ++i)
+	{
+		memcpy (buffer + (size_t) (entries[i].SectorNo - sectorNo) * volume->SectorSize,
+			volume->WriteBackData + (size_t) entries[i].Slot * volume->SectorSize, volume->SectorSize);
+	}
+}
+
+
+// Replaces data read from the host with buffered sectors, including those being flushed, which are older
+// than buffered copies of the same sectors. The caller must hold WriteBackLock.
+static void OverlayWriteBackSectors (PDIRECT_VOLUME volume, uint64 sectorNo, uint64 sectorCount, byte *buffer)
+{
+	OverlayEntries (volume, volume->FlushEntries, volume->FlushCount, sectorNo, sectorCount, buffer);
+	OverlayEntries (volume, volume->WriteBackEntries, volume->WriteBackCount, sectorNo, sectorCount, buffer);
+}
+
+
+static BOOL CALLBACK OverlayStreamCallback (unsigned __int64 sectorNo, DWORD sectorCount, unsigned char *data, void *context)
+{
+	WriteBackStreamContext *streamContext = (WriteBackStreamContext *) context;
+
+	OverlayWriteBackSectors (streamContext->Volume, sectorNo, sectorCount, data);
+	return streamContext->Callback (sectorNo, sectorCount, data, streamContext->CallbackContext);
+}
+
+
+static unsigned __stdcall WriteBackThreadProc (void *threadArg)
+{
+	PDIRECT_VOLUME volume = (PDIRECT_VOLUME) threadArg;
+
+	while (WaitForSingleObject (volume->WriteBackStopEvent, volume->WriteBackInterval) == WAIT_TIMEOUT)
+	{
+		EnterCriticalSection (&volume->FlushLock);
+		EnterCriticalSection (&volume->WriteBackLock);
+
+		// Errors are reported by the next explicit flush, which retries the failed sectors
+		FlushWriteBack (volume);
+
+		LeaveCriticalSection (&volume->WriteBackLock);
+		LeaveCriticalSection (&volume->FlushLock);
+	}
+
+	return 0;
+}
+
+
+static void StopWriteBackThread (PDIRECT_VOLUME volume)
+{
+	if (volume->WriteBackThread)
+	{
+		SetEvent (volume->WriteBackStopEvent);
+		WaitForSingleObject (volume->WriteBackThread, INFINITE);
+		CloseHandle (volume->WriteBackThread);
+		volume->WriteBackThread = NULL;
+	}
+
+	if (volume->WriteBackStopEvent)
+	{
+		CloseHandle (volume->WriteBackStopEvent);
+		volume->WriteBackStopEvent = NULL;
+	}
+}
+
+
+static void FreeWriteBack (PDIRECT_VOLUME volume)
+{
+	if (volume->WriteBackData)
+	{
+		burn (volume->WriteBackData, (size_t) volume->WriteBackCapacity * volume->SectorSize);
+		VirtualUnlock (volume->WriteBackData, (size_t) volume->WriteBackCapacity * volume->SectorSize);
+		TCfree (volume->WriteBackData);
+		volume->WriteBackData = NULL;
+	}
+
+	if (volume->WriteBackEntries)
+	{
+		burn (volume->WriteBackEntries, volume->WriteBackCapacity * sizeof (WriteBackEntry));
+		TCfree (volume->WriteBackEntries);
+		volume->WriteBackEntries = NULL;
+	}
+
+	if (volume->FlushEntries)
+	{
+		burn (volume->FlushEntries, volume->WriteBackCapacity * sizeof (WriteBackEntry));
+		TCfree (volume->FlushEntries);
+		volume->FlushEntries = NULL;
+	}
+
+	if (volume->WriteBackFreeSlots)
+	{
+		TCfree (volume->WriteBackFreeSlots);
+		volume->WriteBackFreeSlots = NULL;
+	}
+
+	volume->WriteBackCapacity = 0;
+	volume->WriteBackCount = 0;
+	volume->WriteBackFreeSlotCount = 0;
+}
+
+
+static BOOL IsSectorRangeValid (PDIRECT_VOLUME volume, uint64 sectorNo, uint64 sectorCount)
+{
+	uint64 sectorTotal = volume->Size / volume->SectorSize;
+
+	return sectorNo <= sectorTotal && sectorCount <= sectorTotal - sectorNo;
+}
+
+
+// Opens a file-hosted volume. All header slots (including backup headers) are tried.
+int DirectVolumeOpen (const char *volumePath, Password *password, BOOL readOnly, PDIRECT_VOLUME *retVolume)
+{
+	char szDiskFile[TC_MAX_PATH];
+	BOOL bDevice;
+	PDIRECT_VOLUME volume;
+	PCRYPTO_INFO cryptoInfo;
+	LARGE_INTEGER fileSize;
+	HeaderSearchHint hint;
+	BOOL hintLoaded = FALSE;
+	BOOL backupHeader;
+	uint64 headerOffset;
+	int status;
+
+	if (retVolume == NULL || volumePath == NULL || password == NULL)
+		return ERR_PARAMETER_INCORRECT;
+
+	*retVolume = NULL;
+
+	CreateFullVolumePath (szDiskFile, volumePath, &bDevice);
+
+	// Only file-hosted volumes are supported
+	if (bDevice)
+		return ERR_PARAMETER_INCORRECT;
+
+	volume = (PDIRECT_VOLUME) TCalloc (sizeof (struct DirectVolumeStruct));
+	if (!volume)
+		return ERR_OUTOFMEMORY;
+
+	memset (volume, 0, sizeof (struct DirectVolumeStruct));
+	InitializeCriticalSection (&volume->ReadAheadLock);
+	InitializeCriticalSection (&volume->FlushLock);
+	InitializeCriticalSection (&volume->WriteBackLock);
+
+	volume->ReadOnly = readOnly;
+	volume->QueueDepth = DIRECT_VOLUME_DEFAULT_QUEUE_DEPTH;
+	volume->ReadAheadMaxSize = DIRECT_VOLUME_DEFAULT_READ_AHEAD_SIZE;
+	volume->NextSectorNo = (uint64) -1;
+
+	volume->HostFile = CreateFile (szDiskFile, readOnly ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS | FILE_FLAG_OVERLAPPED, NULL);
+
+	if (volume->HostFile == INVALID_HANDLE_VALUE)
+	{
+		status = ERR_OS_ERROR;
+		goto error;
+	}
+
+	if (!GetFileSizeEx (volume->HostFile, &fileSize))
+	{
+		status = ERR_OS_ERROR;
+		goto error;
+	}
+
+	volume->HostSize = fileSize.QuadPart;
+
+	if (bUseHeaderHints)
+		hintLoaded = LoadHeaderHint (volumePath, &hint);
+
+	status = ProbeVolumeHeaders (FALSE, volume->HostFile, volume->HostSize, TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, TRUE, password,
+		hintLoaded ? &hint : NULL, &volume->VolumeType, &backupHeader, &headerOffset, &cryptoInfo);
+
+	if (status == ERR_CIPHER_INIT_WEAK_KEY)
+		status = ERR_SUCCESS;	// We can ignore this error here
+
+	if (status != ERR_SUCCESS)
+		goto error;
+
+	volume->CryptoInfo = cryptoInfo;
+
+	// Part of the data area would still be plaintext
+	if ((cryptoInfo->HeaderFlags & TC_HEADER_FLAG_NONSYS_INPLACE_ENC)
+		&& cryptoInfo->EncryptedAreaLength.Value != cryptoInfo->VolumeSize.Value)
+	{
+		status = ERR_NONSYS_INPLACE_ENC_INCOMPLETE;
+		goto error;
+	}
+
+	switch (volume->VolumeType)
+	{
+	case TC_VOLUME_TYPE_NORMAL:
+		cryptoInfo->hiddenVolume = FALSE;
+
+		if (cryptoInfo->LegacyVolume)
+		{
+			cryptoInfo->volDataAreaOffset = TC_VOLUME_HEADER_SIZE_LEGACY;
+			volume->Size = volume->HostSize - TC_VOLUME_HEADER_SIZE_LEGACY;
+		}
+		else
+		{
+			cryptoInfo->volDataAreaOffset = cryptoInfo->EncryptedAreaStart.Value;
+			volume->Size = cryptoInfo->VolumeSize.Value;
+		}
+		break;
+
+	case TC_VOLUME_TYPE_HIDDEN:
+	case TC_VOLUME_TYPE_HIDDEN_LEGACY:
+		if (volume->VolumeType == TC_VOLUME_TYPE_HIDDEN_LEGACY)
+			cryptoInfo->hiddenVolumeOffset = volume->HostSize - cryptoInfo->hiddenVolumeSize - TC_HIDDEN_VOLUME_HEADER_OFFSET_LEGACY;
+		else
+			cryptoInfo->hiddenVolumeOffset = cryptoInfo->EncryptedAreaStart.Value;
+
+		cryptoInfo->volDataAreaOffset = cryptoInfo->hiddenVolumeOffset;
+		cryptoInfo->hiddenVolume = TRUE;
+		volume->Size = cryptoInfo->hiddenVolumeSize;
+		break;
+
+	default:
+		TC_THROW_FATAL_EXCEPTION;
+	}
+
+	cryptoInfo->FirstDataUnitNo.Value = 0;
+	volume->SectorSize = cryptoInfo->SectorSize;
+
+	if (volume->SectorSize < ENCRYPTION_DATA_UNIT_SIZE || volume->SectorSize % ENCRYPTION_DATA_UNIT_SIZE != 0)
+	{
+		status = ERR_VOL_FORMAT_BAD;
+		goto error;
+	}
+
+	status = SectorCacheCreate (DIRECT_VOLUME_DEFAULT_CACHE_SIZE / volume->SectorSize, volume->SectorSize, &volume->Cache);
+	if (status != ERR_SUCCESS)
+		goto error;
+
+	if (volume->Size == 0 || cryptoInfo->volDataAreaOffset > volume->HostSize
+		|| volume->Size > volume->HostSize - cryptoInfo->volDataAreaOffset)
+	{
+		status = ERR_VOL_SIZE_WRONG;
+		goto error;
+	}
+
+	if (bUseHeaderHints)
+	{
+		hint.Pkcs5Prf = cryptoInfo->pkcs5;
+		hint.Ea = cryptoInfo->ea;
+		hint.Mode = cryptoInfo->mode;
+		SaveHeaderHint (volumePath, &hint);
+	}
+
+	*retVolume = volume;
+	return ERR_SUCCESS;
+
+error:
+	DirectVolumeClose (volume);
+	return status;
+}
+
+
+void DirectVolumeClose (PDIRECT_VOLUME volume)
+{
+	if (!volume)
+		return;
+
+	// Buffered sectors that cannot be written are lost; DirectVolumeFlush reports such errors
+	StopWriteBackThread (volume);
+
+	EnterCriticalSection (&volume->FlushLock);
+	EnterCriticalSection (&volume->WriteBackLock);
+	FlushWriteBack (volume);
+	LeaveCriticalSection (&volume->WriteBackLock);
+	LeaveCriticalSection (&volume->FlushLock);
+
+	FreeWriteBack (volume);
+
+	if (volume->CryptoInfo)
+		crypto_close (volume->CryptoInfo);
+
+	if (volume->Cache)
+		SectorCacheDestroy (volume->Cache);
+
+	if (volume->ReadAheadBuffer)
+	{
+		burn (volume->ReadAheadBuffer, volume->ReadAheadMaxSize);
+		VirtualUnlock (volume->ReadAheadBuffer, volume->ReadAheadMaxSize);
+		TCfree (volume->ReadAheadBuffer);
+	}
+
+	DeleteCriticalSection (&volume->ReadAheadLock);
+	DeleteCriticalSection (&volume->FlushLock);
+	DeleteCriticalSection (&volume->WriteBackLock);
+
+	if (volume->HostFile != NULL && volume->HostFile != INVALID_HANDLE_VALUE)
+		CloseHandle (volume->HostFile);
+
+	burn (volume, sizeof (struct DirectVolumeStruct));
+	TCfree (volume);
+}
+
+
+static int ReadSectors (PDIRECT_VOLUME volume, uint64 sectorNo, DWORD sectorCount, byte *buffer)
+{
+	BOOL handled;
+	int status;
+
+	if (volume->ReadAheadMaxSize > 0)
+	{
+		status = ReadAheadSectors (volume, sectorNo, sectorCount, buffer, &handled);
+		if (handled)
+			return status;
+	}
+
+	if (volume->Cache && (uint64) sectorCount * volume->SectorSize <= DIRECT_VOLUME_CACHE_MAX_TRANSFER_SIZE)
+		return CachedReadSectors (volume, sectorNo, sectorCount, buffer);
+
+	return TransferSectors (volume, FALSE, sectorNo, sectorCount, buffer, NULL, NULL);
+}
+
+
+int DirectVolumeReadSectors (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, void *buffer)
+{
+	int status;
+
+	if (!volume || !buffer || !IsSectorRangeValid (volume, sectorNo, sectorCount))
+		return ERR_PARAMETER_INCORRECT;
+
+	if (volume->WriteBackCapacity == 0)
+		return ReadSectors (volume, sectorNo, sectorCount, (byte *) buffer);
+
+	// Sectors being flushed are overlaid until FlushWriteBack releases them, which requires the lock, so
+	// data read from the host before they were written is replaced
+	EnterCriticalSection (&volume->WriteBackLock);
+
+	status = ReadSectors (volume, sectorNo, sectorCount, (byte *) buffer);
+
+	if (status == ERR_SUCCESS)
+		OverlayWriteBackSectors (volume, sectorNo, sectorCount, (byte *) buffer);
+
+	LeaveCriticalSection (&volume->WriteBackLock);
+	return status;
+}
+
+
+// The data in buffer is left unchanged; it is encrypted in separate buffers.
+int DirectVolumeWriteSectors (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, const void *buffer)
+{
+	BOOL buffered;
+	int status;
+
+	if (!volume || !buffer || !IsSectorRangeValid (volume, sectorNo, sectorCount))
+		return ERR_PARAMETER_INCORRECT;
+
+	if (volume->ReadOnly)
+		return ERR_ACCESS_DENIED;
+
+	if (volume->WriteBackCapacity > 0)
+	{
+		EnterCriticalSection (&volume->WriteBackLock);
+		buffered = BufferSectors (volume, sectorNo, sectorCount, (const byte *) buffer);
+		LeaveCriticalSection (&volume->WriteBackLock);
+
+		return buffered ? ERR_SUCCESS : WriteOverflowSectors (volume, sectorNo, sectorCount, (const byte *) buffer);
+	}
+
+	status = TransferSectors (volume, TRUE, sectorNo, sectorCount, (byte *) buffer, NULL, NULL);
+
+	// Even a failed write may have changed some of the sectors
+	InvalidateCachedSectors (volume, sectorNo, sectorCount);
+	return status;
+}
+
+
+// Reads sectorCount sectors starting at sectorNo and passes them to callback, in ascending order, as they
+// are decrypted. The data passed to callback is only valid during the call.
+int DirectVolumeReadStream (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount,
+	DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext)
+{
+	WriteBackStreamContext streamContext;
+	int status;
+
+	if (!volume || !callback || !IsSectorRangeValid (volume, sectorNo, sectorCount))
+		return ERR_PARAMETER_INCORRECT;
+
+	if (volume->WriteBackCapacity == 0)
+		return TransferSectors (volume, FALSE, sectorNo, sectorCount, NULL, callback, callbackContext);
+
+	streamContext.Volume = volume;
+	streamContext.Callback = callback;
+	streamContext.CallbackContext = callbackContext;
+
+	EnterCriticalSection (&volume->WriteBackLock);
+	status = TransferSectors (volume, FALSE, sectorNo, sectorCount, NULL, OverlayStreamCallback, &streamContext);
+	LeaveCriticalSection (&volume->WriteBackLock);
+
+	return status;
+}
+
+
+// Writes sectorCount sectors starting at sectorNo, in ascending order, with the plaintext supplied by 
+// callback, which fills the buffer it is passed.
+int DirectVolumeWriteStream (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount,
+	DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext)
+{
+	int status;
+
+	if (!volume || !callback || !IsSectorRangeValid (volume, sectorNo, sectorCount))
+		return ERR_PARAMETER_INCORRECT;
+
+	if (volume->ReadOnly)
+		return ERR_ACCESS_DENIED;
+
+	// Streams are written directly; buffered copies of the sectors become obsolete
+	EnterCriticalSection (&volume->FlushLock);
+	EnterCriticalSection (&volume->WriteBackLock);
+
+	if (volume->WriteBackCapacity > 0)
+		DiscardWriteBackSectors (volume, sectorNo, sectorCount);
+
+	status = TransferSectors (volume, TRUE, sectorNo, sectorCount, NULL, callback, callbackContext);
+	InvalidateCachedSectors (volume, sectorNo, sectorCount);
+
+	LeaveCriticalSection (&volume->WriteBackLock);
+	LeaveCriticalSection (&volume->FlushLock);
+	return status;
+}
+
+
+// Sets the maximum number of host transfers kept in flight (1 - DIRECT_VOLUME_MAX_QUEUE_DEPTH)
+int DirectVolumeSetQueueDepth (PDIRECT_VOLUME volume, DWORD queueDepth)
+{
+	if (!volume || queueDepth < 1 || queueDepth > DIRECT_VOLUME_MAX_QUEUE_DEPTH)
+		return ERR_PARAMETER_INCORRECT;
+
+	volume->QueueDepth = queueDepth;
+	return ERR_SUCCESS;
+}
+
+
+// Sets the size of the sector cache in bytes (0 disables caching). Must not be called while the volume 
+// is being accessed by other threads.
+int DirectVolumeSetCacheSize (PDIRECT_VOLUME volume, DWORD cacheSize)
+{
+	PSECTOR_CACHE cache = NULL;
+	int status;
+
+	if (!volume)
+		return ERR_PARAMETER_INCORRECT;
+
+	if (cacheSize > 0)
+	{
+		status = SectorCacheCreate (cacheSize / volume->SectorSize, volume->SectorSize, &cache);
+		if (status != ERR_SUCCESS)
+			return status;
+	}
+
+	if (volume->Cache)
+		SectorCacheDestroy (volume->Cache);
+
+	volume->Cache = cache;
+	return ERR_SUCCESS;
+}
+
+
+// Sets the maximum size of the read-ahead window in bytes (0 disables read-ahead). Must not be called 
+// while the volume is being accessed by other threads.
+int DirectVolumeSetReadAhead (PDIRECT_VOLUME volume, DWORD maxSize)
+{
+	if (!volume || (maxSize > 0 && (maxSize < DIRECT_VOLUME_READ_AHEAD_MIN_SIZE || maxSize % DIRECT_VOLUME_READ_AHEAD_MIN_SIZE != 0)))
+		return ERR_PARAMETER_INCORRECT;
+
+	if (volume->ReadAheadBuffer)
+	{
+		burn (volume->ReadAheadBuffer, volume->ReadAheadMaxSize);
+		VirtualUnlock (volume->ReadAheadBuffer, volume->ReadAheadMaxSize);
+		TCfree (volume->ReadAheadBuffer);
+		volume->ReadAheadBuffer = NULL;
+	}
+
+	volume->ReadAheadMaxSize = maxSize;
+	volume->ReadAheadWindow = 0;
+	volume->ReadAheadCount = 0;
+	return ERR_SUCCESS;
+}
+
+
+// Enables buffering of up to maxSize bytes of written sectors (0 disables it). Buffered sectors are also
+// written to the host every flushInterval milliseconds (0 = only when the buffer is full or flushed). 
+// Sectors buffered so far are written first. Must not be called while the volume is being accessed by 
+// other threads.
+// Buffered data exists only in this process and is lost if the process terminates abnormally; only 
+// DirectVolumeFlush also flushes the host file, so it is the only guarantee that data survives a system
+// failure. Views only see buffered data once it has been written to the host.
+int DirectVolumeSetWriteBack (PDIRECT_VOLUME volume, DWORD maxSize, DWORD flushInterval)
+{
+	DWORD capacity, i;
+	int status;
+
+	if (!volume)
+		return ERR_PARAMETER_INCORRECT;
+
+	capacity = maxSize / volume->SectorSize;
+
+	if (maxSize > 0 && capacity < 2)
+		return ERR_PARAMETER_INCORRECT;
+
+	if (maxSize > 0 && volume->ReadOnly)
+		return ERR_ACCESS_DENIED;
+
+	EnterCriticalSection (&volume->FlushLock);
+	EnterCriticalSection (&volume->WriteBackLock);
+	status = FlushWriteBack (volume);
+	LeaveCriticalSection (&volume->WriteBackLock);
+	LeaveCriticalSection (&volume->FlushLock);
+
+	if (status != ERR_SUCCESS)
+		return status;
+
+	StopWriteBackThread (volume);
+	FreeWriteBack (volume);
+
+	if (capacity == 0)
+		return ERR_SUCCESS;
+
+	volume->WriteBackEntries = (WriteBackEntry *) TCalloc (capacity * sizeof (WriteBackEntry));
+	volume->FlushEntries = (WriteBackEntry *) TCalloc (capacity * sizeof (WriteBackEntry));
+	volume->WriteBackFreeSlots = (DWORD *) TCalloc (capacity * sizeof (DWORD));
+	volume->WriteBackData = (byte *) TCalloc ((size_t) capacity * volume->SectorSize);
+
+	if (!volume->WriteBackEntries || !volume->FlushEntries || !volume->WriteBackFreeSlots || !volume->WriteBackData)
+	{
+		FreeWriteBack (volume);
+		return ERR_OUTOFMEMORY;
+	}
+
+	VirtualLock (volume->WriteBackData, (size_t) capacity * volume->SectorSize);
+
+	for (i = 0; i < capacity; ++i)
+		volume->WriteBackFreeSlots[i] = capacity - 1 - i;
+
+	volume->WriteBackFreeSlotCount = capacity;
+	volume->WriteBackCapacity = capacity;
+	volume->WriteBackInterval = flushInterval;
+
+	if (flushInterval > 0)
+	{
+		volume->WriteBackStopEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+		if (volume->WriteBackStopEvent)
+			volume->WriteBackThread = (HANDLE) _beginthreadex (NULL, 0, WriteBackThreadProc, volume, 0, NULL);
+
+		if (!volume->WriteBackThread)
+		{
+			StopWriteBackThread (volume);
+			FreeWriteBack (volume);
+			return ERR_OS_ERROR;
+		}
+	}
+
+	return ERR_SUCCESS;
+}
+
+
+// Returns the sector cache counters (all zero if caching is disabled)
+int DirectVolumeGetCacheStats (PDIRECT_VOLUME volume, SECTOR_CACHE_STATS *stats)
+{
+	if (!volume || !stats)
+		return ERR_PARAMETER_INCORRECT;
+
+	memset (stats, 0, sizeof (*stats));
+
+	if (volume->Cache)
+		SectorCacheGetStats (volume->Cache, stats);
+
+	return ERR_SUCCESS;
+}
+
+
+// Writes buffered sectors to the host and flushes the host file to disk
+int DirectVolumeFlush (PDIRECT_VOLUME volume)
+{
+	int status;
+
+	if (!volume)
+		return ERR_PARAMETER_INCORRECT;
+
+	if (volume->ReadOnly)
+		return ERR_SUCCESS;
+
+	EnterCriticalSection (&volume->FlushLock);
+	EnterCriticalSection (&volume->WriteBackLock);
+	status = FlushWriteBack (volume);
+	LeaveCriticalSection (&volume->WriteBackLock);
+	LeaveCriticalSection (&volume->FlushLock);
+
+	if (status != ERR_SUCCESS)
+		return status;
+
+	if (!FlushFileBuffers (volume->HostFile))
+		return ERR_OS_ERROR;
+
+	return ERR_SUCCESS;
+}
+
+
+unsigned __int64 DirectVolumeGetSize (PDIRECT_VOLUME volume)
+{
+	return volume ? volume->Size : 0;
+}
+
+
+DWORD DirectVolumeGetSectorSize (PDIRECT_VOLUME volume)
+{
+	return volume ? volume->SectorSize : 0;
+}
+
+
+static DWORD GetViewReadAhead (PDIRECT_VOLUME_VIEW view)
+{
+	DWORD readAhead;
+
+	switch (view->AccessHint)
+	{
+	case DIRECT_VOLUME_ACCESS_RANDOM:
+		return 0;
+
+	case DIRECT_VOLUME_ACCESS_SEQUENTIAL:
+		readAhead = DIRECT_VOLUME_VIEW_MAX_READ_AHEAD;
+		break;
+
+	default:
+		readAhead = 1;
+		break;
+	}
+
+	// The page being read must never be evicted by its own read-ahead
+	return min (readAhead, view->CachePageCount - 1);
+}
+
+
+static void InvalidateViewCache (PDIRECT_VOLUME_VIEW view)
+{
+	DWORD i;
+
+	for (i = 0; i < view->CachePageCount; ++i)
+		view->CachePages[i].Valid = FALSE;
+
+	burn (view->CacheData, (size_t) view->CachePageCount * DIRECT_VOLUME_VIEW_PAGE_SIZE);
+}
+
+
+static ViewCachePage *FindViewCachePage (PDIRECT_VOLUME_VIEW view, uint64 pageNo)
+{
+	DWORD i;
+
+	for (i = 0; i < view->CachePageCount; ++i)
+	{
+		if (view->CachePages[i].Valid && view->CachePages[i].PageNo == pageNo)
+			return &view->CachePages[i];
+	}
+
+	return NULL;
+}
+
+
+// Maps the part of the host file containing the given range, unless it is mapped already
+static int MapViewWindow (PDIRECT_VOLUME_VIEW view, uint64 hostOffset, DWORD length)
+{
+	uint64 windowOffset;
+
+	if (view->Window && hostOffset >= view->WindowOffset && hostOffset + length <= view->WindowOffset + view->WindowSize)
+		return ERR_SUCCESS;
+
+	if (view->Window)
+	{
+		UnmapViewOfFile (view->Window);
+		view->Window = NULL;
+	}
+
+	windowOffset = hostOffset - hostOffset % view->AllocationGranularity;
+
+	view->WindowSize = (DWORD) min (DIRECT_VOLUME_VIEW_WINDOW_SIZE, view->Volume->HostSize - windowOffset);
+	view->Window = (byte *) MapViewOfFile (view->Mapping, FILE_MAP_READ, (DWORD) (windowOffset >> 32), (DWORD) windowOffset, view->WindowSize);
+
+	if (!view->Window)
+		return ERR_OS_ERROR;
+
+	view->WindowOffset = windowOffset;
+	return ERR_SUCCESS;
+}
+
+
+// Decrypts the page from the mapped ciphertext into the least recently used cache page
+static int LoadViewPage (PDIRECT_VOLUME_VIEW view, uint64 pageNo, ViewCachePage **retPage)
+{
+	PDIRECT_VOLUME volume = view->Volume;
+	uint64 offset = pageNo * DIRECT_VOLUME_VIEW_PAGE_SIZE;
+	uint64 hostOffset = volume->CryptoInfo->volDataAreaOffset + offset;
+	DWORD length = (DWORD) min (DIRECT_VOLUME_VIEW_PAGE_SIZE, volume->Size - offset);
+	ViewCachePage *page = &view->CachePages[0];
+	UINT64_STRUCT dataUnitNo;
+	byte *data;
+	BOOL copied = FALSE;
+	int status;
+	DWORD i;
+
+	for (i = 1; i < view->CachePageCount && page->Valid; ++i)
+	{
+		if (!view->CachePages[i].Valid || view->CachePages[i].LastUse < page->LastUse)
+			page = &view->CachePages[i];
+	}
+
+	status = MapViewWindow (view, hostOffset, length);
+	if (status != ERR_SUCCESS)
+		return status;
+
+	page->Valid = FALSE;
+	data = view->CacheData + (page - view->CachePages) * DIRECT_VOLUME_VIEW_PAGE_SIZE;
+
+	// A host I/O error surfaces as an exception when the mapped page is touched
+	__try
+	{
+		memcpy (data, view->Window + (hostOffset - view->WindowOffset), length);
+		copied = TRUE;
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+	}
+
+	if (!copied)
+		return ERR_OS_ERROR;
+
+	dataUnitNo.Value = hostOffset / ENCRYPTION_DATA_UNIT_SIZE;
+	DecryptDataUnits (data, &dataUnitNo, length / ENCRYPTION_DATA_UNIT_SIZE, volume->CryptoInfo);
+
+	page->PageNo = pageNo;
+	page->Length = length;
+	page->LastUse = ++view->UseCounter;
+	page->Valid = TRUE;
+
+	*retPage = page;
+	return ERR_SUCCESS;
+}
+
+
+// Opens a read-only view of the volume's plaintext, cached in cachePageCount pages (0 = default). Pages
+// are decrypted from a mapping of the host file into locked memory on demand, ahead of the reader as far
+// as the access hint allows, and handed out by pointer. The view is not synchronized; it must be used by
+// one thread at a time and closed before the volume.
+int DirectVolumeOpenView (PDIRECT_VOLUME volume, DWORD cachePageCount, int accessHint, PDIRECT_VOLUME_VIEW *retView)
+{
+	PDIRECT_VOLUME_VIEW view;
+	SYSTEM_INFO systemInfo;
+	int status;
+
+	if (!volume || !retView || accessHint < DIRECT_VOLUME_ACCESS_NORMAL || accessHint > DIRECT_VOLUME_ACCESS_RANDOM)
+		return ERR_PARAMETER_INCORRECT;
+
+	*retView = NULL;
+
+	if (cachePageCount == 0)
+		cachePageCount = DIRECT_VOLUME_VIEW_DEFAULT_CACHE_PAGES;
+
+	if (cachePageCount < 2)
+		return ERR_PARAMETER_INCORRECT;
+
+	view = (PDIRECT_VOLUME_VIEW) TCalloc (sizeof (struct DirectVolumeViewStruct));
+	if (!view)
+		return ERR_OUTOFMEMORY;
+
+	memset (view, 0, sizeof (struct DirectVolumeViewStruct));
+	view->Volume = volume;
+	view->AccessHint = accessHint;
+	view->CachePageCount = cachePageCount;
+	view->WriteGeneration = volume->WriteGeneration;
+
+	GetSystemInfo (&systemInfo);
+	view->AllocationGranularity = systemInfo.dwAllocationGranularity;
+
+	view->CachePages = (ViewCachePage *) TCalloc (cachePageCount * sizeof (ViewCachePage));
+	view->CacheData = (byte *) TCalloc ((size_t) cachePageCount * DIRECT_VOLUME_VIEW_PAGE_SIZE);
+
+	if (!view->CachePages || !view->CacheData)
+	{
+		status = ERR_OUTOFMEMORY;
+		goto error;
+	}
+
+	memset (view->CachePages, 0, cachePageCount * sizeof (ViewCachePage));
+	VirtualLock (view->CacheData, cachePageCount * DIRECT_VOLUME_VIEW_PAGE_SIZE);
+
+	view->Mapping = CreateFileMapping (volume->HostFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!view->Mapping)
+	{
+		status = ERR_OS_ERROR;
+		goto error;
+	}
+
+	*retView = view;
+	return ERR_SUCCESS;
+
+error:
+	DirectVolumeCloseView (view);
+	return status;
+}
+
+
+void DirectVolumeCloseView (PDIRECT_VOLUME_VIEW view)
+{
+	if (!view)
+		return;
+
+	if (view->Window)
+		UnmapViewOfFile (view->Window);
+
+	if (view->Mapping)
+		CloseHandle (view->Mapping);
+
+	if (view->CacheData)
+	{
+		burn (view->CacheData, (size_t) view->CachePageCount * DIRECT_VOLUME_VIEW_PAGE_SIZE);
+		VirtualUnlock (view->CacheData, view->CachePageCount * DIRECT_VOLUME_VIEW_PAGE_SIZE);
+		TCfree (view->CacheData);
+	}
+
+	if (view->CachePages)
+		TCfree (view->CachePages);
+
+	TCfree (view);
+}
+
+
+// Changes how far ahead of the reader pages are decrypted
+int DirectVolumeViewAdvise (PDIRECT_VOLUME_VIEW view, int accessHint)
+{
+	if (!view || accessHint < DIRECT_VOLUME_ACCESS_NORMAL || accessHint > DIRECT_VOLUME_ACCESS_RANDOM)
+		return ERR_PARAMETER_INCORRECT;
+
+	view->AccessHint = accessHint;
+	return ERR_SUCCESS;
+}
+
+
+// Returns the plaintext of page pageNo (DIRECT_VOLUME_VIEW_PAGE_SIZE bytes at byte offset
+// pageNo * DIRECT_VOLUME_VIEW_PAGE_SIZE of the volume; the last page may be shorter). The data remains 
+// valid until the next call on the view.
+int DirectVolumeViewGetPage (PDIRECT_VOLUME_VIEW view, unsigned __int64 pageNo, const unsigned char **data, DWORD *length)
+{
+	uint64 pageCount;
+	uint64 nextPageNo;
+	ViewCachePage *page, *nextPage;
+	DWORD readAhead;
+	int status;
+
+	if (!view || !data || !length)
+		return ERR_PARAMETER_INCORRECT;
+
+	pageCount = (view->Volume->Size + DIRECT_VOLUME_VIEW_PAGE_SIZE - 1) / DIRECT_VOLUME_VIEW_PAGE_SIZE;
+
+	if (pageNo >= pageCount)
+		return ERR_PARAMETER_INCORRECT;
+
+	if (view->WriteGeneration != view->Volume->WriteGeneration)
+	{
+		view->WriteGeneration = view->Volume->WriteGeneration;
+		InvalidateViewCache (view);
+	}
+
+	page = FindViewCachePage (view, pageNo);
+
+	if (page)
+	{
+		page->LastUse = ++view->UseCounter;
+	}
+	else
+	{
+		status = LoadViewPage (view, pageNo, &page);
+		if (status != ERR_SUCCESS)
+			return status;
+	}
+
+	*data = view->CacheData + (page - view->CachePages) * DIRECT_VOLUME_VIEW_PAGE_SIZE;
+	*length = page->Length;
+
+	// Decrypt ahead of the reader. The requested and read-ahead pages are all more recently used than any
+	// other page, so none of them is evicted by a later read-ahead page.
+	readAhead = GetViewReadAhead (view);
+
+	for (nextPageNo = pageNo + 1; nextPageNo <= pageNo + readAhead && nextPageNo < pageCount; ++nextPageNo)
+	{
+		nextPage = FindViewCachePage (view, nextPageNo);
+
+		if (nextPage)
+			nextPage->LastUse = ++view->UseCounter;
+		else if (LoadViewPage (view, nextPageNo, &nextPage) != ERR_SUCCESS)
+			break;
+	}
+
+	return ERR_SUCCESS;
+}
@@ -0,0 +1,65 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+#ifndef DIRECT_VOLUME_H
+#define DIRECT_VOLUME_H
+
+#include "Tcdefs.h"
+#include "Password.h"
+#include "SectorCache.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/* A file-hosted volume opened without the driver. Sectors are read and written through the host 
+	   file and decrypted/encrypted in the calling process. */
+	typedef struct DirectVolumeStruct DirectVolume, *PDIRECT_VOLUME;
+
+	/* Consumes or produces plaintext of sectorCount sectors starting at sectorNo. Returning FALSE aborts
+	   the transfer. */
+	typedef BOOL (CALLBACK *DIRECT_VOLUME_STREAM_CALLBACK) (unsigned __int64 sectorNo, DWORD sectorCount, unsigned char *data, void *context);
+
+	/* A read-only, page-cached view of a volume's plaintext */
+	typedef struct DirectVolumeViewStruct DirectVolumeView, *PDIRECT_VOLUME_VIEW;
+
+#define DIRECT_VOLUME_MAX_QUEUE_DEPTH	32
+
+#define DIRECT_VOLUME_VIEW_PAGE_SIZE	(64 * 1024)
+
+	/* View access hints */
+	enum
+	{
+		DIRECT_VOLUME_ACCESS_NORMAL = 0,	// Decrypt one page ahead
+		DIRECT_VOLUME_ACCESS_SEQUENTIAL,	// Decrypt far ahead
+		DIRECT_VOLUME_ACCESS_RANDOM			// Decrypt only the pages requested
+	};
+
+	int DirectVolumeOpen (const char *volumePath, Password *password, BOOL readOnly, PDIRECT_VOLUME *retVolume);
+	void DirectVolumeClose (PDIRECT_VOLUME volume);
+	int DirectVolumeReadSectors (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, void *buffer);
+	int DirectVolumeWriteSectors (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, DWORD sectorCount, const void *buffer);
+	int DirectVolumeReadStream (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount, DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext);
+	int DirectVolumeWriteStream (PDIRECT_VOLUME volume, unsigned __int64 sectorNo, unsigned __int64 sectorCount, DIRECT_VOLUME_STREAM_CALLBACK callback, void *callbackContext);
+	int DirectVolumeSetQueueDepth (PDIRECT_VOLUME volume, DWORD queueDepth);
+	int DirectVolumeSetCacheSize (PDIRECT_VOLUME volume, DWORD cacheSize);
+	int DirectVolumeGetCacheStats (PDIRECT_VOLUME volume, SECTOR_CACHE_STATS *stats);
+	int DirectVolumeSetReadAhead (PDIRECT_VOLUME volume, DWORD maxSize);
+	int DirectVolumeSetWriteBack (PDIRECT_VOLUME volume, DWORD maxSize, DWORD flushInterval);
+	int DirectVolumeFlush (PDIRECT_VOLUME volume);
+	unsigned __int64 DirectVolumeGetSize (PDIRECT_VOLUME volume);
+	DWORD DirectVolumeGetSectorSize (PDIRECT_VOLUME volume);
+	int DirectVolumeOpenView (PDIRECT_VOLUME volume, DWORD cachePageCount, int accessHint, PDIRECT_VOLUME_VIEW *retView);
+	void DirectVolumeCloseView (PDIRECT_VOLUME_VIEW view);
+	int DirectVolumeViewAdvise (PDIRECT_VOLUME_VIEW view, int accessHint);
+	int DirectVolumeViewGetPage (PDIRECT_VOLUME_VIEW view, unsigned __int64 pageNo, const unsigned char **data, DWORD *length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
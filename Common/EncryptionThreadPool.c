@@ -74,6 +74,7 @@ typedef struct EncryptionThreadPoolWorkItemStruct
 
 		struct
 		{
+			LONG *AbortFlag;
 			TC_EVENT *CompletionEvent;
 			LONG *CompletionFlag;
 			char *DerivedKey;
@@ -157,31 +158,11 @@ static TC_THREAD_PROC EncryptionThreadProc (void *threadArg)
 			break;
 
 		case DeriveKeyWork:
-			switch (workItem->KeyDerivation.Pkcs5Prf)
-			{
-			case RIPEMD160:
-				derive_key_ripemd160 (workItem->KeyDerivation.Password, workItem->KeyDerivation.PasswordLength, workItem->KeyDerivation.Salt, PKCS5_SALT_SIZE,
-					workItem->KeyDerivation.IterationCount, workItem->KeyDerivation.DerivedKey, GetMaxPkcs5OutSize());
-				break;
-
-			case SHA512:
-				derive_key_sha512 (workItem->KeyDerivation.Password, workItem->KeyDerivation.PasswordLength, workItem->KeyDerivation.Salt, PKCS5_SALT_SIZE,
-					workItem->KeyDerivation.IterationCount, workItem->KeyDerivation.DerivedKey, GetMaxPkcs5OutSize());
-				break;
-
-			case WHIRLPOOL:
-				derive_key_whirlpool (workItem->KeyDerivation.Password, workItem->KeyDerivation.PasswordLength, workItem->KeyDerivation.Salt, PKCS5_SALT_SIZE,
-					workItem->KeyDerivation.IterationCount, workItem->KeyDerivation.DerivedKey, GetMaxPkcs5OutSize());
-				break;
-
-			case SHA1:
-				derive_key_sha1 (workItem->KeyDerivation.Password, workItem->KeyDerivation.PasswordLength, workItem->KeyDerivation.Salt, PKCS5_SALT_SIZE,
-					workItem->KeyDerivation.IterationCount, workItem->KeyDerivation.DerivedKey, GetMaxPkcs5OutSize());
-				break;
-
-			default:		
-				TC_THROW_FATAL_EXCEPTION;
-			} 
+			// The derived key is not valid if the derivation has been aborted; the requester
+			// aborts derivations only when it no longer needs their results
+			derive_key_abortable (workItem->KeyDerivation.Pkcs5Prf, workItem->KeyDerivation.Password, workItem->KeyDerivation.PasswordLength,
+				workItem->KeyDerivation.Salt, PKCS5_SALT_SIZE, workItem->KeyDerivation.IterationCount, workItem->KeyDerivation.DerivedKey,
+				GetMaxPkcs5OutSize(), workItem->KeyDerivation.AbortFlag);
 
 			InterlockedExchange (workItem->KeyDerivation.CompletionFlag, TRUE);
 			TC_SET_EVENT (*workItem->KeyDerivation.CompletionEvent);
@@ -347,7 +328,7 @@ void EncryptionThreadPoolStop ()
 }
 
 
-void EncryptionThreadPoolBeginKeyDerivation (TC_EVENT *completionEvent, TC_EVENT *noOutstandingWorkItemEvent, LONG *completionFlag, LONG *outstandingWorkItemCount, int pkcs5Prf, char *password, int passwordLength, char *salt, int iterationCount, char *derivedKey)
+void EncryptionThreadPoolBeginKeyDerivation (TC_EVENT *completionEvent, TC_EVENT *noOutstandingWorkItemEvent, LONG *completionFlag, LONG *outstandingWorkItemCount, LONG *abortFlag, int pkcs5Prf, char *password, int passwordLength, char *salt, int iterationCount, char *derivedKey)
 {
 	EncryptionThreadPoolWorkItem *workItem;
 
@@ -366,6 +347,7 @@ void EncryptionThreadPoolBeginKeyDerivation (TC_EVENT *completionEvent, TC_EVENT
 	}
 
 	workItem->Type = DeriveKeyWork;
+	workItem->KeyDerivation.AbortFlag = abortFlag;
 	workItem->KeyDerivation.CompletionEvent = completionEvent;
 	workItem->KeyDerivation.CompletionFlag = completionFlag;
 	workItem->KeyDerivation.DerivedKey = derivedKey;
@@ -0,0 +1,96 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+/* NN: Entropy ring. Event sources (the mouse and keyboard hooks of Random.c) append their samples to a 
+   lock-free ring instead of adding them to the pool, which would require critRandProt and mixing the pool
+   inline. Producers claim positions by advancing Tail; a slot is published by setting its sequence number
+   once its value has been written, and freed by the consumer for the next round. */
+
+#include "Tcdefs.h"
+
+#include "EntropyRing.h"
+
+void EntropyRingInit (EntropyRing *ring)
+{
+	int i;
+
+	for (i = 0; i < ENTROPY_RING_SIZE; i++)
+		ring->Slots[i].Sequence = i;
+
+	ring->Tail = 0;
+	ring->Head = 0;
+}
+
+
+void EntropyRingWipe (EntropyRing *ring)
+{
+	burn (ring->Slots, sizeof (ring->Slots));
+	EntropyRingInit (ring);
+}
+
+
+// Appends a sample to the ring. Returns FALSE if the ring is full.
+BOOL EntropyRingPush (EntropyRing *ring, unsigned __int32 value)
+{
+	EntropyRingSlot *slot;
+	LONG pos = ring->Tail;
+
+	for (;;)
+	{
+		LONG claimed;
+
+		slot = &ring->Slots[pos & (ENTROPY_RING_SIZE - 1)];
+		claimed = (LONG) ((unsigned long) slot->Sequence - (unsigned long) pos);
+
+		if (claimed == 0)
+		{
+			LONG previousTail = InterlockedCompareExchange (&ring->Tail, pos + 1, pos);
+			if (previousTail == pos)
+				break;
+
+			pos = previousTail;
+		}
+		else if (claimed < 0)
+		{
+			// The slot has not been consumed since the previous round
+			return FALSE;
+		}
+		else
+			pos = ring->Tail;
+	}
+
+	slot->Value = value;
+
+	// Publish the slot
+	InterlockedExchange (&slot->Sequence, pos + 1);
+	return TRUE;
+}
+
+
+// Moves up to maxCount published samples to values, in the order their positions were claimed. Stops at
+// the first slot which has been claimed but not published yet. Returns the number of samples moved.
+int EntropyRingPop (EntropyRing *ring, unsigned __int32 *values, int maxCount)
+{
+	int count;
+
+	for (count = 0; count < maxCount; count++)
+	{
+		EntropyRingSlot *slot = &ring->Slots[ring->Head & (ENTROPY_RING_SIZE - 1)];
+
+		if ((LONG) ((unsigned long) slot->Sequence - (unsigned long) (ring->Head + 1)) < 0)
+			break;
+
+		values[count] = slot->Value;
+
+		// Free the slot for the next round
+		InterlockedExchange (&slot->Sequence, ring->Head + ENTROPY_RING_SIZE);
+		ring->Head++;
+	}
+
+	return count;
+}
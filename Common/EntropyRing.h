@@ -0,0 +1,48 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+#ifndef ENTROPY_RING_H
+#define ENTROPY_RING_H
+
+#include "Tcdefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of samples a ring holds between two drains (must be a power of two)
+#define ENTROPY_RING_SIZE	1024
+
+	/* Each slot carries a sequence number: the position it can next be written at (free), or that
+	   position + 1 (written) */
+	typedef struct
+	{
+		LONG volatile Sequence;
+		unsigned __int32 Value;
+	} EntropyRingSlot;
+
+	/* A lock-free multiple-producer, single-consumer ring of entropy samples */
+	typedef struct
+	{
+		EntropyRingSlot Slots[ENTROPY_RING_SIZE];
+		LONG volatile Tail;		// Next position to be claimed by a producer
+		LONG Head;				// Next position to be consumed; accessed by the consumer only
+	} EntropyRing;
+
+	/* Init and Wipe must not run concurrently with any other function on the ring. Push may be called by
+	   any number of threads at once, Pop by one thread at a time. */
+	void EntropyRingInit (EntropyRing *ring);
+	void EntropyRingWipe (EntropyRing *ring);
+	BOOL EntropyRingPush (EntropyRing *ring, unsigned __int32 value);
+	int EntropyRingPop (EntropyRing *ring, unsigned __int32 *values, int maxCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
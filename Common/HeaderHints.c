@@ -0,0 +1,213 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+/* NN: Remembers which PKCS-5 PRF, encryption algorithm and mode of operation last opened a given volume,
+   so that the next header read can try that combination first (see ReadVolumeHeaderWithHint()). 
+   The records are kept in TC_APPD_FILENAME_HEADER_HINTS:
+
+	<TrueCrypt>
+		<headerhints>
+			<volume prf="1" ea="1" mode="1">C:\path\to\volume.tc</volume>
+		</headerhints>
+	</TrueCrypt>
+
+   The file reveals which paths hold volumes and how they are encrypted, hence it is only written when 
+   enabled by the caller (TC_OPTION_HEADER_HINTS). */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "Tcdefs.h"
+#include "HeaderHints.h"
+#include "Options.h"
+#include "OsInfo.h"
+#include "Xml.h"
+
+typedef struct
+{
+	char VolumePath[TC_MAX_PATH];
+	HeaderSearchHint Hint;
+} HeaderHintRecord;
+
+CRITICAL_SECTION HeaderHintsLock;	/* Serializes access to the config file within the process; set up by Initialize() */
+
+// Returns the number of records read (at most maxCount).
+static int LoadHeaderHintRecords (const char *configPath, HeaderHintRecord *records, int maxCount)
+{
+	char *fileBuf, *xml;
+	char attr[32];
+	DWORD size;
+	int count = 0;
+
+	if (!FileExists (configPath))
+		return 0;
+
+	if ((fileBuf = LoadFile (configPath, &size)) == NULL)
+		return 0;
+
+	xml = XmlFindElement (fileBuf, "headerhints");
+
+	while (xml && count < maxCount && (xml = XmlFindElement (xml, "volume")))
+	{
+		HeaderHintRecord *record = &records[count];
+
+		XmlGetAttributeText (xml, "prf", attr, sizeof (attr) - 1);
+		record->Hint.Pkcs5Prf = atoi (attr);
+
+		XmlGetAttributeText (xml, "ea", attr, sizeof (attr) - 1);
+		record->Hint.Ea = atoi (attr);
+
+		XmlGetAttributeText (xml, "mode", attr, sizeof (attr) - 1);
+		record->Hint.Mode = atoi (attr);
+
+		XmlGetNodeText (xml, record->VolumePath, sizeof (record->VolumePath) - 1);
+
+		if (record->VolumePath[0] != 0)
+			++count;
+
+		xml++;
+	}
+
+	free (fileBuf);
+	return count;
+}
+
+static BOOL SaveHeaderHintRecords (const char *configPath, const HeaderHintRecord *records, int count)
+{
+	char quotedPath[TC_MAX_PATH * 6];
+	FILE *f;
+	int i;
+
+	if ((f = fopen (configPath, "w")) == NULL)
+		return FALSE;
+
+	XmlWriteHeader (f);
+	fputs ("\n\t<headerhints>", f);
+
+	for (i = 0; i < count; ++i)
+	{
+		if (XmlQuoteText (records[i].VolumePath, quotedPath, sizeof (quotedPath)) == NULL)
+			continue;
+
+		fprintf (f, "\n\t\t<volume prf=\"%d\" ea=\"%d\" mode=\"%d\">%s</volume>",
+			records[i].Hint.Pkcs5Prf, records[i].Hint.Ea, records[i].Hint.Mode, quotedPath);
+	}
+
+	fputs ("\n\t</headerhints>", f);
+	XmlWriteFooter (f);
+
+	if (ferror (f))
+	{
+		fclose (f);
+		return FALSE;
+	}
+
+	return fclose (f) == 0;
+}
+
+// Returns TRUE and fills hint if a record exists for the volume.
+BOOL LoadHeaderHint (const char *volumePath, HeaderSearchHint *hint)
+{
+	char configPath[MAX_PATH * 2];
+	HeaderHintRecord *records;
+	BOOL found = FALSE;
+	int count, i;
+
+	if (volumePath == NULL || hint == NULL)
+		return FALSE;
+
+	records = (HeaderHintRecord *) malloc (sizeof (HeaderHintRecord) * HEADER_HINTS_MAX_COUNT);
+	if (records == NULL)
+		return FALSE;
+
+	EnterCriticalSection (&HeaderHintsLock);
+
+	strcpy_s (configPath, sizeof (configPath), GetConfigPath (TC_APPD_FILENAME_HEADER_HINTS));
+	count = LoadHeaderHintRecords (configPath, records, HEADER_HINTS_MAX_COUNT);
+
+	LeaveCriticalSection (&HeaderHintsLock);
+
+	for (i = 0; i < count; ++i)
+	{
+		if (_stricmp (records[i].VolumePath, volumePath) == 0)
+		{
+			*hint = records[i].Hint;
+			found = TRUE;
+			break;
+		}
+	}
+
+	free (records);
+	return found;
+}
+
+// Stores hint as the most recent record for the volume, replacing any previous one.
+BOOL SaveHeaderHint (const char *volumePath, const HeaderSearchHint *hint)
+{
+	char configPath[MAX_PATH * 2];
+	HeaderHintRecord *records;
+	BOOL status;
+	int count, i;
+
+	if (volumePath == NULL || hint == NULL || strlen (volumePath) >= TC_MAX_PATH)
+		return FALSE;
+
+	records = (HeaderHintRecord *) malloc (sizeof (HeaderHintRecord) * HEADER_HINTS_MAX_COUNT);
+	if (records == NULL)
+		return FALSE;
+
+	EnterCriticalSection (&HeaderHintsLock);
+
+	strcpy_s (configPath, sizeof (configPath), GetConfigPath (TC_APPD_FILENAME_HEADER_HINTS));
+
+	// Record 0 is reserved for the new hint
+	count = LoadHeaderHintRecords (configPath, records + 1, HEADER_HINTS_MAX_COUNT - 1);
+
+	for (i = 1; i <= count; ++i)
+	{
+		if (_stricmp (records[i].VolumePath, volumePath) == 0)
+		{
+			if (memcmp (&records[i].Hint, hint, sizeof (*hint)) == 0 && i == 1)
+			{
+				// Already the most recent record
+				LeaveCriticalSection (&HeaderHintsLock);
+				free (records);
+				return TRUE;
+			}
+
+			memmove (&records[i], &records[i + 1], sizeof (HeaderHintRecord) * (count - i));
+			--count;
+			break;
+		}
+	}
+
+	strcpy_s (records[0].VolumePath, sizeof (records[0].VolumePath), volumePath);
+	records[0].Hint = *hint;
+
+	status = SaveHeaderHintRecords (configPath, records, count + 1);
+
+	LeaveCriticalSection (&HeaderHintsLock);
+
+	free (records);
+	return status;
+}
+
+BOOL ClearHeaderHints (void)
+{
+	char configPath[MAX_PATH * 2];
+	BOOL status = TRUE;
+
+	EnterCriticalSection (&HeaderHintsLock);
+
+	strcpy_s (configPath, sizeof (configPath), GetConfigPath (TC_APPD_FILENAME_HEADER_HINTS));
+
+	if (FileExists (configPath))
+		status = DeleteFile (configPath);
+
+	LeaveCriticalSection (&HeaderHintsLock);
+	return status;
+}
@@ -0,0 +1,32 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+#ifndef HEADER_HINTS_H
+#define HEADER_HINTS_H
+
+#include "Tcdefs.h"
+#include "Volumes.h"
+
+/* Maximum number of volumes for which the last successful PRF/EA/mode combination is remembered. 
+   The least recently saved records are dropped first. */
+#define HEADER_HINTS_MAX_COUNT	256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	extern CRITICAL_SECTION HeaderHintsLock;
+
+	BOOL LoadHeaderHint (const char *volumePath, HeaderSearchHint *hint);
+	BOOL SaveHeaderHint (const char *volumePath, const HeaderSearchHint *hint);
+	BOOL ClearHeaderHints (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
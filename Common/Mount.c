@@ -14,6 +14,8 @@ governed by license terms which are TBD. */
 #include <sstream>
 #include "Boot/Windows/BootCommon.h"
 #include "Uac.h"
+#include "Options.h"
+#include "HeaderHints.h"
 #include "Platform/PlatformBase.h"
 #include <Dbt.h>
 #include <ShlObj.h>
@@ -30,9 +32,9 @@ int WrongPwdRetryCounter = 0;
 BOOL MultipleMountOperationInProgress = FALSE;
 BOOL FavoriteMountOnArrivalInProgress = FALSE;
 BOOL MountVolumesAsSystemFavorite = FALSE;
-BOOL LastMountedVolumeDirty;
 BOOL IgnoreWmDeviceChange = FALSE;
 BOOL DeviceChangeBroadcastDisabled = FALSE;
+CRITICAL_SECTION MountOperationLock;	/* NN: Serializes mount operations, which depend on the process-wide flags above */
 BOOL bForceMount = FALSE;			/* Mount volume even if host file/device already in use */
 BOOL bForceUnmount = FALSE;			/* Unmount volume even if it cannot be locked */
 
@@ -490,9 +492,10 @@ BOOL CheckSysEncMountWithoutPBA (const char *devicePath)
 
 	try
 	{
-		BootEncStatus = BootEncObj->GetStatus();
+		// NN: The status is kept local, as this may run in several mount threads at once
+		BootEncryptionStatus bootEncStatus = BootEncObj->GetStatus();
 
-		if (BootEncStatus.DriveMounted)
+		if (bootEncStatus.DriveMounted)
 		{
 			int retCode = 0;
 			int driveNo;
@@ -559,6 +562,27 @@ void CheckFilesystem (int driveNo, BOOL fixErrors)
 	ShellExecuteW (NULL, (!IsAdmin() && IsUacSupported()) ? L"runas" : L"open", L"cmd.exe", param, NULL, SW_SHOW);
 }
 
+// Remembers the PRF, encryption algorithm and mode of operation of the volume mounted as the
+// specified drive letter, so that subsequent header reads of the volume try them first.
+static void SaveHeaderHintByDriveNo (int nDosDriveNo, const char *volumePath)
+{
+	VOLUME_PROPERTIES_STRUCT prop;
+	HeaderSearchHint hint;
+	DWORD dwResult;
+
+	memset (&prop, 0, sizeof(prop));
+	prop.driveNo = nDosDriveNo;
+
+	if (DeviceIoControl (hDriver, TC_IOCTL_GET_VOLUME_PROPERTIES, &prop, sizeof (prop), &prop, sizeof (prop), &dwResult, NULL))
+	{
+		hint.Pkcs5Prf = prop.pkcs5;
+		hint.Ea = prop.ea;
+		hint.Mode = prop.mode;
+
+		SaveHeaderHint (volumePath, &hint);
+	}
+}
+
 // Use only cached passwords if password = NULL
 //
 // Returns:
@@ -569,6 +593,9 @@ void CheckFilesystem (int driveNo, BOOL fixErrors)
 //
 // Note that some code calling this relies on the content of the mountOptions struct
 // to remain unmodified (don't remove the 'const' without proper revision).
+//
+// NN: Only calls with bReportWrongPassword update process-wide state (the wrong password retry count);
+// they must hold MountOperationLock. Other calls may run concurrently (see MountBatch.c).
 
 int MountVolume (int driveNo, char *volumePath, Password *password, BOOL cachePassword, BOOL sharedAccess, const MountOptions* const mountOptions, BOOL bReportWrongPassword, BOOL bRetryIfInUse)
 {
@@ -788,8 +815,6 @@ retry:
 			set_error_debug_out(TCAPI_W_HEADER_DAMAGED_BACKUP_USED);
 	}
 
-	LastMountedVolumeDirty = mount.FilesystemDirty;
-
 	//if (mount.FilesystemDirty)
 	//{
 	//	wchar_t msg[1024];
@@ -846,7 +871,11 @@ retry:
 	//	}
 	//}
 
-	ResetWrongPwdRetryCount ();
+	if (bReportWrongPassword)
+		ResetWrongPwdRetryCount ();
+
+	if (bUseHeaderHints)
+		SaveHeaderHintByDriveNo (driveNo, volumePath);
 
 	BroadcastDeviceChange (DBT_DEVICEARRIVAL, driveNo, 0);
 
@@ -1013,6 +1042,8 @@ BOOL Mount (HWND hwndDlg, int nDosDriveNo, char *szFileName, Password VolumePass
 	//TODO: 
 	BOOL bCacheInDriver = FALSE;
 
+	EnterCriticalSection (&MountOperationLock);
+
 	bPrebootPasswordDlgMode = mountOptions.PartitionInInactiveSysEncScope;
 
 	//if (nDosDriveNo == 0)
@@ -1166,6 +1197,7 @@ ret:
 	//if (status && CloseSecurityTokenSessionsAfterMount && !MultipleMountOperationInProgress)
 	//	SecurityToken::CloseAllSessions();
 
+	LeaveCriticalSection (&MountOperationLock);
 	return status;
 }
 
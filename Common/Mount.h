@@ -76,6 +76,11 @@ extern "C" {
 	extern MountOptions mountOptions;
 	extern MountOptions defaultMountOptions;
 
+	extern BOOL MultipleMountOperationInProgress;
+	extern BOOL DeviceChangeBroadcastDisabled;
+	extern CRITICAL_SECTION MountOperationLock;
+	extern BOOL bForceMount;
+
 	typedef struct
 	{
 		BOOL bHidVolDamagePrevReported[26];
@@ -0,0 +1,137 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+/* NN: Mounts many volumes at once. Header key derivation is done by the driver in the context of the
+   thread which issued TC_IOCTL_MOUNT_VOLUME (with PRFs spread over the driver's encryption thread pool),
+   so issuing the mount requests from several threads keeps all CPUs busy and cold-start time scales 
+   with the number of CPUs instead of the number of volumes. */
+
+#include "MountBatch.h"
+#include "BatchWorker.h"
+#include "Mount.h"
+#include "Options.h"
+#include "OsInfo.h"
+#include "Apidrvr.h"
+#include "Errors.h"
+#include <Dbt.h>
+
+typedef struct
+{
+	PTCAPI_MOUNT_ENTRY Entries;
+	volatile LONG MountedDriveMap;
+} MountBatchContext;
+
+static BOOL MountBatchEntry (int entryIndex, void *batchContext)
+{
+	MountBatchContext *context = (MountBatchContext *) batchContext;
+	PTCAPI_MOUNT_ENTRY entry = &context->Entries[entryIndex];
+
+	// Wrong passwords are not reported by MountVolume() here. Such calls do not touch the wrong password
+	// retry count shared by all volumes (nor any other process-wide state), so the workers need no lock.
+	entry->Result = MountVolume (entry->DriveNo, entry->VolumePath, &entry->VolumePassword, bCacheInDriver, 
+		bForceMount, &mountOptions, FALSE, TRUE);
+
+	if (entry->Result > 0)
+	{
+		entry->LastError = ERROR_SUCCESS;
+		InterlockedOr (&context->MountedDriveMap, 1 << entry->DriveNo);
+	}
+	else
+	{
+		entry->LastError = GetLastError ();
+
+		if (entry->Result == 0 && entry->LastError == ERROR_SUCCESS)
+			entry->LastError = TCAPI_E_WRONG_PASSWORD;
+	}
+
+	burn (&entry->VolumePassword, sizeof (entry->VolumePassword));
+
+	return entry->Result > 0;
+}
+
+// Mounts the volumes described by entries using up to maxConcurrency threads (0 = one per encryption 
+// thread). Per-volume results are returned in the entries. Returns the number of volumes mounted.
+int MountVolumeBatch (PTCAPI_MOUNT_ENTRY entries, int count, int maxConcurrency)
+{
+	MountBatchContext context;
+	int mountedCount;
+	BOOL multipleMountOperationInProgress, deviceChangeBroadcastDisabled;
+	DWORD driveMap = 0;
+	int i, j;
+
+	if (entries == NULL || count <= 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		entries[i].Result = 0;
+		entries[i].LastError = ERROR_SUCCESS;
+
+		if (entries[i].DriveNo < MIN_MOUNTED_VOLUME_DRIVE_NUMBER || entries[i].DriveNo > MAX_MOUNTED_VOLUME_DRIVE_NUMBER)
+		{
+			set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+			return 0;
+		}
+	}
+
+	// The workers check the availability of their drives independently, so two entries must not
+	// claim the same drive (nor the same volume)
+	for (i = 0; i < count; ++i)
+	{
+		if (driveMap & (1 << entries[i].DriveNo))
+		{
+			set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+			return 0;
+		}
+
+		driveMap |= 1 << entries[i].DriveNo;
+
+		for (j = 0; j < i; ++j)
+		{
+			if (_stricmp (entries[i].VolumePath, entries[j].VolumePath) == 0)
+			{
+				set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+				return 0;
+			}
+		}
+	}
+
+	context.Entries = entries;
+	context.MountedDriveMap = 0;
+
+	// Other mount operations must not run while the flags are changed
+	EnterCriticalSection (&MountOperationLock);
+
+	multipleMountOperationInProgress = MultipleMountOperationInProgress;
+	deviceChangeBroadcastDisabled = DeviceChangeBroadcastDisabled;
+
+	MultipleMountOperationInProgress = TRUE;
+
+	// Explorer is notified about all new drives at once when the batch completes
+	DeviceChangeBroadcastDisabled = TRUE;
+
+	// The system device paths are cached by the first check of a partition in the key scope of system
+	// encryption; the workers must only read them
+	if (mountOptions.PartitionInInactiveSysEncScope)
+		GetSysDevicePaths ();
+
+	mountedCount = RunBatch (count, maxConcurrency, MountBatchEntry, NULL, &context);
+
+	MultipleMountOperationInProgress = multipleMountOperationInProgress;
+	DeviceChangeBroadcastDisabled = deviceChangeBroadcastDisabled;
+
+	if (context.MountedDriveMap != 0)
+		BroadcastDeviceChange (DBT_DEVICEARRIVAL, 0, (DWORD) context.MountedDriveMap);
+
+	LeaveCriticalSection (&MountOperationLock);
+
+	SetLastError (mountedCount == count ? ERROR_SUCCESS : TCAPI_E_ERROR);
+	return mountedCount;
+}
@@ -0,0 +1,32 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+#ifndef MOUNT_BATCH_H
+#define MOUNT_BATCH_H
+
+#include "Tcdefs.h"
+#include "Password.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef struct {
+		char VolumePath[TC_MAX_PATH];	/* In: volume file or device path (may be rewritten to its canonical form) */
+		int DriveNo;					/* In: drive number to mount to (0 = A:) */
+		Password VolumePassword;		/* In: password; burned once the entry has been processed */
+		int Result;						/* Out: as returned by MountVolume(), 1 or 2 = mounted */
+		DWORD LastError;				/* Out: TCAPI_E_* or Win32 error code if not mounted */
+	} TCAPI_MOUNT_ENTRY, *PTCAPI_MOUNT_ENTRY;
+
+	int MountVolumeBatch (PTCAPI_MOUNT_ENTRY entries, int count, int maxConcurrency);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
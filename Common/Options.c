@@ -16,12 +16,14 @@ governed by license terms which are TBD. */
 #include "BootEncryption.h"
 #include "Registry.h"
 #include "OsInfo.h"
+#include "Random.h"
 
 BOOL bPreserveTimestamp = TRUE;
 BOOL bCacheInDriver = FALSE;
 BOOL bMountReadOnly = FALSE;
 BOOL bMountRemovable = FALSE;
 BOOL bWipeCacheOnExit = FALSE;		/* Wipe password from cache on exit */
+BOOL bUseHeaderHints = FALSE;		/* Remember the PRF/EA/mode which opened a volume (see HeaderHints.c) */
 
 /* NN: Path to TrueCrypt driver. If NULL, denotes use of installed driver, otherwise the one at path. 
 Since we load the specified driver only and do not attempt to discover other options, the value of this 
@@ -73,6 +75,15 @@ BOOL ApplyOptions(PTCAPI_OPTIONS options) {
 		case TC_OPTION_WIPE_CACHE_ON_EXIT:
 			bPreserveTimestamp = option->OptionValue;
 			break;
+		case TC_OPTION_HEADER_HINTS:
+			bUseHeaderHints = option->OptionValue;
+			break;
+		case TC_OPTION_SYSTEM_ENTROPY:
+			if (!RandSetSystemEntropy ((BOOL) option->OptionValue)) {
+				set_error_debug_out(TCAPI_E_WRONG_OPTION);
+				return FALSE;
+			}
+			break;
 		case TC_OPTION_DRIVER_PATH:
 			if (option->OptionValue != 0) {
 				pathSize = (MAX_PATH + 1);
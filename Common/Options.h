@@ -22,6 +22,8 @@ governed by license terms which are TBD. */
 #define TC_OPTION_TOKEN_LIBRARY			TC_OPTION_BASE + 8
 #define TC_OPTION_DRIVER_PATH			TC_OPTION_BASE + 9
 #define TC_OPTION_WIPE_CACHE_ON_EXIT	TC_OPTION_BASE + 10
+#define TC_OPTION_HEADER_HINTS			TC_OPTION_BASE + 11
+#define TC_OPTION_SYSTEM_ENTROPY		TC_OPTION_BASE + 12
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,6 +49,7 @@ extern "C" {
 	extern BOOL bMountReadOnly;
 	extern BOOL bMountRemovable;
 	extern BOOL bWipeCacheOnExit;
+	extern BOOL bUseHeaderHints;
 
 	extern char *lpszDriverPath;
 
@@ -67,6 +70,7 @@ extern "C" {
 	uint32 ReadEncryptionThreadPoolFreeCpuCountLimit ();
 	BOOL IsNonInstallMode();
 	char *GetConfigPath (char *fileName);
+	char *LoadFile (const char *fileName, DWORD *size);
 
 #ifdef __cplusplus
 }
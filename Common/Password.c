@@ -16,9 +16,13 @@ governed by license terms which are TBD. */
 #include "Options.h"
 #include "Uac.h"
 #include "Errors.h"
+#include "HeaderHints.h"
 
 #include <io.h>
 
+// Number of header wipe passes whose header keys are derived at once
+#define HEADER_REENCRYPTION_BATCH_SIZE	32
+
 BOOL IsPageLocked(LPVOID pRef, SIZE_T dwSize) {
 
 	int res = VirtualUnlock(pRef, dwSize);
@@ -130,20 +134,73 @@ BOOL CheckPasswordCharEncoding (HWND hPassword, Password *ptrPw)
 	return TRUE;
 }
 
+// Creates passCount re-encrypted versions of a volume header (wipe passes firstPass .. firstPass + passCount - 1),
+// deriving their header keys in parallel. items must be initialized except for the output fields.
+static int CreateReencryptedVolumeHeaders (VolumeHeaderBatchItem *items, int firstPass, int passCount)
+{
+	int wipePassCount = passCount;
+	int nStatus = ERR_SUCCESS;
+	int i;
+
+	// Only the last pass writes the final header, for which the RNG is forced to perform a slow poll
+	if (firstPass + passCount == PRAND_DISK_WIPE_PASSES)
+		--wipePassCount;
+
+	if (wipePassCount > 0)
+		nStatus = CreateVolumeHeadersInMemory (FALSE, items, wipePassCount, TRUE);
+
+	if (nStatus == ERR_SUCCESS && wipePassCount < passCount)
+		nStatus = CreateVolumeHeadersInMemory (FALSE, items + wipePassCount, 1, FALSE);
+
+	for (i = 0; i < passCount; ++i)
+	{
+		if (items[i].CryptoInfo != NULL)
+		{
+			crypto_close (items[i].CryptoInfo);
+			items[i].CryptoInfo = NULL;
+		}
+	}
+
+	return nStatus;
+}
+
 int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, int pkcs5, HWND hwndDlg)
+{
+	int nStatus;
+	DWORD dwError;
+
+	if (oldPassword->Length == 0 || newPassword->Length == 0) return -1;
+
+	// Randinit has already reported the Win32 error which made it fail
+	if (Randinit ())
+		return ERR_OS_ERROR;
+
+	nStatus = ChangeVolumePassword (lpszVolume, oldPassword, newPassword, pkcs5, NULL);
+
+	dwError = GetLastError ();
+	RandStop (FALSE);
+	SetLastError (dwError);
+
+	return nStatus;
+}
+
+// Re-encrypts the headers of a volume with a new password. The random number generator must be running.
+// If hint is not NULL, it is tried first when decrypting the volume header (unless the volume has a saved 
+// hint), and receives the PRF, encryption algorithm and mode of the volume on success.
+int ChangeVolumePassword (char *lpszVolume, Password *oldPassword, Password *newPassword, int pkcs5, HeaderSearchHint *hint)
 {
 	int nDosLinkCreated = 1, nStatus = ERR_OS_ERROR;
 	char szDiskFile[TC_MAX_PATH], szCFDevice[TC_MAX_PATH];
 	char szDosDevice[TC_MAX_PATH];
-	char buffer[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
-	PCRYPTO_INFO cryptoInfo = NULL, ci = NULL;
+	VolumeHeaderBatchItem *headers = NULL;
+	PCRYPTO_INFO cryptoInfo = NULL;
 	void *dev = INVALID_HANDLE_VALUE;
 	DWORD dwError;
-	DWORD bytesRead;
 	BOOL bDevice;
 	unsigned __int64 hostSize = 0;
 	int volumeType;
-	int wipePass;
+	int wipePass, passCount;
+	int i;
 	FILETIME ftCreationTime;
 	FILETIME ftLastWriteTime;
 	FILETIME ftLastAccessTime;
@@ -151,6 +208,8 @@ int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, i
 	LARGE_INTEGER headerOffset;
 	BOOL backupHeader;
 	DISK_GEOMETRY driveInfo;
+	HeaderSearchHint savedHint;
+	const HeaderSearchHint *searchHint = NULL;
 
 	if (oldPassword->Length == 0 || newPassword->Length == 0) return -1;
 
@@ -217,9 +276,6 @@ int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, i
 		hostSize = fileSize.QuadPart;
 	}
 
-	if (Randinit ())
-		goto error;
-
 	if (!bDevice && bPreserveTimestamp)
 	{
 		if (GetFileTime ((HANDLE) dev, &ftCreationTime, &ftLastAccessTime, &ftLastWriteTime) == 0)
@@ -228,67 +284,18 @@ int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, i
 			bTimeStampValid = TRUE;
 	}
 
-	for (volumeType = TC_VOLUME_TYPE_NORMAL; volumeType < TC_VOLUME_TYPE_COUNT; volumeType++)
-	{
-		// Seek the volume header
-		switch (volumeType)
-		{
-		case TC_VOLUME_TYPE_NORMAL:
-			headerOffset.QuadPart = TC_VOLUME_HEADER_OFFSET;
-			break;
-
-		case TC_VOLUME_TYPE_HIDDEN:
-			if (TC_HIDDEN_VOLUME_HEADER_OFFSET + TC_VOLUME_HEADER_SIZE > hostSize)
-				continue;
+	if (bUseHeaderHints && LoadHeaderHint (lpszVolume, &savedHint))
+		searchHint = &savedHint;
+	else if (hint != NULL && hint->Pkcs5Prf != 0)
+		searchHint = hint;
 
-			headerOffset.QuadPart = TC_HIDDEN_VOLUME_HEADER_OFFSET;
-			break;
+	/* Try to decrypt the normal and hidden volume headers */
 
-		case TC_VOLUME_TYPE_HIDDEN_LEGACY:
-			if (bDevice && driveInfo.BytesPerSector != TC_SECTOR_SIZE_LEGACY)
-				continue;
+	nStatus = ProbeVolumeHeaders (bDevice, dev, hostSize, bDevice ? driveInfo.BytesPerSector : TC_SECTOR_SIZE_FILE_HOSTED_VOLUME,
+		FALSE, oldPassword, searchHint, &volumeType, &backupHeader, (uint64 *) &headerOffset.QuadPart, &cryptoInfo);
 
-			headerOffset.QuadPart = hostSize - TC_HIDDEN_VOLUME_HEADER_OFFSET_LEGACY;
-			break;
-		}
-
-		if (!SetFilePointerEx ((HANDLE) dev, headerOffset, NULL, FILE_BEGIN))
-		{
-			nStatus = ERR_OS_ERROR;
-			goto error;
-		}
-
-		/* Read in volume header */
-		if (!ReadEffectiveVolumeHeader (bDevice, dev, (byte *)buffer, &bytesRead))
-		{
-			nStatus = ERR_OS_ERROR;
-			goto error;
-		}
-
-		if (bytesRead != sizeof (buffer))
-		{
-			// Windows may report EOF when reading sectors from the last cluster of a device formatted as NTFS 
-			memset (buffer, 0, sizeof (buffer));
-		}
-
-		/* Try to decrypt the header */
-
-		nStatus = ReadVolumeHeader (FALSE, buffer, oldPassword, &cryptoInfo, NULL);
-		if (nStatus == ERR_CIPHER_INIT_WEAK_KEY)
-			nStatus = 0;	// We can ignore this error here
-
-		if (nStatus == ERR_PASSWORD_WRONG)
-		{
-			continue;		// Try next volume type
-		}
-		else if (nStatus != 0)
-		{
-			cryptoInfo = NULL;
-			goto error;
-		}
-		else 
-			break;
-	}
+	if (nStatus == ERR_CIPHER_INIT_WEAK_KEY)
+		nStatus = 0;	// We can ignore this error here
 
 	if (nStatus != 0)
 	{
@@ -302,6 +309,13 @@ int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, i
 		goto error;
 	}
 
+	if (hint != NULL)
+	{
+		hint->Pkcs5Prf = cryptoInfo->pkcs5;
+		hint->Ea = cryptoInfo->ea;
+		hint->Mode = cryptoInfo->mode;
+	}
+
 	// Change the PKCS-5 PRF if requested by user
 	if (pkcs5 != 0)
 		cryptoInfo->pkcs5 = pkcs5;
@@ -310,6 +324,31 @@ int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, i
 
 	UserEnrichRandomPool ();
 
+	headers = (VolumeHeaderBatchItem *) TCalloc (sizeof (VolumeHeaderBatchItem) * HEADER_REENCRYPTION_BATCH_SIZE);
+	if (headers == NULL)
+	{
+		nStatus = ERR_OUTOFMEMORY;
+		goto error;
+	}
+
+	memset (headers, 0, sizeof (VolumeHeaderBatchItem) * HEADER_REENCRYPTION_BATCH_SIZE);
+
+	for (i = 0; i < HEADER_REENCRYPTION_BATCH_SIZE; ++i)
+	{
+		headers[i].Ea = cryptoInfo->ea;
+		headers[i].Mode = cryptoInfo->mode;
+		headers[i].VolumePassword = newPassword;
+		headers[i].Pkcs5Prf = cryptoInfo->pkcs5;
+		headers[i].MasterKeydata = cryptoInfo->master_keydata;
+		headers[i].VolumeSize = cryptoInfo->VolumeSize.Value;
+		headers[i].HiddenVolumeSize = (volumeType == TC_VOLUME_TYPE_HIDDEN || volumeType == TC_VOLUME_TYPE_HIDDEN_LEGACY) ? cryptoInfo->hiddenVolumeSize : 0;
+		headers[i].EncryptedAreaStart = cryptoInfo->EncryptedAreaStart.Value;
+		headers[i].EncryptedAreaLength = cryptoInfo->EncryptedAreaLength.Value;
+		headers[i].RequiredProgramVersion = cryptoInfo->RequiredProgramVersion;
+		headers[i].HeaderFlags = cryptoInfo->HeaderFlags;
+		headers[i].SectorSize = cryptoInfo->SectorSize;
+	}
+
 	/* Re-encrypt the volume header */ 
 	backupHeader = FALSE;
 
@@ -334,57 +373,46 @@ int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, i
 		topic: http://www.cypherpunks.to/~peter/usenix01.pdf. This said not to diminish TrueCrypt effort 
 		to practice most stringent approach on security, but to keep a correct perspective on the topic. */
 
-		for (wipePass = 0; wipePass < PRAND_DISK_WIPE_PASSES; wipePass++)
+		/* NN: Header keys of consecutive passes are derived in parallel on the encryption thread pool, 
+		HEADER_REENCRYPTION_BATCH_SIZE at a time. The headers are still written in the original order. */
+
+		for (wipePass = 0; wipePass < PRAND_DISK_WIPE_PASSES; wipePass += passCount)
 		{
-			// Prepare new volume header
-			nStatus = CreateVolumeHeaderInMemory (FALSE,
-				buffer,
-				cryptoInfo->ea,
-				cryptoInfo->mode,
-				newPassword,
-				cryptoInfo->pkcs5,
-				cryptoInfo->master_keydata,
-				&ci,
-				cryptoInfo->VolumeSize.Value,
-				(volumeType == TC_VOLUME_TYPE_HIDDEN || volumeType == TC_VOLUME_TYPE_HIDDEN_LEGACY) ? cryptoInfo->hiddenVolumeSize : 0,
-				cryptoInfo->EncryptedAreaStart.Value,
-				cryptoInfo->EncryptedAreaLength.Value,
-				cryptoInfo->RequiredProgramVersion,
-				cryptoInfo->HeaderFlags,
-				cryptoInfo->SectorSize,
-				wipePass < PRAND_DISK_WIPE_PASSES - 1);
-
-			if (ci != NULL)
-				crypto_close (ci);
+			passCount = min (HEADER_REENCRYPTION_BATCH_SIZE, PRAND_DISK_WIPE_PASSES - wipePass);
 
+			// Prepare new volume headers
+			nStatus = CreateReencryptedVolumeHeaders (headers, wipePass, passCount);
 			if (nStatus != 0)
 				goto error;
 
-			if (!SetFilePointerEx ((HANDLE) dev, headerOffset, NULL, FILE_BEGIN))
-			{
-				nStatus = ERR_OS_ERROR;
-				goto error;
-			}
-
-			if (!WriteEffectiveVolumeHeader (bDevice, dev, (byte *)buffer))
+			for (i = 0; i < passCount; ++i)
 			{
-				nStatus = ERR_OS_ERROR;
-				goto error;
-			}
+				if (!SetFilePointerEx ((HANDLE) dev, headerOffset, NULL, FILE_BEGIN))
+				{
+					nStatus = ERR_OS_ERROR;
+					goto error;
+				}
 
-			if (bDevice
-				&& !cryptoInfo->LegacyVolume
-				&& !cryptoInfo->hiddenVolume
-				&& cryptoInfo->HeaderVersion == 4
-				&& (cryptoInfo->HeaderFlags & TC_HEADER_FLAG_NONSYS_INPLACE_ENC) != 0
-				&& (cryptoInfo->HeaderFlags & ~TC_HEADER_FLAG_NONSYS_INPLACE_ENC) == 0)
-			{
-				nStatus = WriteRandomDataToReservedHeaderAreas (dev, cryptoInfo, cryptoInfo->VolumeSize.Value, !backupHeader, backupHeader);
-				if (nStatus != ERR_SUCCESS)
+				if (!WriteEffectiveVolumeHeader (bDevice, dev, (byte *) headers[i].Header))
+				{
+					nStatus = ERR_OS_ERROR;
 					goto error;
+				}
+
+				if (bDevice
+					&& !cryptoInfo->LegacyVolume
+					&& !cryptoInfo->hiddenVolume
+					&& cryptoInfo->HeaderVersion == 4
+					&& (cryptoInfo->HeaderFlags & TC_HEADER_FLAG_NONSYS_INPLACE_ENC) != 0
+					&& (cryptoInfo->HeaderFlags & ~TC_HEADER_FLAG_NONSYS_INPLACE_ENC) == 0)
+				{
+					nStatus = WriteRandomDataToReservedHeaderAreas (dev, cryptoInfo, cryptoInfo->VolumeSize.Value, !backupHeader, backupHeader);
+					if (nStatus != ERR_SUCCESS)
+						goto error;
+				}
+
+				FlushFileBuffers (dev);
 			}
-
-			FlushFileBuffers (dev);
 		}
 
 		if (backupHeader || cryptoInfo->LegacyVolume)
@@ -397,10 +425,21 @@ int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, i
 	/* Password successfully changed */
 	nStatus = 0;
 
+	savedHint.Pkcs5Prf = cryptoInfo->pkcs5;
+	savedHint.Ea = cryptoInfo->ea;
+	savedHint.Mode = cryptoInfo->mode;
+
+	if (bUseHeaderHints)
+		SaveHeaderHint (lpszVolume, &savedHint);
+
 error:
 	dwError = GetLastError ();
 
-	burn (buffer, sizeof (buffer));
+	if (headers != NULL)
+	{
+		burn (headers, sizeof (VolumeHeaderBatchItem) * HEADER_REENCRYPTION_BATCH_SIZE);
+		TCfree (headers);
+	}
 
 	if (cryptoInfo != NULL)
 		crypto_close (cryptoInfo);
@@ -414,8 +453,6 @@ error:
 	if (nDosLinkCreated == 0)
 		RemoveFakeDosName (szDiskFile, szDosDevice);
 
-	RandStop (FALSE);
-
 	SetLastError (dwError);
 
 	if (nStatus == ERR_OS_ERROR && dwError == ERROR_ACCESS_DENIED
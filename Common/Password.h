@@ -31,6 +31,8 @@ extern "C" {
 	BOOL ValidatePassword(const char *szPassword, const char *szVerify, BOOL keyFilesEnabled);
 	BOOL CheckPasswordCharEncoding (HWND hPassword, Password *ptrPw);			
 	int ChangePwd (char *lpszVolume, Password *oldPassword, Password *newPassword, int pkcs5, HWND hwndDlg);
+	struct HeaderSearchHintStruct;
+	int ChangeVolumePassword (char *lpszVolume, Password *oldPassword, Password *newPassword, int pkcs5, struct HeaderSearchHintStruct *hint);
 
 #endif	// defined(_WIN32) && !defined(TC_WINDOWS_DRIVER)
 
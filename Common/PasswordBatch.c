@@ -0,0 +1,106 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+/* NN: Changes passwords of many volumes at once. Each volume is processed by one of several threads while
+   the PBKDF2 work of all of them (old header search and re-encrypted header passes) is spread over the 
+   encryption thread pool, so header I/O of one volume overlaps with key derivation of the others. 
+   Volumes rotated together usually share their PRF, encryption algorithm and mode, so whatever has been
+   found for one volume is tried first for the next ones. */
+
+#include "PasswordBatch.h"
+#include "BatchWorker.h"
+#include "Volumes.h"
+#include "Random.h"
+#include "Errors.h"
+
+typedef struct
+{
+	PTCAPI_PASSWORD_CHANGE_ENTRY Entries;
+	int EntryCount;
+	HeaderSearchHint Hint;
+	CRITICAL_SECTION HintLock;
+	PTCAPI_PASSWORD_CHANGE_PROGRESS Progress;
+	void *ProgressContext;
+} PasswordBatchContext;
+
+static BOOL ChangePasswordBatchEntry (int entryIndex, void *batchContext)
+{
+	PasswordBatchContext *context = (PasswordBatchContext *) batchContext;
+	PTCAPI_PASSWORD_CHANGE_ENTRY entry = &context->Entries[entryIndex];
+	HeaderSearchHint hint;
+
+	EnterCriticalSection (&context->HintLock);
+	hint = context->Hint;
+	LeaveCriticalSection (&context->HintLock);
+
+	entry->Result = ChangeVolumePassword (entry->VolumePath, &entry->OldPassword, &entry->NewPassword, entry->Pkcs5, &hint);
+	entry->LastError = entry->Result == 0 ? ERROR_SUCCESS : GetLastError ();
+
+	burn (&entry->OldPassword, sizeof (entry->OldPassword));
+	burn (&entry->NewPassword, sizeof (entry->NewPassword));
+
+	if (entry->Result == 0)
+	{
+		EnterCriticalSection (&context->HintLock);
+		context->Hint = hint;
+		LeaveCriticalSection (&context->HintLock);
+	}
+
+	return entry->Result == 0;
+}
+
+static void PasswordBatchEntryDone (int entryIndex, BOOL succeeded, int completedCount, void *batchContext)
+{
+	PasswordBatchContext *context = (PasswordBatchContext *) batchContext;
+
+	if (context->Progress)
+		context->Progress (entryIndex, completedCount, context->EntryCount, context->ProgressContext);
+}
+
+// Changes passwords of the volumes described by entries using up to maxConcurrency threads (0 = one per
+// encryption thread). Per-volume results are returned in the entries. Returns the number of volumes whose
+// password has been changed.
+int ChangeVolumePasswordBatch (PTCAPI_PASSWORD_CHANGE_ENTRY entries, int count, int maxConcurrency, 
+	PTCAPI_PASSWORD_CHANGE_PROGRESS progress, void *progressContext)
+{
+	PasswordBatchContext context;
+	int changedCount;
+	int i;
+
+	if (entries == NULL || count <= 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		entries[i].Result = ERR_OS_ERROR;
+		entries[i].LastError = ERROR_SUCCESS;
+	}
+
+	if (Randinit ())
+	{
+		set_error_debug_out(TCAPI_E_ERROR);
+		return 0;
+	}
+
+	memset (&context, 0, sizeof (context));
+	context.Entries = entries;
+	context.EntryCount = count;
+	context.Progress = progress;
+	context.ProgressContext = progressContext;
+	InitializeCriticalSection (&context.HintLock);
+
+	changedCount = RunBatch (count, maxConcurrency, ChangePasswordBatchEntry, PasswordBatchEntryDone, &context);
+
+	DeleteCriticalSection (&context.HintLock);
+	RandStop (FALSE);
+
+	SetLastError (changedCount == count ? ERROR_SUCCESS : TCAPI_E_ERROR);
+	return changedCount;
+}
@@ -0,0 +1,38 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+#ifndef PASSWORD_BATCH_H
+#define PASSWORD_BATCH_H
+
+#include "Tcdefs.h"
+#include "Password.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef struct {
+		char VolumePath[TC_MAX_PATH];	/* In: volume file or device path */
+		Password OldPassword;			/* In: current password; burned once the entry has been processed */
+		Password NewPassword;			/* In: new password; burned once the entry has been processed */
+		int Pkcs5;						/* In: new PKCS-5 PRF, 0 = keep the current one */
+		int Result;						/* Out: 0 = password changed, ERR_* code otherwise */
+		DWORD LastError;				/* Out: TCAPI_E_* or Win32 error code if not changed */
+	} TCAPI_PASSWORD_CHANGE_ENTRY, *PTCAPI_PASSWORD_CHANGE_ENTRY;
+
+	/* Called once an entry has been processed (successfully or not). Calls are serialized but may come 
+	   from any of the batch threads. */
+	typedef void (CALLBACK *PTCAPI_PASSWORD_CHANGE_PROGRESS) (int entryIndex, int completedCount, int totalCount, void *context);
+
+	int ChangeVolumePasswordBatch (PTCAPI_PASSWORD_CHANGE_ENTRY entries, int count, int maxConcurrency, 
+		PTCAPI_PASSWORD_CHANGE_PROGRESS progress, void *progressContext);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,11 +17,47 @@
 #include "Sha1.h"
 #include "Sha2.h"
 #include "Whirlpool.h"
+#include "WhirlpoolFast.h"
 #endif
 #include "Pkcs5.h"
 #include "Crypto.h"
 #include "Errors.h"
 
+/* Number of PBKDF2 output blocks that derive_key_* computes in lock-step
+   from a single set of precomputed HMAC pad states. Large enough for
+   GetMaxPkcs5OutSize() with any PRF. */
+#ifdef TC_WINDOWS_BOOT
+#	define PKCS5_MAX_LANES	1
+#else
+#	define PKCS5_MAX_LANES	10
+#endif
+
+#ifdef TC_WINDOWS_BOOT
+#	define PKCS5_MAX_DIGESTSIZE	RIPEMD160_DIGESTSIZE
+#else
+#	define PKCS5_MAX_DIGESTSIZE	SHA512_DIGESTSIZE
+#endif
+
+/* Number of iterations between checks of the abort flag of derive_key_abortable() */
+#define PKCS5_ABORT_CHECK_INTERVAL	64
+
+#ifdef TC_NO_COMPILER_INT64
+typedef uint32 pkcs5_word;
+#else
+typedef uint64 pkcs5_word;
+#endif
+
+/* HMAC primitives of a PRF, driven by the PBKDF2 code shared by all PRFs
+   (derive_lanes and derive_key_lanes). hctx is the PRF's hmac_*_ctx. */
+typedef struct
+{
+	int digestSize;
+	BOOL wordIterations;	/* iterate works on the digest as big-endian 64-bit words */
+	void (*init) (void *hctx, char *k, int lk);	/* absorbs the padded key */
+	void (*resume) (void *hctx, char *d, int ld, char *out);	/* HMAC of d; out may alias d */
+	void (*iterate) (void *hctx, void *j);	/* one PBKDF2 iteration, j = HMAC (key, j) */
+} pkcs5_prf_ops;
+
 void hmac_truncate
   (
 	  char *d1,		/* data to be truncated */
@@ -111,71 +147,107 @@ void hmac_sha512
 }
 
 
-void derive_u_sha512 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+typedef struct
 {
-	char j[SHA512_DIGESTSIZE], k[SHA512_DIGESTSIZE];
-	char init[128];
-	char counter[4];
-	int c, i;
-
-	/* iteration 1 */
-	memset (counter, 0, 4);
-	counter[3] = (char) b;
-	memcpy (init, salt, salt_len);	/* salt */
-	memcpy (&init[salt_len], counter, 4);	/* big-endian block number */
-	hmac_sha512 (pwd, pwd_len, init, salt_len + 4, j, SHA512_DIGESTSIZE);
-	memcpy (u, j, SHA512_DIGESTSIZE);
+	sha512_ctx inner;	/* state after absorbing key ^ ipad */
+	sha512_ctx outer;	/* state after absorbing key ^ opad */
+	sha512_ctx work;	/* scratch of resume and iterate */
+} hmac_sha512_ctx;
+
+/* Absorbs the padded key once per derivation, so that every PBKDF2 iteration
+   costs two compression function calls instead of four. */
+static void hmac_sha512_init (void *ctx, char *k, int lk)
+{
+	hmac_sha512_ctx *hctx = (hmac_sha512_ctx *) ctx;
+	char key[SHA512_DIGESTSIZE];
+	char buf[SHA512_BLOCKSIZE];
+	int i;
 
-	/* remaining iterations */
-	for (c = 1; c < iterations; c++)
+	if (lk > SHA512_BLOCKSIZE)
 	{
-		hmac_sha512 (pwd, pwd_len, j, SHA512_DIGESTSIZE, k, SHA512_DIGESTSIZE);
-		for (i = 0; i < SHA512_DIGESTSIZE; i++)
-		{
-			u[i] ^= k[i];
-			j[i] = k[i];
-		}
+		sha512_ctx tctx;
+
+		sha512_begin (&tctx);
+		sha512_hash ((unsigned char *) k, lk, &tctx);
+		sha512_end ((unsigned char *) key, &tctx);
+
+		k = key;
+		lk = SHA512_DIGESTSIZE;
+
+		burn (&tctx, sizeof(tctx));		// Prevent leaks
 	}
 
-	/* Prevent possible leaks. */
-	burn (j, sizeof(j));
-	burn (k, sizeof(k));
-}
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x36);
+	for (i = lk; i < SHA512_BLOCKSIZE; ++i)
+		buf[i] = 0x36;
 
+	sha512_begin (&hctx->inner);
+	sha512_hash ((unsigned char *) buf, SHA512_BLOCKSIZE, &hctx->inner);
 
-void derive_key_sha512 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x5C);
+	for (i = lk; i < SHA512_BLOCKSIZE; ++i)
+		buf[i] = 0x5C;
+
+	sha512_begin (&hctx->outer);
+	sha512_hash ((unsigned char *) buf, SHA512_BLOCKSIZE, &hctx->outer);
+
+	/* Prevent leaks */
+	burn (buf, sizeof(buf));
+	burn (key, sizeof(key));
+}
+
+/* HMAC of d resumed from the precomputed pad states. out may alias d. */
+static void hmac_sha512_resume (void *ctx, char *d, int ld, char *out)
 {
-	char u[SHA512_DIGESTSIZE];
-	int b, l, r;
+	hmac_sha512_ctx *hctx = (hmac_sha512_ctx *) ctx;
 
-	if (dklen % SHA512_DIGESTSIZE)
-	{
-		l = 1 + dklen / SHA512_DIGESTSIZE;
-	}
-	else
-	{
-		l = dklen / SHA512_DIGESTSIZE;
-	}
+	memcpy (&hctx->work, &hctx->inner, sizeof (hctx->work));
+	sha512_hash ((unsigned char *) d, ld, &hctx->work);
+	sha512_end ((unsigned char *) out, &hctx->work);
 
-	r = dklen - (l - 1) * SHA512_DIGESTSIZE;
+	memcpy (&hctx->work, &hctx->outer, sizeof (hctx->work));
+	sha512_hash ((unsigned char *) out, SHA512_DIGESTSIZE, &hctx->work);
+	sha512_end ((unsigned char *) out, &hctx->work);
+}
 
-	/* first l - 1 blocks */
-	for (b = 1; b < l; b++)
-	{
-		derive_u_sha512 (pwd, pwd_len, salt, salt_len, iterations, u, b);
-		memcpy (dk, u, SHA512_DIGESTSIZE);
-		dk += SHA512_DIGESTSIZE;
-	}
+/* Sets the padding of a block holding a 64-byte message that follows one
+   absorbed block (the HMAC pad). The message words are set by the caller. */
+static void sha512_pad_digest_block (uint_64t *wbuf)
+{
+	wbuf[8] = li_64(8000000000000000);
+	wbuf[9] = wbuf[10] = wbuf[11] = wbuf[12] = wbuf[13] = wbuf[14] = 0;
+	wbuf[15] = (SHA512_BLOCKSIZE + SHA512_DIGESTSIZE) * 8;	/* message length in bits */
+}
 
-	/* last block */
-	derive_u_sha512 (pwd, pwd_len, salt, salt_len, iterations, u, b);
-	memcpy (dk, u, r);
+/* One PBKDF2 iteration, j = HMAC (key, j), on 64-bit words. Iterations hash
+   64-byte messages only, so the single message block of each HMAC pass has a
+   fixed layout and is assembled from the state words and compiled directly.
+   This skips the buffering, byte swapping and digest serialization that
+   sha512_hash and sha512_end would perform twice per iteration. */
+static void hmac_sha512_iterate (void *hmacCtx, void *j)
+{
+	hmac_sha512_ctx *hctx = (hmac_sha512_ctx *) hmacCtx;
+	sha512_ctx *ctx = &hctx->work;
 
+	memcpy (ctx->hash, hctx->inner.hash, sizeof (ctx->hash));
+	memcpy (ctx->wbuf, j, SHA512_DIGESTSIZE);
+	sha512_pad_digest_block (ctx->wbuf);
+	sha512_compile (ctx);
 
-	/* Prevent possible leaks. */
-	burn (u, sizeof(u));
+	memcpy (ctx->wbuf, ctx->hash, SHA512_DIGESTSIZE);
+	sha512_pad_digest_block (ctx->wbuf);
+	memcpy (ctx->hash, hctx->outer.hash, sizeof (ctx->hash));
+	sha512_compile (ctx);
+
+	memcpy (j, ctx->hash, SHA512_DIGESTSIZE);
 }
 
+static const pkcs5_prf_ops pkcs5_sha512 =
+{
+	SHA512_DIGESTSIZE, TRUE, hmac_sha512_init, hmac_sha512_resume, hmac_sha512_iterate
+};
 
 /* Deprecated/legacy */
 void hmac_sha1
@@ -253,73 +325,83 @@ void hmac_sha1
 }
 
 
-/* Deprecated/legacy */
-void derive_u_sha1 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+typedef struct
 {
-	char j[SHA1_DIGESTSIZE], k[SHA1_DIGESTSIZE];
-	char init[128];
-	char counter[4];
-	int c, i;
-
-	/* iteration 1 */
-	memset (counter, 0, 4);
-	counter[3] = (char) b;
-	memcpy (init, salt, salt_len);	/* salt */
-	memcpy (&init[salt_len], counter, 4);	/* big-endian block number */
-	hmac_sha1 (pwd, pwd_len, init, salt_len + 4, j, SHA1_DIGESTSIZE);
-	memcpy (u, j, SHA1_DIGESTSIZE);
+	sha1_ctx inner;	/* state after absorbing key ^ ipad */
+	sha1_ctx outer;	/* state after absorbing key ^ opad */
+	sha1_ctx work;	/* scratch of resume */
+} hmac_sha1_ctx;
+
+/* Absorbs the padded key once per derivation, so that every PBKDF2 iteration
+   costs two compression function calls instead of four. */
+static void hmac_sha1_init (void *ctx, char *k, int lk)
+{
+	hmac_sha1_ctx *hctx = (hmac_sha1_ctx *) ctx;
+	char key[SHA1_DIGESTSIZE];
+	char buf[SHA1_BLOCKSIZE];
+	int i;
 
-	/* remaining iterations */
-	for (c = 1; c < iterations; c++)
+	if (lk > SHA1_BLOCKSIZE)
 	{
-		hmac_sha1 (pwd, pwd_len, j, SHA1_DIGESTSIZE, k, SHA1_DIGESTSIZE);
-		for (i = 0; i < SHA1_DIGESTSIZE; i++)
-		{
-			u[i] ^= k[i];
-			j[i] = k[i];
-		}
+		sha1_ctx tctx;
+
+		sha1_begin (&tctx);
+		sha1_hash ((unsigned char *) k, lk, &tctx);
+		sha1_end ((unsigned char *) key, &tctx);
+
+		k = key;
+		lk = SHA1_DIGESTSIZE;
+
+		burn (&tctx, sizeof(tctx));		// Prevent leaks
 	}
 
-	/* Prevent possible leaks. */
-	burn (j, sizeof(j));
-	burn (k, sizeof(k));
-}
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x36);
+	for (i = lk; i < SHA1_BLOCKSIZE; ++i)
+		buf[i] = 0x36;
 
+	sha1_begin (&hctx->inner);
+	sha1_hash ((unsigned char *) buf, SHA1_BLOCKSIZE, &hctx->inner);
 
-/* Deprecated/legacy */
-void derive_key_sha1 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
-{
-	char u[SHA1_DIGESTSIZE];
-	int b, l, r;
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x5C);
+	for (i = lk; i < SHA1_BLOCKSIZE; ++i)
+		buf[i] = 0x5C;
 
-	if (dklen % SHA1_DIGESTSIZE)
-	{
-		l = 1 + dklen / SHA1_DIGESTSIZE;
-	}
-	else
-	{
-		l = dklen / SHA1_DIGESTSIZE;
-	}
+	sha1_begin (&hctx->outer);
+	sha1_hash ((unsigned char *) buf, SHA1_BLOCKSIZE, &hctx->outer);
 
-	r = dklen - (l - 1) * SHA1_DIGESTSIZE;
+	/* Prevent leaks */
+	burn (buf, sizeof(buf));
+	burn (key, sizeof(key));
+}
 
-	/* first l - 1 blocks */
-	for (b = 1; b < l; b++)
-	{
-		derive_u_sha1 (pwd, pwd_len, salt, salt_len, iterations, u, b);
-		memcpy (dk, u, SHA1_DIGESTSIZE);
-		dk += SHA1_DIGESTSIZE;
-	}
+/* HMAC of d resumed from the precomputed pad states. out may alias d. */
+static void hmac_sha1_resume (void *hmacCtx, char *d, int ld, char *out)
+{
+	hmac_sha1_ctx *hctx = (hmac_sha1_ctx *) hmacCtx;
+	sha1_ctx *ctx = &hctx->work;
 
-	/* last block */
-	derive_u_sha1 (pwd, pwd_len, salt, salt_len, iterations, u, b);
-	memcpy (dk, u, r);
+	memcpy (ctx, &hctx->inner, sizeof (*ctx));
+	sha1_hash ((unsigned char *) d, ld, ctx);
+	sha1_end ((unsigned char *) out, ctx);
 
+	memcpy (ctx, &hctx->outer, sizeof (*ctx));
+	sha1_hash ((unsigned char *) out, SHA1_DIGESTSIZE, ctx);
+	sha1_end ((unsigned char *) out, ctx);
+}
 
-	/* Prevent possible leaks. */
-	burn (u, sizeof(u));
+/* One PBKDF2 iteration, j = HMAC (key, j) */
+static void hmac_sha1_iterate (void *hctx, void *j)
+{
+	hmac_sha1_resume (hctx, (char *) j, SHA1_DIGESTSIZE, (char *) j);
 }
 
+static const pkcs5_prf_ops pkcs5_sha1 =
+{
+	SHA1_DIGESTSIZE, FALSE, hmac_sha1_init, hmac_sha1_resume, hmac_sha1_iterate
+};
+
 #endif // TC_WINDOWS_BOOT
 
 void hmac_ripemd160 (char *key, int keylen, char *input, int len, char *digest)
@@ -388,70 +470,83 @@ void hmac_ripemd160 (char *key, int keylen, char *input, int len, char *digest)
 	burn (&context, sizeof(context));
 }
 
-void derive_u_ripemd160 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+typedef struct
 {
-	char j[RIPEMD160_DIGESTSIZE], k[RIPEMD160_DIGESTSIZE];
-	char init[128];
-	char counter[4];
-	int c, i;
-
-	/* iteration 1 */
-	memset (counter, 0, 4);
-	counter[3] = (char) b;
-	memcpy (init, salt, salt_len);	/* salt */
-	memcpy (&init[salt_len], counter, 4);	/* big-endian block number */
-	hmac_ripemd160 (pwd, pwd_len, init, salt_len + 4, j);
-	memcpy (u, j, RIPEMD160_DIGESTSIZE);
+	RMD160_CTX inner;	/* state after absorbing key ^ ipad */
+	RMD160_CTX outer;	/* state after absorbing key ^ opad */
+	RMD160_CTX work;	/* scratch of resume */
+} hmac_ripemd160_ctx;
+
+/* Absorbs the padded key once per derivation, so that every PBKDF2 iteration
+   costs two compression function calls instead of four. */
+static void hmac_ripemd160_init (void *ctx, char *k, int lk)
+{
+	hmac_ripemd160_ctx *hctx = (hmac_ripemd160_ctx *) ctx;
+	char key[RIPEMD160_DIGESTSIZE];
+	char buf[RIPEMD160_BLOCKSIZE];
+	int i;
 
-	/* remaining iterations */
-	for (c = 1; c < iterations; c++)
+	if (lk > RIPEMD160_BLOCKSIZE)
 	{
-		hmac_ripemd160 (pwd, pwd_len, j, RIPEMD160_DIGESTSIZE, k);
-		for (i = 0; i < RIPEMD160_DIGESTSIZE; i++)
-		{
-			u[i] ^= k[i];
-			j[i] = k[i];
-		}
-	}
+		RMD160_CTX tctx;
 
-	/* Prevent possible leaks. */
-	burn (j, sizeof(j));
-	burn (k, sizeof(k));
-}
+		RMD160Init (&tctx);
+		RMD160Update (&tctx, (const unsigned char *) k, lk);
+		RMD160Final ((unsigned char *) key, &tctx);
 
-void derive_key_ripemd160 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
-{
-	char u[RIPEMD160_DIGESTSIZE];
-	int b, l, r;
+		k = key;
+		lk = RIPEMD160_DIGESTSIZE;
 
-	if (dklen % RIPEMD160_DIGESTSIZE)
-	{
-		l = 1 + dklen / RIPEMD160_DIGESTSIZE;
-	}
-	else
-	{
-		l = dklen / RIPEMD160_DIGESTSIZE;
+		burn (&tctx, sizeof(tctx));		// Prevent leaks
 	}
 
-	r = dklen - (l - 1) * RIPEMD160_DIGESTSIZE;
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x36);
+	for (i = lk; i < RIPEMD160_BLOCKSIZE; ++i)
+		buf[i] = 0x36;
 
-	/* first l - 1 blocks */
-	for (b = 1; b < l; b++)
-	{
-		derive_u_ripemd160 (pwd, pwd_len, salt, salt_len, iterations, u, b);
-		memcpy (dk, u, RIPEMD160_DIGESTSIZE);
-		dk += RIPEMD160_DIGESTSIZE;
-	}
+	RMD160Init (&hctx->inner);
+	RMD160Update (&hctx->inner, (const unsigned char *) buf, RIPEMD160_BLOCKSIZE);
 
-	/* last block */
-	derive_u_ripemd160 (pwd, pwd_len, salt, salt_len, iterations, u, b);
-	memcpy (dk, u, r);
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x5C);
+	for (i = lk; i < RIPEMD160_BLOCKSIZE; ++i)
+		buf[i] = 0x5C;
 
+	RMD160Init (&hctx->outer);
+	RMD160Update (&hctx->outer, (const unsigned char *) buf, RIPEMD160_BLOCKSIZE);
 
-	/* Prevent possible leaks. */
-	burn (u, sizeof(u));
+	/* Prevent leaks */
+	burn (buf, sizeof(buf));
+	burn (key, sizeof(key));
+}
+
+/* HMAC of d resumed from the precomputed pad states. out may alias d. */
+static void hmac_ripemd160_resume (void *hmacCtx, char *d, int ld, char *out)
+{
+	hmac_ripemd160_ctx *hctx = (hmac_ripemd160_ctx *) hmacCtx;
+	RMD160_CTX *ctx = &hctx->work;
+
+	memcpy (ctx, &hctx->inner, sizeof (*ctx));
+	RMD160Update (ctx, (const unsigned char *) d, ld);
+	RMD160Final ((unsigned char *) out, ctx);
+
+	memcpy (ctx, &hctx->outer, sizeof (*ctx));
+	RMD160Update (ctx, (const unsigned char *) out, RIPEMD160_DIGESTSIZE);
+	RMD160Final ((unsigned char *) out, ctx);
+}
+
+/* One PBKDF2 iteration, j = HMAC (key, j) */
+static void hmac_ripemd160_iterate (void *hctx, void *j)
+{
+	hmac_ripemd160_resume (hctx, (char *) j, RIPEMD160_DIGESTSIZE, (char *) j);
 }
 
+static const pkcs5_prf_ops pkcs5_ripemd160 =
+{
+	RIPEMD160_DIGESTSIZE, FALSE, hmac_ripemd160_init, hmac_ripemd160_resume, hmac_ripemd160_iterate
+};
+
 #ifndef TC_WINDOWS_BOOT
 
 void hmac_whirlpool
@@ -528,68 +623,295 @@ void hmac_whirlpool
 	burn (key, sizeof(key));
 }
 
-void derive_u_whirlpool (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+typedef struct
+{
+	WHIRLPOOL_CTX inner;	/* state after absorbing key ^ ipad */
+	WHIRLPOOL_CTX outer;	/* state after absorbing key ^ opad */
+	BOOL fast;	/* iterations use WhirlpoolFast and the round keys below */
+	u64 innerKeys[WHIRLPOOL_FAST_ROUNDS + 1][8];	/* round keys of inner.hash */
+	u64 outerKeys[WHIRLPOOL_FAST_ROUNDS + 1][8];	/* round keys of outer.hash */
+	WHIRLPOOL_CTX work;	/* scratch of resume */
+} hmac_whirlpool_ctx;
+
+/* Absorbs the padded key once per derivation, so that every PBKDF2 iteration
+   costs two compression function calls instead of four. */
+static void hmac_whirlpool_init (void *ctx, char *k, int lk)
+{
+	hmac_whirlpool_ctx *hctx = (hmac_whirlpool_ctx *) ctx;
+	char key[WHIRLPOOL_DIGESTSIZE];
+	char buf[WHIRLPOOL_BLOCKSIZE];
+	int i;
+
+	if (lk > WHIRLPOOL_BLOCKSIZE)
+	{
+		WHIRLPOOL_CTX tctx;
+
+		WHIRLPOOL_init (&tctx);
+		WHIRLPOOL_add ((unsigned char *) k, lk * 8, &tctx);
+		WHIRLPOOL_finalize (&tctx, (unsigned char *) key);
+
+		k = key;
+		lk = WHIRLPOOL_DIGESTSIZE;
+
+		burn (&tctx, sizeof(tctx));		// Prevent leaks
+	}
+
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x36);
+	for (i = lk; i < WHIRLPOOL_BLOCKSIZE; ++i)
+		buf[i] = 0x36;
+
+	WHIRLPOOL_init (&hctx->inner);
+	WHIRLPOOL_add ((unsigned char *) buf, WHIRLPOOL_BLOCKSIZE * 8, &hctx->inner);
+
+	for (i = 0; i < lk; ++i)
+		buf[i] = (char) (k[i] ^ 0x5C);
+	for (i = lk; i < WHIRLPOOL_BLOCKSIZE; ++i)
+		buf[i] = 0x5C;
+
+	WHIRLPOOL_init (&hctx->outer);
+	WHIRLPOOL_add ((unsigned char *) buf, WHIRLPOOL_BLOCKSIZE * 8, &hctx->outer);
+
+	hctx->fast = WhirlpoolFastAvailable ();
+	if (hctx->fast)
+	{
+		WhirlpoolFastExpandKey (hctx->inner.hash, hctx->innerKeys);
+		WhirlpoolFastExpandKey (hctx->outer.hash, hctx->outerKeys);
+	}
+
+	/* Prevent leaks */
+	burn (buf, sizeof(buf));
+	burn (key, sizeof(key));
+}
+
+/* HMAC of d resumed from the precomputed pad states. out may alias d. */
+static void hmac_whirlpool_resume (void *hmacCtx, char *d, int ld, char *out)
+{
+	hmac_whirlpool_ctx *hctx = (hmac_whirlpool_ctx *) hmacCtx;
+	WHIRLPOOL_CTX *ctx = &hctx->work;
+
+	memcpy (ctx, &hctx->inner, sizeof (*ctx));
+	WHIRLPOOL_add ((unsigned char *) d, ld * 8, ctx);
+	WHIRLPOOL_finalize (ctx, (unsigned char *) out);
+
+	memcpy (ctx, &hctx->outer, sizeof (*ctx));
+	WHIRLPOOL_add ((unsigned char *) out, WHIRLPOOL_DIGESTSIZE * 8, ctx);
+	WHIRLPOOL_finalize (ctx, (unsigned char *) out);
+}
+
+/* One PBKDF2 iteration, j = HMAC (key, j), on 64-bit words. Each HMAC pass
+   compresses the 64-byte message from the pad state, whose round keys were
+   expanded by hmac_whirlpool_init, followed by a constant padding block. */
+static void hmac_whirlpool_iterate (void *hmacCtx, void *jw)
+{
+	static const u64 padBlock[8] =	/* 0x80, zeros, message length of 1024 bits */
+	{
+		LL(0x8000000000000000), 0, 0, 0, 0, 0, 0, (WHIRLPOOL_BLOCKSIZE + WHIRLPOOL_DIGESTSIZE) * 8
+	};
+	hmac_whirlpool_ctx *hctx = (hmac_whirlpool_ctx *) hmacCtx;
+	u64 *j = (u64 *) jw;
+	u64 hash[8];
+	int i;
+
+	if (!hctx->fast)
+	{
+		/* WhirlpoolFast is not initialized or failed its self-test */
+		for (i = 0; i < WHIRLPOOL_DIGESTSIZE / 8; i++)
+			j[i] = BE64 (j[i]);
+
+		hmac_whirlpool_resume (hctx, (char *) j, WHIRLPOOL_DIGESTSIZE, (char *) j);
+
+		for (i = 0; i < WHIRLPOOL_DIGESTSIZE / 8; i++)
+			j[i] = BE64 (j[i]);
+		return;
+	}
+
+	memcpy (hash, hctx->inner.hash, sizeof (hash));
+	WhirlpoolFastCompressWithKey (hash, hctx->innerKeys, j);
+	WhirlpoolFastCompress (hash, padBlock);
+
+	memcpy (j, hash, WHIRLPOOL_DIGESTSIZE);
+	memcpy (hash, hctx->outer.hash, sizeof (hash));
+	WhirlpoolFastCompressWithKey (hash, hctx->outerKeys, j);
+	WhirlpoolFastCompress (hash, padBlock);
+
+	memcpy (j, hash, WHIRLPOOL_DIGESTSIZE);
+	burn (hash, sizeof(hash));
+}
+
+static const pkcs5_prf_ops pkcs5_whirlpool =
 {
-	char j[WHIRLPOOL_DIGESTSIZE], k[WHIRLPOOL_DIGESTSIZE];
+	WHIRLPOOL_DIGESTSIZE, TRUE, hmac_whirlpool_init, hmac_whirlpool_resume, hmac_whirlpool_iterate
+};
+
+#endif // TC_WINDOWS_BOOT
+
+
+typedef union
+{
+	hmac_ripemd160_ctx ripemd160;
+#ifndef TC_WINDOWS_BOOT
+	hmac_sha512_ctx sha512;
+	hmac_sha1_ctx sha1;
+	hmac_whirlpool_ctx whirlpool;
+#endif
+} hmac_prf_ctx;
+
+/* Computes the PBKDF2 blocks b .. b + lanes - 1 into u. The blocks are
+   independent iteration chains and are advanced in lock-step. Returns FALSE
+   if *abortFlag (optional) was set before all iterations were completed. */
+static BOOL derive_lanes (const pkcs5_prf_ops *prf, void *hctx, char *salt, int salt_len, int iterations, char *u, int b, int lanes, volatile LONG *abortFlag)
+{
+	pkcs5_word j[PKCS5_MAX_LANES][PKCS5_MAX_DIGESTSIZE / sizeof (pkcs5_word) + 1];
+	pkcs5_word uw[PKCS5_MAX_LANES][PKCS5_MAX_DIGESTSIZE / sizeof (pkcs5_word) + 1];
+	int words = (prf->digestSize + sizeof (pkcs5_word) - 1) / sizeof (pkcs5_word);
 	char init[128];
-	char counter[4];
-	int c, i;
+	BOOL aborted = FALSE;
+	int c, i, n;
+
+	memset (j, 0, sizeof (j));
 
 	/* iteration 1 */
-	memset (counter, 0, 4);
-	counter[3] = (char) b;
 	memcpy (init, salt, salt_len);	/* salt */
-	memcpy (&init[salt_len], counter, 4);	/* big-endian block number */
-	hmac_whirlpool (pwd, pwd_len, init, salt_len + 4, j, WHIRLPOOL_DIGESTSIZE);
-	memcpy (u, j, WHIRLPOOL_DIGESTSIZE);
+	memset (&init[salt_len], 0, 4);
+	for (n = 0; n < lanes; n++)
+	{
+		init[salt_len + 3] = (char) (b + n);	/* big-endian block number */
+		prf->resume (hctx, init, salt_len + 4, (char *) j[n]);
+
+#ifndef TC_WINDOWS_BOOT
+		/* The remaining iterations work on the digest as big-endian words */
+		if (prf->wordIterations)
+		{
+			for (i = 0; i < words; i++)
+				j[n][i] = BE64 (j[n][i]);
+		}
+#endif
+		memcpy (uw[n], j[n], sizeof (uw[n]));
+	}
 
 	/* remaining iterations */
 	for (c = 1; c < iterations; c++)
 	{
-		hmac_whirlpool (pwd, pwd_len, j, WHIRLPOOL_DIGESTSIZE, k, WHIRLPOOL_DIGESTSIZE);
-		for (i = 0; i < WHIRLPOOL_DIGESTSIZE; i++)
+		if (abortFlag && c % PKCS5_ABORT_CHECK_INTERVAL == 0 && *abortFlag)
+		{
+			aborted = TRUE;
+			break;
+		}
+
+		for (n = 0; n < lanes; n++)
+		{
+			prf->iterate (hctx, j[n]);
+			for (i = 0; i < words; i++)
+				uw[n][i] ^= j[n][i];
+		}
+	}
+
+	for (n = 0; n < lanes; n++)
+	{
+#ifndef TC_WINDOWS_BOOT
+		if (prf->wordIterations)
 		{
-			u[i] ^= k[i];
-			j[i] = k[i];
+			for (i = 0; i < words; i++)
+				uw[n][i] = BE64 (uw[n][i]);
 		}
+#endif
+		memcpy (u + n * prf->digestSize, uw[n], prf->digestSize);
 	}
 
 	/* Prevent possible leaks. */
 	burn (j, sizeof(j));
-	burn (k, sizeof(k));
+	burn (uw, sizeof(uw));
+
+	return !aborted;
 }
 
-void derive_key_whirlpool (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
+static void derive_u (const pkcs5_prf_ops *prf, char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
 {
-	char u[WHIRLPOOL_DIGESTSIZE];
-	int b, l, r;
+	hmac_prf_ctx hctx;
 
-	if (dklen % WHIRLPOOL_DIGESTSIZE)
-	{
-		l = 1 + dklen / WHIRLPOOL_DIGESTSIZE;
-	}
-	else
-	{
-		l = dklen / WHIRLPOOL_DIGESTSIZE;
-	}
+	prf->init (&hctx, pwd, pwd_len);
+	derive_lanes (prf, &hctx, salt, salt_len, iterations, u, b, 1, NULL);
 
-	r = dklen - (l - 1) * WHIRLPOOL_DIGESTSIZE;
+	/* Prevent possible leaks. */
+	burn (&hctx, sizeof(hctx));
+}
 
-	/* first l - 1 blocks */
-	for (b = 1; b < l; b++)
-	{
-		derive_u_whirlpool (pwd, pwd_len, salt, salt_len, iterations, u, b);
-		memcpy (dk, u, WHIRLPOOL_DIGESTSIZE);
-		dk += WHIRLPOOL_DIGESTSIZE;
-	}
+static BOOL derive_key_lanes (const pkcs5_prf_ops *prf, char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen, volatile LONG *abortFlag)
+{
+	hmac_prf_ctx hctx;
+	char u[PKCS5_MAX_LANES * PKCS5_MAX_DIGESTSIZE];
+	BOOL completed = TRUE;
+	int b, l, lanes, len;
 
-	/* last block */
-	derive_u_whirlpool (pwd, pwd_len, salt, salt_len, iterations, u, b);
-	memcpy (dk, u, r);
+	l = (dklen + prf->digestSize - 1) / prf->digestSize;
 
+	prf->init (&hctx, pwd, pwd_len);
+
+	for (b = 1; b <= l; b += lanes)
+	{
+		lanes = l - b + 1 > PKCS5_MAX_LANES ? PKCS5_MAX_LANES : l - b + 1;
+		if (!derive_lanes (prf, &hctx, salt, salt_len, iterations, u, b, lanes, abortFlag))
+		{
+			completed = FALSE;
+			break;
+		}
+
+		len = dklen > lanes * prf->digestSize ? lanes * prf->digestSize : dklen;
+		memcpy (dk, u, len);
+		dk += len;
+		dklen -= len;
+	}
 
 	/* Prevent possible leaks. */
 	burn (u, sizeof(u));
+	burn (&hctx, sizeof(hctx));
+
+	return completed;
+}
+
+void derive_u_ripemd160 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+{
+	derive_u (&pkcs5_ripemd160, pwd, pwd_len, salt, salt_len, iterations, u, b);
+}
+
+void derive_key_ripemd160 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
+{
+	derive_key_lanes (&pkcs5_ripemd160, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, NULL);
+}
+
+#ifndef TC_WINDOWS_BOOT
+
+void derive_u_sha512 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+{
+	derive_u (&pkcs5_sha512, pwd, pwd_len, salt, salt_len, iterations, u, b);
+}
+
+void derive_key_sha512 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
+{
+	derive_key_lanes (&pkcs5_sha512, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, NULL);
+}
+
+/* Deprecated/legacy */
+void derive_u_sha1 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+{
+	derive_u (&pkcs5_sha1, pwd, pwd_len, salt, salt_len, iterations, u, b);
+}
+
+/* Deprecated/legacy */
+void derive_key_sha1 (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
+{
+	derive_key_lanes (&pkcs5_sha1, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, NULL);
+}
+
+void derive_u_whirlpool (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *u, int b)
+{
+	derive_u (&pkcs5_whirlpool, pwd, pwd_len, salt, salt_len, iterations, u, b);
+}
+
+void derive_key_whirlpool (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen)
+{
+	derive_key_lanes (&pkcs5_whirlpool, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, NULL);
 }
 
 
@@ -614,6 +936,56 @@ char *get_pkcs5_prf_name (int pkcs5_prf_id)
 	}
 }
 
+
+BOOL derive_key_abortable (int pkcs5_prf, char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen, volatile LONG *abortFlag)
+{
+	switch (pkcs5_prf)
+	{
+	case RIPEMD160:
+		return derive_key_lanes (&pkcs5_ripemd160, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, abortFlag);
+
+	case SHA512:
+		return derive_key_lanes (&pkcs5_sha512, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, abortFlag);
+
+	case SHA1:	// Deprecated/legacy
+		return derive_key_lanes (&pkcs5_sha1, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, abortFlag);
+
+	case WHIRLPOOL:
+		return derive_key_lanes (&pkcs5_whirlpool, pwd, pwd_len, salt, salt_len, iterations, dk, dklen, abortFlag);
+
+	default:
+		TC_THROW_FATAL_EXCEPTION;	// Unknown/wrong ID
+	}
+	return FALSE;
+}
+
+/* Measures how many PBKDF2 iterations (HMAC computations of one block chain) per second
+   the given PRF performs. Returns 0 if the PRF is not supported. */
+unsigned __int64 Pkcs5Benchmark (int pkcs5_prf, DWORD duration)
+{
+	char pwd[] = "password", salt[PKCS5_SALT_SIZE], dk[1];
+	unsigned __int64 iterationCount = 0;
+	int iterations = 1000;
+	DWORD startTime, elapsed;
+
+	if (pkcs5_prf < FIRST_PRF_ID || pkcs5_prf > LAST_PRF_ID)
+		return 0;
+
+	memset (salt, 0, sizeof (salt));
+	startTime = GetTickCount();
+
+	do
+	{
+		derive_key_abortable (pkcs5_prf, pwd, sizeof (pwd) - 1, salt, sizeof (salt), iterations, dk, sizeof (dk), NULL);
+		iterationCount += iterations;
+		elapsed = GetTickCount() - startTime;
+	} while (elapsed < duration);
+
+	burn (dk, sizeof (dk));
+
+	return elapsed ? iterationCount * 1000 / elapsed : iterationCount * 1000;
+}
+
 #endif //!TC_WINDOWS_BOOT
 
 
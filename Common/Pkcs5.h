@@ -33,6 +33,11 @@ void derive_u_whirlpool (char *pwd, int pwd_len, char *salt, int salt_len, int i
 void derive_key_whirlpool (char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen);
 int get_pkcs5_iteration_count (int pkcs5_prf_id, BOOL bBoot);
 char *get_pkcs5_prf_name (int pkcs5_prf_id);
+#ifndef TC_WINDOWS_BOOT
+// Returns FALSE if the derivation was abandoned because *abortFlag became nonzero
+BOOL derive_key_abortable (int pkcs5_prf, char *pwd, int pwd_len, char *salt, int salt_len, int iterations, char *dk, int dklen, volatile LONG *abortFlag);
+unsigned __int64 Pkcs5Benchmark (int pkcs5_prf, DWORD duration);
+#endif
 
 #if defined(__cplusplus)
 }
@@ -12,6 +12,7 @@
 #include "Tcdefs.h"
 #include "Crc.h"
 #include "Random.h"
+#include "EntropyRing.h"
 #include "Errors.h"
 
 static unsigned __int8 buffer[RNG_POOL_SIZE];
@@ -24,6 +25,15 @@ BOOL volatile bFastPollEnabled = TRUE;	/* Used to reduce CPU load when performin
 BOOL volatile bRandmixEnabled = TRUE;	/* Used to reduce CPU load when performing benchmarks */
 static BOOL RandomPoolEnrichedByUser = FALSE;
 static HANDLE PeriodicFastPollThreadHandle = NULL;
+static BOOL bUseSystemEntropy = FALSE;		/* Seed the pool from the system generator only (see SystemPoll) */
+static BOOL bSystemEntropyActive = FALSE;	/* Mode the running generator was started in */
+static unsigned __int64 RandInitDuration = 0;	/* Duration of the last successful Randinit (in microseconds) */
+static LONG volatile RandGeneration = 0;	/* Incremented whenever the generator is started (see RandGetGeneration) */
+static EntropyRing HookEntropyRing;	/* Hook samples waiting to be added to the pool (see RandAddEntropy) */
+static CRITICAL_SECTION critRandUsers;		/* Serializes Randinit and RandStop */
+static int RandUserCount = 0;			/* Number of Randinit calls not yet matched by RandStop */
+static BOOL bFreePoolOnStop = FALSE;		/* A caller requested RandStop (TRUE) while other users were active */
+static BOOL bRandProcessDetaching = FALSE;	/* RandShutdown is called from DllMain (see RandProcessDetach) */
 
 /* Macro to add a single byte to the pool */
 #define RandaddByte(x) {\
@@ -62,16 +72,104 @@ BOOL CryptoAPIAvailable = FALSE;
 HCRYPTPROV hCryptProv;
 
 
-/* Init the random number generator, setup the hooks, and start the thread */
+/* Returns the time elapsed since startCount (in microseconds) */
+static unsigned __int64 GetElapsedMicroseconds (LARGE_INTEGER *startCount)
+{
+	LARGE_INTEGER frequency, count;
+
+	if (!QueryPerformanceFrequency (&frequency) || !QueryPerformanceCounter (&count) || frequency.QuadPart == 0)
+		return 0;
+
+	return (unsigned __int64) (count.QuadPart - startCount->QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+static int RandStart (void);
+static void RandShutdown (BOOL freePool);
+
+/* Must be called once per process before any other function of the generator (DllMain) */
+void RandProcessAttach (void)
+{
+	InitializeCriticalSection (&critRandUsers);
+}
+
+void RandProcessDetach (void)
+{
+	/* The hooks and the poll thread must not outlive the DLL, even if a Randinit was never matched, and
+	   the pool is wiped even if the last user kept it */
+	bRandProcessDetaching = TRUE;
+	RandUserCount = 0;
+	RandShutdown (TRUE);
+
+	DeleteCriticalSection (&critRandUsers);
+}
+
+/* Init the random number generator, setup the hooks, and start the thread. Calls are counted:
+   the generator keeps running until each successful Randinit has been matched by RandStop, so
+   that concurrent API calls do not shut it down under each other. */
 int Randinit ()
 {
+	int status = 0;
+
+	EnterCriticalSection (&critRandUsers);
+
+	if (!bRandDidInit)
+		status = RandStart ();
+
+	if (status == 0)
+		RandUserCount++;
+
+	LeaveCriticalSection (&critRandUsers);
+	return status;
+}
+
+/* Releases one Randinit. The last user closes everything down; the pool is freed if any of
+   the users asked for it. */
+void RandStop (BOOL freePool)
+{
+	EnterCriticalSection (&critRandUsers);
+
+	bFreePoolOnStop |= freePool;
+
+	if (RandUserCount > 0)
+		RandUserCount--;
+
+	if (RandUserCount == 0)
+	{
+		RandShutdown (bFreePoolOnStop);
+		bFreePoolOnStop = FALSE;
+	}
+
+	LeaveCriticalSection (&critRandUsers);
+}
+
+/* Selects the entropy source of the generator (see SystemPoll). Fails if the generator is running in 
+   the other mode; the mode can only change once all users have stopped it. */
+BOOL RandSetSystemEntropy (BOOL enable)
+{
+	BOOL bResult = TRUE;
+
+	EnterCriticalSection (&critRandUsers);
+
+	if (bRandDidInit && !bSystemEntropyActive != !enable)
+		bResult = FALSE;
+	else
+		bUseSystemEntropy = enable;
+
+	LeaveCriticalSection (&critRandUsers);
+	return bResult;
+}
+
+static int RandStart (void)
+{
+	LARGE_INTEGER startCount;
+
 	if (GetMaxPkcs5OutSize() > RNG_POOL_SIZE)
 		TC_THROW_FATAL_EXCEPTION;
 
-	if(bRandDidInit) 
-		return 0;
+	QueryPerformanceCounter (&startCount);
 
 	InitializeCriticalSection (&critRandProt);
+	EntropyRingInit (&HookEntropyRing);
 
 	bRandDidInit = TRUE;
 
@@ -88,6 +186,28 @@ int Randinit ()
 		VirtualLock (pRandPool, RANDOMPOOL_ALLOCSIZE);
 	}
 
+	bSystemEntropyActive = bUseSystemEntropy;
+	if (bSystemEntropyActive)
+	{
+		/* Headless operation: no hooks, no polling thread and no slow poll. The pool
+		   is seeded here and refreshed from the system generator on every request. */
+		if (!CryptAcquireContext (&hCryptProv, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+		{
+			HandleWin32Error ();
+			goto error;
+		}
+
+		CryptoAPIAvailable = TRUE;
+
+		if (!SystemPoll ())
+			goto error;
+
+		bDidSlowPoll = TRUE;
+		InterlockedIncrement (&RandGeneration);
+		RandInitDuration = GetElapsedMicroseconds (&startCount);
+		return 0;
+	}
+
 	hKeyboard = SetWindowsHookEx (WH_KEYBOARD, (HOOKPROC)&KeyboardProc, NULL, GetCurrentThreadId ());
 	if (hKeyboard == 0) HandleWin32Error ();
 
@@ -107,16 +227,18 @@ int Randinit ()
 	if (!(PeriodicFastPollThreadHandle = (HANDLE) _beginthreadex (NULL, 0, PeriodicFastPollThreadProc, NULL, 0, NULL)))
 		goto error;
 
+	InterlockedIncrement (&RandGeneration);
+	RandInitDuration = GetElapsedMicroseconds (&startCount);
 	return 0;
 
 error:
-	RandStop (TRUE);
+	RandShutdown (TRUE);
 	return 1;
 }
 
 /* Close everything down, including the thread which is closed down by
    setting a flag which eventually causes the thread function to exit */
-void RandStop (BOOL freePool)
+static void RandShutdown (BOOL freePool)
 {
 	if (!bRandDidInit && freePool && pRandPool)
 		goto freePool;
@@ -135,10 +257,22 @@ void RandStop (BOOL freePool)
 
 	LeaveCriticalSection (&critRandProt);
 
+	/* Under the loader lock (DllMain), the thread cannot finish exiting. It is then only waited for until
+	   it has left the poll loop (it clears bThreadTerminate), or has been terminated with the process. */
+	while (bRandProcessDetaching && bThreadTerminate && PeriodicFastPollThreadHandle
+		&& WaitForSingleObject (PeriodicFastPollThreadHandle, 10) == WAIT_TIMEOUT);
+
 	if (PeriodicFastPollThreadHandle)
-		WaitForSingleObject (PeriodicFastPollThreadHandle, INFINITE);
+	{
+		if (!bRandProcessDetaching)
+			WaitForSingleObject (PeriodicFastPollThreadHandle, INFINITE);
 
-	if (hNetAPI32 != 0)
+		CloseHandle (PeriodicFastPollThreadHandle);
+		PeriodicFastPollThreadHandle = NULL;
+	}
+
+	/* FreeLibrary must not be called from DllMain */
+	if (hNetAPI32 != 0 && !bRandProcessDetaching)
 	{
 		FreeLibrary (hNetAPI32);
 		hNetAPI32 = NULL;
@@ -153,8 +287,12 @@ void RandStop (BOOL freePool)
 	hMouse = NULL;
 	hKeyboard = NULL;
 	bThreadTerminate = FALSE;
+	bSystemEntropyActive = FALSE;
 	DeleteCriticalSection (&critRandProt);
 
+	/* The event sources are gone, so samples not drained yet can be discarded */
+	EntropyRingWipe (&HookEntropyRing);
+
 	bRandDidInit = FALSE;
 
 freePool:
@@ -177,6 +315,18 @@ BOOL IsRandomNumberGeneratorStarted ()
 	return bRandDidInit;
 }
 
+unsigned __int64 RandGetInitDuration (void)
+{
+	return RandInitDuration;
+}
+
+/* Generators seeded from the pool (see RandomStream.c) compare this value with the one they were
+   seeded under, and reseed when the generator has been restarted (and the pool possibly replaced) since. */
+LONG RandGetGeneration (void)
+{
+	return RandGeneration;
+}
+
 void RandSetHashFunction (int hash_algo_id)
 {
 	if (HashIsDeprecated (hash_algo_id))
@@ -200,104 +350,194 @@ BOOL IsRandomPoolEnrichedByUser ()
 	return RandomPoolEnrichedByUser;
 }
 
-/* The random pool mixing function */
-BOOL Randmix ()
+/* Computes the message digest of the given data using the selected hash function */
+static void RandHash (int hashFunction, const unsigned char *data, int len, unsigned char *digest)
 {
-	if (bRandmixEnabled)
-	{
-		unsigned char hashOutputBuffer [MAX_DIGESTSIZE];
-		WHIRLPOOL_CTX	wctx;
-		RMD160_CTX		rctx;
-		sha512_ctx		sctx;
-		int poolIndex, digestIndex, digestSize;
+	WHIRLPOOL_CTX	wctx;
+	RMD160_CTX		rctx;
+	sha512_ctx		sctx;
 
-		switch (HashFunction)
-		{
-		case RIPEMD160:
-			digestSize = RIPEMD160_DIGESTSIZE;
-			break;
+	switch (hashFunction)
+	{
+	case RIPEMD160:
+		RMD160Init(&rctx);
+		RMD160Update(&rctx, data, len);
+		RMD160Final(digest, &rctx);
+		burn (&rctx, sizeof(rctx));
+		break;
+
+	case SHA512:
+		sha512_begin (&sctx);
+		sha512_hash (data, len, &sctx);
+		sha512_end (digest, &sctx);
+		burn (&sctx, sizeof(sctx));
+		break;
+
+	case WHIRLPOOL:
+		WHIRLPOOL_init (&wctx);
+		WHIRLPOOL_add (data, len * 8, &wctx);
+		WHIRLPOOL_finalize (&wctx, digest);
+		burn (&wctx, sizeof(wctx));
+		break;
+
+	default:		
+		// Unknown/wrong ID
+		TC_THROW_FATAL_EXCEPTION;
+	}
+}
 
-		case SHA512:
-			digestSize = SHA512_DIGESTSIZE;
-			break;
+/* Mixes the given pool. The message digest of the entire pool is computed once; every digest-sized
+   slot is then XORed with a digest chained from it (the previous digest followed by the slot number).
+   Each slot thus still depends on the whole pool, while the cost is linear in the pool size rather
+   than one full-pool hash per slot. */
+static void RandmixPool (unsigned char *pool, int hashFunction)
+{
+	unsigned char chainBuffer [MAX_DIGESTSIZE + sizeof (unsigned __int32)];
+	int poolIndex, digestIndex, digestSize;
+	unsigned __int32 slot;
 
-		case WHIRLPOOL:
-			digestSize = WHIRLPOOL_DIGESTSIZE;
-			break;
+	switch (hashFunction)
+	{
+	case RIPEMD160:
+		digestSize = RIPEMD160_DIGESTSIZE;
+		break;
 
-		default:
-			TC_THROW_FATAL_EXCEPTION;
-		}
+	case SHA512:
+		digestSize = SHA512_DIGESTSIZE;
+		break;
 
-		if (RNG_POOL_SIZE % digestSize)
-			TC_THROW_FATAL_EXCEPTION;
+	case WHIRLPOOL:
+		digestSize = WHIRLPOOL_DIGESTSIZE;
+		break;
 
-		for (poolIndex = 0; poolIndex < RNG_POOL_SIZE; poolIndex += digestSize)		
-		{
-			/* Compute the message digest of the entire pool using the selected hash function. */
-			switch (HashFunction)
-			{
-			case RIPEMD160:
-				RMD160Init(&rctx);
-				RMD160Update(&rctx, pRandPool, RNG_POOL_SIZE);
-				RMD160Final(hashOutputBuffer, &rctx);
-				break;
-
-			case SHA512:
-				sha512_begin (&sctx);
-				sha512_hash (pRandPool, RNG_POOL_SIZE, &sctx);
-				sha512_end (hashOutputBuffer, &sctx);
-				break;
-
-			case WHIRLPOOL:
-				WHIRLPOOL_init (&wctx);
-				WHIRLPOOL_add (pRandPool, RNG_POOL_SIZE * 8, &wctx);
-				WHIRLPOOL_finalize (&wctx, hashOutputBuffer);
-				break;
-
-			default:		
-				// Unknown/wrong ID
-				TC_THROW_FATAL_EXCEPTION;
-			}
+	default:
+		TC_THROW_FATAL_EXCEPTION;
+	}
 
-			/* XOR the resultant message digest to the pool at the poolIndex position. */
-			for (digestIndex = 0; digestIndex < digestSize; digestIndex++)
-			{
-				pRandPool [poolIndex + digestIndex] ^= hashOutputBuffer [digestIndex];
-			}
-		}
+	if (RNG_POOL_SIZE % digestSize)
+		TC_THROW_FATAL_EXCEPTION;
 
-		/* Prevent leaks */
-		burn (hashOutputBuffer, MAX_DIGESTSIZE);	
-		switch (HashFunction)
-		{
-		case RIPEMD160:
-			burn (&rctx, sizeof(rctx));		
-			break;
+	/* Compute the message digest of the entire pool using the selected hash function. */
+	RandHash (hashFunction, pool, RNG_POOL_SIZE, chainBuffer);
 
-		case SHA512:
-			burn (&sctx, sizeof(sctx));		
-			break;
+	for (poolIndex = 0, slot = 0; poolIndex < RNG_POOL_SIZE; poolIndex += digestSize, slot++)
+	{
+		/* Derive the digest for this slot from the previous one. */
+		chainBuffer [digestSize] = (unsigned char) (slot >> 24);
+		chainBuffer [digestSize + 1] = (unsigned char) (slot >> 16);
+		chainBuffer [digestSize + 2] = (unsigned char) (slot >> 8);
+		chainBuffer [digestSize + 3] = (unsigned char) slot;
 
-		case WHIRLPOOL:
-			burn (&wctx, sizeof(wctx));		
-			break;
+		RandHash (hashFunction, chainBuffer, digestSize + sizeof (unsigned __int32), chainBuffer);
 
-		default:		
-			// Unknown/wrong ID
-			TC_THROW_FATAL_EXCEPTION;
+		/* XOR the resultant message digest to the pool at the poolIndex position. */
+		for (digestIndex = 0; digestIndex < digestSize; digestIndex++)
+		{
+			pool [poolIndex + digestIndex] ^= chainBuffer [digestIndex];
 		}
 	}
+
+	/* Prevent leaks */
+	burn (chainBuffer, sizeof (chainBuffer));
+}
+
+/* The random pool mixing function */
+BOOL Randmix ()
+{
+	if (bRandmixEnabled)
+		RandmixPool (pRandPool, HashFunction);
+
 	return TRUE;
 }
 
 /* Add a buffer to the pool */
 void RandaddBuf (void *buf, int len)
 {
-	int i;
-	for (i = 0; i < len; i++)
+	unsigned char *data = (unsigned char *) buf;
+
+	while (len > 0)
 	{
-		RandaddByte (((unsigned char *) buf)[i]);
+		/* Add bytes in runs ending at the next byte that triggers mixing (see RandaddByte) */
+		int runEnd, count, i;
+
+		if (nRandIndex == RNG_POOL_SIZE)
+			nRandIndex = 0;
+
+		runEnd = (nRandIndex + RANDMIX_BYTE_INTERVAL - 1) / RANDMIX_BYTE_INTERVAL * RANDMIX_BYTE_INTERVAL;
+		if (runEnd >= RNG_POOL_SIZE)
+			runEnd = RNG_POOL_SIZE - 1;
+
+		count = runEnd - nRandIndex + 1;
+		if (count > len)
+			count = len;
+
+		for (i = 0; i < count; i++)
+			pRandPool [nRandIndex + i] = (unsigned char) (data[i] + pRandPool [nRandIndex + i]);
+
+		nRandIndex += count;
+		data += count;
+		len -= count;
+
+		if ((nRandIndex - 1) % RANDMIX_BYTE_INTERVAL == 0)
+			Randmix();
+	}
+}
+
+/* Measures how many times per second the pool can be mixed using the given hash function.
+   A private pool is used, so the random number generator does not need to be started. */
+unsigned __int64 RandBenchmarkMix (int hashFunction, DWORD duration)
+{
+	unsigned char *pool;
+	unsigned __int64 mixCount = 0;
+	DWORD startTime, elapsed;
+
+	if (hashFunction < FIRST_PRF_ID || hashFunction > LAST_PRF_ID || HashIsDeprecated (hashFunction))
+		return 0;
+
+	pool = (unsigned char *) TCalloc (RNG_POOL_SIZE);
+	if (!pool)
+		return 0;
+
+	memset (pool, 0, RNG_POOL_SIZE);
+	startTime = GetTickCount();
+
+	do
+	{
+		RandmixPool (pool, hashFunction);
+		mixCount++;
+		elapsed = GetTickCount() - startTime;
+	} while (elapsed < duration);
+
+	burn (pool, RNG_POOL_SIZE);
+	TCfree (pool);
+
+	return elapsed ? mixCount * 1000 / elapsed : mixCount * 1000;
+}
+
+/* Adds the samples accumulated in the entropy ring to the pool. Must be called with critRandProt held. */
+void RandDrainEntropyRing (void)
+{
+	unsigned __int32 batch[64];
+	int count;
+
+	while ((count = EntropyRingPop (&HookEntropyRing, batch, sizeof (batch) / sizeof (batch[0]))) > 0)
+		RandaddBuf (batch, count * sizeof (batch[0]));
+
+	burn (batch, sizeof (batch));
+}
+
+/* Adds a sample from an event source to the pool without taking critRandProt (unless the ring is full) */
+void RandAddEntropy (unsigned __int32 x)
+{
+	if (!bRandDidInit)
+		return;
+
+	if (!EntropyRingPush (&HookEntropyRing, x))
+	{
+		EnterCriticalSection (&critRandProt);
+		RandDrainEntropyRing ();
+		RandaddInt32 (x);
+		LeaveCriticalSection (&critRandProt);
 	}
 }
 
@@ -331,22 +571,33 @@ BOOL RandgetBytes (unsigned char *buf, int len, BOOL forceSlowPoll)
 
 	EnterCriticalSection (&critRandProt);
 
-	if (bDidSlowPoll == FALSE || forceSlowPoll)
+	RandDrainEntropyRing ();
+
+	if (bSystemEntropyActive)
 	{
-		if (!SlowPoll ())
+		/* The system generator replaces both the slow and the fast poll */
+		if (!SystemPoll ())
 			ret = FALSE;
-		else
-			bDidSlowPoll = TRUE;
 	}
+	else
+	{
+		if (bDidSlowPoll == FALSE || forceSlowPoll)
+		{
+			if (!SlowPoll ())
+				ret = FALSE;
+			else
+				bDidSlowPoll = TRUE;
+		}
 
-	if (!FastPoll ())
-		ret = FALSE;
+		if (!FastPoll ())
+			ret = FALSE;
+	}
 
 	/* There's never more than RNG_POOL_SIZE worth of randomess */
 	if (len > RNG_POOL_SIZE)
 	{
 		SetLastError(TCAPI_E_NOT_ENOUGH_RANDOM_DATA);
-		len = RNG_POOL_SIZE;
+		LeaveCriticalSection (&critRandProt);
 		return FALSE;
 	}
 
@@ -365,7 +616,7 @@ BOOL RandgetBytes (unsigned char *buf, int len, BOOL forceSlowPoll)
 	}
 
 	// Mix the pool
-	if (!FastPoll ())
+	if (!(bSystemEntropyActive ? SystemPoll () : FastPoll ()))
 		ret = FALSE;
 
 	// XOR the current pool content into the output buffer to prevent pool state leaks
@@ -425,9 +676,7 @@ LRESULT CALLBACK MouseProc (int nCode, WPARAM wParam, LPARAM lParam)
 				timeCrc = UPDC32 (((unsigned char *) &dwTimer)[i], timeCrc);
 			}
 
-			EnterCriticalSection (&critRandProt);
-			RandaddInt32 ((unsigned __int32) (crc + timeCrc));
-			LeaveCriticalSection (&critRandProt);
+			RandAddEntropy ((unsigned __int32) (crc + timeCrc));
 		}
 		lastCrc2 = lastCrc;
 		lastCrc = crc;
@@ -480,9 +729,7 @@ LRESULT CALLBACK KeyboardProc (int nCode, WPARAM wParam, LPARAM lParam)
 			timeCrc = UPDC32 (((unsigned char *) &dwTimer)[i], timeCrc);
 		}
 
-		EnterCriticalSection (&critRandProt);
-		RandaddInt32 ((unsigned __int32) (crc32int(&lParam) + timeCrc));
-		LeaveCriticalSection (&critRandProt);
+		RandAddEntropy ((unsigned __int32) (crc32int(&lParam) + timeCrc));
 	}
 
 	return CallNextHookEx (hMouse, nCode, wParam, lParam);
@@ -505,6 +752,7 @@ static unsigned __stdcall PeriodicFastPollThreadProc (void *dummy)
 		}
 		else if (bFastPollEnabled)
 		{
+			RandDrainEntropyRing ();
 			FastPoll ();
 		}
 
@@ -770,9 +1018,36 @@ BOOL FastPoll (void)
 	return TRUE;
 }
 
+/* Adds data from the operating system's random number generator to the pool. This is the only
+   entropy source when the generator runs in system entropy mode (bUseSystemEntropy). */
+BOOL SystemPoll (void)
+{
+	unsigned char buffer[RNG_POOL_SIZE];
+	int nOriginalRandIndex = nRandIndex;
+
+	if (!CryptoAPIAvailable || !CryptGenRandom (hCryptProv, sizeof (buffer), buffer))
+	{
+		burn (buffer, sizeof (buffer));
+		return FALSE;
+	}
+
+	RandaddBuf (buffer, sizeof (buffer));
+	burn (buffer, sizeof (buffer));
+
+	/* Apply the pool mixing function */
+	Randmix();
+
+	/* Restore the original pool cursor position (see FastPoll) */
+	nRandIndex = nOriginalRandIndex;
+
+	return TRUE;
+}
+
+/* The caller must hold a Randinit reference */
 void UserEnrichRandomPool (void)
 {
-	Randinit();
+	if (!bRandDidInit)
+		TC_THROW_FATAL_EXCEPTION;
 
 	if (!IsRandomPoolEnrichedByUser())
 	{
@@ -32,17 +32,26 @@ extern "C" {
 #define FASTPOLL_INTERVAL		500
 
 void RandAddInt ( unsigned __int32 x );
+void RandAddEntropy ( unsigned __int32 x );
+void RandDrainEntropyRing ( void );
+void RandProcessAttach (void);
+void RandProcessDetach (void);
 int Randinit ( void );
 void RandStop (BOOL freePool);
+BOOL RandSetSystemEntropy (BOOL enable);
 BOOL IsRandomNumberGeneratorStarted ();
+unsigned __int64 RandGetInitDuration (void);
+LONG RandGetGeneration (void);
 void RandSetHashFunction ( int hash_algo_id );
 int RandGetHashFunction (void);
 void SetRandomPoolEnrichedByUserStatus (BOOL enriched);
 BOOL IsRandomPoolEnrichedByUser ();
 BOOL Randmix ( void );
 void RandaddBuf ( void *buf , int len );
+unsigned __int64 RandBenchmarkMix (int hashFunction, DWORD duration);
 BOOL FastPoll ( void );
 BOOL SlowPoll ( void );
+BOOL SystemPoll ( void );
 BOOL RandpeekBytes ( unsigned char *buf , int len );
 BOOL RandgetBytes ( unsigned char *buf , int len, BOOL forceSlowPoll );
 
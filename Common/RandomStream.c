@@ -0,0 +1,405 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+/* NN: Bulk random data. RandgetBytes is meant for keys and salts: it polls entropy sources and remixes the
+   whole pool for every RNG_POOL_SIZE bytes, which makes it far too slow for filling large areas. A random 
+   stream is a deterministic generator keyed from the pool: AES-256 in counter mode (using AES instructions
+   where the CPU has them), rekeyed from its own output after every request so that earlier output cannot
+   be recovered from the state, and reseeded from the pool every RANDOM_STREAM_RESEED_INTERVAL bytes or
+   RANDOM_STREAM_RESEED_REQUESTS requests, and whenever the random number generator has been restarted.
+
+   Each thread may also use a stream of its own (RandgetThreadBytes). Threads then only contend for the
+   pool (critRandProt) when their streams are seeded, instead of on every request. */
+
+#include "Tcdefs.h"
+
+#include <process.h>
+#include "Crypto.h"
+#include "Random.h"
+#include "RandomStream.h"
+#include "Errors.h"
+
+#define RANDOM_STREAM_BLOCK_SIZE		16
+#define RANDOM_STREAM_KEY_SIZE			32
+
+// Keystream generated per EncipherBlocks call (a multiple of 32 blocks, which AES instructions process at once)
+#define RANDOM_STREAM_CHUNK_BLOCKS		256
+#define RANDOM_STREAM_CHUNK_SIZE		(RANDOM_STREAM_CHUNK_BLOCKS * RANDOM_STREAM_BLOCK_SIZE)
+
+#define RANDOM_STREAM_RESEED_INTERVAL	(64 * BYTES_PER_MB)
+#define RANDOM_STREAM_RESEED_REQUESTS	1024
+
+typedef struct RandomStreamStruct
+{
+	unsigned __int8 KeySchedule[AES_KS];
+	unsigned __int8 Counter[RANDOM_STREAM_BLOCK_SIZE];
+	unsigned __int8 Chunk[RANDOM_STREAM_CHUNK_SIZE];
+	uint64 BytesSinceReseed;
+	int RequestsSinceReseed;
+	LONG Generation;	// RandGetGeneration() at the time of the last reseed
+
+	// Per-thread streams are listed so that they can be destroyed when the DLL is unloaded
+	struct RandomStreamStruct *PrevThreadStream;
+	struct RandomStreamStruct *NextThreadStream;
+} RandomStream;
+
+static DWORD ThreadStreamTlsIndex = TLS_OUT_OF_INDEXES;
+static CRITICAL_SECTION ThreadStreamListLock;
+static RandomStream *ThreadStreamList = NULL;
+
+
+static void IncrementCounter (unsigned __int8 *counter)
+{
+	int i = RANDOM_STREAM_BLOCK_SIZE;
+
+	while (i-- > 0 && ++counter[i] == 0);
+}
+
+
+// Fills data with blockCount blocks of keystream
+static void GenerateKeystream (RandomStream *stream, unsigned __int8 *data, size_t blockCount)
+{
+	size_t i;
+
+	for (i = 0; i < blockCount; ++i)
+	{
+		memcpy (data + i * RANDOM_STREAM_BLOCK_SIZE, stream->Counter, RANDOM_STREAM_BLOCK_SIZE);
+		IncrementCounter (stream->Counter);
+	}
+
+	EncipherBlocks (AES, data, stream->KeySchedule, blockCount);
+}
+
+
+// Replaces the key and counter with keystream, mixed with seed if it is not NULL
+static BOOL Rekey (RandomStream *stream, const unsigned __int8 *seed)
+{
+	unsigned __int8 material[RANDOM_STREAM_KEY_SIZE + RANDOM_STREAM_BLOCK_SIZE];
+	size_t i;
+	int status;
+
+	GenerateKeystream (stream, material, sizeof (material) / RANDOM_STREAM_BLOCK_SIZE);
+
+	if (seed)
+	{
+		for (i = 0; i < sizeof (material); ++i)
+			material[i] ^= seed[i];
+	}
+
+	status = CipherInit (AES, material, stream->KeySchedule);
+	memcpy (stream->Counter, material + RANDOM_STREAM_KEY_SIZE, RANDOM_STREAM_BLOCK_SIZE);
+
+	burn (material, sizeof (material));
+	return status == ERR_SUCCESS || status == ERR_CIPHER_INIT_WEAK_KEY;
+}
+
+
+static BOOL Reseed (RandomStream *stream)
+{
+	unsigned __int8 seed[RANDOM_STREAM_KEY_SIZE + RANDOM_STREAM_BLOCK_SIZE];
+	BOOL bResult;
+
+	if (!IsRandomNumberGeneratorStarted ())
+		return FALSE;
+
+	stream->Generation = RandGetGeneration ();
+	bResult = RandgetBytes (seed, sizeof (seed), FALSE) && Rekey (stream, seed);
+	stream->BytesSinceReseed = 0;
+	stream->RequestsSinceReseed = 0;
+
+	burn (seed, sizeof (seed));
+	return bResult;
+}
+
+
+int RandomStreamOpen (PRANDOM_STREAM *retStream)
+{
+	RandomStream *stream;
+
+	if (!retStream)
+		return ERR_PARAMETER_INCORRECT;
+
+	*retStream = NULL;
+
+	if (!IsRandomNumberGeneratorStarted ())
+		return ERR_PARAMETER_INCORRECT;
+
+	stream = (RandomStream *) TCalloc (sizeof (RandomStream));
+	if (!stream)
+		return ERR_OUTOFMEMORY;
+
+	memset (stream, 0, sizeof (RandomStream));
+	VirtualLock (stream, sizeof (RandomStream));
+
+	// The initial key is all zero; the seed is the only source of entropy
+	if (CipherInit (AES, stream->Chunk, stream->KeySchedule) != ERR_SUCCESS || !Reseed (stream))
+	{
+		RandomStreamClose (stream);
+		return ERR_OS_ERROR;
+	}
+
+	*retStream = stream;
+	return ERR_SUCCESS;
+}
+
+
+void RandomStreamClose (PRANDOM_STREAM stream)
+{
+	if (!stream)
+		return;
+
+	burn (stream, sizeof (RandomStream));
+	VirtualUnlock (stream, sizeof (RandomStream));
+	TCfree (stream);
+}
+
+
+BOOL RandomStreamGetBytes (PRANDOM_STREAM stream, unsigned char *buffer, size_t length)
+{
+	size_t blockCount, chunkLength;
+
+	if (!stream || (!buffer && length > 0))
+		return FALSE;
+
+	if ((stream->Generation != RandGetGeneration () || ++stream->RequestsSinceReseed > RANDOM_STREAM_RESEED_REQUESTS)
+		&& !Reseed (stream))
+		return FALSE;
+
+	while (length > 0)
+	{
+		if (stream->BytesSinceReseed >= RANDOM_STREAM_RESEED_INTERVAL && !Reseed (stream))
+			return FALSE;
+
+		chunkLength = (size_t) min (length, RANDOM_STREAM_RESEED_INTERVAL - stream->BytesSinceReseed);
+
+		// Whole blocks are generated in place
+		blockCount = chunkLength / RANDOM_STREAM_BLOCK_SIZE;
+
+		if (blockCount >= RANDOM_STREAM_CHUNK_BLOCKS)
+		{
+			blockCount -= blockCount % RANDOM_STREAM_CHUNK_BLOCKS;
+			chunkLength = blockCount * RANDOM_STREAM_BLOCK_SIZE;
+
+			GenerateKeystream (stream, buffer, blockCount);
+		}
+		else
+		{
+			chunkLength = min (chunkLength, RANDOM_STREAM_CHUNK_SIZE);
+			blockCount = (chunkLength + RANDOM_STREAM_BLOCK_SIZE - 1) / RANDOM_STREAM_BLOCK_SIZE;
+
+			GenerateKeystream (stream, stream->Chunk, blockCount);
+			memcpy (buffer, stream->Chunk, chunkLength);
+			burn (stream->Chunk, blockCount * RANDOM_STREAM_BLOCK_SIZE);
+		}
+
+		buffer += chunkLength;
+		length -= chunkLength;
+		stream->BytesSinceReseed += chunkLength;
+	}
+
+	// Backtracking resistance
+	return Rekey (stream, NULL);
+}
+
+
+BOOL RandomThreadStreamsStart (void)
+{
+	ThreadStreamTlsIndex = TlsAlloc ();
+	if (ThreadStreamTlsIndex == TLS_OUT_OF_INDEXES)
+		return FALSE;
+
+	InitializeCriticalSection (&ThreadStreamListLock);
+	return TRUE;
+}
+
+
+void RandomThreadStreamRelease (void)
+{
+	RandomStream *stream;
+
+	if (ThreadStreamTlsIndex == TLS_OUT_OF_INDEXES)
+		return;
+
+	stream = (RandomStream *) TlsGetValue (ThreadStreamTlsIndex);
+	if (!stream)
+		return;
+
+	TlsSetValue (ThreadStreamTlsIndex, NULL);
+
+	EnterCriticalSection (&ThreadStreamListLock);
+
+	if (stream->PrevThreadStream)
+		stream->PrevThreadStream->NextThreadStream = stream->NextThreadStream;
+	else
+		ThreadStreamList = stream->NextThreadStream;
+
+	if (stream->NextThreadStream)
+		stream->NextThreadStream->PrevThreadStream = stream->PrevThreadStream;
+
+	LeaveCriticalSection (&ThreadStreamListLock);
+
+	RandomStreamClose (stream);
+}
+
+
+void RandomThreadStreamsStop (void)
+{
+	RandomStream *stream;
+
+	if (ThreadStreamTlsIndex == TLS_OUT_OF_INDEXES)
+		return;
+
+	// No other thread can be running code of the DLL at this point
+	while (ThreadStreamList)
+	{
+		stream = ThreadStreamList;
+		ThreadStreamList = stream->NextThreadStream;
+		RandomStreamClose (stream);
+	}
+
+	DeleteCriticalSection (&ThreadStreamListLock);
+	TlsFree (ThreadStreamTlsIndex);
+	ThreadStreamTlsIndex = TLS_OUT_OF_INDEXES;
+}
+
+
+// Returns the number of threads that have a stream
+int RandomThreadStreamCount (void)
+{
+	RandomStream *stream;
+	int count = 0;
+
+	if (ThreadStreamTlsIndex == TLS_OUT_OF_INDEXES)
+		return 0;
+
+	EnterCriticalSection (&ThreadStreamListLock);
+
+	for (stream = ThreadStreamList; stream; stream = stream->NextThreadStream)
+		++count;
+
+	LeaveCriticalSection (&ThreadStreamListLock);
+	return count;
+}
+
+
+BOOL RandgetThreadBytes (unsigned char *buf, size_t len)
+{
+	RandomStream *stream;
+
+	if (ThreadStreamTlsIndex == TLS_OUT_OF_INDEXES || !IsRandomNumberGeneratorStarted ())
+		return FALSE;
+
+	stream = (RandomStream *) TlsGetValue (ThreadStreamTlsIndex);
+	if (!stream)
+	{
+		// The stream is forked from the pool; afterwards the thread only takes the pool lock to reseed it
+		if (RandomStreamOpen (&stream) != ERR_SUCCESS)
+			return FALSE;
+
+		if (!TlsSetValue (ThreadStreamTlsIndex, stream))
+		{
+			RandomStreamClose (stream);
+			return FALSE;
+		}
+
+		EnterCriticalSection (&ThreadStreamListLock);
+
+		stream->NextThreadStream = ThreadStreamList;
+		if (ThreadStreamList)
+			ThreadStreamList->PrevThreadStream = stream;
+		ThreadStreamList = stream;
+
+		LeaveCriticalSection (&ThreadStreamListLock);
+	}
+
+	return RandomStreamGetBytes (stream, buf, len);
+}
+
+
+typedef struct
+{
+	BOOL PerThread;
+	DWORD EndTime;
+	unsigned __int64 ByteCount;
+	BOOL Failed;
+} RandomBenchmarkThread;
+
+static unsigned __stdcall RandomBenchmarkThreadProc (void *arg)
+{
+	RandomBenchmarkThread *thread = (RandomBenchmarkThread *) arg;
+	unsigned char buffer[PKCS5_SALT_SIZE];
+
+	// Requests the size of a salt, the most frequent small request
+	while ((LONG) (thread->EndTime - GetTickCount ()) > 0)
+	{
+		if (thread->PerThread ? !RandgetThreadBytes (buffer, sizeof (buffer)) : !RandgetBytes (buffer, sizeof (buffer), FALSE))
+		{
+			thread->Failed = TRUE;
+			break;
+		}
+
+		thread->ByteCount += sizeof (buffer);
+	}
+
+	burn (buffer, sizeof (buffer));
+
+	if (thread->PerThread)
+		RandomThreadStreamRelease ();
+
+	return 0;
+}
+
+unsigned __int64 RandBenchmarkThreads (int threadCount, BOOL perThread, DWORD duration)
+{
+	RandomBenchmarkThread threads[MAXIMUM_WAIT_OBJECTS];
+	HANDLE threadHandles[MAXIMUM_WAIT_OBJECTS];
+	unsigned __int64 byteCount = 0;
+	DWORD startTime;
+	int i, started = 0;
+	BOOL failed = FALSE;
+
+	if (threadCount < 1 || threadCount > MAXIMUM_WAIT_OBJECTS || duration == 0 || !IsRandomNumberGeneratorStarted ())
+		return 0;
+
+	startTime = GetTickCount ();
+
+	for (i = 0; i < threadCount; ++i)
+	{
+		threads[i].PerThread = perThread;
+		threads[i].EndTime = startTime + duration;
+		threads[i].ByteCount = 0;
+		threads[i].Failed = FALSE;
+
+		threadHandles[started] = (HANDLE) _beginthreadex (NULL, 0, RandomBenchmarkThreadProc, &threads[i], 0, NULL);
+		if (!threadHandles[started])
+		{
+			failed = TRUE;
+			break;
+		}
+
+		++started;
+	}
+
+	if (started > 0)
+	{
+		WaitForMultipleObjects (started, threadHandles, TRUE, INFINITE);
+
+		for (i = 0; i < started; ++i)
+		{
+			CloseHandle (threadHandles[i]);
+			byteCount += threads[i].ByteCount;
+			failed |= threads[i].Failed;
+		}
+	}
+
+	if (failed)
+		return 0;
+
+	duration = GetTickCount () - startTime;
+	return duration ? byteCount * 1000 / duration : byteCount * 1000;
+}
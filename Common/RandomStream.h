@@ -0,0 +1,43 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+#ifndef RANDOM_STREAM_H
+#define RANDOM_STREAM_H
+
+#include "Tcdefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef struct RandomStreamStruct *PRANDOM_STREAM;
+
+	/* The random number generator must be running (Randinit) while a stream is open. A stream must not be 
+	   used by several threads at the same time. */
+	int RandomStreamOpen (PRANDOM_STREAM *retStream);
+	void RandomStreamClose (PRANDOM_STREAM stream);
+	BOOL RandomStreamGetBytes (PRANDOM_STREAM stream, unsigned char *buffer, size_t length);
+
+	/* Per-thread streams. RandgetThreadBytes serves the calling thread from a stream of its own, seeded from
+	   the pool when first used. RandomThreadStreamRelease destroys the calling thread's stream (on thread exit);
+	   RandomThreadStreamsStart/Stop are called when the DLL is loaded/unloaded. */
+	BOOL RandomThreadStreamsStart (void);
+	void RandomThreadStreamsStop (void);
+	void RandomThreadStreamRelease (void);
+	int RandomThreadStreamCount (void);
+	BOOL RandgetThreadBytes (unsigned char *buf, size_t len);
+
+	/* Returns the number of bytes per second that threadCount threads together obtain in salt-sized requests,
+	   from per-thread streams or from the pool (RandgetBytes), or 0 on failure */
+	unsigned __int64 RandBenchmarkThreads (int threadCount, BOOL perThread, DWORD duration);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
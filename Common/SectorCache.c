@@ -0,0 +1,442 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+/* NN: Plaintext sector cache with 2Q replacement (Johnson & Shasha, VLDB '94). Sectors read once enter the
+   FIFO queue A1in; when evicted from it, only their numbers are remembered in the ghost queue A1out. A
+   sector missed again while remembered in A1out is considered hot and enters the LRU queue Am. A large 
+   scan therefore passes through A1in without flushing the hot sectors (e.g., file system metadata) kept
+   in Am. Evicted sector data is wiped. All operations are serialized by a critical section.
+
+   The cache is write-through: writers invalidate the written sectors after writing them to the host. A 
+   reader that missed passes the generation it obtained before reading the host to SectorCacheInsert, 
+   which ignores the data if sectors have been invalidated meanwhile, as the data may be stale. */
+
+#include "Tcdefs.h"
+
+#include "SectorCache.h"
+
+#define SECTOR_CACHE_NIL	((DWORD) -1)
+
+enum
+{
+	SECTOR_CACHE_QUEUE_A1IN = 0,
+	SECTOR_CACHE_QUEUE_A1OUT,
+	SECTOR_CACHE_QUEUE_AM,
+	SECTOR_CACHE_QUEUE_COUNT
+};
+
+typedef struct
+{
+	uint64 SectorNo;
+	DWORD Prev;
+	DWORD Next;
+	DWORD HashNext;
+	DWORD DataSlot;		// SECTOR_CACHE_NIL for sectors in A1out
+	int Queue;
+} SectorCacheEntry;
+
+typedef struct
+{
+	DWORD Head;			// Most recently inserted
+	DWORD Tail;
+	DWORD Count;
+} SectorCacheQueue;
+
+struct SectorCacheStruct
+{
+	CRITICAL_SECTION Lock;
+	DWORD SectorSize;
+	DWORD Capacity;			// Maximum number of resident sectors
+	DWORD MaxA1in;
+	DWORD MaxA1out;
+
+	SectorCacheEntry *Entries;
+	DWORD EntryCount;
+	DWORD FreeEntry;		// Head of the free entry list (linked through HashNext)
+
+	DWORD *Buckets;
+	DWORD BucketMask;
+
+	DWORD *FreeSlots;
+	DWORD FreeSlotCount;
+	byte *Data;
+
+	SectorCacheQueue Queues[SECTOR_CACHE_QUEUE_COUNT];
+	LONG Generation;
+
+	uint64 Hits;
+	uint64 Misses;
+	uint64 Evictions;
+};
+
+
+static DWORD HashSector (PSECTOR_CACHE cache, uint64 sectorNo)
+{
+	return (DWORD) ((sectorNo * 0x9E3779B97F4A7C15ULL) >> 32) & cache->BucketMask;
+}
+
+
+static DWORD FindEntry (PSECTOR_CACHE cache, uint64 sectorNo)
+{
+	DWORD e;
+
+	for (e = cache->Buckets[HashSector (cache, sectorNo)]; e != SECTOR_CACHE_NIL; e = cache->Entries[e].HashNext)
+	{
+		if (cache->Entries[e].SectorNo == sectorNo)
+			return e;
+	}
+
+	return SECTOR_CACHE_NIL;
+}
+
+
+static void PushQueueHead (PSECTOR_CACHE cache, int queue, DWORD e)
+{
+	SectorCacheQueue *q = &cache->Queues[queue];
+	SectorCacheEntry *entry = &cache->Entries[e];
+
+	entry->Queue = queue;
+	entry->Prev = SECTOR_CACHE_NIL;
+	entry->Next = q->Head;
+
+	if (q->Head != SECTOR_CACHE_NIL)
+		cache->Entries[q->Head].Prev = e;
+	else
+		q->Tail = e;
+
+	q->Head = e;
+	q->Count++;
+}
+
+
+static void UnlinkFromQueue (PSECTOR_CACHE cache, DWORD e)
+{
+	SectorCacheEntry *entry = &cache->Entries[e];
+	SectorCacheQueue *q = &cache->Queues[entry->Queue];
+
+	if (entry->Prev != SECTOR_CACHE_NIL)
+		cache->Entries[entry->Prev].Next = entry->Next;
+	else
+		q->Head = entry->Next;
+
+	if (entry->Next != SECTOR_CACHE_NIL)
+		cache->Entries[entry->Next].Prev = entry->Prev;
+	else
+		q->Tail = entry->Prev;
+
+	q->Count--;
+}
+
+
+static void ReleaseDataSlot (PSECTOR_CACHE cache, DWORD e)
+{
+	SectorCacheEntry *entry = &cache->Entries[e];
+
+	if (entry->DataSlot == SECTOR_CACHE_NIL)
+		return;
+
+	burn (cache->Data + (size_t) entry->DataSlot * cache->SectorSize, cache->SectorSize);
+	cache->FreeSlots[cache->FreeSlotCount++] = entry->DataSlot;
+	entry->DataSlot = SECTOR_CACHE_NIL;
+}
+
+
+// Removes the entry from its queue and the hash table and frees it
+static void RemoveEntry (PSECTOR_CACHE cache, DWORD e)
+{
+	DWORD *link = &cache->Buckets[HashSector (cache, cache->Entries[e].SectorNo)];
+
+	while (*link != e)
+		link = &cache->Entries[*link].HashNext;
+
+	*link = cache->Entries[e].HashNext;
+
+	UnlinkFromQueue (cache, e);
+	ReleaseDataSlot (cache, e);
+
+	cache->Entries[e].HashNext = cache->FreeEntry;
+	cache->FreeEntry = e;
+}
+
+
+// Evicts a resident sector to make a data slot available
+static void ReclaimDataSlot (PSECTOR_CACHE cache)
+{
+	DWORD e;
+
+	if (cache->FreeSlotCount > 0)
+		return;
+
+	cache->Evictions++;
+
+	if (cache->Queues[SECTOR_CACHE_QUEUE_A1IN].Count > cache->MaxA1in || cache->Queues[SECTOR_CACHE_QUEUE_AM].Count == 0)
+	{
+		// The sector's number is remembered in A1out
+		e = cache->Queues[SECTOR_CACHE_QUEUE_A1IN].Tail;
+
+		UnlinkFromQueue (cache, e);
+		ReleaseDataSlot (cache, e);
+		PushQueueHead (cache, SECTOR_CACHE_QUEUE_A1OUT, e);
+
+		if (cache->Queues[SECTOR_CACHE_QUEUE_A1OUT].Count > cache->MaxA1out)
+			RemoveEntry (cache, cache->Queues[SECTOR_CACHE_QUEUE_A1OUT].Tail);
+	}
+	else
+	{
+		RemoveEntry (cache, cache->Queues[SECTOR_CACHE_QUEUE_AM].Tail);
+	}
+}
+
+
+int SectorCacheCreate (DWORD capacitySectors, DWORD sectorSize, PSECTOR_CACHE *retCache)
+{
+	PSECTOR_CACHE cache;
+	DWORD bucketCount;
+	DWORD i;
+
+	if (!retCache || capacitySectors < 4 || sectorSize == 0 || capacitySectors > 0x1000000)
+		return ERR_PARAMETER_INCORRECT;
+
+	*retCache = NULL;
+
+	cache = (PSECTOR_CACHE) TCalloc (sizeof (struct SectorCacheStruct));
+	if (!cache)
+		return ERR_OUTOFMEMORY;
+
+	memset (cache, 0, sizeof (struct SectorCacheStruct));
+	InitializeCriticalSection (&cache->Lock);
+
+	cache->SectorSize = sectorSize;
+	cache->Capacity = capacitySectors;
+
+	// Queue sizes recommended by the 2Q paper
+	cache->MaxA1in = capacitySectors / 4;
+	cache->MaxA1out = capacitySectors / 2;
+
+	cache->EntryCount = capacitySectors + cache->MaxA1out;
+
+	for (bucketCount = 1; bucketCount < cache->EntryCount; bucketCount <<= 1);
+	cache->BucketMask = bucketCount - 1;
+
+	cache->Entries = (SectorCacheEntry *) TCalloc (cache->EntryCount * sizeof (SectorCacheEntry));
+	cache->Buckets = (DWORD *) TCalloc (bucketCount * sizeof (DWORD));
+	cache->FreeSlots = (DWORD *) TCalloc (capacitySectors * sizeof (DWORD));
+	cache->Data = (byte *) TCalloc ((size_t) capacitySectors * sectorSize);
+
+	if (!cache->Entries || !cache->Buckets || !cache->FreeSlots || !cache->Data)
+	{
+		SectorCacheDestroy (cache);
+		return ERR_OUTOFMEMORY;
+	}
+
+	VirtualLock (cache->Data, (size_t) capacitySectors * sectorSize);
+
+	for (i = 0; i < bucketCount; ++i)
+		cache->Buckets[i] = SECTOR_CACHE_NIL;
+
+	for (i = 0; i < cache->EntryCount; ++i)
+	{
+		cache->Entries[i].HashNext = i + 1 < cache->EntryCount ? i + 1 : SECTOR_CACHE_NIL;
+		cache->Entries[i].DataSlot = SECTOR_CACHE_NIL;
+	}
+
+	cache->FreeEntry = 0;
+
+	for (i = 0; i < capacitySectors; ++i)
+		cache->FreeSlots[i] = capacitySectors - 1 - i;
+
+	cache->FreeSlotCount = capacitySectors;
+
+	for (i = 0; i < SECTOR_CACHE_QUEUE_COUNT; ++i)
+	{
+		cache->Queues[i].Head = SECTOR_CACHE_NIL;
+		cache->Queues[i].Tail = SECTOR_CACHE_NIL;
+	}
+
+	*retCache = cache;
+	return ERR_SUCCESS;
+}
+
+
+void SectorCacheDestroy (PSECTOR_CACHE cache)
+{
+	if (!cache)
+		return;
+
+	if (cache->Data)
+	{
+		burn (cache->Data, (size_t) cache->Capacity * cache->SectorSize);
+		VirtualUnlock (cache->Data, (size_t) cache->Capacity * cache->SectorSize);
+		TCfree (cache->Data);
+	}
+
+	if (cache->Entries)
+	{
+		// Sector numbers reveal which parts of the volume are in use
+		burn (cache->Entries, cache->EntryCount * sizeof (SectorCacheEntry));
+		TCfree (cache->Entries);
+	}
+
+	if (cache->Buckets)
+		TCfree (cache->Buckets);
+
+	if (cache->FreeSlots)
+		TCfree (cache->FreeSlots);
+
+	DeleteCriticalSection (&cache->Lock);
+	TCfree (cache);
+}
+
+
+LONG SectorCacheGetGeneration (PSECTOR_CACHE cache)
+{
+	LONG generation;
+
+	EnterCriticalSection (&cache->Lock);
+	generation = cache->Generation;
+	LeaveCriticalSection (&cache->Lock);
+
+	return generation;
+}
+
+
+// Copies the sector to buffer if it is cached
+BOOL SectorCacheLookup (PSECTOR_CACHE cache, unsigned __int64 sectorNo, void *buffer)
+{
+	DWORD e;
+	BOOL hit = FALSE;
+
+	EnterCriticalSection (&cache->Lock);
+
+	e = FindEntry (cache, sectorNo);
+
+	if (e != SECTOR_CACHE_NIL && cache->Entries[e].DataSlot != SECTOR_CACHE_NIL)
+	{
+		memcpy (buffer, cache->Data + (size_t) cache->Entries[e].DataSlot * cache->SectorSize, cache->SectorSize);
+
+		// Sectors in A1in keep their position until they leave the queue
+		if (cache->Entries[e].Queue == SECTOR_CACHE_QUEUE_AM)
+		{
+			UnlinkFromQueue (cache, e);
+			PushQueueHead (cache, SECTOR_CACHE_QUEUE_AM, e);
+		}
+
+		cache->Hits++;
+		hit = TRUE;
+	}
+	else
+	{
+		cache->Misses++;
+	}
+
+	LeaveCriticalSection (&cache->Lock);
+	return hit;
+}
+
+
+// Caches the sector read from the host. The data is ignored if any sectors have been invalidated since
+// generation was obtained.
+void SectorCacheInsert (PSECTOR_CACHE cache, unsigned __int64 sectorNo, const void *data, LONG generation)
+{
+	SectorCacheEntry *entry;
+	DWORD e;
+	DWORD bucket;
+
+	EnterCriticalSection (&cache->Lock);
+
+	if (generation != cache->Generation)
+		goto ret;
+
+	e = FindEntry (cache, sectorNo);
+
+	if (e != SECTOR_CACHE_NIL && cache->Entries[e].DataSlot != SECTOR_CACHE_NIL)
+	{
+		// Inserted by another reader meanwhile
+		memcpy (cache->Data + (size_t) cache->Entries[e].DataSlot * cache->SectorSize, data, cache->SectorSize);
+		goto ret;
+	}
+
+	ReclaimDataSlot (cache);
+
+	if (e != SECTOR_CACHE_NIL && FindEntry (cache, sectorNo) == e)
+	{
+		// Missed again while remembered in A1out: the sector is hot
+		UnlinkFromQueue (cache, e);
+		PushQueueHead (cache, SECTOR_CACHE_QUEUE_AM, e);
+	}
+	else
+	{
+		e = cache->FreeEntry;
+		cache->FreeEntry = cache->Entries[e].HashNext;
+
+		bucket = HashSector (cache, sectorNo);
+		cache->Entries[e].SectorNo = sectorNo;
+		cache->Entries[e].DataSlot = SECTOR_CACHE_NIL;
+		cache->Entries[e].HashNext = cache->Buckets[bucket];
+		cache->Buckets[bucket] = e;
+
+		PushQueueHead (cache, SECTOR_CACHE_QUEUE_A1IN, e);
+	}
+
+	entry = &cache->Entries[e];
+	entry->DataSlot = cache->FreeSlots[--cache->FreeSlotCount];
+	memcpy (cache->Data + (size_t) entry->DataSlot * cache->SectorSize, data, cache->SectorSize);
+
+ret:
+	LeaveCriticalSection (&cache->Lock);
+}
+
+
+// Discards cached data of the given sectors. Must be called after the sectors have been written to the host.
+void SectorCacheInvalidate (PSECTOR_CACHE cache, unsigned __int64 sectorNo, unsigned __int64 sectorCount)
+{
+	DWORD e;
+
+	EnterCriticalSection (&cache->Lock);
+
+	cache->Generation++;
+
+	if (sectorCount > cache->EntryCount)
+	{
+		for (e = 0; e < cache->EntryCount; ++e)
+		{
+			SectorCacheEntry *entry = &cache->Entries[e];
+
+			if (entry->DataSlot != SECTOR_CACHE_NIL && entry->SectorNo >= sectorNo && entry->SectorNo - sectorNo < sectorCount)
+				RemoveEntry (cache, e);
+		}
+	}
+	else
+	{
+		uint64 i;
+
+		for (i = 0; i < sectorCount; ++i)
+		{
+			e = FindEntry (cache, sectorNo + i);
+
+			if (e != SECTOR_CACHE_NIL && cache->Entries[e].DataSlot != SECTOR_CACHE_NIL)
+				RemoveEntry (cache, e);
+		}
+	}
+
+	LeaveCriticalSection (&cache->Lock);
+}
+
+
+void SectorCacheGetStats (PSECTOR_CACHE cache, SECTOR_CACHE_STATS *stats)
+{
+	EnterCriticalSection (&cache->Lock);
+
+	stats->Hits = cache->Hits;
+	stats->Misses = cache->Misses;
+	stats->Evictions = cache->Evictions;
+	stats->ResidentSectors = cache->Capacity - cache->FreeSlotCount;
+	stats->CapacitySectors = cache->Capacity;
+
+	LeaveCriticalSection (&cache->Lock);
+}
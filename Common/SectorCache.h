@@ -0,0 +1,42 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+#ifndef SECTOR_CACHE_H
+#define SECTOR_CACHE_H
+
+#include "Tcdefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/* A bounded cache of plaintext sectors, kept in locked memory */
+	typedef struct SectorCacheStruct SectorCache, *PSECTOR_CACHE;
+
+	typedef struct
+	{
+		unsigned __int64 Hits;
+		unsigned __int64 Misses;
+		unsigned __int64 Evictions;
+		DWORD ResidentSectors;
+		DWORD CapacitySectors;
+	} SECTOR_CACHE_STATS;
+
+	int SectorCacheCreate (DWORD capacitySectors, DWORD sectorSize, PSECTOR_CACHE *retCache);
+	void SectorCacheDestroy (PSECTOR_CACHE cache);
+	LONG SectorCacheGetGeneration (PSECTOR_CACHE cache);
+	BOOL SectorCacheLookup (PSECTOR_CACHE cache, unsigned __int64 sectorNo, void *buffer);
+	void SectorCacheInsert (PSECTOR_CACHE cache, unsigned __int64 sectorNo, const void *data, LONG generation);
+	void SectorCacheInvalidate (PSECTOR_CACHE cache, unsigned __int64 sectorNo, unsigned __int64 sectorCount);
+	void SectorCacheGetStats (PSECTOR_CACHE cache, SECTOR_CACHE_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -40,6 +40,7 @@
 #define TC_APPD_FILENAME_SYSTEM_FAVORITE_VOLUMES			TC_APP_NAME " System Favorite Volumes.xml"
 #define TC_APPD_FILENAME_NONSYS_INPLACE_ENC					"In-Place Encryption"
 #define TC_APPD_FILENAME_NONSYS_INPLACE_ENC_WIPE			"In-Place Encryption Wipe Algo"
+#define TC_APPD_FILENAME_HEADER_HINTS						"Header Hints.xml"
 
 
 /* GUI/driver errors */
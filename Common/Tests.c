@@ -0,0 +1,1420 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+/* NN: Self-tests of the API's components. Each test returns FALSE as soon as a check fails. */
+
+#include "Tcdefs.h"
+
+#include <memory.h>
+#include <process.h>
+#include "Crypto.h"
+#include "Volumes.h"
+#include "Tests.h"
+#include "Pkcs5.h"
+#include "Random.h"
+#include "RandomStream.h"
+#include "EntropyRing.h"
+#include "DirectVolume.h"
+#include "SectorCache.h"
+#include "VolumeImage.h"
+#include "Mount.h"
+#include "MountBatch.h"
+#include "OsInfo.h"
+#include "Errors.h"
+
+/* Known-answer tests of the key derivation. The PBKDF2 code of all PRFs is shared (see Pkcs5.c), so every
+   PRF is tested on a single output block and on several blocks derived in lock-step. */
+BOOL test_pkcs5 (void)
+{
+	char dk[144];
+
+	/* PKCS-5 test 1 with HMAC-SHA-1 used as the PRF */
+	derive_key_sha1 ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 4);
+	if (memcmp (dk, "\x5c\x75\xce\xf0", 4) != 0)
+		return FALSE;
+
+	/* PKCS-5 test 2 with HMAC-SHA-1 used as the PRF */
+	derive_key_sha1 ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 144);
+	if (memcmp (dk + 140, "\x4e\x8c\x3d\xd7", 4) != 0)
+		return FALSE;
+
+	/* PKCS-5 test 1 with HMAC-RIPEMD-160 used as the PRF */
+	derive_key_ripemd160 ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 4);
+	if (memcmp (dk, "\x7a\x3d\x7c\x03", 4) != 0)
+		return FALSE;
+
+	/* PKCS-5 test 2 with HMAC-RIPEMD-160 used as the PRF */
+	derive_key_ripemd160 ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 48);
+	if (memcmp (dk + 44, "\x73\xce\xe1\x43", 4) != 0)
+		return FALSE;
+
+	/* PKCS-5 test 1 with HMAC-SHA-512 used as the PRF */
+	derive_key_sha512 ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 4);
+	if (memcmp (dk, "\x13\x64\xae\xf8", 4) != 0)
+		return FALSE;
+
+	/* PKCS-5 test 2 with HMAC-SHA-512 used as the PRF */
+	derive_key_sha512 ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 144);
+	if (memcmp (dk + 140, "\xb6\xdd\x41\xc6", 4) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-SHA-512, 1 iteration (RFC 6070 inputs) */
+	derive_key_sha512 ("password", 8, "salt", 4, 1, dk, 64);
+	if (memcmp (dk,
+		"\x86\x7f\x70\xcf\x1a\xde\x02\xcf\xf3\x75\x25\x99\xa3\xa5\x3d\xc4"
+		"\xaf\x34\xc7\xa6\x69\x81\x5a\xe5\xd5\x13\x55\x4e\x1c\x8c\xf2\x52"
+		"\xc0\x2d\x47\x0a\x28\x5a\x05\x01\xba\xd9\x99\xbf\xe9\x43\xc0\x8f"
+		"\x05\x02\x35\xd7\xd6\x8b\x1d\xa5\x5e\x63\xf7\x3b\x60\xa5\x7f\xce", 64) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-SHA-512, 2 iterations (RFC 6070 inputs) */
+	derive_key_sha512 ("password", 8, "salt", 4, 2, dk, 64);
+	if (memcmp (dk,
+		"\xe1\xd9\xc1\x6a\xa6\x81\x70\x8a\x45\xf5\xc7\xc4\xe2\x15\xce\xb6"
+		"\x6e\x01\x1a\x2e\x9f\x00\x40\x71\x3f\x18\xae\xfd\xb8\x66\xd5\x3c"
+		"\xf7\x6c\xab\x28\x68\xa3\x9b\x9f\x78\x40\xed\xce\x4f\xef\x5a\x82"
+		"\xbe\x67\x33\x5c\x77\xa6\x06\x8e\x04\x11\x27\x54\xf2\x7c\xcf\x4e", 64) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-SHA-512, 4096 iterations (RFC 6070 inputs) */
+	derive_key_sha512 ("password", 8, "salt", 4, 4096, dk, 64);
+	if (memcmp (dk,
+		"\xd1\x97\xb1\xb3\x3d\xb0\x14\x3e\x01\x8b\x12\xf3\xd1\xd1\x47\x9e"
+		"\x6c\xde\xbd\xcc\x97\xc5\xc0\xf8\x7f\x69\x02\xe0\x72\xf4\x57\xb5"
+		"\x14\x3f\x30\x60\x26\x41\xb3\xd5\x5c\xd3\x35\x98\x8c\xb3\x6b\x84"
+		"\x37\x60\x60\xec\xd5\x32\xe0\x39\xb7\x42\xa2\x39\x43\x4a\xf2\xd5", 64) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-SHA-512, 4096 iterations, two output blocks (RFC 6070 inputs) */
+	derive_key_sha512 ("passwordPASSWORDpassword", 24, "saltSALTsaltSALTsaltSALTsaltSALTsalt", 36, 4096, dk, 80);
+	if (memcmp (dk,
+		"\x8c\x05\x11\xf4\xc6\xe5\x97\xc6\xac\x63\x15\xd8\xf0\x36\x2e\x22"
+		"\x5f\x3c\x50\x14\x95\xba\x23\xb8\x68\xc0\x05\x17\x4d\xc4\xee\x71"
+		"\x11\x5b\x59\xf9\xe6\x0c\xd9\x53\x2f\xa3\x3e\x0f\x75\xae\xfe\x30"
+		"\x22\x5c\x58\x3a\x18\x6c\xd8\x2b\xd4\xda\xea\x97\x24\xa3\xd3\xb8"
+		"\x04\xf7\x5b\xdd\x41\x49\x4f\xa3\x24\xca\xb2\x4b\xcc\x68\x0f\xb3", 80) != 0)
+		return FALSE;
+
+	/* PKCS-5 test 1 with HMAC-Whirlpool used as the PRF */
+	derive_key_whirlpool ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 4);
+	if (memcmp (dk, "\x50\x7c\x36\x6f", 4) != 0)
+		return FALSE;
+
+	/* PKCS-5 test 2 with HMAC-Whirlpool used as the PRF */
+	derive_key_whirlpool ("password", 8, "\x12\x34\x56\x78", 4, 5, dk, 96);
+	if (memcmp (dk + 92, "\x65\x6f\xbd\x24", 4) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-Whirlpool, 1 iteration (RFC 6070 inputs) */
+	derive_key_whirlpool ("password", 8, "salt", 4, 1, dk, 64);
+	if (memcmp (dk,
+		"\x7e\x25\x00\x9b\xf8\xaf\xad\xe8\xab\x33\x91\x1d\x33\x1b\x5b\x3e"
+		"\x98\x7f\xc7\xc3\xe2\xd5\xfd\xb3\xf3\x3c\x18\x3e\x83\x7c\x35\x78"
+		"\x50\xa7\x5e\xb8\xba\xad\x2c\x05\xb1\xe3\xbc\x70\x68\xc2\xa2\xd5"
+		"\xc0\xf3\xe5\x86\xf4\x01\x61\x0a\xd0\x2f\x52\x5c\x8f\xcf\x2c\xbd", 64) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-Whirlpool, 2 iterations (RFC 6070 inputs) */
+	derive_key_whirlpool ("password", 8, "salt", 4, 2, dk, 64);
+	if (memcmp (dk,
+		"\x11\x0b\x2e\x42\x66\xf0\x3c\x33\x4f\x60\x85\xbf\x42\x1a\x68\xd6"
+		"\x97\x6a\x2f\x76\x7e\x0b\xb6\x04\x1a\x9c\x93\x15\xec\x0d\x24\x9f"
+		"\xc8\xcb\x5f\xac\x1f\x9f\x3b\x87\xdb\xb9\x8e\x9b\x4b\x22\x0d\xfe"
+		"\x0d\x6b\x55\xf8\x81\x09\xdd\x55\x8c\x30\xf0\xa0\x35\x6f\x7d\x9f", 64) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-Whirlpool, 4096 iterations (RFC 6070 inputs) */
+	derive_key_whirlpool ("password", 8, "salt", 4, 4096, dk, 64);
+	if (memcmp (dk,
+		"\x4f\x4c\x03\x07\x91\x5b\x7e\x3f\x94\x8d\xaa\xf4\x1e\xe7\x80\x5c"
+		"\xd2\x96\x75\x13\xa3\xbe\x69\x75\xa7\xcc\xe7\x82\x40\x25\x98\xe6"
+		"\xbd\x95\x0c\x50\x51\xea\x0c\x81\x85\xbe\xba\x48\x7b\x13\xeb\x93"
+		"\xf5\xa9\x3b\x8e\x2e\x1e\x75\x35\x64\x3f\x00\xdd\x7c\x39\xca\xd1", 64) != 0)
+		return FALSE;
+
+	/* PBKDF2-HMAC-Whirlpool, 4096 iterations, two output blocks (RFC 6070 inputs) */
+	derive_key_whirlpool ("passwordPASSWORDpassword", 24, "saltSALTsaltSALTsaltSALTsaltSALTsalt", 36, 4096, dk, 80);
+	if (memcmp (dk,
+		"\xb7\x04\x48\x8b\xcc\x93\x71\xa5\xfa\x3a\x7e\xb6\xe7\x55\x55\x49"
+		"\xa9\x6e\xae\x3d\x57\x2c\x0d\x50\x5e\x19\x70\xf8\x46\x04\x25\xd0"
+		"\xcc\xc4\xcd\xb0\x91\xf2\x30\x82\xda\x6f\x94\xd3\xe5\x94\x01\x20"
+		"\x75\x44\x34\x91\xb6\x08\xd8\x1a\xf3\x79\x52\xc2\x05\x40\x3a\xd3"
+		"\x36\x26\x7f\xf6\xae\x03\x9b\x05\x61\x73\x19\x09\xfb\x35\xe5\x72", 80) != 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+
+static unsigned __stdcall RandomThreadStreamTestProc (void *arg)
+{
+	unsigned char buffer[PKCS5_SALT_SIZE];
+
+	*(BOOL *) arg = RandgetThreadBytes (buffer, sizeof (buffer));
+	burn (buffer, sizeof (buffer));
+	return 0;
+}
+
+/* Random streams (RandomStream.c). The generator is started and restarted by the test, so it must not be
+   running when the test starts. */
+BOOL test_random_streams (void)
+{
+	PRANDOM_STREAM stream = NULL;
+	unsigned char first[64], second[64];
+	BOOL bThreadResult = FALSE, bStarted = FALSE, bResult = FALSE;
+	HANDLE thread;
+	int streamCount;
+
+	if (IsRandomNumberGeneratorStarted () || Randinit ())
+		return FALSE;
+
+	bStarted = TRUE;
+
+	if (RandomStreamOpen (&stream) != ERR_SUCCESS)
+		goto ret;
+
+	/* Consecutive requests must not repeat the output */
+	if (!RandomStreamGetBytes (stream, first, sizeof (first)) || !RandomStreamGetBytes (stream, second, sizeof (second))
+		|| memcmp (first, second, sizeof (first)) == 0)
+		goto ret;
+
+	/* The stream of a thread is released when the thread exits */
+	streamCount = RandomThreadStreamCount ();
+
+	thread = (HANDLE) _beginthreadex (NULL, 0, RandomThreadStreamTestProc, &bThreadResult, 0, NULL);
+	if (!thread)
+		goto ret;
+
+	WaitForSingleObject (thread, INFINITE);
+	CloseHandle (thread);
+
+	if (!bThreadResult || RandomThreadStreamCount () != streamCount)
+		goto ret;
+
+	/* After the generator has been restarted, a stream must reseed before producing output. The reseed 
+	   fails while the generator is stopped again. */
+	RandStop (FALSE);
+	bStarted = FALSE;
+
+	if (Randinit ())
+		goto ret;
+
+	RandStop (FALSE);
+
+	if (RandomStreamGetBytes (stream, first, sizeof (first)))
+		goto ret;
+
+	if (Randinit ())
+		goto ret;
+
+	bStarted = TRUE;
+
+	if (!RandomStreamGetBytes (stream, first, sizeof (first)) || memcmp (first, second, sizeof (first)) == 0)
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	if (stream)
+		RandomStreamClose (stream);
+
+	if (bStarted)
+		RandStop (FALSE);
+
+	burn (first, sizeof (first));
+	burn (second, sizeof (second));
+	return bResult;
+}
+
+
+/* Creates an empty file in the temporary directory */
+static BOOL CreateTestFile (char *path)
+{
+	char tempPath[TC_MAX_PATH];
+
+	return GetTempPath (sizeof (tempPath), tempPath) && GetTempFileName (tempPath, "tct", 0, path);
+}
+
+static void SetTestPassword (Password *password)
+{
+	memset (password, 0, sizeof (*password));
+	strcpy ((char *) password->Text, "test");
+	password->Length = 4;
+}
+
+/* Creates a volume with dataSize bytes of data area in a new file in the temporary directory and sets its
+   password. The master key and the salt are fixed, so the generator is not needed. */
+static BOOL CreateTestVolume (char *path, Password *password, uint64 dataSize)
+{
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	char masterKeydata[MASTER_KEYDATA_SIZE];
+	char salt[PKCS5_SALT_SIZE];
+	VolumeHeaderScratch scratch;
+	PCRYPTO_INFO cryptoInfo;
+	LARGE_INTEGER offset;
+	HANDLE file;
+	DWORD bytesDone;
+	BOOL bResult;
+
+	if (!CreateTestFile (path))
+		return FALSE;
+
+	SetTestPassword (password);
+
+	memset (masterKeydata, 0x5a, sizeof (masterKeydata));
+	memset (salt, 0xa5, sizeof (salt));
+
+	if (CreateVolumeHeaderInMemoryEx (FALSE, header, EAGetFirst (), XTS, password, RIPEMD160, masterKeydata, salt, &cryptoInfo,
+		dataSize, 0, TC_VOLUME_DATA_OFFSET, dataSize, 0, 0, TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, FALSE, &scratch) != ERR_SUCCESS)
+	{
+		DeleteFile (path);
+		return FALSE;
+	}
+
+	crypto_close (cryptoInfo);
+
+	file = CreateFile (path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		DeleteFile (path);
+		return FALSE;
+	}
+
+	/* The primary header, the backup header at the end of the host and a zeroed data area */
+	offset.QuadPart = dataSize + TC_VOLUME_DATA_OFFSET;
+
+	bResult = WriteFile (file, header, sizeof (header), &bytesDone, NULL) && bytesDone == sizeof (header)
+		&& SetFilePointerEx (file, offset, NULL, FILE_BEGIN)
+		&& WriteFile (file, header, sizeof (header), &bytesDone, NULL) && bytesDone == sizeof (header);
+
+	offset.QuadPart += TC_VOLUME_HEADER_GROUP_SIZE;
+	bResult = bResult && SetFilePointerEx (file, offset, NULL, FILE_BEGIN) && SetEndOfFile (file);
+
+	CloseHandle (file);
+
+	if (!bResult)
+		DeleteFile (path);
+
+	return bResult;
+}
+
+/* Write-back buffering of direct volumes (DirectVolume.c). Buffered sectors must be read back before they
+   are flushed and must be on the host once the volume is reopened. */
+BOOL test_direct_volume_write_back (void)
+{
+	const DWORD sectorCount = 64;
+	const uint64 firstSector = 16;
+	char path[TC_MAX_PATH];
+	Password password;
+	PDIRECT_VOLUME volume = NULL;
+	byte *data, *readBack;
+	BOOL bResult = FALSE;
+	DWORD i;
+
+	if (!CreateTestVolume (path, &password, 1024 * 1024))
+		return FALSE;
+
+	data = (byte *) TCalloc (sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+	readBack = (byte *) TCalloc (sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+	if (!data || !readBack)
+		goto ret;
+
+	for (i = 0; i < sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME; ++i)
+		data[i] = (byte) (i * 7 + i / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+
+	if (DirectVolumeOpen (path, &password, FALSE, &volume) != ERR_SUCCESS
+		|| DirectVolumeSetWriteBack (volume, 256 * 1024, 0) != ERR_SUCCESS)
+		goto ret;
+
+	/* Single sectors, in reverse order, and a rewrite of one of them */
+	for (i = sectorCount; i > 0; --i)
+	{
+		if (DirectVolumeWriteSectors (volume, firstSector + i - 1, 1, data + (i - 1) * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME) != ERR_SUCCESS)
+			goto ret;
+	}
+
+	data[5 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME] ^= 0xff;
+	if (DirectVolumeWriteSectors (volume, firstSector + 5, 1, data + 5 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME) != ERR_SUCCESS)
+		goto ret;
+
+	if (DirectVolumeReadSectors (volume, firstSector, sectorCount, readBack) != ERR_SUCCESS
+		|| memcmp (readBack, data, sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME) != 0)
+		goto ret;
+
+	if (DirectVolumeFlush (volume) != ERR_SUCCESS)
+		goto ret;
+
+	DirectVolumeClose (volume);
+	volume = NULL;
+
+	memset (readBack, 0, sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+
+	if (DirectVolumeOpen (path, &password, TRUE, &volume) != ERR_SUCCESS
+		|| DirectVolumeReadSectors (volume, firstSector, sectorCount, readBack) != ERR_SUCCESS
+		|| memcmp (readBack, data, sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME) != 0)
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	if (volume)
+		DirectVolumeClose (volume);
+
+	DeleteFile (path);
+
+	if (data)
+		TCfree (data);
+
+	if (readBack)
+		TCfree (readBack);
+
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+/* Content of the files encrypted in place by the tests */
+static byte GetTestFileByte (uint64 offset)
+{
+	return (byte) (offset * 31 + (offset >> 9));
+}
+
+static BOOL CALLBACK StopAfterFirstCheckpoint (const VOLUME_IMAGE_PROGRESS *progress, void *context)
+{
+	return progress->BytesDone <= VOLUME_IMAGE_INPLACE_BATCH_SIZE;
+}
+
+/* In-place encryption (VolumeImage.c) interrupted after its first checkpoint and resumed. The checkpoint 
+   must describe the encrypted end of the data area and the resumed volume must hold the original data. */
+BOOL test_in_place_encryption_resume (void)
+{
+	const uint64 fileSize = VOLUME_IMAGE_INPLACE_BATCH_SIZE + BYTES_PER_MB + 1000;
+	const uint64 dataAreaSize = (fileSize + TC_SECTOR_SIZE_FILE_HOSTED_VOLUME - 1) / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	char path[TC_MAX_PATH];
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	Password password;
+	PCRYPTO_INFO cryptoInfo = NULL;
+	PDIRECT_VOLUME volume = NULL;
+	byte *buffer;
+	HANDLE file;
+	LARGE_INTEGER offset;
+	DWORD bytesDone, length, i;
+	uint64 pos;
+	BOOL bHeaderRead, bResult = FALSE;
+
+	if (!CreateTestFile (path))
+		return FALSE;
+
+	SetTestPassword (&password);
+
+	buffer = (byte *) TCalloc ((size_t) BYTES_PER_MB);
+	if (!buffer)
+		goto ret;
+
+	file = CreateFile (path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		goto ret;
+
+	for (pos = 0; pos < fileSize; pos += length)
+	{
+		length = (DWORD) min (BYTES_PER_MB, fileSize - pos);
+
+		for (i = 0; i < length; ++i)
+			buffer[i] = GetTestFileByte (pos + i);
+
+		if (!WriteFile (file, buffer, length, &bytesDone, NULL) || bytesDone != length)
+			break;
+	}
+
+	CloseHandle (file);
+
+	if (pos < fileSize)
+		goto ret;
+
+	if (EncryptFileInPlace (path, &password, 0, 0, StopAfterFirstCheckpoint, NULL) != ERR_USER_ABORT)
+		goto ret;
+
+	/* The checkpoint is stored at the backup header location */
+	file = CreateFile (path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		goto ret;
+
+	offset.QuadPart = TC_VOLUME_DATA_OFFSET + dataAreaSize;
+
+	bHeaderRead = SetFilePointerEx (file, offset, NULL, FILE_BEGIN)
+		&& ReadFile (file, header, sizeof (header), &bytesDone, NULL) && bytesDone == sizeof (header);
+
+	CloseHandle (file);
+
+	if (!bHeaderRead || ReadVolumeHeader (FALSE, header, &password, &cryptoInfo, NULL) != ERR_SUCCESS
+		|| cryptoInfo->EncryptedAreaLength.Value != VOLUME_IMAGE_INPLACE_BATCH_SIZE
+		|| cryptoInfo->EncryptedAreaStart.Value != TC_VOLUME_DATA_OFFSET + dataAreaSize - VOLUME_IMAGE_INPLACE_BATCH_SIZE)
+	{
+		goto ret;
+	}
+
+	if (ResumeFileInPlaceEncryption (path, &password, NULL, NULL) != ERR_SUCCESS)
+		goto ret;
+
+	if (DirectVolumeOpen (path, &password, TRUE, &volume) != ERR_SUCCESS || DirectVolumeGetSize (volume) != dataAreaSize)
+		goto ret;
+
+	for (pos = 0; pos < dataAreaSize; pos += length)
+	{
+		length = (DWORD) min (BYTES_PER_MB, dataAreaSize - pos);
+
+		if (DirectVolumeReadSectors (volume, pos / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, length / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, buffer) != ERR_SUCCESS)
+			goto ret;
+
+		for (i = 0; i < length && pos + i < fileSize; ++i)
+		{
+			if (buffer[i] != GetTestFileByte (pos + i))
+				goto ret;
+		}
+	}
+
+	bResult = TRUE;
+
+ret:
+	if (volume)
+		DirectVolumeClose (volume);
+
+	if (cryptoInfo)
+		crypto_close (cryptoInfo);
+
+	DeleteFile (path);
+
+	if (buffer)
+		TCfree (buffer);
+
+	burn (header, sizeof (header));
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+/* Batch mounting (MountBatch.c) of volumes with correct and wrong passwords, which are mounted by several
+   threads at once. The driver must be loaded. */
+BOOL test_mount_batch (void)
+{
+	enum { volumeCount = 4 };
+	TCAPI_MOUNT_ENTRY entries[volumeCount];
+	char paths[volumeCount][TC_MAX_PATH];
+	Password password;
+	DWORD freeDrives = ~GetLogicalDrives ();
+	int driveNo = MAX_MOUNTED_VOLUME_DRIVE_NUMBER;
+	int createdCount, mountedCount, i;
+	BOOL bResult = FALSE;
+
+	memset (entries, 0, sizeof (entries));
+
+	for (createdCount = 0; createdCount < volumeCount; ++createdCount)
+	{
+		if (!CreateTestVolume (paths[createdCount], &password, 1024 * 1024))
+			goto ret;
+	}
+
+	/* Every other entry has a wrong password. The drives are taken from the end of the alphabet. */
+	for (i = 0; i < volumeCount; ++i)
+	{
+		while (driveNo >= MIN_MOUNTED_VOLUME_DRIVE_NUMBER && !(freeDrives & (1 << driveNo)))
+			--driveNo;
+
+		if (driveNo < MIN_MOUNTED_VOLUME_DRIVE_NUMBER)
+			goto ret;
+
+		strcpy (entries[i].VolumePath, paths[i]);
+		entries[i].DriveNo = driveNo--;
+		entries[i].VolumePassword = password;
+
+		if (i % 2 != 0)
+			entries[i].VolumePassword.Text[0] ^= 1;
+	}
+
+	mountedCount = MountVolumeBatch (entries, volumeCount, volumeCount);
+
+	for (i = 0; i < volumeCount; ++i)
+	{
+		if (i % 2 == 0 && entries[i].Result <= 0)
+			goto ret;
+
+		if (i % 2 != 0 && (entries[i].Result != 0 || entries[i].LastError != TCAPI_E_WRONG_PASSWORD))
+			goto ret;
+	}
+
+	bResult = mountedCount == (volumeCount + 1) / 2;
+
+ret:
+	for (i = 0; i < volumeCount; ++i)
+	{
+		if (entries[i].Result > 0)
+			UnmountVolume (NULL, entries[i].DriveNo, TRUE);
+	}
+
+	for (i = 0; i < createdCount; ++i)
+		DeleteFile (paths[i]);
+
+	burn (entries, sizeof (entries));
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+static void FillTestSector (byte *sector, uint64 sectorNo)
+{
+	memset (sector, (int) (sectorNo * 3 + 1), TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+}
+
+/* 2Q replacement of the sector cache (SectorCache.c). A sector missed again after leaving A1in is promoted
+   to Am and must survive a scan of sectors read once. Invalidated sectors must not be returned, and data
+   read before an invalidation must not be cached. */
+BOOL test_sector_cache (void)
+{
+	const DWORD capacity = 8;
+	PSECTOR_CACHE cache;
+	SECTOR_CACHE_STATS stats;
+	byte sector[TC_SECTOR_SIZE_FILE_HOSTED_VOLUME], expected[TC_SECTOR_SIZE_FILE_HOSTED_VOLUME];
+	LONG generation;
+	BOOL bResult = FALSE;
+	uint64 i;
+
+	if (SectorCacheCreate (capacity, TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, &cache) != ERR_SUCCESS)
+		return FALSE;
+
+	/* Fill the cache; all sectors enter A1in */
+	for (i = 0; i < capacity; ++i)
+	{
+		FillTestSector (sector, i);
+		SectorCacheInsert (cache, i, sector, SectorCacheGetGeneration (cache));
+	}
+
+	for (i = 0; i < capacity; ++i)
+	{
+		FillTestSector (expected, i);
+
+		if (!SectorCacheLookup (cache, i, sector) || memcmp (sector, expected, sizeof (sector)) != 0)
+			goto ret;
+	}
+
+	/* A1in is evicted first in, first out, so sector 0 leaves for A1out */
+	FillTestSector (sector, capacity);
+	SectorCacheInsert (cache, capacity, sector, SectorCacheGetGeneration (cache));
+
+	if (SectorCacheLookup (cache, 0, sector) || !SectorCacheLookup (cache, capacity, sector))
+		goto ret;
+
+	/* Sector 0 is missed again while remembered in A1out, so it is promoted to Am */
+	FillTestSector (sector, 0);
+	SectorCacheInsert (cache, 0, sector, SectorCacheGetGeneration (cache));
+
+	/* A scan of sectors read once evicts the rest of A1in, but not the hot sector */
+	for (i = 100; i < 100 + 4 * capacity; ++i)
+	{
+		FillTestSector (sector, i);
+		SectorCacheInsert (cache, i, sector, SectorCacheGetGeneration (cache));
+	}
+
+	FillTestSector (expected, 0);
+
+	if (!SectorCacheLookup (cache, 0, sector) || memcmp (sector, expected, sizeof (sector)) != 0)
+		goto ret;
+
+	for (i = 1; i <= capacity; ++i)
+	{
+		if (SectorCacheLookup (cache, i, sector))
+			goto ret;
+	}
+
+	SectorCacheGetStats (cache, &stats);
+	if (stats.ResidentSectors != capacity || stats.Evictions == 0)
+		goto ret;
+
+	/* A written sector is invalidated */
+	SectorCacheInvalidate (cache, 0, 1);
+
+	if (SectorCacheLookup (cache, 0, sector))
+		goto ret;
+
+	/* Data read before another sector was written is ignored, as it may be stale */
+	generation = SectorCacheGetGeneration (cache);
+	SectorCacheInvalidate (cache, 100 + 4 * capacity - 1, 1);
+
+	FillTestSector (sector, 200);
+	SectorCacheInsert (cache, 200, sector, generation);
+
+	if (SectorCacheLookup (cache, 200, sector))
+		goto ret;
+
+	SectorCacheInsert (cache, 200, sector, SectorCacheGetGeneration (cache));
+
+	if (!SectorCacheLookup (cache, 200, sector))
+		goto ret;
+
+	/* A range larger than the cache is invalidated by scanning all entries */
+	SectorCacheInvalidate (cache, 0, 0x10000);
+
+	SectorCacheGetStats (cache, &stats);
+	if (stats.ResidentSectors != 0 || SectorCacheLookup (cache, 200, sector))
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	SectorCacheDestroy (cache);
+
+	burn (sector, sizeof (sector));
+	return bResult;
+}
+
+
+typedef struct
+{
+	PDIRECT_VOLUME Volume;
+	uint64 RegionSectors;
+	uint64 TargetSector;
+	volatile LONG WrittenVersion;	/* Last version of the target sector whose write has completed */
+	volatile LONG Done;
+	BOOL Result;
+} ReadAheadTestContext;
+
+/* Reads the region sequentially in small requests, which are served by read-ahead windows. The target
+   sector must never be older than the version written before the read started. */
+static unsigned __stdcall ReadAheadTestReaderProc (void *arg)
+{
+	ReadAheadTestContext *context = (ReadAheadTestContext *) arg;
+	byte buffer[8 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME];
+	const DWORD sectorCount = sizeof (buffer) / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	uint64 sectorNo;
+	LONG expected, version;
+
+	context->Result = TRUE;
+
+	while (!context->Done && context->Result)
+	{
+		for (sectorNo = 0; sectorNo < context->RegionSectors && context->Result; sectorNo += sectorCount)
+		{
+			expected = context->WrittenVersion;
+
+			if (DirectVolumeReadSectors (context->Volume, sectorNo, sectorCount, buffer) != ERR_SUCCESS)
+			{
+				context->Result = FALSE;
+				break;
+			}
+
+			if (context->TargetSector >= sectorNo && context->TargetSector < sectorNo + sectorCount)
+			{
+				memcpy (&version, buffer + (size_t) (context->TargetSector - sectorNo) * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, sizeof (version));
+
+				if (version < expected)
+					context->Result = FALSE;
+			}
+		}
+	}
+
+	burn (buffer, sizeof (buffer));
+	return 0;
+}
+
+/* Read-ahead of direct volumes (DirectVolume.c) racing with writes. A window filled while a write of one
+   of its sectors completed may be stale and must not be published (WriteGeneration). The race is not 
+   forced, but the check cannot fail spuriously, so a stale window is detected whenever it is served. */
+BOOL test_direct_volume_read_ahead (void)
+{
+	const LONG versionCount = 2000;
+	ReadAheadTestContext context;
+	char path[TC_MAX_PATH];
+	Password password;
+	byte sector[TC_SECTOR_SIZE_FILE_HOSTED_VOLUME];
+	HANDLE thread = NULL;
+	LONG version;
+	BOOL bResult = FALSE;
+
+	if (!CreateTestVolume (path, &password, 2 * 1024 * 1024))
+		return FALSE;
+
+	memset (&context, 0, sizeof (context));
+	context.RegionSectors = 1024 * 1024 / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	context.TargetSector = context.RegionSectors * 3 / 4;
+
+	if (DirectVolumeOpen (path, &password, FALSE, &context.Volume) != ERR_SUCCESS)
+		goto ret;
+
+	thread = (HANDLE) _beginthreadex (NULL, 0, ReadAheadTestReaderProc, &context, 0, NULL);
+	if (!thread)
+		goto ret;
+
+	for (version = 1; version <= versionCount; ++version)
+	{
+		memset (sector, (int) version, sizeof (sector));
+		memcpy (sector, &version, sizeof (version));
+
+		if (DirectVolumeWriteSectors (context.Volume, context.TargetSector, 1, sector) != ERR_SUCCESS)
+			break;
+
+		InterlockedExchange (&context.WrittenVersion, version);
+	}
+
+	InterlockedExchange (&context.Done, TRUE);
+	WaitForSingleObject (thread, INFINITE);
+	CloseHandle (thread);
+
+	if (version <= versionCount || !context.Result)
+		goto ret;
+
+	/* The last version is read back through a new window */
+	if (DirectVolumeReadSectors (context.Volume, context.TargetSector, 1, sector) != ERR_SUCCESS
+		|| memcmp (sector, &versionCount, sizeof (versionCount)) != 0)
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	if (context.Volume)
+		DirectVolumeClose (context.Volume);
+
+	DeleteFile (path);
+
+	burn (sector, sizeof (sector));
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+/* Reads and decrypts part of the data area of a test volume the way TrueCrypt does it: synchronously,
+   without the pipeline, the caches or the thread pool of direct volumes. */
+static BOOL ReadTestVolumePlaintext (const char *path, Password *password, uint64 offset, byte *buffer, DWORD length)
+{
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	PCRYPTO_INFO cryptoInfo = NULL;
+	UINT64_STRUCT dataUnitNo;
+	LARGE_INTEGER hostOffset;
+	HANDLE file;
+	DWORD bytesDone;
+	BOOL bResult = FALSE;
+
+	file = CreateFile (path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	if (!ReadFile (file, header, sizeof (header), &bytesDone, NULL) || bytesDone != sizeof (header)
+		|| ReadVolumeHeader (FALSE, header, password, &cryptoInfo, NULL) != ERR_SUCCESS)
+		goto ret;
+
+	/* The data area of a normal volume starts where its encrypted area does */
+	hostOffset.QuadPart = cryptoInfo->EncryptedAreaStart.Value + offset;
+
+	if (!SetFilePointerEx (file, hostOffset, NULL, FILE_BEGIN)
+		|| !ReadFile (file, buffer, length, &bytesDone, NULL) || bytesDone != length)
+		goto ret;
+
+	dataUnitNo.Value = hostOffset.QuadPart / ENCRYPTION_DATA_UNIT_SIZE;
+	DecryptDataUnitsCurrentThread (buffer, &dataUnitNo, length / ENCRYPTION_DATA_UNIT_SIZE, cryptoInfo);
+
+	bResult = TRUE;
+
+ret:
+	if (cryptoInfo)
+		crypto_close (cryptoInfo);
+
+	CloseHandle (file);
+	burn (header, sizeof (header));
+	return bResult;
+}
+
+typedef struct
+{
+	byte *Buffer;
+	uint64 FirstSector;
+	uint64 NextSector;
+} StreamTestContext;
+
+/* Copies the fragments to the buffer and checks that they arrive in ascending order */
+static BOOL CALLBACK CopyStreamFragment (unsigned __int64 sectorNo, DWORD sectorCount, unsigned char *data, void *context)
+{
+	StreamTestContext *streamContext = (StreamTestContext *) context;
+
+	if (sectorNo != streamContext->NextSector)
+		return FALSE;
+
+	memcpy (streamContext->Buffer + (size_t) (sectorNo - streamContext->FirstSector) * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME,
+		data, (size_t) sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+
+	streamContext->NextSector += sectorCount;
+	return TRUE;
+}
+
+/* Pipelined transfers of direct volumes (DirectVolume.c). Data written and read back with several queue
+   depths, and through the stream reader, must equal what the unpipelined path decrypts from the host. The
+   range is not aligned to the fragments. */
+BOOL test_direct_volume_pipeline (void)
+{
+	const uint64 firstSector = 3;
+	const DWORD sectorCount = (3 * 1024 * 1024 + 7 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME) / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	const DWORD length = sectorCount * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	const DWORD queueDepths[] = { 1, 2, DIRECT_VOLUME_MAX_QUEUE_DEPTH };
+	StreamTestContext streamContext;
+	char path[TC_MAX_PATH];
+	Password password;
+	PDIRECT_VOLUME volume = NULL;
+	byte *data, *readBack;
+	BOOL bResult = FALSE;
+	DWORD i;
+
+	if (!CreateTestVolume (path, &password, 4 * 1024 * 1024))
+		return FALSE;
+
+	data = (byte *) TCalloc (length);
+	readBack = (byte *) TCalloc (length);
+	if (!data || !readBack)
+		goto ret;
+
+	for (i = 0; i < length; ++i)
+		data[i] = (byte) (i * 13 + i / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+
+	/* Read-ahead would serve the reads from its own window */
+	if (DirectVolumeOpen (path, &password, FALSE, &volume) != ERR_SUCCESS
+		|| DirectVolumeSetReadAhead (volume, 0) != ERR_SUCCESS
+		|| DirectVolumeSetQueueDepth (volume, DIRECT_VOLUME_MAX_QUEUE_DEPTH) != ERR_SUCCESS
+		|| DirectVolumeWriteSectors (volume, firstSector, sectorCount, data) != ERR_SUCCESS)
+		goto ret;
+
+	for (i = 0; i < sizeof (queueDepths) / sizeof (queueDepths[0]); ++i)
+	{
+		memset (readBack, 0, length);
+
+		if (DirectVolumeSetQueueDepth (volume, queueDepths[i]) != ERR_SUCCESS
+			|| DirectVolumeReadSectors (volume, firstSector, sectorCount, readBack) != ERR_SUCCESS
+			|| memcmp (readBack, data, length) != 0)
+			goto ret;
+	}
+
+	memset (readBack, 0, length);
+	streamContext.Buffer = readBack;
+	streamContext.FirstSector = firstSector;
+	streamContext.NextSector = firstSector;
+
+	if (DirectVolumeReadStream (volume, firstSector, sectorCount, CopyStreamFragment, &streamContext) != ERR_SUCCESS
+		|| streamContext.NextSector != firstSector + sectorCount
+		|| memcmp (readBack, data, length) != 0)
+		goto ret;
+
+	DirectVolumeClose (volume);
+	volume = NULL;
+
+	memset (readBack, 0, length);
+
+	if (!ReadTestVolumePlaintext (path, &password, firstSector * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, readBack, length)
+		|| memcmp (readBack, data, length) != 0)
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	if (volume)
+		DirectVolumeClose (volume);
+
+	DeleteFile (path);
+
+	if (data)
+		TCfree (data);
+
+	if (readBack)
+	{
+		burn (readBack, length);
+		TCfree (readBack);
+	}
+
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+/* Reads every page of a view, in ascending order or, if reverse is TRUE, in descending order, and compares
+   it with the plaintext of the volume */
+static BOOL CheckViewPages (PDIRECT_VOLUME_VIEW view, const byte *plaintext, uint64 size, BOOL reverse)
+{
+	uint64 pageCount = (size + DIRECT_VOLUME_VIEW_PAGE_SIZE - 1) / DIRECT_VOLUME_VIEW_PAGE_SIZE;
+	uint64 i, pageNo, offset;
+	const unsigned char *data;
+	DWORD length;
+
+	for (i = 0; i < pageCount; ++i)
+	{
+		pageNo = reverse ? pageCount - 1 - i : i;
+		offset = pageNo * DIRECT_VOLUME_VIEW_PAGE_SIZE;
+
+		if (DirectVolumeViewGetPage (view, pageNo, &data, &length) != ERR_SUCCESS
+			|| length != (DWORD) min (DIRECT_VOLUME_VIEW_PAGE_SIZE, size - offset)
+			|| memcmp (data, plaintext + offset, length) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Mapped views of direct volumes (DirectVolume.c). Every page read with each access hint must equal what
+   the unpipelined path decrypts from the host, including the shorter last page and pages beyond the first
+   mapped window of the host. A write through the volume must replace the cached pages. */
+BOOL test_direct_volume_view (void)
+{
+	const uint64 size = 17 * 1024 * 1024 + 8 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	const int accessHints[] = { DIRECT_VOLUME_ACCESS_NORMAL, DIRECT_VOLUME_ACCESS_SEQUENTIAL, DIRECT_VOLUME_ACCESS_RANDOM };
+	char path[TC_MAX_PATH];
+	Password password;
+	PDIRECT_VOLUME volume = NULL;
+	PDIRECT_VOLUME_VIEW view = NULL;
+	byte *data, *plaintext;
+	const unsigned char *page;
+	DWORD length, i;
+	BOOL bResult = FALSE;
+
+	if (!CreateTestVolume (path, &password, size))
+		return FALSE;
+
+	data = (byte *) TCalloc ((size_t) size);
+	plaintext = (byte *) TCalloc ((size_t) size);
+	if (!data || !plaintext)
+		goto ret;
+
+	for (i = 0; i < size; ++i)
+		data[i] = (byte) (i * 11 + i / DIRECT_VOLUME_VIEW_PAGE_SIZE);
+
+	if (DirectVolumeOpen (path, &password, FALSE, &volume) != ERR_SUCCESS
+		|| DirectVolumeWriteSectors (volume, 0, (DWORD) (size / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME), data) != ERR_SUCCESS)
+		goto ret;
+
+	if (!ReadTestVolumePlaintext (path, &password, 0, plaintext, (DWORD) size) || memcmp (plaintext, data, (size_t) size) != 0)
+		goto ret;
+
+	/* A small cache, so that pages are evicted and decrypted again */
+	for (i = 0; i < sizeof (accessHints) / sizeof (accessHints[0]); ++i)
+	{
+		if (DirectVolumeOpenView (volume, 4, accessHints[i], &view) != ERR_SUCCESS
+			|| !CheckViewPages (view, plaintext, size, FALSE)
+			|| !CheckViewPages (view, plaintext, size, TRUE))
+			goto ret;
+
+		DirectVolumeCloseView (view);
+		view = NULL;
+	}
+
+	/* Page 1 is cached before its first sector is rewritten */
+	if (DirectVolumeOpenView (volume, 4, DIRECT_VOLUME_ACCESS_NORMAL, &view) != ERR_SUCCESS
+		|| DirectVolumeViewGetPage (view, 1, &page, &length) != ERR_SUCCESS)
+		goto ret;
+
+	for (i = 0; i < TC_SECTOR_SIZE_FILE_HOSTED_VOLUME; ++i)
+		plaintext[DIRECT_VOLUME_VIEW_PAGE_SIZE + i] ^= 0xff;
+
+	if (DirectVolumeWriteSectors (volume, DIRECT_VOLUME_VIEW_PAGE_SIZE / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, 1,
+		plaintext + DIRECT_VOLUME_VIEW_PAGE_SIZE) != ERR_SUCCESS)
+		goto ret;
+
+	if (DirectVolumeViewGetPage (view, 1, &page, &length) != ERR_SUCCESS
+		|| memcmp (page, plaintext + DIRECT_VOLUME_VIEW_PAGE_SIZE, DIRECT_VOLUME_VIEW_PAGE_SIZE) != 0)
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	if (view)
+		DirectVolumeCloseView (view);
+
+	if (volume)
+		DirectVolumeClose (volume);
+
+	DeleteFile (path);
+
+	if (data)
+		TCfree (data);
+
+	if (plaintext)
+	{
+		burn (plaintext, (size_t) size);
+		TCfree (plaintext);
+	}
+
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+/* Creates or overwrites a file with the given content */
+static BOOL WriteTestFile (const char *path, const byte *data, DWORD length)
+{
+	HANDLE file;
+	DWORD bytesDone;
+	BOOL bResult;
+
+	file = CreateFile (path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	bResult = WriteFile (file, data, length, &bytesDone, NULL) && bytesDone == length;
+
+	CloseHandle (file);
+	return bResult;
+}
+
+static BOOL CALLBACK RecordProgress (const VOLUME_IMAGE_PROGRESS *progress, void *context)
+{
+	*(VOLUME_IMAGE_PROGRESS *) context = *progress;
+	return TRUE;
+}
+
+/* Content of the test images: GetTestFileByte with zero runs, one of them 64 KB-aligned */
+static void FillTestImage (byte *image, DWORD length)
+{
+	DWORD i;
+
+	for (i = 0; i < length; ++i)
+		image[i] = GetTestFileByte (i);
+
+	memset (image + 100000, 0, 300);
+	memset (image + 5 * 64 * 1024, 0, 4 * 64 * 1024);
+}
+
+/* Encryption of a plaintext image to a new volume (VolumeImage.c). The image size is not a multiple of the
+   sector size. The data area must hold the image followed by zeros, both headers must be valid and the
+   progress must end at the size of the data area. */
+BOOL test_image_to_volume (void)
+{
+	const DWORD imageSize = 3 * BYTES_PER_MB + 1000;
+	const DWORD dataAreaSize = (imageSize + TC_SECTOR_SIZE_FILE_HOSTED_VOLUME - 1) / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	char imagePath[TC_MAX_PATH], volumePath[TC_MAX_PATH];
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	Password password;
+	PCRYPTO_INFO cryptoInfo = NULL;
+	VOLUME_IMAGE_PROGRESS progress;
+	byte *image = NULL, *plaintext = NULL;
+	LARGE_INTEGER offset;
+	HANDLE file;
+	DWORD bytesDone;
+	BOOL bHeaderRead, bVolumePathCreated = FALSE, bResult = FALSE;
+
+	SetTestPassword (&password);
+	memset (&progress, 0, sizeof (progress));
+
+	if (!CreateTestFile (imagePath))
+		return FALSE;
+
+	/* The volume file must not exist */
+	if (!CreateTestFile (volumePath))
+		goto ret;
+
+	bVolumePathCreated = TRUE;
+	DeleteFile (volumePath);
+
+	image = (byte *) TCalloc (dataAreaSize);
+	plaintext = (byte *) TCalloc (dataAreaSize);
+	if (!image || !plaintext)
+		goto ret;
+
+	memset (image, 0, dataAreaSize);
+	FillTestImage (image, imageSize);
+
+	if (!WriteTestFile (imagePath, image, imageSize))
+		goto ret;
+
+	if (EncryptImageToVolume (imagePath, volumePath, &password, 0, 0, RecordProgress, &progress) != ERR_SUCCESS
+		|| progress.BytesDone != dataAreaSize || progress.BytesTotal != dataAreaSize)
+		goto ret;
+
+	if (!ReadTestVolumePlaintext (volumePath, &password, 0, plaintext, dataAreaSize)
+		|| memcmp (plaintext, image, dataAreaSize) != 0)
+		goto ret;
+
+	/* The backup header follows the data area */
+	file = CreateFile (volumePath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		goto ret;
+
+	offset.QuadPart = TC_VOLUME_DATA_OFFSET + dataAreaSize;
+
+	bHeaderRead = SetFilePointerEx (file, offset, NULL, FILE_BEGIN)
+		&& ReadFile (file, header, sizeof (header), &bytesDone, NULL) && bytesDone == sizeof (header);
+
+	CloseHandle (file);
+
+	if (!bHeaderRead || ReadVolumeHeader (FALSE, header, &password, &cryptoInfo, NULL) != ERR_SUCCESS
+		|| cryptoInfo->VolumeSize.Value != dataAreaSize)
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	if (cryptoInfo)
+		crypto_close (cryptoInfo);
+
+	DeleteFile (imagePath);
+
+	if (bVolumePathCreated)
+		DeleteFile (volumePath);
+
+	if (image)
+		TCfree (image);
+
+	if (plaintext)
+	{
+		burn (plaintext, dataAreaSize);
+		TCfree (plaintext);
+	}
+
+	burn (header, sizeof (header));
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+/* Reads a file, which must be exactly length bytes long */
+static BOOL ReadTestFile (const char *path, byte *buffer, DWORD length)
+{
+	LARGE_INTEGER fileSize;
+	HANDLE file;
+	DWORD bytesDone;
+	BOOL bResult;
+
+	file = CreateFile (path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	bResult = GetFileSizeEx (file, &fileSize) && fileSize.QuadPart == length
+		&& ReadFile (file, buffer, length, &bytesDone, NULL) && bytesDone == length;
+
+	CloseHandle (file);
+	return bResult;
+}
+
+/* Export of a volume to a plaintext image (VolumeImage.c), with and without sparse output. Besides the
+   zero runs of the test image, the data has a zero run across the boundary of the 1 MB export chunks, which
+   ends inside a block, and ends with zeros, which a sparse export does not write. Both images must equal
+   the data, at its full size. */
+BOOL test_volume_to_image (void)
+{
+	const DWORD dataSize = 3 * BYTES_PER_MB + 64 * 1024 + 8 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+	const DWORD flags[] = { 0, VOLUME_IMAGE_EXPORT_SPARSE };
+	char volumePath[TC_MAX_PATH], imagePath[TC_MAX_PATH];
+	Password password;
+	PDIRECT_VOLUME volume = NULL;
+	VOLUME_IMAGE_PROGRESS progress;
+	byte *data = NULL, *image = NULL;
+	BOOL bImagePathCreated = FALSE, bResult = FALSE;
+	DWORD i;
+
+	if (!CreateTestVolume (volumePath, &password, dataSize))
+		return FALSE;
+
+	if (!CreateTestFile (imagePath))
+		goto ret;
+
+	bImagePathCreated = TRUE;
+
+	data = (byte *) TCalloc (dataSize);
+	image = (byte *) TCalloc (dataSize);
+	if (!data || !image)
+		goto ret;
+
+	FillTestImage (data, dataSize);
+	memset (data + BYTES_PER_MB - 64 * 1024, 0, 3 * 64 * 1024 + 1000);
+	memset (data + dataSize - 64 * 1024 - 8 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, 0, 64 * 1024 + 8 * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME);
+
+	if (DirectVolumeOpen (volumePath, &password, FALSE, &volume) != ERR_SUCCESS
+		|| DirectVolumeWriteSectors (volume, 0, dataSize / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, data) != ERR_SUCCESS)
+		goto ret;
+
+	DirectVolumeClose (volume);
+	volume = NULL;
+
+	for (i = 0; i < sizeof (flags) / sizeof (flags[0]); ++i)
+	{
+		memset (&progress, 0, sizeof (progress));
+		memset (image, 0xff, dataSize);
+
+		if (DecryptVolumeToImage (volumePath, &password, imagePath, flags[i], RecordProgress, &progress) != ERR_SUCCESS
+			|| progress.BytesDone != dataSize || progress.BytesTotal != dataSize)
+			goto ret;
+
+		if (!ReadTestFile (imagePath, image, dataSize) || memcmp (image, data, dataSize) != 0)
+			goto ret;
+
+		/* So that the sparse image cannot pass with data left by the previous one */
+		if (!DeleteFile (imagePath))
+			goto ret;
+	}
+
+	bResult = TRUE;
+
+ret:
+	if (volume)
+		DirectVolumeClose (volume);
+
+	DeleteFile (volumePath);
+
+	if (bImagePathCreated)
+		DeleteFile (imagePath);
+
+	if (data)
+		TCfree (data);
+
+	if (image)
+	{
+		burn (image, dataSize);
+		TCfree (image);
+	}
+
+	burn (&password, sizeof (password));
+	return bResult;
+}
+
+
+#define ENTROPY_RING_TEST_PRODUCERS 4
+#define ENTROPY_RING_TEST_SAMPLES 20000
+
+typedef struct
+{
+	EntropyRing *Ring;
+	unsigned __int32 Producer;
+} EntropyRingTestProducer;
+
+static unsigned __stdcall EntropyRingTestProducerProc (void *arg)
+{
+	EntropyRingTestProducer *producer = (EntropyRingTestProducer *) arg;
+	unsigned __int32 i;
+
+	for (i = 0; i < ENTROPY_RING_TEST_SAMPLES; ++i)
+	{
+		// Wait for the consumer while the ring is full
+		while (!EntropyRingPush (producer->Ring, producer->Producer << 24 | i))
+			Sleep (0);
+	}
+
+	return 0;
+}
+
+/* Entropy ring (EntropyRing.c). Samples are popped in the order they were pushed, a full ring rejects 
+   samples instead of overwriting unconsumed ones, and concurrent producers lose or duplicate none of 
+   their samples. */
+BOOL test_entropy_ring (void)
+{
+	EntropyRingTestProducer producers[ENTROPY_RING_TEST_PRODUCERS];
+	HANDLE threads[ENTROPY_RING_TEST_PRODUCERS];
+	unsigned __int32 next[ENTROPY_RING_TEST_PRODUCERS];
+	unsigned __int32 values[ENTROPY_RING_SIZE];
+	EntropyRing *ring;
+	int threadCount = 0, count, i, j;
+	BOOL bDone, bResult = FALSE;
+
+	ring = (EntropyRing *) TCalloc (sizeof (EntropyRing));
+	if (!ring)
+		return FALSE;
+
+	EntropyRingInit (ring);
+
+	if (EntropyRingPop (ring, values, ENTROPY_RING_SIZE) != 0)
+		goto ret;
+
+	/* Overflow */
+	for (i = 0; i < ENTROPY_RING_SIZE; ++i)
+	{
+		if (!EntropyRingPush (ring, i))
+			goto ret;
+	}
+
+	if (EntropyRingPush (ring, ENTROPY_RING_SIZE))
+		goto ret;
+
+	if (EntropyRingPop (ring, values, 10) != 10)
+		goto ret;
+
+	for (i = 0; i < 10; ++i)
+	{
+		if (values[i] != (unsigned __int32) i)
+			goto ret;
+	}
+
+	/* The freed slots are reused when the ring wraps around */
+	for (i = 0; i < 10; ++i)
+	{
+		if (!EntropyRingPush (ring, ENTROPY_RING_SIZE + i))
+			goto ret;
+	}
+
+	if (EntropyRingPush (ring, 0))
+		goto ret;
+
+	if (EntropyRingPop (ring, values, ENTROPY_RING_SIZE) != ENTROPY_RING_SIZE)
+		goto ret;
+
+	for (i = 0; i < ENTROPY_RING_SIZE; ++i)
+	{
+		if (values[i] != (unsigned __int32) i + 10)
+			goto ret;
+	}
+
+	if (EntropyRingPop (ring, values, ENTROPY_RING_SIZE) != 0)
+		goto ret;
+
+	/* Concurrent producers, single consumer. Each producer pushes its own sequence, which must be popped 
+	   complete and in order however the pushes of the producers interleave. */
+	for (threadCount = 0; threadCount < ENTROPY_RING_TEST_PRODUCERS; ++threadCount)
+	{
+		producers[threadCount].Ring = ring;
+		producers[threadCount].Producer = threadCount;
+		next[threadCount] = 0;
+
+		threads[threadCount] = (HANDLE) _beginthreadex (NULL, 0, EntropyRingTestProducerProc, &producers[threadCount], 0, NULL);
+		if (!threads[threadCount])
+			goto ret;
+	}
+
+	do
+	{
+		count = EntropyRingPop (ring, values, ENTROPY_RING_SIZE);
+
+		for (i = 0; i < count; ++i)
+		{
+			unsigned __int32 producer = values[i] >> 24;
+
+			if (producer >= ENTROPY_RING_TEST_PRODUCERS || (values[i] & 0xffffff) != next[producer]++)
+				goto ret;
+		}
+
+		bDone = TRUE;
+		for (j = 0; j < ENTROPY_RING_TEST_PRODUCERS; ++j)
+		{
+			if (next[j] < ENTROPY_RING_TEST_SAMPLES)
+				bDone = FALSE;
+		}
+
+		if (count == 0)
+			Sleep (0);
+
+	} while (!bDone);
+
+	if (EntropyRingPop (ring, values, ENTROPY_RING_SIZE) != 0)
+		goto ret;
+
+	bResult = TRUE;
+
+ret:
+	// The producers must not be left waiting on a full ring
+	while (threadCount > 0)
+	{
+		if (WaitForSingleObject (threads[threadCount - 1], 0) != WAIT_OBJECT_0)
+		{
+			EntropyRingPop (ring, values, ENTROPY_RING_SIZE);
+			Sleep (0);
+			continue;
+		}
+
+		CloseHandle (threads[--threadCount]);
+	}
+
+	EntropyRingWipe (ring);
+	TCfree (ring);
+	return bResult;
+}
@@ -0,0 +1,34 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+#ifndef TESTS_H
+#define TESTS_H
+
+#include "Tcdefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	BOOL test_pkcs5 (void);
+	BOOL test_random_streams (void);
+	BOOL test_direct_volume_write_back (void);
+	BOOL test_in_place_encryption_resume (void);
+	BOOL test_mount_batch (void);
+	BOOL test_sector_cache (void);
+	BOOL test_direct_volume_read_ahead (void);
+	BOOL test_direct_volume_pipeline (void);
+	BOOL test_direct_volume_view (void);
+	BOOL test_image_to_volume (void);
+	BOOL test_volume_to_image (void);
+	BOOL test_entropy_ring (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
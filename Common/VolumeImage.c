@@ -0,0 +1,1336 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+/* NN: Bulk transfers between plaintext images and volumes. Data is moved in large chunks through a ring
+   of buffers using overlapped I/O: while one chunk is being encrypted or decrypted (in parallel, by the 
+   encryption thread pool), the next one is being read and the previous one written, so disks and CPUs 
+   are kept busy at the same time. */
+
+#include "Tcdefs.h"
+
+#include <process.h>
+#include "Crypto.h"
+#include "Volumes.h"
+#include "VolumeImage.h"
+#include "BatchWorker.h"
+#include "DirectVolume.h"
+#include "EncryptionThreadPool.h"
+#include "Random.h"
+#include "RandomStream.h"
+#include "Crc.h"
+#include "Endian.h"
+#include "Errors.h"
+
+#define VOLUME_IMAGE_CHUNK_SIZE		(1024 * 1024)
+
+// One buffer is being read, one transformed and one written
+#define VOLUME_IMAGE_BUFFER_COUNT	3
+
+#define VOLUME_IMAGE_INPLACE_JOURNAL_SIZE	(VOLUME_IMAGE_INPLACE_BATCH_SIZE + TC_SECTOR_SIZE_FILE_HOSTED_VOLUME)
+#define VOLUME_IMAGE_INPLACE_JOURNAL_MAGIC	0x4A504C49	// 'IPLJ'
+
+// Granularity of sparse exports (allocation unit of NTFS sparse files)
+#define VOLUME_IMAGE_SPARSE_BLOCK_SIZE		(64 * 1024)
+
+typedef struct
+{
+	OVERLAPPED Overlapped;
+	byte *Data;
+	DWORD Length;
+	HANDLE PendingFile;		// File of the pending read or write; NULL if none
+	BOOL EndOfFile;			// The read started at or beyond the end of the file
+} ImageChunkBuffer;
+
+typedef struct
+{
+	HANDLE Source;
+	uint64 SourceOffset;
+	HANDLE Destination;
+	uint64 DestinationOffset;
+	uint64 Length;			// Multiple of ENCRYPTION_DATA_UNIT_SIZE
+	BOOL AllowShortSource;	// The source may end before Length (the rest is zero)
+	PCRYPTO_INFO CryptoInfo;	// NULL to copy the data unchanged
+	BOOL Encrypt;
+	uint64 FirstDataUnitNo;	// Data unit number of the first ciphertext byte
+	PVOLUME_IMAGE_PROGRESS_CALLBACK ProgressCallback;
+	void *ProgressContext;
+	uint64 ProgressBase;	// Bytes of the whole operation done before this transfer
+	uint64 ProgressTotal;	// Bytes of the whole operation
+	uint64 StartBytes;		// Bytes done when the operation was started or resumed
+	DWORD StartTime;
+} ImageTransfer;
+
+// Stored in the last sector of the in-place encryption journal once the journal holds the plaintext of a batch
+typedef struct
+{
+	uint64 BatchStart;
+	uint64 BatchEnd;
+	uint32 Magic;
+	uint32 Crc;
+} InPlaceJournalTrailer;
+
+// Writes exported plaintext from a thread of its own while the next buffer is being decrypted
+typedef struct
+{
+	HANDLE File;
+	BOOL Sparse;
+	DWORD SectorSize;
+	byte *Buffers[2];
+	int Current;			// Buffer being filled
+	DWORD Filled;
+	uint64 Offset;			// Output offset of the buffer being filled
+	int PendingBuffer;		// Buffer being written
+	DWORD PendingLength;
+	uint64 PendingOffset;
+	HANDLE Thread;
+	HANDLE DataReadyEvent;
+	HANDLE WriteDoneEvent;
+	BOOL Stop;
+	int Status;				// Result of the writes
+	DWORD LastError;
+	ImageTransfer Progress;	// Progress reporting only
+} ImageWriter;
+
+
+static BOOL BeginChunkIo (HANDLE file, BOOL write, ImageChunkBuffer *buffer, uint64 offset)
+{
+	BOOL bResult;
+
+	buffer->Overlapped.Internal = 0;
+	buffer->Overlapped.InternalHigh = 0;
+	buffer->Overlapped.Offset = (DWORD) offset;
+	buffer->Overlapped.OffsetHigh = (DWORD) (offset >> 32);
+	buffer->EndOfFile = FALSE;
+
+	if (write)
+		bResult = WriteFile (file, buffer->Data, buffer->Length, NULL, &buffer->Overlapped);
+	else
+		bResult = ReadFile (file, buffer->Data, buffer->Length, NULL, &buffer->Overlapped);
+
+	if (!bResult)
+	{
+		if (!write && GetLastError () == ERROR_HANDLE_EOF)
+		{
+			buffer->EndOfFile = TRUE;
+			return TRUE;
+		}
+
+		if (GetLastError () != ERROR_IO_PENDING)
+			return FALSE;
+	}
+
+	buffer->PendingFile = file;
+	return TRUE;
+}
+
+
+static BOOL CompleteChunkIo (ImageChunkBuffer *buffer, DWORD *bytesTransferred)
+{
+	HANDLE file = buffer->PendingFile;
+
+	*bytesTransferred = 0;
+
+	if (buffer->EndOfFile)
+		return TRUE;
+
+	buffer->PendingFile = NULL;
+
+	if (!GetOverlappedResult (file, &buffer->Overlapped, bytesTransferred, TRUE))
+		return GetLastError () == ERROR_HANDLE_EOF;
+
+	return TRUE;
+}
+
+
+static void UpdateImageProgress (ImageTransfer *transfer, VOLUME_IMAGE_PROGRESS *progress, uint64 bytesDone)
+{
+	progress->BytesDone = transfer->ProgressBase + bytesDone;
+	progress->BytesTotal = transfer->ProgressTotal;
+	progress->ElapsedTime = GetTickCount () - transfer->StartTime;
+	progress->BytesPerSecond = (progress->BytesDone - transfer->StartBytes) * 1000 / max (progress->ElapsedTime, 1);
+}
+
+
+// Reports the chunks of the transfer whose writes have completed
+static int ReportImageTransferProgress (ImageTransfer *transfer, VOLUME_IMAGE_PROGRESS *progress, uint64 chunksWritten)
+{
+	if (!transfer->ProgressCallback)
+		return ERR_SUCCESS;
+
+	UpdateImageProgress (transfer, progress, min (chunksWritten * VOLUME_IMAGE_CHUNK_SIZE, transfer->Length));
+
+	return transfer->ProgressCallback (progress, transfer->ProgressContext) ? ERR_SUCCESS : ERR_USER_ABORT;
+}
+
+
+// Reads, encrypts/decrypts and writes the data of the transfer in chunks
+static int RunImageTransfer (ImageTransfer *transfer)
+{
+	ImageChunkBuffer buffers[VOLUME_IMAGE_BUFFER_COUNT];
+	ImageChunkBuffer *buffer;
+	uint64 chunkCount = (transfer->Length + VOLUME_IMAGE_CHUNK_SIZE - 1) / VOLUME_IMAGE_CHUNK_SIZE;
+	uint64 nextRead = 0, next = 0, written = 0;
+	VOLUME_IMAGE_PROGRESS progress;
+	UINT64_STRUCT dataUnitNo;
+	DWORD bytesTransferred;
+	int status = ERR_SUCCESS;
+	int i;
+
+	memset (buffers, 0, sizeof (buffers));
+	memset (&progress, 0, sizeof (progress));
+
+	for (i = 0; i < VOLUME_IMAGE_BUFFER_COUNT; ++i)
+	{
+		buffers[i].Data = (byte *) TCalloc (VOLUME_IMAGE_CHUNK_SIZE);
+		buffers[i].Overlapped.hEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+
+		if (!buffers[i].Data || !buffers[i].Overlapped.hEvent)
+		{
+			status = buffers[i].Data ? ERR_OS_ERROR : ERR_OUTOFMEMORY;
+			goto ret;
+		}
+
+		VirtualLock (buffers[i].Data, VOLUME_IMAGE_CHUNK_SIZE);
+	}
+
+	while (next < chunkCount)
+	{
+		// Read ahead into the buffers whose writes have been issued before the current chunk
+		while (nextRead < chunkCount && nextRead < next + VOLUME_IMAGE_BUFFER_COUNT - 1)
+		{
+			buffer = &buffers[nextRead % VOLUME_IMAGE_BUFFER_COUNT];
+
+			// A pending operation of a buffer being reused is the write of the oldest chunk
+			if (buffer->PendingFile)
+			{
+				if (!CompleteChunkIo (buffer, &bytesTransferred) || bytesTransferred != buffer->Length)
+				{
+					status = ERR_OS_ERROR;
+					goto ret;
+				}
+
+				status = ReportImageTransferProgress (transfer, &progress, ++written);
+				if (status != ERR_SUCCESS)
+					goto ret;
+			}
+
+			buffer->Length = (DWORD) min (VOLUME_IMAGE_CHUNK_SIZE, transfer->Length - nextRead * VOLUME_IMAGE_CHUNK_SIZE);
+
+			if (!BeginChunkIo (transfer->Source, FALSE, buffer, transfer->SourceOffset + nextRead * VOLUME_IMAGE_CHUNK_SIZE))
+			{
+				status = ERR_OS_ERROR;
+				goto ret;
+			}
+
+			++nextRead;
+		}
+
+		buffer = &buffers[next % VOLUME_IMAGE_BUFFER_COUNT];
+
+		if (!CompleteChunkIo (buffer, &bytesTransferred))
+		{
+			status = ERR_OS_ERROR;
+			goto ret;
+		}
+
+		if (bytesTransferred < buffer->Length)
+		{
+			if (!transfer->AllowShortSource)
+			{
+				SetLastError (ERROR_HANDLE_EOF);
+				status = ERR_OS_ERROR;
+				goto ret;
+			}
+
+			memset (buffer->Data + bytesTransferred, 0, buffer->Length - bytesTransferred);
+		}
+
+		if (transfer->CryptoInfo)
+		{
+			dataUnitNo.Value = transfer->FirstDataUnitNo + next * (VOLUME_IMAGE_CHUNK_SIZE / ENCRYPTION_DATA_UNIT_SIZE);
+
+			if (transfer->Encrypt)
+				EncryptDataUnits (buffer->Data, &dataUnitNo, buffer->Length / ENCRYPTION_DATA_UNIT_SIZE, transfer->CryptoInfo);
+			else
+				DecryptDataUnits (buffer->Data, &dataUnitNo, buffer->Length / ENCRYPTION_DATA_UNIT_SIZE, transfer->CryptoInfo);
+		}
+
+		if (!BeginChunkIo (transfer->Destination, TRUE, buffer, transfer->DestinationOffset + next * VOLUME_IMAGE_CHUNK_SIZE))
+		{
+			status = ERR_OS_ERROR;
+			goto ret;
+		}
+
+		++next;
+	}
+
+	// Complete the remaining writes in chunk order
+	while (written < chunkCount)
+	{
+		buffer = &buffers[written % VOLUME_IMAGE_BUFFER_COUNT];
+
+		if (!CompleteChunkIo (buffer, &bytesTransferred) || bytesTransferred != buffer->Length)
+		{
+			status = ERR_OS_ERROR;
+			goto ret;
+		}
+
+		status = ReportImageTransferProgress (transfer, &progress, ++written);
+		if (status != ERR_SUCCESS)
+			goto ret;
+	}
+
+ret:
+	// The buffers must not be released while they are being read or written
+	for (i = 0; i < VOLUME_IMAGE_BUFFER_COUNT; ++i)
+	{
+		// Only writes can be pending after the last chunk
+		if (buffers[i].PendingFile && !buffers[i].EndOfFile
+			&& (!CompleteChunkIo (&buffers[i], &bytesTransferred) || bytesTransferred != buffers[i].Length)
+			&& status == ERR_SUCCESS)
+		{
+			status = ERR_OS_ERROR;
+		}
+
+		if (buffers[i].Overlapped.hEvent)
+			CloseHandle (buffers[i].Overlapped.hEvent);
+
+		if (buffers[i].Data)
+		{
+			burn (buffers[i].Data, VOLUME_IMAGE_CHUNK_SIZE);
+			VirtualUnlock (buffers[i].Data, VOLUME_IMAGE_CHUNK_SIZE);
+			TCfree (buffers[i].Data);
+		}
+	}
+
+	return status;
+}
+
+
+// Validates the password and applies the defaults to the algorithms of a new volume
+static BOOL CheckFormatParameters (Password *password, int *ea, int *pkcs5)
+{
+	if (!password || password->Length == 0 || password->Length > MAX_PASSWORD)
+		return FALSE;
+
+	if (*ea == 0)
+		*ea = EAGetFirst ();
+
+	if (*pkcs5 == 0)
+		*pkcs5 = DEFAULT_HASH_ALGORITHM;
+
+	return EAIsFormatEnabled (*ea) && *pkcs5 >= FIRST_PRF_ID && *pkcs5 <= LAST_PRF_ID;
+}
+
+
+// Reads or writes at the given offset of a file opened for overlapped I/O and waits for completion
+static BOOL TransferAt (HANDLE file, BOOL write, uint64 offset, void *data, DWORD length)
+{
+	OVERLAPPED overlapped;
+	DWORD bytesTransferred;
+	BOOL bResult;
+
+	memset (&overlapped, 0, sizeof (overlapped));
+	overlapped.Offset = (DWORD) offset;
+	overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+	overlapped.hEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+	if (!overlapped.hEvent)
+		return FALSE;
+
+	if (write)
+		bResult = WriteFile (file, data, length, NULL, &overlapped);
+	else
+		bResult = ReadFile (file, data, length, NULL, &overlapped);
+
+	if (bResult || GetLastError () == ERROR_IO_PENDING)
+		bResult = GetOverlappedResult (file, &overlapped, &bytesTransferred, TRUE) && bytesTransferred == length;
+
+	CloseHandle (overlapped.hEvent);
+	return bResult;
+}
+
+
+// Writes the header at the given offset of a file opened for synchronous I/O
+static int WriteHeaderAt (HANDLE file, uint64 offset, char *header)
+{
+	LARGE_INTEGER headerOffset;
+
+	headerOffset.QuadPart = offset;
+
+	if (!SetFilePointerEx (file, headerOffset, NULL, FILE_BEGIN) || !WriteEffectiveVolumeHeader (FALSE, file, (byte *) header))
+		return ERR_OS_ERROR;
+
+	return ERR_SUCCESS;
+}
+
+
+/* Creates a new file-hosted volume (which must not exist) containing the plaintext image, without the 
+   driver. The data area is the size of the image rounded up to whole sectors. The volume is formatted the
+   way TrueCrypt Format does it: primary header, data area, backup header (with its own salt) and random
+   data in the reserved header areas. A partially created volume is deleted. ea and pkcs5 may be 0 to use
+   the defaults. */
+int EncryptImageToVolume (const char *imagePath, const char *volumePath, Password *password, int ea, int pkcs5,
+	PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext)
+{
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	PCRYPTO_INFO cryptoInfo = NULL, backupCryptoInfo = NULL;
+	HANDLE image = INVALID_HANDLE_VALUE, volume = INVALID_HANDLE_VALUE;
+	BOOL volumeCreated = FALSE;
+	LARGE_INTEGER imageSize, hostSize;
+	uint64 dataAreaSize;
+	ImageTransfer transfer;
+	DWORD dwError;
+	int status;
+
+	if (!imagePath || !volumePath || !CheckFormatParameters (password, &ea, &pkcs5))
+		return ERR_PARAMETER_INCORRECT;
+
+	if (Randinit ())
+		return ERR_OS_ERROR;
+
+	image = CreateFile (imagePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
+	if (image == INVALID_HANDLE_VALUE)
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	if (!GetFileSizeEx (image, &imageSize))
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	dataAreaSize = (imageSize.QuadPart + TC_SECTOR_SIZE_FILE_HOSTED_VOLUME - 1) / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+
+	if (dataAreaSize == 0 || dataAreaSize > TC_MAX_VOLUME_SIZE - TC_TOTAL_VOLUME_HEADERS_SIZE)
+	{
+		status = ERR_VOL_SIZE_WRONG;
+		goto ret;
+	}
+
+	status = CreateVolumeHeaderInMemory (FALSE, header, ea, FIRST_MODE_OF_OPERATION_ID, password, pkcs5, NULL, &cryptoInfo,
+		dataAreaSize, 0, TC_VOLUME_DATA_OFFSET, dataAreaSize, 0, 0, TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, FALSE);
+
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	volume = CreateFile (volumePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_FLAG_OVERLAPPED, NULL);
+	if (volume == INVALID_HANDLE_VALUE)
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	volumeCreated = TRUE;
+
+	// Preallocate the volume
+	hostSize.QuadPart = dataAreaSize + TC_TOTAL_VOLUME_HEADERS_SIZE;
+
+	if (!SetFilePointerEx (volume, hostSize, NULL, FILE_BEGIN) || !SetEndOfFile (volume))
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	memset (&transfer, 0, sizeof (transfer));
+	transfer.Source = image;
+	transfer.SourceOffset = 0;
+	transfer.Destination = volume;
+	transfer.DestinationOffset = TC_VOLUME_DATA_OFFSET;
+	transfer.Length = dataAreaSize;
+	transfer.AllowShortSource = TRUE;
+	transfer.CryptoInfo = cryptoInfo;
+	transfer.Encrypt = TRUE;
+	transfer.FirstDataUnitNo = TC_VOLUME_DATA_OFFSET / ENCRYPTION_DATA_UNIT_SIZE;
+	transfer.ProgressCallback = progressCallback;
+	transfer.ProgressContext = progressContext;
+	transfer.ProgressTotal = dataAreaSize;
+	transfer.StartTime = GetTickCount ();
+
+	status = RunImageTransfer (&transfer);
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	// Headers are written synchronously, as WriteRandomDataToReservedHeaderAreas requires
+	CloseHandle (volume);
+
+	volume = CreateFile (volumePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (volume == INVALID_HANDLE_VALUE)
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	status = WriteHeaderAt (volume, TC_VOLUME_HEADER_OFFSET, header);
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	// The backup header has its own salt
+	status = CreateVolumeHeaderInMemory (FALSE, header, ea, FIRST_MODE_OF_OPERATION_ID, password, pkcs5, cryptoInfo->master_keydata,
+		&backupCryptoInfo, dataAreaSize, 0, TC_VOLUME_DATA_OFFSET, dataAreaSize, 0, 0, TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, FALSE);
+
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	status = WriteHeaderAt (volume, TC_VOLUME_DATA_OFFSET + dataAreaSize, header);
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	status = WriteRandomDataToReservedHeaderAreas (volume, cryptoInfo, dataAreaSize, FALSE, FALSE);
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	if (!FlushFileBuffers (volume))
+		status = ERR_OS_ERROR;
+
+ret:
+	dwError = GetLastError ();
+
+	burn (header, sizeof (header));
+
+	if (cryptoInfo)
+		crypto_close (cryptoInfo);
+
+	if (backupCryptoInfo)
+		crypto_close (backupCryptoInfo);
+
+	if (volume != INVALID_HANDLE_VALUE)
+		CloseHandle (volume);
+
+	if (image != INVALID_HANDLE_VALUE)
+		CloseHandle (image);
+
+	if (status != ERR_SUCCESS && volumeCreated)
+		DeleteFile (volumePath);
+
+	RandStop (FALSE);
+
+	SetLastError (dwError);
+	return status;
+}
+
+
+/* NN: In-place encryption of a file-hosted volume. The file is extended by the header groups and a journal,
+   and its data is shifted by TC_VOLUME_DATA_OFFSET while being encrypted. The work proceeds from the end 
+   of the file towards its start, so that encrypted data only overwrites plaintext which has already been 
+   encrypted, plus the plaintext of the batch being written. To be able to redo a batch interrupted by a 
+   crash, its plaintext is first saved in the journal. The progress is checkpointed in EncryptedAreaStart 
+   and EncryptedAreaLength of a header stored at the backup header location. They describe the encrypted 
+   part of the data area, which always ends at the end of the data area:
+
+   [plaintext | free | encrypted data | backup header group | journal]
+                      ^ EncryptedAreaStart = TC_VOLUME_DATA_OFFSET + dataAreaSize - EncryptedAreaLength
+
+   When all the data is encrypted, the primary and backup headers are written and the journal is removed. 
+   As the journal holds plaintext, it is overwritten with random data before it is cut off, and also when 
+   the operation fails while the journal is not required to resume it. */
+
+static uint64 GetInPlaceHeaderOffset (uint64 dataAreaSize)
+{
+	return TC_VOLUME_DATA_OFFSET + dataAreaSize;
+}
+
+
+static uint64 GetInPlaceJournalOffset (uint64 dataAreaSize)
+{
+	return dataAreaSize + TC_TOTAL_VOLUME_HEADERS_SIZE;
+}
+
+
+// Updates the encrypted area in the header and writes it to the file
+static int WriteInPlaceCheckpoint (HANDLE file, uint64 dataAreaSize, char *header, PCRYPTO_INFO headerCryptoInfo, uint64 encryptedAreaLength)
+{
+	byte *p;
+
+	DecryptBuffer ((unsigned __int8 *) header + HEADER_ENCRYPTED_DATA_OFFSET, HEADER_ENCRYPTED_DATA_SIZE, headerCryptoInfo);
+
+	p = (byte *) header + TC_HEADER_OFFSET_ENCRYPTED_AREA_START;
+	mputInt64 (p, TC_VOLUME_DATA_OFFSET + dataAreaSize - encryptedAreaLength);
+
+	p = (byte *) header + TC_HEADER_OFFSET_ENCRYPTED_AREA_LENGTH;
+	mputInt64 (p, encryptedAreaLength);
+
+	p = (byte *) header + TC_HEADER_OFFSET_HEADER_CRC;
+	mputLong (p, GetCrc32 ((unsigned char *) header + TC_HEADER_OFFSET_MAGIC, TC_HEADER_OFFSET_HEADER_CRC - TC_HEADER_OFFSET_MAGIC));
+
+	EncryptBuffer ((unsigned __int8 *) header + HEADER_ENCRYPTED_DATA_OFFSET, HEADER_ENCRYPTED_DATA_SIZE, headerCryptoInfo);
+
+	if (!TransferAt (file, TRUE, GetInPlaceHeaderOffset (dataAreaSize), header, TC_VOLUME_HEADER_EFFECTIVE_SIZE)
+		|| !FlushFileBuffers (file))
+	{
+		return ERR_OS_ERROR;
+	}
+
+	return ERR_SUCCESS;
+}
+
+
+static int WriteInPlaceJournalTrailer (HANDLE file, uint64 dataAreaSize, uint64 batchStart, uint64 batchEnd)
+{
+	byte sector[TC_SECTOR_SIZE_FILE_HOSTED_VOLUME];
+	InPlaceJournalTrailer *trailer = (InPlaceJournalTrailer *) sector;
+
+	memset (sector, 0, sizeof (sector));
+	trailer->BatchStart = batchStart;
+	trailer->BatchEnd = batchEnd;
+	trailer->Magic = VOLUME_IMAGE_INPLACE_JOURNAL_MAGIC;
+	trailer->Crc = GetCrc32 (sector, offsetof (InPlaceJournalTrailer, Crc));
+
+	if (!TransferAt (file, TRUE, GetInPlaceJournalOffset (dataAreaSize) + VOLUME_IMAGE_INPLACE_BATCH_SIZE, sector, sizeof (sector))
+		|| !FlushFileBuffers (file))
+	{
+		return ERR_OS_ERROR;
+	}
+
+	return ERR_SUCCESS;
+}
+
+
+// Overwrites the journal (if the file has been extended by it) with random data. The file may be opened for
+// synchronous or overlapped I/O.
+static int WipeInPlaceJournal (HANDLE file, uint64 dataAreaSize)
+{
+	uint64 journalOffset = GetInPlaceJournalOffset (dataAreaSize);
+	LARGE_INTEGER fileSize;
+	byte *buffer;
+	DWORD length;
+	uint64 offset;
+	int status = ERR_SUCCESS;
+
+	if (!GetFileSizeEx (file, &fileSize))
+		return ERR_OS_ERROR;
+
+	if ((uint64) fileSize.QuadPart < journalOffset + VOLUME_IMAGE_INPLACE_JOURNAL_SIZE)
+		return ERR_SUCCESS;
+
+	buffer = (byte *) TCalloc (VOLUME_IMAGE_CHUNK_SIZE);
+	if (!buffer)
+		return ERR_OUTOFMEMORY;
+
+	for (offset = 0; offset < VOLUME_IMAGE_INPLACE_JOURNAL_SIZE; offset += length)
+	{
+		length = (DWORD) min (VOLUME_IMAGE_CHUNK_SIZE, VOLUME_IMAGE_INPLACE_JOURNAL_SIZE - offset);
+
+		if (!RandgetThreadBytes (buffer, length))
+		{
+			status = ERR_PARAMETER_INCORRECT;
+			break;
+		}
+
+		if (!TransferAt (file, TRUE, journalOffset + offset, buffer, length))
+		{
+			status = ERR_OS_ERROR;
+			break;
+		}
+	}
+
+	if (status == ERR_SUCCESS && !FlushFileBuffers (file))
+		status = ERR_OS_ERROR;
+
+	burn (buffer, VOLUME_IMAGE_CHUNK_SIZE);
+	TCfree (buffer);
+	return status;
+}
+
+
+// Returns TRUE if the journal holds the plaintext of the given batch
+static BOOL IsInPlaceJournalValid (HANDLE file, uint64 dataAreaSize, uint64 batchStart, uint64 batchEnd)
+{
+	byte sector[TC_SECTOR_SIZE_FILE_HOSTED_VOLUME];
+	InPlaceJournalTrailer *trailer = (InPlaceJournalTrailer *) sector;
+
+	if (!TransferAt (file, FALSE, GetInPlaceJournalOffset (dataAreaSize) + VOLUME_IMAGE_INPLACE_BATCH_SIZE, sector, sizeof (sector)))
+		return FALSE;
+
+	return trailer->Magic == VOLUME_IMAGE_INPLACE_JOURNAL_MAGIC
+		&& trailer->Crc == GetCrc32 (sector, offsetof (InPlaceJournalTrailer, Crc))
+		&& trailer->BatchStart == batchStart
+		&& trailer->BatchEnd == batchEnd;
+}
+
+
+// Writes the final headers and removes the journal. The file must be opened for synchronous I/O.
+static int FinishInPlaceEncryption (HANDLE file, PCRYPTO_INFO cryptoInfo, Password *password)
+{
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	uint64 dataAreaSize = cryptoInfo->VolumeSize.Value;
+	PCRYPTO_INFO headerCryptoInfo = NULL;
+	LARGE_INTEGER hostSize;
+	int status;
+	int i;
+
+	// Each header has its own salt
+	for (i = 0; i < 2; ++i)
+	{
+		status = CreateVolumeHeaderInMemory (FALSE, header, cryptoInfo->ea, cryptoInfo->mode, password, cryptoInfo->pkcs5, cryptoInfo->master_keydata,
+			&headerCryptoInfo, dataAreaSize, 0, TC_VOLUME_DATA_OFFSET, dataAreaSize, 0, TC_HEADER_FLAG_NONSYS_INPLACE_ENC, TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, FALSE);
+
+		if (status != ERR_SUCCESS)
+			goto ret;
+
+		crypto_close (headerCryptoInfo);
+		headerCryptoInfo = NULL;
+
+		status = WriteHeaderAt (file, i == 0 ? TC_VOLUME_HEADER_OFFSET : GetInPlaceHeaderOffset (dataAreaSize), header);
+		if (status != ERR_SUCCESS)
+			goto ret;
+	}
+
+	status = WriteRandomDataToReservedHeaderAreas (file, cryptoInfo, dataAreaSize, FALSE, FALSE);
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	if (!FlushFileBuffers (file))
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	status = WipeInPlaceJournal (file, dataAreaSize);
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	hostSize.QuadPart = dataAreaSize + TC_TOTAL_VOLUME_HEADERS_SIZE;
+
+	if (!SetFilePointerEx (file, hostSize, NULL, FILE_BEGIN) || !SetEndOfFile (file) || !FlushFileBuffers (file))
+		status = ERR_OS_ERROR;
+
+ret:
+	burn (header, sizeof (header));
+	return status;
+}
+
+
+// Encrypts the remaining data of a file being encrypted in place, starting at the last checkpoint
+static int ContinueInPlaceEncryption (const char *volumePath, HANDLE *file, Password *password,
+	PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext)
+{
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	PCRYPTO_INFO cryptoInfo = NULL, headerCryptoInfo = NULL;
+	uint64 dataAreaSize, encryptedAreaLength, batchStart, batchEnd;
+	LARGE_INTEGER fileSize;
+	ImageTransfer transfer;
+	BOOL journalRequired = TRUE;	// The journal may hold the plaintext of a batch not checkpointed yet
+	int status;
+
+	if (!GetFileSizeEx (*file, &fileSize))
+		return ERR_OS_ERROR;
+
+	if ((uint64) fileSize.QuadPart <= TC_TOTAL_VOLUME_HEADERS_SIZE + VOLUME_IMAGE_INPLACE_JOURNAL_SIZE
+		|| fileSize.QuadPart % TC_SECTOR_SIZE_FILE_HOSTED_VOLUME != 0)
+	{
+		return ERR_VOL_SIZE_WRONG;
+	}
+
+	dataAreaSize = fileSize.QuadPart - TC_TOTAL_VOLUME_HEADERS_SIZE - VOLUME_IMAGE_INPLACE_JOURNAL_SIZE;
+
+	headerCryptoInfo = crypto_open ();
+	if (!headerCryptoInfo)
+		return ERR_OUTOFMEMORY;
+
+	if (!TransferAt (*file, FALSE, GetInPlaceHeaderOffset (dataAreaSize), header, sizeof (header)))
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	status = ReadVolumeHeader (FALSE, header, password, &cryptoInfo, headerCryptoInfo);
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	if (!(cryptoInfo->HeaderFlags & TC_HEADER_FLAG_NONSYS_INPLACE_ENC)
+		|| cryptoInfo->VolumeSize.Value != dataAreaSize
+		|| cryptoInfo->EncryptedAreaLength.Value > dataAreaSize
+		|| cryptoInfo->EncryptedAreaLength.Value % TC_SECTOR_SIZE_FILE_HOSTED_VOLUME != 0
+		|| cryptoInfo->EncryptedAreaStart.Value != TC_VOLUME_DATA_OFFSET + dataAreaSize - cryptoInfo->EncryptedAreaLength.Value)
+	{
+		status = ERR_PARAMETER_INCORRECT;
+		goto ret;
+	}
+
+	encryptedAreaLength = cryptoInfo->EncryptedAreaLength.Value;
+
+	memset (&transfer, 0, sizeof (transfer));
+	transfer.Source = *file;
+	transfer.Destination = *file;
+	transfer.ProgressTotal = dataAreaSize;
+	transfer.StartBytes = encryptedAreaLength;
+	transfer.StartTime = GetTickCount ();
+
+	while (encryptedAreaLength < dataAreaSize)
+	{
+		batchEnd = dataAreaSize - encryptedAreaLength;
+		batchStart = batchEnd > VOLUME_IMAGE_INPLACE_BATCH_SIZE ? batchEnd - VOLUME_IMAGE_INPLACE_BATCH_SIZE : 0;
+
+		transfer.Length = batchEnd - batchStart;
+
+		// Unless a previous run has already saved it, the plaintext of the batch is still in place
+		if (!IsInPlaceJournalValid (*file, dataAreaSize, batchStart, batchEnd))
+		{
+			journalRequired = FALSE;
+
+			transfer.SourceOffset = batchStart;
+			transfer.DestinationOffset = GetInPlaceJournalOffset (dataAreaSize);
+			transfer.CryptoInfo = NULL;
+			transfer.ProgressCallback = NULL;
+
+			status = RunImageTransfer (&transfer);
+			if (status != ERR_SUCCESS)
+				goto ret;
+
+			if (!FlushFileBuffers (*file))
+			{
+				status = ERR_OS_ERROR;
+				goto ret;
+			}
+
+			status = WriteInPlaceJournalTrailer (*file, dataAreaSize, batchStart, batchEnd);
+			if (status != ERR_SUCCESS)
+				goto ret;
+		}
+
+		journalRequired = TRUE;
+
+		transfer.SourceOffset = GetInPlaceJournalOffset (dataAreaSize);
+		transfer.DestinationOffset = TC_VOLUME_DATA_OFFSET + batchStart;
+		transfer.CryptoInfo = cryptoInfo;
+		transfer.Encrypt = TRUE;
+		transfer.FirstDataUnitNo = (TC_VOLUME_DATA_OFFSET + batchStart) / ENCRYPTION_DATA_UNIT_SIZE;
+		transfer.ProgressCallback = progressCallback;
+		transfer.ProgressContext = progressContext;
+		transfer.ProgressBase = encryptedAreaLength;
+
+		status = RunImageTransfer (&transfer);
+		if (status != ERR_SUCCESS)
+			goto ret;
+
+		if (!FlushFileBuffers (*file))
+		{
+			status = ERR_OS_ERROR;
+			goto ret;
+		}
+
+		encryptedAreaLength = dataAreaSize - batchStart;
+
+		status = WriteInPlaceCheckpoint (*file, dataAreaSize, header, headerCryptoInfo, encryptedAreaLength);
+		if (status != ERR_SUCCESS)
+			goto ret;
+
+		journalRequired = FALSE;
+	}
+
+	journalRequired = FALSE;
+
+	// WriteRandomDataToReservedHeaderAreas requires synchronous I/O
+	CloseHandle (*file);
+
+	*file = CreateFile (volumePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (*file == INVALID_HANDLE_VALUE)
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	status = FinishInPlaceEncryption (*file, cryptoInfo, password);
+
+ret:
+	// Unless the plaintext in the journal is needed to redo the interrupted batch, it must not be left behind
+	if (status != ERR_SUCCESS && !journalRequired && *file != INVALID_HANDLE_VALUE)
+	{
+		DWORD dwError = GetLastError ();
+		WipeInPlaceJournal (*file, dataAreaSize);
+		SetLastError (dwError);
+	}
+
+	burn (header, sizeof (header));
+
+	if (cryptoInfo)
+		crypto_close (cryptoInfo);
+
+	crypto_close (headerCryptoInfo);
+	return status;
+}
+
+
+/* Encrypts an existing file in place, turning it into a volume whose data area holds the original content
+   of the file (padded to whole sectors). The file is extended by the volume headers. Progress is saved 
+   periodically, so that an interrupted operation (including one aborted by the progress callback or a 
+   crash) can be completed by ResumeFileInPlaceEncryption. ea and pkcs5 may be 0 to use the defaults. */
+int EncryptFileInPlace (const char *volumePath, Password *password, int ea, int pkcs5,
+	PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext)
+{
+	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	PCRYPTO_INFO cryptoInfo = NULL;
+	HANDLE file = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER fileSize, hostSize;
+	uint64 dataAreaSize;
+	DWORD dwError;
+	int status;
+
+	if (!volumePath || !CheckFormatParameters (password, &ea, &pkcs5))
+		return ERR_PARAMETER_INCORRECT;
+
+	if (Randinit ())
+		return ERR_OS_ERROR;
+
+	file = CreateFile (volumePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	if (!GetFileSizeEx (file, &fileSize))
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	dataAreaSize = (fileSize.QuadPart + TC_SECTOR_SIZE_FILE_HOSTED_VOLUME - 1) / TC_SECTOR_SIZE_FILE_HOSTED_VOLUME * TC_SECTOR_SIZE_FILE_HOSTED_VOLUME;
+
+	if (dataAreaSize == 0 || dataAreaSize > TC_MAX_VOLUME_SIZE - TC_TOTAL_VOLUME_HEADERS_SIZE)
+	{
+		status = ERR_VOL_SIZE_WRONG;
+		goto ret;
+	}
+
+	status = CreateVolumeHeaderInMemory (FALSE, header, ea, FIRST_MODE_OF_OPERATION_ID, password, pkcs5, NULL, &cryptoInfo,
+		dataAreaSize, 0, TC_VOLUME_DATA_OFFSET + dataAreaSize, 0, 0, TC_HEADER_FLAG_NONSYS_INPLACE_ENC, TC_SECTOR_SIZE_FILE_HOSTED_VOLUME, FALSE);
+
+	if (status != ERR_SUCCESS)
+		goto ret;
+
+	crypto_close (cryptoInfo);
+	cryptoInfo = NULL;
+
+	hostSize.QuadPart = dataAreaSize + TC_TOTAL_VOLUME_HEADERS_SIZE + VOLUME_IMAGE_INPLACE_JOURNAL_SIZE;
+
+	if (!SetFilePointerEx (file, hostSize, NULL, FILE_BEGIN) || !SetEndOfFile (file)
+		|| !TransferAt (file, TRUE, GetInPlaceHeaderOffset (dataAreaSize), header, sizeof (header))
+		|| !FlushFileBuffers (file))
+	{
+		// Nothing has been encrypted yet
+		dwError = GetLastError ();
+
+		if (WipeInPlaceJournal (file, dataAreaSize) == ERR_SUCCESS && SetFilePointerEx (file, fileSize, NULL, FILE_BEGIN))
+			SetEndOfFile (file);
+
+		SetLastError (dwError);
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	status = ContinueInPlaceEncryption (volumePath, &file, password, progressCallback, progressContext);
+
+ret:
+	dwError = GetLastError ();
+
+	burn (header, sizeof (header));
+
+	if (cryptoInfo)
+		crypto_close (cryptoInfo);
+
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle (file);
+
+	RandStop (FALSE);
+
+	SetLastError (dwError);
+	return status;
+}
+
+
+// Completes the in-place encryption of a file interrupted after its first checkpoint
+int ResumeFileInPlaceEncryption (const char *volumePath, Password *password,
+	PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext)
+{
+	HANDLE file;
+	DWORD dwError;
+	int status;
+
+	if (!volumePath || !password || password->Length == 0 || password->Length > MAX_PASSWORD)
+		return ERR_PARAMETER_INCORRECT;
+
+	if (Randinit ())
+		return ERR_OS_ERROR;
+
+	file = CreateFile (volumePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		status = ERR_OS_ERROR;
+	else
+		status = ContinueInPlaceEncryption (volumePath, &file, password, progressCallback, progressContext);
+
+	dwError = GetLastError ();
+
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle (file);
+
+	RandStop (FALSE);
+
+	SetLastError (dwError);
+	return status;
+}
+
+
+static BOOL IsZeroBlock (const byte *data, DWORD length)
+{
+	const uint64 *p = (const uint64 *) data;
+	const uint64 *end = (const uint64 *) (data + length);
+
+	while (p < end)
+	{
+		if (*p++ != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+static BOOL WriteImageData (ImageWriter *writer, const byte *data, DWORD length, uint64 offset)
+{
+	LARGE_INTEGER writeOffset;
+	DWORD start, end, bytesWritten;
+
+	if (!writer->Sparse)
+		return WriteFile (writer->File, data, length, &bytesWritten, NULL) && bytesWritten == length;
+
+	// Write the runs of blocks which are not all zero
+	for (start = 0; start < length; start = end)
+	{
+		DWORD blockLength = min (VOLUME_IMAGE_SPARSE_BLOCK_SIZE, length - start);
+
+		if (IsZeroBlock (data + start, blockLength))
+		{
+			end = start + blockLength;
+			continue;
+		}
+
+		for (end = start + blockLength; end < length; end += blockLength)
+		{
+			blockLength = min (VOLUME_IMAGE_SPARSE_BLOCK_SIZE, length - end);
+
+			if (IsZeroBlock (data + end, blockLength))
+				break;
+		}
+
+		writeOffset.QuadPart = offset + start;
+
+		if (!SetFilePointerEx (writer->File, writeOffset, NULL, FILE_BEGIN)
+			|| !WriteFile (writer->File, data + start, end - start, &bytesWritten, NULL)
+			|| bytesWritten != end - start)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+
+static unsigned __stdcall ImageWriterThreadProc (void *threadArg)
+{
+	ImageWriter *writer = (ImageWriter *) threadArg;
+
+	while (WaitForSingleObject (writer->DataReadyEvent, INFINITE) == WAIT_OBJECT_0 && !writer->Stop)
+	{
+		if (writer->Status == ERR_SUCCESS
+			&& !WriteImageData (writer, writer->Buffers[writer->PendingBuffer], writer->PendingLength, writer->PendingOffset))
+		{
+			writer->LastError = GetLastError ();
+			writer->Status = ERR_OS_ERROR;
+		}
+
+		SetEvent (writer->WriteDoneEvent);
+	}
+
+	return 0;
+}
+
+
+// Reports the data written so far, i.e. everything submitted before the pending write has completed
+static BOOL ReportImageWriterProgress (ImageWriter *writer)
+{
+	VOLUME_IMAGE_PROGRESS progress;
+
+	if (!writer->Progress.ProgressCallback)
+		return TRUE;
+
+	UpdateImageProgress (&writer->Progress, &progress, writer->Offset);
+	return writer->Progress.ProgressCallback (&progress, writer->Progress.ProgressContext);
+}
+
+
+// Passes the filled buffer to the writer thread once it has written the other one
+static BOOL SubmitImageBuffer (ImageWriter *writer)
+{
+	WaitForSingleObject (writer->WriteDoneEvent, INFINITE);
+
+	if (writer->Status != ERR_SUCCESS || (writer->Offset > 0 && !ReportImageWriterProgress (writer)))
+	{
+		// Nothing is being written
+		SetEvent (writer->WriteDoneEvent);
+		return FALSE;
+	}
+
+	writer->PendingBuffer = writer->Current;
+	writer->PendingLength = writer->Filled;
+	writer->PendingOffset = writer->Offset;
+	SetEvent (writer->DataReadyEvent);
+
+	writer->Current ^= 1;
+	writer->Offset += writer->Filled;
+	writer->Filled = 0;
+
+	return TRUE;
+}
+
+
+static BOOL CALLBACK ExportStreamCallback (unsigned __int64 sectorNo, DWORD sectorCount, unsigned char *data, void *context)
+{
+	ImageWriter *writer = (ImageWriter *) context;
+	DWORD length = sectorCount * writer->SectorSize;
+
+	while (length > 0)
+	{
+		DWORD copyLength = min (length, VOLUME_IMAGE_CHUNK_SIZE - writer->Filled);
+
+		memcpy (writer->Buffers[writer->Current] + writer->Filled, data, copyLength);
+		writer->Filled += copyLength;
+		data += copyLength;
+		length -= copyLength;
+
+		if (writer->Filled == VOLUME_IMAGE_CHUNK_SIZE && !SubmitImageBuffer (writer))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+static int ExportVolumeData (PDIRECT_VOLUME volume, HANDLE file, BOOL sparse,
+	PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext)
+{
+	ImageWriter writer;
+	uint64 size = DirectVolumeGetSize (volume);
+	LARGE_INTEGER fileSize;
+	int status = ERR_SUCCESS;
+	int i;
+
+	memset (&writer, 0, sizeof (writer));
+	writer.File = file;
+	writer.Sparse = sparse;
+	writer.SectorSize = DirectVolumeGetSectorSize (volume);
+	writer.Status = ERR_SUCCESS;
+	writer.Progress.ProgressCallback = progressCallback;
+	writer.Progress.ProgressContext = progressContext;
+	writer.Progress.ProgressTotal = size;
+	writer.Progress.StartTime = GetTickCount ();
+
+	for (i = 0; i < 2; ++i)
+	{
+		writer.Buffers[i] = (byte *) TCalloc (VOLUME_IMAGE_CHUNK_SIZE);
+		if (!writer.Buffers[i])
+		{
+			status = ERR_OUTOFMEMORY;
+			goto ret;
+		}
+
+		VirtualLock (writer.Buffers[i], VOLUME_IMAGE_CHUNK_SIZE);
+	}
+
+	writer.DataReadyEvent = CreateEvent (NULL, FALSE, FALSE, NULL);
+	writer.WriteDoneEvent = CreateEvent (NULL, FALSE, TRUE, NULL);
+
+	if (!writer.DataReadyEvent || !writer.WriteDoneEvent)
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	writer.Thread = (HANDLE) _beginthreadex (NULL, 0, ImageWriterThreadProc, &writer, 0, NULL);
+	if (!writer.Thread)
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	status = DirectVolumeReadStream (volume, 0, size / writer.SectorSize, ExportStreamCallback, &writer);
+
+	if (status == ERR_SUCCESS && writer.Filled > 0 && !SubmitImageBuffer (&writer))
+		status = ERR_USER_ABORT;
+
+	// Wait for the last write
+	WaitForSingleObject (writer.WriteDoneEvent, INFINITE);
+
+	if (writer.Status != ERR_SUCCESS)
+	{
+		SetLastError (writer.LastError);
+		status = writer.Status;
+	}
+	else if (status == ERR_SUCCESS && !ReportImageWriterProgress (&writer))
+		status = ERR_USER_ABORT;
+
+	// Trailing zero blocks have not been written
+	if (status == ERR_SUCCESS && sparse)
+	{
+		fileSize.QuadPart = size;
+
+		if (!SetFilePointerEx (file, fileSize, NULL, FILE_BEGIN) || !SetEndOfFile (file))
+			status = ERR_OS_ERROR;
+	}
+
+ret:
+	if (writer.Thread)
+	{
+		writer.Stop = TRUE;
+		SetEvent (writer.DataReadyEvent);
+		WaitForSingleObject (writer.Thread, INFINITE);
+		CloseHandle (writer.Thread);
+	}
+
+	if (writer.DataReadyEvent)
+		CloseHandle (writer.DataReadyEvent);
+
+	if (writer.WriteDoneEvent)
+		CloseHandle (writer.WriteDoneEvent);
+
+	for (i = 0; i < 2; ++i)
+	{
+		if (writer.Buffers[i])
+		{
+			burn (writer.Buffers[i], VOLUME_IMAGE_CHUNK_SIZE);
+			VirtualUnlock (writer.Buffers[i], VOLUME_IMAGE_CHUNK_SIZE);
+			TCfree (writer.Buffers[i]);
+		}
+	}
+
+	return status;
+}
+
+
+/* Writes the plaintext of the data area of a volume to an image file, which is created or overwritten, or
+   to the standard output if imagePath is NULL. With VOLUME_IMAGE_EXPORT_SPARSE, all-zero blocks are 
+   skipped, and the image is made a sparse file where the file system supports it. A partially written 
+   image file is deleted. */
+int DecryptVolumeToImage (const char *volumePath, Password *password, const char *imagePath, DWORD flags,
+	PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext)
+{
+	PDIRECT_VOLUME volume = NULL;
+	HANDLE file = INVALID_HANDLE_VALUE;
+	BOOL sparse = imagePath && (flags & VOLUME_IMAGE_EXPORT_SPARSE);
+	DWORD bytesReturned;
+	DWORD dwError;
+	int status;
+
+	if (!volumePath || !password)
+		return ERR_PARAMETER_INCORRECT;
+
+	status = DirectVolumeOpen (volumePath, password, TRUE, &volume);
+	if (status != ERR_SUCCESS)
+		return status;
+
+	if (imagePath)
+		file = CreateFile (imagePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	else
+		file = GetStdHandle (STD_OUTPUT_HANDLE);
+
+	if (file == INVALID_HANDLE_VALUE || file == NULL)
+	{
+		file = INVALID_HANDLE_VALUE;
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	// Not all file systems support sparse files; skipped blocks then read as zeros anyway
+	if (sparse)
+		DeviceIoControl (file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL);
+
+	status = ExportVolumeData (volume, file, sparse, progressCallback, progressContext);
+
+ret:
+	dwError = GetLastError ();
+
+	if (imagePath && file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle (file);
+
+		if (status != ERR_SUCCESS)
+			DeleteFile (imagePath);
+	}
+
+	DirectVolumeClose (volume);
+
+	SetLastError (dwError);
+	return status;
+}
+
+
+typedef struct
+{
+	PTCAPI_VOLUME_EXPORT_ENTRY Entries;
+	int EntryCount;
+	PTCAPI_VOLUME_EXPORT_PROGRESS Progress;
+	void *ProgressContext;
+} ExportBatchContext;
+
+static BOOL ExportBatchEntry (int entryIndex, void *batchContext)
+{
+	ExportBatchContext *context = (ExportBatchContext *) batchContext;
+	PTCAPI_VOLUME_EXPORT_ENTRY entry = &context->Entries[entryIndex];
+
+	entry->Result = DecryptVolumeToImage (entry->VolumePath, &entry->VolumePassword, entry->ImagePath, entry->Flags, NULL, NULL);
+	entry->LastError = entry->Result == 0 ? ERROR_SUCCESS : GetLastError ();
+
+	burn (&entry->VolumePassword, sizeof (entry->VolumePassword));
+
+	return entry->Result == 0;
+}
+
+static void ExportBatchEntryDone (int entryIndex, BOOL succeeded, int completedCount, void *batchContext)
+{
+	ExportBatchContext *context = (ExportBatchContext *) batchContext;
+
+	if (context->Progress)
+		context->Progress (entryIndex, completedCount, context->EntryCount, context->ProgressContext);
+}
+
+// Exports the volumes described by entries using up to maxConcurrency threads (0 = one per encryption 
+// thread). Per-volume results are returned in the entries. Returns the number of volumes exported.
+int DecryptVolumesToImages (PTCAPI_VOLUME_EXPORT_ENTRY entries, int count, int maxConcurrency,
+	PTCAPI_VOLUME_EXPORT_PROGRESS progress, void *progressContext)
+{
+	ExportBatchContext context;
+	int exportedCount;
+	int i;
+
+	if (entries == NULL || count <= 0)
+	{
+		set_error_debug_out(TCAPI_E_PARAM_INCORRECT);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		entries[i].Result = ERR_OS_ERROR;
+		entries[i].LastError = ERROR_SUCCESS;
+	}
+
+	memset (&context, 0, sizeof (context));
+	context.Entries = entries;
+	context.EntryCount = count;
+	context.Progress = progress;
+	context.ProgressContext = progressContext;
+
+	exportedCount = RunBatch (count, maxConcurrency, ExportBatchEntry, ExportBatchEntryDone, &context);
+
+	SetLastError (exportedCount == count ? ERROR_SUCCESS : TCAPI_E_ERROR);
+	return exportedCount;
+}
@@ -0,0 +1,64 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+
+#ifndef VOLUME_IMAGE_H
+#define VOLUME_IMAGE_H
+
+#include "Tcdefs.h"
+#include "Password.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	typedef struct
+	{
+		unsigned __int64 BytesDone;
+		unsigned __int64 BytesTotal;
+		unsigned __int64 BytesPerSecond;	// Average since the start
+		DWORD ElapsedTime;					// Milliseconds
+	} VOLUME_IMAGE_PROGRESS;
+
+	/* Called after each chunk. Returning FALSE aborts the operation. */
+	typedef BOOL (CALLBACK *PVOLUME_IMAGE_PROGRESS_CALLBACK) (const VOLUME_IMAGE_PROGRESS *progress, void *context);
+
+	/* Export flags */
+	#define VOLUME_IMAGE_EXPORT_SPARSE		0x1		/* All-zero blocks are not written (files only) */
+
+	/* Amount of data encrypted in place between progress checkpoints */
+	#define VOLUME_IMAGE_INPLACE_BATCH_SIZE	(64 * BYTES_PER_MB)
+
+	typedef struct {
+		char VolumePath[TC_MAX_PATH];	/* In: volume file path */
+		Password VolumePassword;		/* In: burned once the entry has been processed */
+		char ImagePath[TC_MAX_PATH];	/* In: image file to create or overwrite */
+		DWORD Flags;					/* In: VOLUME_IMAGE_EXPORT_* */
+		int Result;						/* Out: 0 = exported, ERR_* code otherwise */
+		DWORD LastError;				/* Out: TCAPI_E_* or Win32 error code if not exported */
+	} TCAPI_VOLUME_EXPORT_ENTRY, *PTCAPI_VOLUME_EXPORT_ENTRY;
+
+	/* Called once an entry has been processed (successfully or not). Calls are serialized but may come 
+	   from any of the batch threads. */
+	typedef void (CALLBACK *PTCAPI_VOLUME_EXPORT_PROGRESS) (int entryIndex, int completedCount, int totalCount, void *context);
+
+	int EncryptImageToVolume (const char *imagePath, const char *volumePath, Password *password, int ea, int pkcs5,
+		PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext);
+	int EncryptFileInPlace (const char *volumePath, Password *password, int ea, int pkcs5,
+		PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext);
+	int ResumeFileInPlaceEncryption (const char *volumePath, Password *password,
+		PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext);
+	int DecryptVolumeToImage (const char *volumePath, Password *password, const char *imagePath, DWORD flags,
+		PVOLUME_IMAGE_PROGRESS_CALLBACK progressCallback, void *progressContext);
+	int DecryptVolumesToImages (PTCAPI_VOLUME_EXPORT_ENTRY entries, int count, int maxConcurrency,
+		PTCAPI_VOLUME_EXPORT_PROGRESS progress, void *progressContext);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -26,10 +26,12 @@
 
 #ifndef DEVICE_DRIVER
 #include "Random.h"
+#include "RandomStream.h"
 #endif
 
 #include "Crc.h"
 #include "Crypto.h"
+#include "Xts.h"
 #include "Endian.h"
 #include "Volumes.h"
 #include "Pkcs5.h"
@@ -157,18 +159,227 @@ typedef struct
 	BOOL Free;
 	LONG KeyReady;
 	int Pkcs5Prf;
+	int HeaderIndex;
 } KeyDerivationWorkItem;
 
 
+// Returns TRUE if a key derivation for a header preceding headerIndex is queued (items may be NULL) or yet 
+// to be started (jobs from firstJobIndex on).
+static BOOL IsPrecedingHeaderJobPending (KeyDerivationWorkItem *items, int jobCount, int headerCount, int firstJobIndex, int headerIndex)
+{
+	int i;
+
+	for (i = firstJobIndex; i < jobCount; ++i)
+	{
+		if (i % headerCount < headerIndex)
+			return TRUE;
+	}
+
+	for (i = 0; items && i < jobCount; ++i)
+	{
+		if (!items[i].Free && items[i].HeaderIndex < headerIndex)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+#define KEY_SCHEDULE_CACHE_MAX_ENTRIES	32
+#define KEY_SCHEDULE_CACHE_POOL_SIZE	(MAX_EXPANDED_KEY * 6)
+
+// Key schedules expanded from one header key (dk), keyed by cipher and key offset within dk. Many EAs
+// schedule the same cipher from the same part of dk (e.g., AES from dk[0..31] for AES, AES-Serpent and
+// AES-Twofish-Serpent), so each distinct subkey needs to be expanded only once per derived key.
+typedef struct
+{
+	int Cipher;
+	int KeyOffset;
+	int Status;
+	unsigned __int8 *Ks;
+} KeyScheduleCacheEntry;
+
+typedef struct
+{
+	KeyScheduleCacheEntry Entries[KEY_SCHEDULE_CACHE_MAX_ENTRIES];
+	int EntryCount;
+	int PoolUsed;
+	unsigned __int8 Pool[KEY_SCHEDULE_CACHE_POOL_SIZE];
+} KeyScheduleCache;
+
+
 BOOL ReadVolumeHeaderRecoveryMode = FALSE;
 
+
+static void KeyScheduleCacheReset (KeyScheduleCache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	burn (cache->Pool, cache->PoolUsed);
+	cache->EntryCount = 0;
+	cache->PoolUsed = 0;
+}
+
+
+// Same as EAInit (ea, dk + keyOffset, ks) but reuses key schedules already expanded from dk.
+// The cache is optional; if it is NULL or full, key schedules are expanded directly.
+static int EAInitCached (KeyScheduleCache *cache, int ea, unsigned char *dk, int keyOffset, unsigned __int8 *ks)
+{
+	int c, retVal = ERR_SUCCESS;
+
+	if (cache == NULL)
+		return EAInit (ea, dk + keyOffset, ks);
+
+	for (c = EAGetFirstCipher (ea); c != 0; c = EAGetNextCipher (ea, c))
+	{
+		int ksSize = CipherGetKeyScheduleSize (c);
+		KeyScheduleCacheEntry *entry = NULL;
+		int status;
+		int i;
+
+		for (i = 0; i < cache->EntryCount; ++i)
+		{
+			if (cache->Entries[i].Cipher == c && cache->Entries[i].KeyOffset == keyOffset)
+			{
+				entry = &cache->Entries[i];
+				break;
+			}
+		}
+
+		if (entry)
+		{
+			memcpy (ks, entry->Ks, ksSize);
+			status = entry->Status;
+		}
+		else
+		{
+			status = CipherInit (c, dk + keyOffset, ks);
+
+			if (status != ERR_CIPHER_INIT_FAILURE
+				&& cache->EntryCount < KEY_SCHEDULE_CACHE_MAX_ENTRIES
+				&& cache->PoolUsed + ksSize <= KEY_SCHEDULE_CACHE_POOL_SIZE)
+			{
+				entry = &cache->Entries[cache->EntryCount++];
+				entry->Cipher = c;
+				entry->KeyOffset = keyOffset;
+				entry->Status = status;
+				entry->Ks = cache->Pool + cache->PoolUsed;
+
+				memcpy (entry->Ks, ks, ksSize);
+				cache->PoolUsed += ksSize;
+			}
+		}
+
+		switch (status)
+		{
+		case ERR_CIPHER_INIT_FAILURE:
+			return ERR_CIPHER_INIT_FAILURE;
+
+		case ERR_CIPHER_INIT_WEAK_KEY:
+			retVal = ERR_CIPHER_INIT_WEAK_KEY;		// Non-fatal error
+			break;
+		}
+
+		keyOffset += CipherGetKeySize (c);
+		ks += ksSize;
+	}
+	return retVal;
+}
+
+
+// Decrypts len bytes of the encrypted header area in XTS mode, starting at the cipher block
+// startCipherBlockNo of data unit 0. buf must point to that block. Cipher blocks within a data
+// unit are independent, so any range of blocks can be decrypted separately from the rest.
+static void DecryptHeaderBlocksXTS (unsigned __int8 *buf, TC_LARGEST_COMPILER_UINT len, unsigned int startCipherBlockNo, PCRYPTO_INFO cryptoInfo)
+{
+	unsigned __int8 *ks = cryptoInfo->ks + EAGetKeyScheduleSize (cryptoInfo->ea);
+	unsigned __int8 *ks2 = cryptoInfo->ks2 + EAGetKeyScheduleSize (cryptoInfo->ea);
+	UINT64_STRUCT dataUnitNo;
+	int cipher;
+
+	dataUnitNo.LowPart = 0;
+	dataUnitNo.HighPart = 0;
+
+	for (cipher = EAGetLastCipher (cryptoInfo->ea);
+		cipher != 0;
+		cipher = EAGetPreviousCipher (cryptoInfo->ea, cipher))
+	{
+		ks -= CipherGetKeyScheduleSize (cipher);
+		ks2 -= CipherGetKeyScheduleSize (cipher);
+
+		DecryptBufferXTS (buf, len, &dataUnitNo, startCipherBlockNo, ks, ks2, cipher);
+	}
+}
+
+// Fills order with the IDs first..last, starting with hint if it lies within the range.
+static void GetHintedSearchOrder (int *order, int first, int last, int hint)
+{
+	int id, i = 0;
+
+	if (hint >= first && hint <= last)
+		order[i++] = hint;
+
+	for (id = first; id <= last; ++id)
+	{
+		if (id != hint)
+			order[i++] = id;
+	}
+}
+
+
+// Enumerates encryption algorithms like EAGetFirst/EAGetNext, but starting with hintEa (if not 0).
+static int HintedEAGetFirst (int hintEa)
+{
+	return hintEa != 0 ? hintEa : EAGetFirst ();
+}
+
+
+static int HintedEAGetNext (int hintEa, int previousEA)
+{
+	int ea = (previousEA == hintEa) ? EAGetFirst () : EAGetNext (previousEA);
+
+	if (ea != 0 && ea == hintEa)
+		ea = EAGetNext (ea);
+
+	return ea;
+}
+
+
 int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCRYPTO_INFO *retInfo, CRYPTO_INFO *retHeaderCryptoInfo)
+{
+	return ReadVolumeHeaderWithHint (bBoot, encryptedHeader, password, NULL, retInfo, retHeaderCryptoInfo);
+}
+
+
+// Same as ReadVolumeHeader, but the PRF, mode of operation and encryption algorithm specified by
+// hint (if not NULL) are tried first. The hint only affects the order of the search; if it is wrong,
+// invalid or incomplete (zero fields), all remaining combinations are tested as usual.
+int ReadVolumeHeaderWithHint (BOOL bBoot, char *encryptedHeader, Password *password, const HeaderSearchHint *hint, PCRYPTO_INFO *retInfo, CRYPTO_INFO *retHeaderCryptoInfo)
+{
+	return ReadVolumeHeaders (bBoot, &encryptedHeader, 1, password, hint, NULL, retInfo, retHeaderCryptoInfo);
+}
+
+
+// Tries the password on headerCount encrypted headers (e.g., the normal and hidden volume headers) at once.
+// Key derivations for all headers and PRFs are queued together, so that all of them are processed in
+// a single parallel search. If several headers can be decrypted, the one listed first wins (e.g., the primary
+// header over the backup one). The index of the header which has been decrypted is returned in
+// retHeaderIndex (if not NULL). Other parameters are as in ReadVolumeHeaderWithHint.
+int ReadVolumeHeaders (BOOL bBoot, char **encryptedHeaders, int headerCount, Password *password, const HeaderSearchHint *hint, int *retHeaderIndex, PCRYPTO_INFO *retInfo, CRYPTO_INFO *retHeaderCryptoInfo)
 {
 	char header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	char *encryptedHeader;
 	KEY_INFO keyInfo;
 	PCRYPTO_INFO cryptoInfo;
 	char dk[MASTER_KEYDATA_SIZE];
-	int enqPkcs5Prf, pkcs5_prf;
+	char bestDk[MASTER_KEYDATA_SIZE];
+	int enqPkcs5Prf, pkcs5_prf, bestPkcs5Prf = 0;
+	int prfOrder[LAST_PRF_ID - FIRST_PRF_ID + 1];
+	int modeOrder[LAST_MODE_OF_OPERATION - FIRST_MODE_OF_OPERATION_ID + 1];
+	int jobIndex, modeIndex;
+	int enqHeaderIndex, headerIndex, bestHeaderIndex = headerCount;
+	int hintEa = 0;
 	uint16 headerVersion;
 	int status = ERR_PARAMETER_INCORRECT;
 	int primaryKeyOffset;
@@ -178,11 +389,18 @@ int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCR
 	KeyDerivationWorkItem *keyDerivationWorkItems;
 	KeyDerivationWorkItem *item;
 	int pkcs5PrfCount = LAST_PRF_ID - FIRST_PRF_ID + 1;
+	int jobCount = pkcs5PrfCount * headerCount;
+	int modeCount = LAST_MODE_OF_OPERATION - FIRST_MODE_OF_OPERATION_ID + 1;
 	size_t encryptionThreadCount = GetEncryptionThreadCount();
 	size_t queuedWorkItems = 0;
 	LONG outstandingWorkItemCount = 0;
+	LONG abortKeyDerivation = FALSE;
+	KeyScheduleCache *keyScheduleCache;
 	int i;
 
+	if (encryptedHeaders == NULL || headerCount < 1)
+		return ERR_PARAMETER_INCORRECT;
+
 	if (retHeaderCryptoInfo != NULL)
 	{
 		cryptoInfo = retHeaderCryptoInfo;
@@ -196,11 +414,14 @@ int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCR
 
 	if (encryptionThreadCount > 1)
 	{
-		keyDerivationWorkItems = TCalloc (sizeof (KeyDerivationWorkItem) * pkcs5PrfCount);
+		keyDerivationWorkItems = TCalloc (sizeof (KeyDerivationWorkItem) * jobCount);
 		if (!keyDerivationWorkItems)
-			return ERR_OUTOFMEMORY;
+		{
+			status = ERR_OUTOFMEMORY;
+			goto allocErr;
+		}
 
-		for (i = 0; i < pkcs5PrfCount; ++i)
+		for (i = 0; i < jobCount; ++i)
 			keyDerivationWorkItems[i].Free = TRUE;
 
 #ifdef DEVICE_DRIVER
@@ -211,7 +432,8 @@ int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCR
 		if (!keyDerivationCompletedEvent)
 		{
 			TCfree (keyDerivationWorkItems);
-			return ERR_OUTOFMEMORY;
+			status = ERR_OUTOFMEMORY;
+			goto allocErr;
 		}
 
 		noOutstandingWorkItemEvent = CreateEvent (NULL, FALSE, TRUE, NULL);
@@ -219,7 +441,8 @@ int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCR
 		{
 			CloseHandle (keyDerivationCompletedEvent);
 			TCfree (keyDerivationWorkItems);
-			return ERR_OUTOFMEMORY;
+			status = ERR_OUTOFMEMORY;
+			goto allocErr;
 		}
 #endif
 	}
@@ -227,25 +450,64 @@ int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCR
 #ifndef DEVICE_DRIVER
 	VirtualLock (&keyInfo, sizeof (keyInfo));
 	VirtualLock (&dk, sizeof (dk));
+	VirtualLock (&bestDk, sizeof (bestDk));
+#endif
+
+	// The key schedule cache is an optimization only; headers are read without it if it cannot be allocated
+	keyScheduleCache = TCalloc (sizeof (KeyScheduleCache));
+	if (keyScheduleCache)
+	{
+#ifndef DEVICE_DRIVER
+		VirtualLock (keyScheduleCache, sizeof (KeyScheduleCache));
 #endif
+		keyScheduleCache->EntryCount = 0;
+		keyScheduleCache->PoolUsed = 0;
+	}
 
 	crypto_loadkey (&keyInfo, password->Text, (int) password->Length);
 
-	// PKCS5 is used to derive the primary header key(s) and secondary header key(s) (XTS mode) from the password
-	memcpy (keyInfo.salt, encryptedHeader + HEADER_SALT_OFFSET, PKCS5_SALT_SIZE);
+	// Order of the search (combination suggested by the hint first)
+	GetHintedSearchOrder (prfOrder, FIRST_PRF_ID, LAST_PRF_ID, hint ? hint->Pkcs5Prf : 0);
+	GetHintedSearchOrder (modeOrder, FIRST_MODE_OF_OPERATION_ID, LAST_MODE_OF_OPERATION, hint ? hint->Mode : 0);
+
+	if (hint)
+	{
+		int ea;
+		for (ea = EAGetFirst (); ea != 0; ea = EAGetNext (ea))
+		{
+			if (ea == hint->Ea)
+				hintEa = ea;
+		}
+	}
 
-	// Test all available PKCS5 PRFs
-	for (enqPkcs5Prf = FIRST_PRF_ID; enqPkcs5Prf <= LAST_PRF_ID || queuedWorkItems > 0; ++enqPkcs5Prf)
+	// Test all available PKCS5 PRFs (on all headers)
+	for (jobIndex = 0; jobIndex < jobCount || queuedWorkItems > 0 || bestHeaderIndex < headerCount; ++jobIndex)
 	{
 		BOOL lrw64InitDone = FALSE;		// Deprecated/legacy
 		BOOL lrw128InitDone = FALSE;	// Deprecated/legacy
 
-		if (encryptionThreadCount > 1)
+		if (bestHeaderIndex < headerCount
+			&& !IsPrecedingHeaderJobPending (encryptionThreadCount > 1 ? keyDerivationWorkItems : NULL, jobCount, headerCount, jobIndex, bestHeaderIndex))
+		{
+			// No preceding header can be decrypted; the header key kept aside is used
+			pkcs5_prf = bestPkcs5Prf;
+			headerIndex = bestHeaderIndex;
+			keyInfo.noIterations = get_pkcs5_iteration_count (pkcs5_prf, bBoot);
+			memcpy (keyInfo.salt, encryptedHeaders[headerIndex] + HEADER_SALT_OFFSET, PKCS5_SALT_SIZE);
+			memcpy (dk, bestDk, sizeof (dk));
+
+			bestHeaderIndex = headerCount;
+		}
+		else if (encryptionThreadCount > 1)
 		{
 			// Enqueue key derivation on thread pool
-			if (queuedWorkItems < encryptionThreadCount && enqPkcs5Prf <= LAST_PRF_ID)
+			if (queuedWorkItems < encryptionThreadCount && jobIndex < jobCount)
 			{
-				for (i = 0; i < pkcs5PrfCount; ++i)
+				enqPkcs5Prf = prfOrder[jobIndex / headerCount];
+				enqHeaderIndex = jobIndex % headerCount;
+
+				// Headers following the one already decrypted are skipped
+				for (i = 0; i < jobCount && enqHeaderIndex < bestHeaderIndex; ++i)
 				{
 					item = &keyDerivationWorkItems[i];
 					if (item->Free)
@@ -253,32 +515,44 @@ int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCR
 						item->Free = FALSE;
 						item->KeyReady = FALSE;
 						item->Pkcs5Prf = enqPkcs5Prf;
+						item->HeaderIndex = enqHeaderIndex;
 
+						// PKCS5 is used to derive the primary header key(s) and secondary header key(s) (XTS mode) from the password
 						EncryptionThreadPoolBeginKeyDerivation (&keyDerivationCompletedEvent, &noOutstandingWorkItemEvent,
-							&item->KeyReady, &outstandingWorkItemCount, enqPkcs5Prf, keyInfo.userKey,
-							keyInfo.keyLength, keyInfo.salt, get_pkcs5_iteration_count (enqPkcs5Prf, bBoot), item->DerivedKey);
+							&item->KeyReady, &outstandingWorkItemCount, &abortKeyDerivation, enqPkcs5Prf, keyInfo.userKey,
+							keyInfo.keyLength, encryptedHeaders[enqHeaderIndex] + HEADER_SALT_OFFSET,
+							get_pkcs5_iteration_count (enqPkcs5Prf, bBoot), item->DerivedKey);
 						
 						++queuedWorkItems;
 						break;
 					}
 				}
 
-				if (enqPkcs5Prf < LAST_PRF_ID)
+				if (jobIndex < jobCount - 1)
 					continue;
 			}
 			else
-				--enqPkcs5Prf;
+				--jobIndex;
 
 			// Wait for completion of a key derivation
 			while (queuedWorkItems > 0)
 			{
-				for (i = 0; i < pkcs5PrfCount; ++i)
+				for (i = 0; i < jobCount; ++i)
 				{
 					item = &keyDerivationWorkItems[i];
 					if (!item->Free && InterlockedExchangeAdd (&item->KeyReady, 0) == TRUE)
 					{
+						if (item->HeaderIndex >= bestHeaderIndex)
+						{
+							item->Free = TRUE;
+							--queuedWorkItems;
+							continue;
+						}
+
 						pkcs5_prf = item->Pkcs5Prf;
+						headerIndex = item->HeaderIndex;
 						keyInfo.noIterations = get_pkcs5_iteration_count (pkcs5_prf, bBoot);
+						memcpy (keyInfo.salt, encryptedHeaders[headerIndex] + HEADER_SALT_OFFSET, PKCS5_SALT_SIZE);
 						memcpy (dk, item->DerivedKey, sizeof (dk));
 
 						item->Free = TRUE;
@@ -295,8 +569,16 @@ KeyReady:	;
 		}
 		else
 		{
-			pkcs5_prf = enqPkcs5Prf;
-			keyInfo.noIterations = get_pkcs5_iteration_count (enqPkcs5Prf, bBoot);
+			pkcs5_prf = prfOrder[jobIndex / headerCount];
+			headerIndex = jobIndex % headerCount;
+
+			if (headerIndex >= bestHeaderIndex)
+				continue;
+
+			keyInfo.noIterations = get_pkcs5_iteration_count (pkcs5_prf, bBoot);
+
+			// PKCS5 is used to derive the primary header key(s) and secondary header key(s) (XTS mode) from the password
+			memcpy (keyInfo.salt, encryptedHeaders[headerIndex] + HEADER_SALT_OFFSET, PKCS5_SALT_SIZE);
 
 			switch (pkcs5_prf)
 			{
@@ -327,11 +609,16 @@ KeyReady:	;
 			} 
 		}
 
+		encryptedHeader = encryptedHeaders[headerIndex];
+
+		// Key schedules cached for the previous derived key are no longer valid
+		KeyScheduleCacheReset (keyScheduleCache);
+
 		// Test all available modes of operation
-		for (cryptoInfo->mode = FIRST_MODE_OF_OPERATION_ID;
-			cryptoInfo->mode <= LAST_MODE_OF_OPERATION;
-			cryptoInfo->mode++)
+		for (modeIndex = 0; modeIndex < modeCount; ++modeIndex)
 		{
+			cryptoInfo->mode = modeOrder[modeIndex];
+
 			switch (cryptoInfo->mode)
 			{
 			case LRW:
@@ -350,9 +637,9 @@ KeyReady:	;
 			}
 
 			// Test all available encryption algorithms
-			for (cryptoInfo->ea = EAGetFirst ();
+			for (cryptoInfo->ea = HintedEAGetFirst (hintEa);
 				cryptoInfo->ea != 0;
-				cryptoInfo->ea = EAGetNext (cryptoInfo->ea))
+				cryptoInfo->ea = HintedEAGetNext (hintEa, cryptoInfo->ea))
 			{
 				int blockSize;
 
@@ -361,7 +648,7 @@ KeyReady:	;
 
 				blockSize = CipherGetBlockSize (EAGetFirstCipher (cryptoInfo->ea));
 
-				status = EAInit (cryptoInfo->ea, dk + primaryKeyOffset, cryptoInfo->ks);
+				status = EAInitCached (keyScheduleCache, cryptoInfo->ea, dk, primaryKeyOffset, cryptoInfo->ks);
 				if (status == ERR_CIPHER_INIT_FAILURE)
 					goto err;
 
@@ -372,8 +659,8 @@ KeyReady:	;
 					// Copy the secondary key (if cascade, multiple concatenated)
 					memcpy (cryptoInfo->k2, dk + EAGetKeySize (cryptoInfo->ea), EAGetKeySize (cryptoInfo->ea));
 
-					// Secondary key schedule
-					if (!EAInitMode (cryptoInfo))
+					// Secondary key schedule (equivalent to EAInitMode)
+					if (EAInitCached (keyScheduleCache, cryptoInfo->ea, dk, EAGetKeySize (cryptoInfo->ea), cryptoInfo->ks2) != ERR_SUCCESS)
 					{
 						status = ERR_MODE_INIT_FAILED;
 						goto err;
@@ -396,16 +683,39 @@ KeyReady:	;
 						lrw128InitDone = TRUE;
 				}
 
-				// Copy the header for decryption
-				memcpy (header, encryptedHeader, sizeof (header));
+				if (cryptoInfo->mode == XTS)
+				{
+					// The magic occupies the first cipher block of the encrypted area. Decrypt only
+					// that block and decrypt the rest of the header only if the magic matches.
+					memcpy (header, encryptedHeader, HEADER_ENCRYPTED_DATA_OFFSET + BYTES_PER_XTS_BLOCK);
+					DecryptHeaderBlocksXTS (header + HEADER_ENCRYPTED_DATA_OFFSET, BYTES_PER_XTS_BLOCK, 0, cryptoInfo);
 
-				// Try to decrypt header 
+					// Magic 'TRUE'
+					if (GetHeaderField32 (header, TC_HEADER_OFFSET_MAGIC) != 0x54525545)
+						continue;
 
-				DecryptBuffer (header + HEADER_ENCRYPTED_DATA_OFFSET, HEADER_ENCRYPTED_DATA_SIZE, cryptoInfo);
+					memcpy (header + HEADER_ENCRYPTED_DATA_OFFSET + BYTES_PER_XTS_BLOCK,
+						encryptedHeader + HEADER_ENCRYPTED_DATA_OFFSET + BYTES_PER_XTS_BLOCK,
+						HEADER_ENCRYPTED_DATA_SIZE - BYTES_PER_XTS_BLOCK);
 
-				// Magic 'TRUE'
-				if (GetHeaderField32 (header, TC_HEADER_OFFSET_MAGIC) != 0x54525545)
-					continue;
+					DecryptHeaderBlocksXTS (header + HEADER_ENCRYPTED_DATA_OFFSET + BYTES_PER_XTS_BLOCK,
+						HEADER_ENCRYPTED_DATA_SIZE - BYTES_PER_XTS_BLOCK, 1, cryptoInfo);
+				}
+				else
+				{
+					// Deprecated/legacy
+
+					// Copy the header for decryption
+					memcpy (header, encryptedHeader, sizeof (header));
+
+					// Try to decrypt header 
+
+					DecryptBuffer (header + HEADER_ENCRYPTED_DATA_OFFSET, HEADER_ENCRYPTED_DATA_SIZE, cryptoInfo);
+
+					// Magic 'TRUE'
+					if (GetHeaderField32 (header, TC_HEADER_OFFSET_MAGIC) != 0x54525545)
+						continue;
+				}
 
 				// Header version
 				headerVersion = GetHeaderField16 (header, TC_HEADER_OFFSET_VERSION);
@@ -433,6 +743,19 @@ KeyReady:	;
 
 				// Now we have the correct password, cipher, hash algorithm, and volume type
 
+				// Key derivations complete in any order. The header key is kept aside until all preceding
+				// headers have been tried, so that the result does not depend on the number of threads.
+				if (IsPrecedingHeaderJobPending (encryptionThreadCount > 1 ? keyDerivationWorkItems : NULL, jobCount, headerCount, jobIndex + 1, headerIndex))
+				{
+					bestPkcs5Prf = pkcs5_prf;
+					bestHeaderIndex = headerIndex;
+					memcpy (bestDk, dk, sizeof (bestDk));
+					goto NextKey;
+				}
+
+				if (retHeaderIndex)
+					*retHeaderIndex = headerIndex;
+
 				// Check the version required to handle this volume
 				if (cryptoInfo->RequiredProgramVersion > VERSION_NUM)
 				{
@@ -541,6 +864,7 @@ KeyReady:	;
 				goto ret;
 			}
 		}
+NextKey:	;
 	}
 	status = ERR_PASSWORD_WRONG;
 
@@ -552,19 +876,35 @@ err:
 	}
 
 ret:
+	// Key derivations still queued or in progress are no longer needed. They stop within
+	// PKCS5_ABORT_CHECK_INTERVAL iterations, which releases the pool threads for data I/O.
+	if (encryptionThreadCount > 1)
+		InterlockedExchange (&abortKeyDerivation, TRUE);
+
 	burn (&keyInfo, sizeof (keyInfo));
 	burn (dk, sizeof(dk));
+	burn (bestDk, sizeof (bestDk));
 
 #ifndef DEVICE_DRIVER
 	VirtualUnlock (&keyInfo, sizeof (keyInfo));
 	VirtualUnlock (&dk, sizeof (dk));
+	VirtualUnlock (&bestDk, sizeof (bestDk));
 #endif
 
+	if (keyScheduleCache)
+	{
+		burn (keyScheduleCache, sizeof (KeyScheduleCache));
+#ifndef DEVICE_DRIVER
+		VirtualUnlock (keyScheduleCache, sizeof (KeyScheduleCache));
+#endif
+		TCfree (keyScheduleCache);
+	}
+
 	if (encryptionThreadCount > 1)
 	{
 		TC_WAIT_EVENT (noOutstandingWorkItemEvent);
 
-		burn (keyDerivationWorkItems, sizeof (KeyDerivationWorkItem) * pkcs5PrfCount);
+		burn (keyDerivationWorkItems, sizeof (KeyDerivationWorkItem) * jobCount);
 		TCfree (keyDerivationWorkItems);
 
 #ifndef DEVICE_DRIVER
@@ -573,6 +913,15 @@ ret:
 #endif
 	}
 
+	return status;
+
+allocErr:
+	if (cryptoInfo != retHeaderCryptoInfo)
+	{
+		crypto_close (cryptoInfo);
+		*retInfo = NULL;
+	}
+
 	return status;
 }
 
@@ -678,31 +1027,12 @@ ret:
 
 #if !defined (DEVICE_DRIVER) && !defined (TC_WINDOWS_BOOT)
 
-// Creates a volume header in memory
-int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Password *password,
-		   int pkcs5_prf, char *masterKeydata, PCRYPTO_INFO *retInfo,
-		   unsigned __int64 volumeSize, unsigned __int64 hiddenVolumeSize,
-		   unsigned __int64 encryptedAreaStart, unsigned __int64 encryptedAreaLength, uint16 requiredProgramVersion, uint32 headerFlags, uint32 sectorSize, BOOL bWipeMode)
+// Generates (or copies) the master key data and salt, and loads the password into scratch->KeyInfo.
+// If salt is NULL, it is generated by the RNG.
+static int PrepareVolumeHeaderKeyInfo (VolumeHeaderScratch *scratch, BOOL bBoot, int ea, int mode, Password *password,
+		int pkcs5_prf, char *masterKeydata, const char *salt, BOOL bWipeMode)
 {
-	unsigned char *p = (unsigned char *) header;
-	static KEY_INFO keyInfo;
-
-	int nUserKeyLen = password->Length;
-	PCRYPTO_INFO cryptoInfo = crypto_open ();
-	static char dk[MASTER_KEYDATA_SIZE];
-	int x;
-	int retVal = 0;
-	int primaryKeyOffset;
-
-	if (cryptoInfo == NULL)
-		return ERR_OUTOFMEMORY;
-
-	memset (header, 0, TC_VOLUME_HEADER_EFFECTIVE_SIZE);
-
-	VirtualLock (&keyInfo, sizeof (keyInfo));
-	VirtualLock (&dk, sizeof (dk));
-
-	/* Encryption setup */
+	KEY_INFO *keyInfo = &scratch->KeyInfo;
 
 	if (masterKeydata == NULL)
 	{
@@ -729,63 +1059,73 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 			bytesNeeded = EAGetKeySize (ea) * 2;	// Size of primary + secondary key(s)
 		}
 
-		if (!RandgetBytes (keyInfo.master_keydata, bytesNeeded, TRUE))
+		if (!RandgetBytes (keyInfo->master_keydata, bytesNeeded, TRUE))
 			return ERR_CIPHER_INIT_WEAK_KEY;
 	}
 	else
 	{
 		// We already have existing master key data (the header is being re-encrypted)
-		memcpy (keyInfo.master_keydata, masterKeydata, MASTER_KEYDATA_SIZE);
+		memcpy (keyInfo->master_keydata, masterKeydata, MASTER_KEYDATA_SIZE);
 	}
 
 	// User key 
-	memcpy (keyInfo.userKey, password->Text, nUserKeyLen);
-	keyInfo.keyLength = nUserKeyLen;
-	keyInfo.noIterations = get_pkcs5_iteration_count (pkcs5_prf, bBoot);
-
-	// User selected encryption algorithm
-	cryptoInfo->ea = ea;
-
-	// Mode of operation
-	cryptoInfo->mode = mode;
+	memcpy (keyInfo->userKey, password->Text, password->Length);
+	keyInfo->keyLength = password->Length;
+	keyInfo->noIterations = get_pkcs5_iteration_count (pkcs5_prf, bBoot);
 
 	// Salt for header key derivation
-	if (!RandgetBytes (keyInfo.salt, PKCS5_SALT_SIZE, !bWipeMode))
+	if (salt != NULL)
+		memcpy (keyInfo->salt, salt, PKCS5_SALT_SIZE);
+	else if (bWipeMode)
+	{
+		// NN: Wipe passes only need fresh salts; they are taken from the thread's own stream to avoid contention for the pool
+		if (!RandgetThreadBytes (keyInfo->salt, PKCS5_SALT_SIZE))
+			return ERR_CIPHER_INIT_WEAK_KEY;
+	}
+	else if (!RandgetBytes (keyInfo->salt, PKCS5_SALT_SIZE, TRUE))
 		return ERR_CIPHER_INIT_WEAK_KEY; 
 
-	// PBKDF2 (PKCS5) is used to derive primary header key(s) and secondary header key(s) (XTS) from the password/keyfiles
-	switch (pkcs5_prf)
+	return ERR_SUCCESS;
+}
+
+
+// Builds and encrypts the header from scratch->KeyInfo and the header key derived from it (scratch->DerivedKey)
+static int BuildVolumeHeader (VolumeHeaderScratch *scratch, char *header, int ea, int mode, PCRYPTO_INFO *retInfo,
+		   unsigned __int64 volumeSize, unsigned __int64 hiddenVolumeSize,
+		   unsigned __int64 encryptedAreaStart, unsigned __int64 encryptedAreaLength, uint16 requiredProgramVersion, uint32 headerFlags, uint32 sectorSize)
+{
+	unsigned char *p = (unsigned char *) header;
+	KEY_INFO *keyInfo = &scratch->KeyInfo;
+	char *dk = scratch->DerivedKey;
+	PCRYPTO_INFO cryptoInfo;
+	int x;
+	int retVal = 0;
+	int primaryKeyOffset;
+
+	// Sector size
+	if (sectorSize < TC_MIN_VOLUME_SECTOR_SIZE
+		|| sectorSize > TC_MAX_VOLUME_SECTOR_SIZE
+		|| sectorSize % ENCRYPTION_DATA_UNIT_SIZE != 0)
 	{
-	case SHA512:
-		derive_key_sha512 (keyInfo.userKey, keyInfo.keyLength, keyInfo.salt,
-			PKCS5_SALT_SIZE, keyInfo.noIterations, dk, GetMaxPkcs5OutSize());
-		break;
+		TC_THROW_FATAL_EXCEPTION;
+	}
 
-	case SHA1:
-		// Deprecated/legacy
-		derive_key_sha1 (keyInfo.userKey, keyInfo.keyLength, keyInfo.salt,
-			PKCS5_SALT_SIZE, keyInfo.noIterations, dk, GetMaxPkcs5OutSize());
-		break;
+	cryptoInfo = crypto_open ();
+	if (cryptoInfo == NULL)
+		return ERR_OUTOFMEMORY;
 
-	case RIPEMD160:
-		derive_key_ripemd160 (keyInfo.userKey, keyInfo.keyLength, keyInfo.salt,
-			PKCS5_SALT_SIZE, keyInfo.noIterations, dk, GetMaxPkcs5OutSize());
-		break;
+	memset (header, 0, TC_VOLUME_HEADER_EFFECTIVE_SIZE);
 
-	case WHIRLPOOL:
-		derive_key_whirlpool (keyInfo.userKey, keyInfo.keyLength, keyInfo.salt,
-			PKCS5_SALT_SIZE, keyInfo.noIterations, dk, GetMaxPkcs5OutSize());
-		break;
+	// User selected encryption algorithm
+	cryptoInfo->ea = ea;
 
-	default:		
-		// Unknown/wrong ID
-		TC_THROW_FATAL_EXCEPTION;
-	} 
+	// Mode of operation
+	cryptoInfo->mode = mode;
 
 	/* Header setup */
 
 	// Salt
-	mputBytes (p, keyInfo.salt, PKCS5_SALT_SIZE);	
+	mputBytes (p, keyInfo->salt, PKCS5_SALT_SIZE);	
 
 	// Magic
 	mputLong (p, 0x54525545);
@@ -815,7 +1155,7 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 	}
 
 	// CRC of the master key data
-	x = GetCrc32(keyInfo.master_keydata, MASTER_KEYDATA_SIZE);
+	x = GetCrc32(keyInfo->master_keydata, MASTER_KEYDATA_SIZE);
 	mputLong (p, x);
 
 	// Reserved fields
@@ -844,13 +1184,6 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 	mputLong (p, headerFlags);
 
 	// Sector size
-	if (sectorSize < TC_MIN_VOLUME_SECTOR_SIZE
-		|| sectorSize > TC_MAX_VOLUME_SECTOR_SIZE
-		|| sectorSize % ENCRYPTION_DATA_UNIT_SIZE != 0)
-	{
-		TC_THROW_FATAL_EXCEPTION;
-	}
-
 	cryptoInfo->SectorSize = sectorSize;
 	mputLong (p, sectorSize);
 
@@ -860,7 +1193,7 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 	mputLong (p, x);
 
 	// The master key data
-	memcpy (header + HEADER_MASTER_KEYDATA_OFFSET, keyInfo.master_keydata, MASTER_KEYDATA_SIZE);
+	memcpy (header + HEADER_MASTER_KEYDATA_OFFSET, keyInfo->master_keydata, MASTER_KEYDATA_SIZE);
 
 
 	/* Header encryption */
@@ -886,11 +1219,14 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 
 	retVal = EAInit (cryptoInfo->ea, dk + primaryKeyOffset, cryptoInfo->ks);
 	if (retVal != ERR_SUCCESS)
-		return retVal;
+		goto err;
 
 	// Mode of operation
 	if (!EAInitMode (cryptoInfo))
-		return ERR_OUTOFMEMORY;
+	{
+		retVal = ERR_OUTOFMEMORY;
+		goto err;
+	}
 
 
 	// Encrypt the entire header (except the salt)
@@ -902,11 +1238,11 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 	/* cryptoInfo setup for further use (disk format) */
 
 	// Init with the master key(s) 
-	retVal = EAInit (cryptoInfo->ea, keyInfo.master_keydata + primaryKeyOffset, cryptoInfo->ks);
+	retVal = EAInit (cryptoInfo->ea, keyInfo->master_keydata + primaryKeyOffset, cryptoInfo->ks);
 	if (retVal != ERR_SUCCESS)
-		return retVal;
+		goto err;
 
-	memcpy (cryptoInfo->master_keydata, keyInfo.master_keydata, MASTER_KEYDATA_SIZE);
+	memcpy (cryptoInfo->master_keydata, keyInfo->master_keydata, MASTER_KEYDATA_SIZE);
 
 	switch (cryptoInfo->mode)
 	{
@@ -917,17 +1253,20 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 
 		// For LRW (deprecated/legacy), the tweak key
 		// For CBC (deprecated/legacy), the IV/whitening seed
-		memcpy (cryptoInfo->k2, keyInfo.master_keydata, LEGACY_VOL_IV_SIZE);
+		memcpy (cryptoInfo->k2, keyInfo->master_keydata, LEGACY_VOL_IV_SIZE);
 		break;
 
 	default:
 		// The secondary master key (if cascade, multiple concatenated)
-		memcpy (cryptoInfo->k2, keyInfo.master_keydata + EAGetKeySize (cryptoInfo->ea), EAGetKeySize (cryptoInfo->ea));
+		memcpy (cryptoInfo->k2, keyInfo->master_keydata + EAGetKeySize (cryptoInfo->ea), EAGetKeySize (cryptoInfo->ea));
 	}
 
 	// Mode of operation
 	if (!EAInitMode (cryptoInfo))
-		return ERR_OUTOFMEMORY;
+	{
+		retVal = ERR_OUTOFMEMORY;
+		goto err;
+	}
 
 
 #ifdef VOLFORMAT
@@ -948,7 +1287,7 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 		for (i = 0; i < j; i++)
 		{
 			char tmp2[8] = {0};
-			sprintf (tmp2, "%02X", (int) (unsigned char) keyInfo.master_keydata[i + primaryKeyOffset]);
+			sprintf (tmp2, "%02X", (int) (unsigned char) keyInfo->master_keydata[i + primaryKeyOffset]);
 			strcat (MasterKeyGUIView, tmp2);
 		}
 
@@ -972,11 +1311,183 @@ int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Pass
 	}
 #endif	// #ifdef VOLFORMAT
 
-	burn (dk, sizeof(dk));
-	burn (&keyInfo, sizeof (keyInfo));
-
 	*retInfo = cryptoInfo;
 	return 0;
+
+err:
+	crypto_close (cryptoInfo);
+	return retVal;
+}
+
+
+// Creates a volume header in memory. Reentrant: all secret intermediate data is kept in scratch, which is
+// owned by the caller (see AllocVolumeHeaderScratch()) and burned before returning. If salt is NULL, a new
+// salt is generated by the RNG.
+int CreateVolumeHeaderInMemoryEx (BOOL bBoot, char *header, int ea, int mode, Password *password,
+		   int pkcs5_prf, char *masterKeydata, const char *salt, PCRYPTO_INFO *retInfo,
+		   unsigned __int64 volumeSize, unsigned __int64 hiddenVolumeSize,
+		   unsigned __int64 encryptedAreaStart, unsigned __int64 encryptedAreaLength, uint16 requiredProgramVersion, uint32 headerFlags, uint32 sectorSize, BOOL bWipeMode,
+		   VolumeHeaderScratch *scratch)
+{
+	KEY_INFO *keyInfo = &scratch->KeyInfo;
+	int retVal;
+
+	retVal = PrepareVolumeHeaderKeyInfo (scratch, bBoot, ea, mode, password, pkcs5_prf, masterKeydata, salt, bWipeMode);
+	if (retVal != ERR_SUCCESS)
+		goto ret;
+
+	// PBKDF2 (PKCS5) is used to derive primary header key(s) and secondary header key(s) (XTS) from the password/keyfiles
+	derive_key_abortable (pkcs5_prf, keyInfo->userKey, keyInfo->keyLength, keyInfo->salt,
+		PKCS5_SALT_SIZE, keyInfo->noIterations, scratch->DerivedKey, GetMaxPkcs5OutSize(), NULL);
+
+	retVal = BuildVolumeHeader (scratch, header, ea, mode, retInfo, volumeSize, hiddenVolumeSize,
+		encryptedAreaStart, encryptedAreaLength, requiredProgramVersion, headerFlags, sectorSize);
+
+ret:
+	burn (scratch, sizeof (*scratch));
+	return retVal;
+}
+
+
+// Creates a volume header in memory
+int CreateVolumeHeaderInMemory (BOOL bBoot, char *header, int ea, int mode, Password *password,
+		   int pkcs5_prf, char *masterKeydata, PCRYPTO_INFO *retInfo,
+		   unsigned __int64 volumeSize, unsigned __int64 hiddenVolumeSize,
+		   unsigned __int64 encryptedAreaStart, unsigned __int64 encryptedAreaLength, uint16 requiredProgramVersion, uint32 headerFlags, uint32 sectorSize, BOOL bWipeMode)
+{
+	VolumeHeaderScratch scratch;
+	int retVal;
+
+	VirtualLock (&scratch, sizeof (scratch));
+
+	retVal = CreateVolumeHeaderInMemoryEx (bBoot, header, ea, mode, password, pkcs5_prf, masterKeydata, NULL, retInfo,
+		volumeSize, hiddenVolumeSize, encryptedAreaStart, encryptedAreaLength, requiredProgramVersion, headerFlags, sectorSize, bWipeMode,
+		&scratch);
+
+	VirtualUnlock (&scratch, sizeof (scratch));
+	return retVal;
+}
+
+
+// Allocates scratch memory for count headers, locked in physical memory
+VolumeHeaderScratch *AllocVolumeHeaderScratch (int count)
+{
+	VolumeHeaderScratch *scratch = TCalloc (sizeof (VolumeHeaderScratch) * count);
+
+	if (scratch)
+	{
+		memset (scratch, 0, sizeof (VolumeHeaderScratch) * count);
+		VirtualLock (scratch, sizeof (VolumeHeaderScratch) * count);
+	}
+
+	return scratch;
+}
+
+
+void FreeVolumeHeaderScratch (VolumeHeaderScratch *scratch, int count)
+{
+	if (scratch)
+	{
+		burn (scratch, sizeof (VolumeHeaderScratch) * count);
+		VirtualUnlock (scratch, sizeof (VolumeHeaderScratch) * count);
+		TCfree (scratch);
+	}
+}
+
+
+// Creates count volume headers in memory. Header keys are derived in parallel on the encryption thread pool
+// (if running); salts and master keys are obtained from the RNG beforehand. Returns ERR_SUCCESS if all
+// headers have been created, otherwise the first error (the status of each header is in its Status field).
+int CreateVolumeHeadersInMemory (BOOL bBoot, VolumeHeaderBatchItem *items, int count, BOOL bWipeMode)
+{
+	VolumeHeaderScratch *scratch;
+	LONG *keyReady = NULL;
+	TC_EVENT keyDerivationCompletedEvent;
+	TC_EVENT noOutstandingWorkItemEvent;
+	LONG outstandingWorkItemCount = 0;
+	BOOL parallel = GetEncryptionThreadCount () > 1 && count > 1;
+	int status = ERR_SUCCESS;
+	int i;
+
+	if (items == NULL || count < 1)
+		return ERR_PARAMETER_INCORRECT;
+
+	scratch = AllocVolumeHeaderScratch (count);
+	if (!scratch)
+		return ERR_OUTOFMEMORY;
+
+	if (parallel)
+	{
+		keyReady = TCalloc (sizeof (LONG) * count);
+		keyDerivationCompletedEvent = CreateEvent (NULL, FALSE, FALSE, NULL);
+		noOutstandingWorkItemEvent = CreateEvent (NULL, FALSE, TRUE, NULL);
+
+		if (!keyReady || !keyDerivationCompletedEvent || !noOutstandingWorkItemEvent)
+		{
+			if (keyReady)
+				TCfree (keyReady);
+			if (keyDerivationCompletedEvent)
+				CloseHandle (keyDerivationCompletedEvent);
+			if (noOutstandingWorkItemEvent)
+				CloseHandle (noOutstandingWorkItemEvent);
+
+			parallel = FALSE;
+		}
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		VolumeHeaderBatchItem *item = &items[i];
+		KEY_INFO *keyInfo = &scratch[i].KeyInfo;
+
+		item->CryptoInfo = NULL;
+		item->Status = PrepareVolumeHeaderKeyInfo (&scratch[i], bBoot, item->Ea, item->Mode, item->VolumePassword,
+			item->Pkcs5Prf, item->MasterKeydata, NULL, bWipeMode);
+
+		if (item->Status != ERR_SUCCESS)
+			continue;
+
+		// PBKDF2 (PKCS5) is used to derive primary header key(s) and secondary header key(s) (XTS) from the password/keyfiles
+		if (parallel)
+		{
+			keyReady[i] = FALSE;
+			EncryptionThreadPoolBeginKeyDerivation (&keyDerivationCompletedEvent, &noOutstandingWorkItemEvent,
+				&keyReady[i], &outstandingWorkItemCount, NULL, item->Pkcs5Prf, keyInfo->userKey, keyInfo->keyLength,
+				keyInfo->salt, keyInfo->noIterations, scratch[i].DerivedKey);
+		}
+		else
+		{
+			derive_key_abortable (item->Pkcs5Prf, keyInfo->userKey, keyInfo->keyLength, keyInfo->salt,
+				PKCS5_SALT_SIZE, keyInfo->noIterations, scratch[i].DerivedKey, GetMaxPkcs5OutSize(), NULL);
+		}
+	}
+
+	if (parallel)
+	{
+		TC_WAIT_EVENT (noOutstandingWorkItemEvent);
+
+		CloseHandle (keyDerivationCompletedEvent);
+		CloseHandle (noOutstandingWorkItemEvent);
+		TCfree (keyReady);
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		VolumeHeaderBatchItem *item = &items[i];
+
+		if (item->Status == ERR_SUCCESS)
+		{
+			item->Status = BuildVolumeHeader (&scratch[i], item->Header, item->Ea, item->Mode, &item->CryptoInfo,
+				item->VolumeSize, item->HiddenVolumeSize, item->EncryptedAreaStart, item->EncryptedAreaLength,
+				item->RequiredProgramVersion, item->HeaderFlags, item->SectorSize);
+		}
+
+		if (item->Status != ERR_SUCCESS && status == ERR_SUCCESS)
+			status = item->Status;
+	}
+
+	FreeVolumeHeaderScratch (scratch, count);
+	return status;
 }
 
 
@@ -1079,6 +1590,160 @@ BOOL WriteEffectiveVolumeHeader (BOOL device, HANDLE fileHandle, byte *header)
 }
 
 
+// Normal and hidden volume headers, their backups, and legacy hidden volume header
+#define TC_PROBE_MAX_HEADER_COUNT	5
+
+
+// Reads size bytes at offset in a single read. Bytes beyond the end of the host are zeroed. The read is
+// positional, so dev may have been opened for overlapped I/O.
+static BOOL ReadVolumeHeaderArea (HANDLE dev, uint64 offset, char *buffer, DWORD size)
+{
+	OVERLAPPED overlapped;
+	DWORD bytesRead;
+	BOOL bResult;
+
+	memset (buffer, 0, size);
+
+	memset (&overlapped, 0, sizeof (overlapped));
+	overlapped.Offset = (DWORD) offset;
+	overlapped.OffsetHigh = (DWORD) (offset >> 32);
+	overlapped.hEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+
+	if (!overlapped.hEvent)
+		return FALSE;
+
+	bResult = ReadFile (dev, buffer, size, NULL, &overlapped);
+
+	if (bResult || GetLastError () == ERROR_IO_PENDING)
+		bResult = GetOverlappedResult (dev, &overlapped, &bytesRead, TRUE);
+
+	if (!bResult && GetLastError () == ERROR_HANDLE_EOF)
+		bResult = TRUE;
+
+	CloseHandle (overlapped.hEvent);
+	return bResult;
+}
+
+
+// Tries the password on all header slots of the volume hosted by dev: the normal and hidden volume
+// headers (and legacy hidden volume header if sectorSize allows it), and optionally their backups. The
+// primary and backup header groups are read with one read each and the PRF derivations for all slots
+// are processed in a single parallel search. On success, the slot which has been decrypted is returned in
+// retVolumeType, retBackupHeader and retHeaderOffset (absolute offset of the header within the host).
+int ProbeVolumeHeaders (BOOL device, HANDLE dev, uint64 hostSize, uint32 sectorSize, BOOL includeBackupHeaders, Password *password, const HeaderSearchHint *hint, int *retVolumeType, BOOL *retBackupHeader, uint64 *retHeaderOffset, PCRYPTO_INFO *retInfo)
+{
+	char *headers[TC_PROBE_MAX_HEADER_COUNT];
+	int volumeTypes[TC_PROBE_MAX_HEADER_COUNT];
+	BOOL backupHeaders[TC_PROBE_MAX_HEADER_COUNT];
+	uint64 headerOffsets[TC_PROBE_MAX_HEADER_COUNT];
+	char legacyHeader[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	char *primaryGroup, *backupGroup;
+	uint64 backupGroupOffset = 0;
+	BOOL backupGroupRead = FALSE;
+	BOOL legacyHidden = (sectorSize == TC_SECTOR_SIZE_LEGACY && hostSize >= TC_HIDDEN_VOLUME_HEADER_OFFSET_LEGACY);
+	int headerCount = 0, headerIndex = 0;
+	int status;
+
+	*retInfo = NULL;
+
+	primaryGroup = TCalloc (2 * TC_VOLUME_HEADER_GROUP_SIZE);
+	if (!primaryGroup)
+		return ERR_OUTOFMEMORY;
+
+	backupGroup = primaryGroup + TC_VOLUME_HEADER_GROUP_SIZE;
+
+	if (!ReadVolumeHeaderArea (dev, TC_VOLUME_HEADER_OFFSET, primaryGroup, TC_VOLUME_HEADER_GROUP_SIZE))
+	{
+		status = ERR_OS_ERROR;
+		goto ret;
+	}
+
+	// Windows may report EOF when reading sectors from the last cluster of a device formatted as NTFS. Such
+	// header slots remain zeroed, which makes them fail to decrypt.
+	if ((includeBackupHeaders || legacyHidden) && hostSize >= 2 * TC_VOLUME_HEADER_GROUP_SIZE)
+	{
+		backupGroupOffset = hostSize - TC_VOLUME_HEADER_GROUP_SIZE;
+		backupGroupRead = ReadVolumeHeaderArea (dev, backupGroupOffset, backupGroup, TC_VOLUME_HEADER_GROUP_SIZE);
+	}
+
+	headers[headerCount] = primaryGroup + TC_VOLUME_HEADER_OFFSET;
+	volumeTypes[headerCount] = TC_VOLUME_TYPE_NORMAL;
+	backupHeaders[headerCount] = FALSE;
+	headerOffsets[headerCount++] = TC_VOLUME_HEADER_OFFSET;
+
+	if (TC_HIDDEN_VOLUME_HEADER_OFFSET + TC_VOLUME_HEADER_SIZE <= hostSize)
+	{
+		headers[headerCount] = primaryGroup + TC_HIDDEN_VOLUME_HEADER_OFFSET;
+		volumeTypes[headerCount] = TC_VOLUME_TYPE_HIDDEN;
+		backupHeaders[headerCount] = FALSE;
+		headerOffsets[headerCount++] = TC_HIDDEN_VOLUME_HEADER_OFFSET;
+	}
+
+	if (includeBackupHeaders && backupGroupRead)
+	{
+		headers[headerCount] = backupGroup + TC_VOLUME_HEADER_OFFSET;
+		volumeTypes[headerCount] = TC_VOLUME_TYPE_NORMAL;
+		backupHeaders[headerCount] = TRUE;
+		headerOffsets[headerCount++] = backupGroupOffset + TC_VOLUME_HEADER_OFFSET;
+
+		headers[headerCount] = backupGroup + TC_HIDDEN_VOLUME_HEADER_OFFSET;
+		volumeTypes[headerCount] = TC_VOLUME_TYPE_HIDDEN;
+		backupHeaders[headerCount] = TRUE;
+		headerOffsets[headerCount++] = backupGroupOffset + TC_HIDDEN_VOLUME_HEADER_OFFSET;
+	}
+
+	if (legacyHidden)
+	{
+		// Deprecated/legacy
+		uint64 legacyHeaderOffset = hostSize - TC_HIDDEN_VOLUME_HEADER_OFFSET_LEGACY;
+
+		if (backupGroupRead)
+		{
+			headers[headerCount] = backupGroup + (legacyHeaderOffset - backupGroupOffset);
+		}
+		else if (!device)
+		{
+			ReadVolumeHeaderArea (dev, legacyHeaderOffset, legacyHeader, sizeof (legacyHeader));
+			headers[headerCount] = legacyHeader;
+		}
+		else
+		{
+			DWORD bytesRead;
+			LARGE_INTEGER seekOffset;
+
+			memset (legacyHeader, 0, sizeof (legacyHeader));
+			seekOffset.QuadPart = legacyHeaderOffset;
+
+			if (SetFilePointerEx (dev, seekOffset, NULL, FILE_BEGIN))
+				ReadEffectiveVolumeHeader (device, dev, (byte *) legacyHeader, &bytesRead);
+
+			headers[headerCount] = legacyHeader;
+		}
+
+		volumeTypes[headerCount] = TC_VOLUME_TYPE_HIDDEN_LEGACY;
+		backupHeaders[headerCount] = FALSE;
+		headerOffsets[headerCount++] = legacyHeaderOffset;
+	}
+
+	status = ReadVolumeHeaders (FALSE, headers, headerCount, password, hint, &headerIndex, retInfo, NULL);
+
+	if (status == ERR_SUCCESS)
+	{
+		if (retVolumeType)
+			*retVolumeType = volumeTypes[headerIndex];
+
+		if (retBackupHeader)
+			*retBackupHeader = backupHeaders[headerIndex];
+
+		if (retHeaderOffset)
+			*retHeaderOffset = headerOffsets[headerIndex];
+	}
+
+ret:
+	TCfree (primaryGroup);
+	return status;
+}
+
 // Writes randomly generated data to unused/reserved header areas.
 // When bPrimaryOnly is TRUE, then only the primary header area (not the backup header area) is filled with random data.
 // When bBackupOnly is TRUE, only the backup header area (not the primary header area) is filled with random data.
@@ -1103,8 +1768,8 @@ int WriteRandomDataToReservedHeaderAreas (HANDLE dev, CRYPTO_INFO *cryptoInfo, u
 	while (TRUE)
 	{
 		// Temporary keys
-		if (!RandgetBytes (temporaryKey, EAGetKeySize (cryptoInfo->ea), FALSE)
-			|| !RandgetBytes (cryptoInfo->k2, sizeof (cryptoInfo->k2), FALSE))
+		if (!RandgetThreadBytes (temporaryKey, EAGetKeySize (cryptoInfo->ea))
+			|| !RandgetThreadBytes (cryptoInfo->k2, sizeof (cryptoInfo->k2)))
 		{
 			nStatus = ERR_PARAMETER_INCORRECT; 
 			goto final_seq;
@@ -1216,7 +1881,8 @@ void CreateFullVolumePath (char *lpszDiskFile, const char *lpszFileName, BOOL *
 int FakeDosNameForDevice (const char *lpszDiskFile, char *lpszDosDevice, char *lpszCFDevice, BOOL bNameOnly)
 {
 	BOOL bDosLinkCreated = TRUE;
-	sprintf (lpszDosDevice, "truecrypt%lu", GetCurrentProcessId ());
+	// The thread ID keeps the names unique when several volumes are processed concurrently
+	sprintf (lpszDosDevice, "truecrypt%lu_%lu", GetCurrentProcessId (), GetCurrentThreadId ());
 
 	if (bNameOnly == FALSE)
 		bDosLinkCreated = DefineDosDevice (DDD_RAW_TARGET_PATH, lpszDosDevice, lpszDiskFile);
@@ -151,15 +151,64 @@ enum
 
 extern BOOL ReadVolumeHeaderRecoveryMode;
 
+// Combination of PKCS-5 PRF, encryption algorithm and mode of operation to be tried first when reading
+// a volume header. Zero fields are ignored.
+typedef struct HeaderSearchHintStruct
+{
+	int Pkcs5Prf;
+	int Ea;
+	int Mode;
+} HeaderSearchHint;
+
 uint16 GetHeaderField16 (byte *header, int offset);
 uint32 GetHeaderField32 (byte *header, int offset);
 UINT64_STRUCT GetHeaderField64 (byte *header, int offset);
 int ReadVolumeHeader (BOOL bBoot, char *encryptedHeader, Password *password, PCRYPTO_INFO *retInfo, CRYPTO_INFO *retHeaderCryptoInfo);
 
+#ifndef TC_WINDOWS_BOOT
+int ReadVolumeHeaderWithHint (BOOL bBoot, char *encryptedHeader, Password *password, const HeaderSearchHint *hint, PCRYPTO_INFO *retInfo, CRYPTO_INFO *retHeaderCryptoInfo);
+int ReadVolumeHeaders (BOOL bBoot, char **encryptedHeaders, int headerCount, Password *password, const HeaderSearchHint *hint, int *retHeaderIndex, PCRYPTO_INFO *retInfo, CRYPTO_INFO *retHeaderCryptoInfo);
+#endif
+
 #if !defined (DEVICE_DRIVER) && !defined (TC_WINDOWS_BOOT)
+
+// Secret intermediate data used while creating a volume header. Owned by the caller, which should keep
+// it locked in physical memory (see AllocVolumeHeaderScratch()).
+typedef struct
+{
+	KEY_INFO KeyInfo;
+	char DerivedKey[MASTER_KEYDATA_SIZE];
+} VolumeHeaderScratch;
+
+// A header to be created by CreateVolumeHeadersInMemory()
+typedef struct
+{
+	int Ea;
+	int Mode;
+	Password *VolumePassword;
+	int Pkcs5Prf;
+	char *MasterKeydata;	// NULL to generate new master keys
+	unsigned __int64 VolumeSize;
+	unsigned __int64 HiddenVolumeSize;
+	unsigned __int64 EncryptedAreaStart;
+	unsigned __int64 EncryptedAreaLength;
+	uint16 RequiredProgramVersion;
+	uint32 HeaderFlags;
+	uint32 SectorSize;
+
+	char Header[TC_VOLUME_HEADER_EFFECTIVE_SIZE];
+	PCRYPTO_INFO CryptoInfo;
+	int Status;
+} VolumeHeaderBatchItem;
+
+VolumeHeaderScratch *AllocVolumeHeaderScratch (int count);
+void FreeVolumeHeaderScratch (VolumeHeaderScratch *scratch, int count);
+int CreateVolumeHeaderInMemoryEx (BOOL bBoot, char *encryptedHeader, int ea, int mode, Password *password, int pkcs5_prf, char *masterKeydata, const char *salt, PCRYPTO_INFO *retInfo, unsigned __int64 volumeSize, unsigned __int64 hiddenVolumeSize, unsigned __int64 encryptedAreaStart, unsigned __int64 encryptedAreaLength, uint16 requiredProgramVersion, uint32 headerFlags, uint32 sectorSize, BOOL bWipeMode, VolumeHeaderScratch *scratch);
+int CreateVolumeHeadersInMemory (BOOL bBoot, VolumeHeaderBatchItem *items, int count, BOOL bWipeMode);
 int CreateVolumeHeaderInMemory (BOOL bBoot, char *encryptedHeader, int ea, int mode, Password *password, int pkcs5_prf, char *masterKeydata, PCRYPTO_INFO *retInfo, unsigned __int64 volumeSize, unsigned __int64 hiddenVolumeSize, unsigned __int64 encryptedAreaStart, unsigned __int64 encryptedAreaLength, uint16 requiredProgramVersion, uint32 headerFlags, uint32 sectorSize, BOOL bWipeMode);
 BOOL ReadEffectiveVolumeHeader (BOOL device, HANDLE fileHandle, byte *header, DWORD *bytesRead);
 BOOL WriteEffectiveVolumeHeader (BOOL device, HANDLE fileHandle, byte *header);
+int ProbeVolumeHeaders (BOOL device, HANDLE dev, uint64 hostSize, uint32 sectorSize, BOOL includeBackupHeaders, Password *password, const HeaderSearchHint *hint, int *retVolumeType, BOOL *retBackupHeader, uint64 *retHeaderOffset, PCRYPTO_INFO *retInfo);
 int WriteRandomDataToReservedHeaderAreas (HANDLE dev, CRYPTO_INFO *cryptoInfo, uint64 dataAreaSize, BOOL bPrimaryOnly, BOOL bBackupOnly);
 void CreateFullVolumePath (char *lpszDiskFile, const char *lpszFileName, BOOL * bDevice);
 int FakeDosNameForDevice (const char *lpszDiskFile, char *lpszDosDevice, char *lpszCFDevice, BOOL bNameOnly);
@@ -0,0 +1,275 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+/* NN: Whirlpool compression function for the PBKDF2 iterations of HMAC-Whirlpool (Pkcs5.c).
+   Whirlpool.c (the NESSIE reference) is left as it is; this is a separate implementation of the same
+   transform which
+   - works on 64-bit words, so that PBKDF2 can pass digests and padding blocks without byte buffering,
+   - computes the key schedule and the state rounds of each round interleaved, as independent table
+     lookups that the processor can overlap, and
+   - can reuse expanded round keys for a fixed chaining value (WhirlpoolFastCompressWithKey), which
+     halves the work for the first block of every HMAC pass.
+   The tables are generated from the S-box and the diffusion matrix cir(1, 1, 4, 1, 8, 5, 2, 9), and
+   the result is checked against NESSIE test vectors before use. */
+
+#include <string.h>
+
+#include "WhirlpoolFast.h"
+
+static const u8 WhirlpoolSbox[256] =
+{
+	0x18, 0x23, 0xc6, 0xe8, 0x87, 0xb8, 0x01, 0x4f, 0x36, 0xa6, 0xd2, 0xf5, 0x79, 0x6f, 0x91, 0x52,
+	0x60, 0xbc, 0x9b, 0x8e, 0xa3, 0x0c, 0x7b, 0x35, 0x1d, 0xe0, 0xd7, 0xc2, 0x2e, 0x4b, 0xfe, 0x57,
+	0x15, 0x77, 0x37, 0xe5, 0x9f, 0xf0, 0x4a, 0xda, 0x58, 0xc9, 0x29, 0x0a, 0xb1, 0xa0, 0x6b, 0x85,
+	0xbd, 0x5d, 0x10, 0xf4, 0xcb, 0x3e, 0x05, 0x67, 0xe4, 0x27, 0x41, 0x8b, 0xa7, 0x7d, 0x95, 0xd8,
+	0xfb, 0xee, 0x7c, 0x66, 0xdd, 0x17, 0x47, 0x9e, 0xca, 0x2d, 0xbf, 0x07, 0xad, 0x5a, 0x83, 0x33,
+	0x63, 0x02, 0xaa, 0x71, 0xc8, 0x19, 0x49, 0xd9, 0xf2, 0xe3, 0x5b, 0x88, 0x9a, 0x26, 0x32, 0xb0,
+	0xe9, 0x0f, 0xd5, 0x80, 0xbe, 0xcd, 0x34, 0x48, 0xff, 0x7a, 0x90, 0x5f, 0x20, 0x68, 0x1a, 0xae,
+	0xb4, 0x54, 0x93, 0x22, 0x64, 0xf1, 0x73, 0x12, 0x40, 0x08, 0xc3, 0xec, 0xdb, 0xa1, 0x8d, 0x3d,
+	0x97, 0x00, 0xcf, 0x2b, 0x76, 0x82, 0xd6, 0x1b, 0xb5, 0xaf, 0x6a, 0x50, 0x45, 0xf3, 0x30, 0xef,
+	0x3f, 0x55, 0xa2, 0xea, 0x65, 0xba, 0x2f, 0xc0, 0xde, 0x1c, 0xfd, 0x4d, 0x92, 0x75, 0x06, 0x8a,
+	0xb2, 0xe6, 0x0e, 0x1f, 0x62, 0xd4, 0xa8, 0x96, 0xf9, 0xc5, 0x25, 0x59, 0x84, 0x72, 0x39, 0x4c,
+	0x5e, 0x78, 0x38, 0x8c, 0xd1, 0xa5, 0xe2, 0x61, 0xb3, 0x21, 0x9c, 0x1e, 0x43, 0xc7, 0xfc, 0x04,
+	0x51, 0x99, 0x6d, 0x0d, 0xfa, 0xdf, 0x7e, 0x24, 0x3b, 0xab, 0xce, 0x11, 0x8f, 0x4e, 0xb7, 0xeb,
+	0x3c, 0x81, 0x94, 0xf7, 0xb9, 0x13, 0x2c, 0xd3, 0xe7, 0x6e, 0xc4, 0x03, 0x56, 0x44, 0x7f, 0xa9,
+	0x2a, 0xbb, 0xc1, 0x53, 0xdc, 0x0b, 0x9d, 0x6c, 0x31, 0x74, 0xf6, 0x46, 0xac, 0x89, 0x14, 0xe1,
+	0x16, 0x3a, 0x69, 0x09, 0x70, 0xb6, 0xd0, 0xed, 0xcc, 0x42, 0x98, 0xa4, 0x28, 0x5c, 0xf8, 0x86
+};
+
+static u64 C[8][256];
+static u64 RoundConstants[WHIRLPOOL_FAST_ROUNDS + 1];
+static BOOL bTablesReady = FALSE;	/* set once the tables are built and the self-test passed */
+
+/* Row i of the round function applied to a */
+#define WHIRLPOOL_ROW(a, i) ( \
+	C[0][(int) (a[i] >> 56)] ^ \
+	C[1][(int) (a[(i + 7) & 7] >> 48) & 0xff] ^ \
+	C[2][(int) (a[(i + 6) & 7] >> 40) & 0xff] ^ \
+	C[3][(int) (a[(i + 5) & 7] >> 32) & 0xff] ^ \
+	C[4][(int) (a[(i + 4) & 7] >> 24) & 0xff] ^ \
+	C[5][(int) (a[(i + 3) & 7] >> 16) & 0xff] ^ \
+	C[6][(int) (a[(i + 2) & 7] >> 8) & 0xff] ^ \
+	C[7][(int) (a[(i + 1) & 7]) & 0xff])
+
+
+/* Multiplication in GF(2^8) modulo x^8 + x^4 + x^3 + x^2 + 1 */
+static u8 GfMultiply (u8 a, u8 b)
+{
+	u32 product = 0;
+
+	while (b)
+	{
+		if (b & 1)
+			product ^= a;
+
+		b >>= 1;
+		a = (u8) ((a << 1) ^ (a & 0x80 ? 0x1d : 0));
+	}
+
+	return (u8) product;
+}
+
+
+static void BuildTables (void)
+{
+	static const u8 matrixRow[8] = { 1, 1, 4, 1, 8, 5, 2, 9 };
+	int i, k, r;
+
+	for (i = 0; i < 256; i++)
+	{
+		u64 v = 0;
+
+		for (k = 0; k < 8; k++)
+			v = (v << 8) | GfMultiply (WhirlpoolSbox[i], matrixRow[k]);
+
+		for (k = 0; k < 8; k++)
+			C[k][i] = k == 0 ? v : ROTR64 (v, 8 * k);
+	}
+
+	RoundConstants[0] = 0;
+	for (r = 1; r <= WHIRLPOOL_FAST_ROUNDS; r++)
+	{
+		u64 v = 0;
+
+		for (k = 0; k < 8; k++)
+			v = (v << 8) | WhirlpoolSbox[8 * (r - 1) + k];
+
+		RoundConstants[r] = v;
+	}
+}
+
+
+void WhirlpoolFastCompress (u64 hash[8], const u64 block[8])
+{
+	u64 K[8], state[8], LK[8], LS[8];
+	int i, r;
+
+	for (i = 0; i < 8; i++)
+	{
+		K[i] = hash[i];
+		state[i] = block[i] ^ K[i];
+	}
+
+	for (r = 1; r <= WHIRLPOOL_FAST_ROUNDS; r++)
+	{
+		/* Key schedule and state rows are independent until the round key is added */
+		LK[0] = WHIRLPOOL_ROW (K, 0) ^ RoundConstants[r];	LS[0] = WHIRLPOOL_ROW (state, 0);
+		LK[1] = WHIRLPOOL_ROW (K, 1);	LS[1] = WHIRLPOOL_ROW (state, 1);
+		LK[2] = WHIRLPOOL_ROW (K, 2);	LS[2] = WHIRLPOOL_ROW (state, 2);
+		LK[3] = WHIRLPOOL_ROW (K, 3);	LS[3] = WHIRLPOOL_ROW (state, 3);
+		LK[4] = WHIRLPOOL_ROW (K, 4);	LS[4] = WHIRLPOOL_ROW (state, 4);
+		LK[5] = WHIRLPOOL_ROW (K, 5);	LS[5] = WHIRLPOOL_ROW (state, 5);
+		LK[6] = WHIRLPOOL_ROW (K, 6);	LS[6] = WHIRLPOOL_ROW (state, 6);
+		LK[7] = WHIRLPOOL_ROW (K, 7);	LS[7] = WHIRLPOOL_ROW (state, 7);
+
+		for (i = 0; i < 8; i++)
+		{
+			K[i] = LK[i];
+			state[i] = LS[i] ^ LK[i];
+		}
+	}
+
+	for (i = 0; i < 8; i++)
+		hash[i] ^= state[i] ^ block[i];
+
+	burn (K, sizeof (K));
+	burn (state, sizeof (state));
+	burn (LK, sizeof (LK));
+	burn (LS, sizeof (LS));
+}
+
+
+void WhirlpoolFastExpandKey (const u64 hash[8], u64 roundKeys[WHIRLPOOL_FAST_ROUNDS + 1][8])
+{
+	int i, r;
+
+	for (i = 0; i < 8; i++)
+		roundKeys[0][i] = hash[i];
+
+	for (r = 1; r <= WHIRLPOOL_FAST_ROUNDS; r++)
+	{
+		const u64 *K = roundKeys[r - 1];
+
+		roundKeys[r][0] = WHIRLPOOL_ROW (K, 0) ^ RoundConstants[r];
+		roundKeys[r][1] = WHIRLPOOL_ROW (K, 1);
+		roundKeys[r][2] = WHIRLPOOL_ROW (K, 2);
+		roundKeys[r][3] = WHIRLPOOL_ROW (K, 3);
+		roundKeys[r][4] = WHIRLPOOL_ROW (K, 4);
+		roundKeys[r][5] = WHIRLPOOL_ROW (K, 5);
+		roundKeys[r][6] = WHIRLPOOL_ROW (K, 6);
+		roundKeys[r][7] = WHIRLPOOL_ROW (K, 7);
+	}
+}
+
+
+void WhirlpoolFastCompressWithKey (u64 hash[8], const u64 roundKeys[WHIRLPOOL_FAST_ROUNDS + 1][8], const u64 block[8])
+{
+	u64 state[8], L[8];
+	int i, r;
+
+	for (i = 0; i < 8; i++)
+		state[i] = block[i] ^ roundKeys[0][i];
+
+	for (r = 1; r <= WHIRLPOOL_FAST_ROUNDS; r++)
+	{
+		L[0] = WHIRLPOOL_ROW (state, 0) ^ roundKeys[r][0];
+		L[1] = WHIRLPOOL_ROW (state, 1) ^ roundKeys[r][1];
+		L[2] = WHIRLPOOL_ROW (state, 2) ^ roundKeys[r][2];
+		L[3] = WHIRLPOOL_ROW (state, 3) ^ roundKeys[r][3];
+		L[4] = WHIRLPOOL_ROW (state, 4) ^ roundKeys[r][4];
+		L[5] = WHIRLPOOL_ROW (state, 5) ^ roundKeys[r][5];
+		L[6] = WHIRLPOOL_ROW (state, 6) ^ roundKeys[r][6];
+		L[7] = WHIRLPOOL_ROW (state, 7) ^ roundKeys[r][7];
+
+		for (i = 0; i < 8; i++)
+			state[i] = L[i];
+	}
+
+	for (i = 0; i < 8; i++)
+		hash[i] ^= state[i] ^ block[i];
+
+	burn (state, sizeof (state));
+	burn (L, sizeof (L));
+}
+
+
+/* Hashes a message shorter than one block (enough for the test vectors) */
+static void HashShortMessage (const char *message, u8 digest[64])
+{
+	u64 hash[8], block[8];
+	size_t length = strlen (message), i;
+
+	memset (hash, 0, sizeof (hash));
+	memset (block, 0, sizeof (block));
+
+	for (i = 0; i < length; i++)
+		block[i / 8] |= (u64) (u8) message[i] << (56 - 8 * (i % 8));
+
+	block[length / 8] |= (u64) 0x80 << (56 - 8 * (length % 8));
+
+	if (length >= 32)
+	{
+		WhirlpoolFastCompress (hash, block);
+		memset (block, 0, sizeof (block));
+	}
+
+	block[7] = (u64) length * 8;
+	WhirlpoolFastCompress (hash, block);
+
+	for (i = 0; i < 64; i++)
+		digest[i] = (u8) (hash[i / 8] >> (56 - 8 * (i % 8)));
+}
+
+
+static BOOL SelfTest (void)
+{
+	/* NESSIE test vectors */
+	static const struct
+	{
+		const char *Message;
+		u8 Digest[8];	/* First eight bytes of the digest */
+		u8 DigestEnd[8];	/* Last eight bytes of the digest */
+	} vectors[] =
+	{
+		{ "", { 0x19, 0xfa, 0x61, 0xd7, 0x55, 0x22, 0xa4, 0x66 }, { 0x08, 0xb1, 0x38, 0xcc, 0x42, 0xa6, 0x6e, 0xb3 } },
+		{ "a", { 0x8a, 0xca, 0x26, 0x02, 0x79, 0x2a, 0xec, 0x6f }, { 0x3b, 0x47, 0x85, 0x84, 0xfd, 0xae, 0x23, 0x1a } },
+		{ "abc", { 0x4e, 0x24, 0x48, 0xa4, 0xc6, 0xf4, 0x86, 0xbb }, { 0xd2, 0x25, 0x29, 0x20, 0x76, 0xd4, 0xee, 0xf5 } },
+		{ "message digest", { 0x37, 0x8c, 0x84, 0xa4, 0x12, 0x6e, 0x2d, 0xc6 }, { 0x62, 0xe8, 0x6d, 0xbd, 0x37, 0xa8, 0x90, 0x3e } },
+		{ "abcdefghijklmnopqrstuvwxyz", { 0xf1, 0xd7, 0x54, 0x66, 0x26, 0x36, 0xff, 0xe9 }, { 0x5d, 0x98, 0x19, 0xa3, 0xdb, 0xa4, 0xeb, 0x3b } },
+		{ "abcdbcdecdefdefgefghfghighijhijk", { 0x2a, 0x98, 0x7e, 0xa4, 0x0f, 0x91, 0x70, 0x61 }, { 0x74, 0x5b, 0x7b, 0x18, 0x1c, 0x3b, 0xe3, 0xfd } }
+	};
+	u8 digest[64];
+	size_t i;
+
+	for (i = 0; i < sizeof (vectors) / sizeof (vectors[0]); i++)
+	{
+		HashShortMessage (vectors[i].Message, digest);
+
+		if (memcmp (digest, vectors[i].Digest, 8) != 0 || memcmp (digest + 56, vectors[i].DigestEnd, 8) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+BOOL WhirlpoolFastInit (void)
+{
+	if (!bTablesReady)
+	{
+		BuildTables ();
+		bTablesReady = SelfTest ();
+	}
+
+	return bTablesReady;
+}
+
+
+BOOL WhirlpoolFastAvailable (void)
+{
+	return bTablesReady;
+}
@@ -0,0 +1,42 @@
+/* Legal Notice: Portions of the source code contained in this file were 
+derived from the source code of TrueCrypt 7.1a which is Copyright (c) 2003-2013 
+TrueCrypt Developers Association and is governed by the TrueCrypt License 3.0. 
+Modifications and additions to the original source code (contained in this file) 
+and all other portions of this file are Copyright (c) 2013 Nic Nilov and are 
+governed by license terms which are TBD. */
+
+#ifndef WHIRLPOOL_FAST_H
+#define WHIRLPOOL_FAST_H
+
+#include "Whirlpool.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#define WHIRLPOOL_FAST_ROUNDS	10
+
+/* Whirlpool compression function on 64-bit words (big-endian, as in NESSIEstruct.hash). Computes
+   hash = E_hash(block) ^ block ^ hash, the transform of processBuffer in Whirlpool.c. */
+
+/* Builds the lookup tables and checks the implementation against NESSIE test vectors. Called
+   once by Initialize, before any API call can derive a key; it must not run concurrently with the
+   functions below. Returns FALSE if the self-test failed. */
+BOOL WhirlpoolFastInit (void);
+
+/* TRUE once WhirlpoolFastInit has succeeded. Otherwise the functions below must not be used. */
+BOOL WhirlpoolFastAvailable (void);
+
+void WhirlpoolFastCompress (u64 hash[8], const u64 block[8]);
+
+/* The round keys depend on the chaining value only. When many blocks are compressed from the
+   same chaining value (as with the HMAC pad states in PBKDF2), they can be expanded once. */
+void WhirlpoolFastExpandKey (const u64 hash[8], u64 roundKeys[WHIRLPOOL_FAST_ROUNDS + 1][8]);
+void WhirlpoolFastCompressWithKey (u64 hash[8], const u64 roundKeys[WHIRLPOOL_FAST_ROUNDS + 1][8], const u64 block[8]);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif